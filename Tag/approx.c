@@ -0,0 +1,456 @@
+//
+// approx.c
+// Tag
+//
+
+#include "approx.h"
+
+#include "hash.h"
+#include "probes.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Normal quantile of a two sided 95% confidence interval
+#define APPROX_Z95        1.96
+
+/**
+ * @typedef Horvitz-Thompson estimate of the total of a subtree
+ * @field estimate Total of the directory itself plus the estimates of its
+ * sampled subdirectories over their conditional inclusion probability
+ * @field variance Unbiased multistage variance estimate
+ * @field observed Raw total seen in the sample
+ */
+typedef struct ApproxEstimate {
+  double estimate;
+  double variance;
+  unsigned long long observed;
+} ApproxEstimate;
+
+/**
+ * @typedef Estimated number of files carrying a tag name
+ * @field directories Number of sampled directories with a file carrying it
+ */
+typedef struct ApproxTag {
+  uint64_t hash;
+  char *name;
+  ApproxEstimate files;
+  unsigned long long directories;
+} ApproxTag;
+
+/**
+ * @typedef Estimates of a subtree, or of the whole sample
+ * @field tags Open addressing table of the tag names seen below the subtree
+ * @field used Number of distinct tag names seen
+ */
+typedef struct ApproxSubtree {
+  ApproxTag *tags;
+  size_t capacity;
+  size_t used;
+  ApproxEstimate files;
+  ApproxEstimate tagged;
+  ApproxEstimate buckets[APPROX_BUCKETS];
+} ApproxSubtree;
+
+/**
+ * @typedef Sampling state
+ */
+typedef struct ApproxState {
+  ApproxOptions *options;
+  OutputFlags outputFlags;
+  ApproxSubtree total;
+  unsigned long long directories;
+  unsigned long long skipped;
+} ApproxState;
+
+/**
+ * @typedef Exact totals of a single enumerated directory
+ */
+typedef struct ApproxCluster {
+  TagCountTable tags;
+  unsigned long long files;
+  unsigned long long tagged;
+  unsigned long long buckets[APPROX_BUCKETS];
+} ApproxCluster;
+
+// Add an exact total of the directory itself
+static void approxAdd(ApproxEstimate *estimate, unsigned long long total) {
+  estimate->estimate += (double)total;
+  estimate->observed += total;
+}
+
+// Add the estimate of a subdirectory entered with the given conditional
+// probability. Subdirectories are drawn independently (Poisson sampling) and
+// their subtrees are estimated independently given the draw, so the
+// variance is the between-subtree term over the estimated subtree total plus
+// the subtree's own variance, inflated by 1 / probability. Both terms
+// together are unbiased for the nested design.
+static void approxFold(ApproxEstimate *estimate, const ApproxEstimate *child,
+                       double probability) {
+  double y = child->estimate;
+  estimate->estimate += y / probability;
+  double between = (1 - probability) / (probability * probability) * y * y;
+  estimate->variance += between + child->variance / probability;
+  estimate->observed += child->observed;
+}
+
+// Find or insert the estimate of a tag name
+static ApproxTag *approxTag(ApproxSubtree *subtree, const char *name) {
+  uint64_t hash = tagHashString(name, 0);
+  size_t i;
+
+  if ((subtree->used + 1) * 4 > subtree->capacity * 3) {
+    size_t capacity = subtree->capacity ? subtree->capacity * 2 : 64;
+    ApproxTag *tags = calloc(capacity, sizeof(*tags));
+    for (size_t j = 0; j < subtree->capacity; ++j) {
+      if (!subtree->tags[j].name) continue;
+      size_t k = subtree->tags[j].hash & (capacity - 1);
+      while (tags[k].name) k = (k + 1) & (capacity - 1);
+      tags[k] = subtree->tags[j];
+    }
+    free(subtree->tags);
+    subtree->tags = tags;
+    subtree->capacity = capacity;
+  }
+
+  for (i = hash & (subtree->capacity - 1); subtree->tags[i].name;
+       i = (i + 1) & (subtree->capacity - 1)) {
+    if (subtree->tags[i].hash == hash &&
+        strcmp(subtree->tags[i].name, name) == 0)
+      return subtree->tags + i;
+  }
+
+  subtree->tags[i].hash = hash;
+  subtree->tags[i].name = strdup(name);
+  subtree->used++;
+  return subtree->tags + i;
+}
+
+// Fold the estimates of a subtree into those of its parent
+static void approxMerge(ApproxSubtree *parent, const ApproxSubtree *child,
+                        double probability) {
+  approxFold(&parent->files, &child->files, probability);
+  approxFold(&parent->tagged, &child->tagged, probability);
+  for (int i = 0; i < APPROX_BUCKETS; ++i)
+    approxFold(parent->buckets + i, child->buckets + i, probability);
+  for (size_t i = 0; i < child->capacity; ++i) {
+    const ApproxTag *tag = child->tags + i;
+    if (!tag->name) continue;
+    ApproxTag *merged = approxTag(parent, tag->name);
+    approxFold(&merged->files, &tag->files, probability);
+    merged->directories += tag->directories;
+  }
+}
+
+static void approxSubtreeFree(ApproxSubtree *subtree) {
+  for (size_t i = 0; i < subtree->capacity; ++i)
+    if (subtree->tags[i].name) free(subtree->tags[i].name);
+  free(subtree->tags);
+}
+
+// Deterministic uniform number in [0, 1) derived from the path and seed
+static double approxUniform(const char *path, uint64_t seed) {
+  return (double)(tagHashString(path, seed) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Decode the tags of one entry into the cluster totals
+static void approxEntry(ApproxCluster *cluster, const char *path) {
+  UserTag *existingTags;
+  int existingTagsCount;
+
+  existingTags = createUserTagsFromPath((char *)path, &existingTagsCount);
+
+  cluster->files++;
+  if (existingTagsCount) cluster->tagged++;
+  cluster->buckets[existingTagsCount < APPROX_BUCKETS - 1
+                     ? existingTagsCount
+                     : APPROX_BUCKETS - 1]++;
+
+  // Names only, duplicates within a blob count once
+  if (existingTagsCount)
+    qsort(existingTags, existingTagsCount, sizeof(*existingTags), tagCompare);
+  for (int i = 0; i < existingTagsCount; ++i) {
+    if (i && tagCompare(existingTags + i - 1, existingTags + i) == 0) continue;
+    countTableAdd(&cluster->tags, (existingTags + i)->name, TagColorNone, 1, 0);
+  }
+
+  freeUserTags(existingTags, existingTagsCount);
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Enumerate a directory completely, then sample its subdirectories, filling
+// in the estimates of its subtree. Returns -1 with errno set if the directory
+// could not be opened or read.
+static int approxDirectory(ApproxState *state, const char *path,
+                           ApproxSubtree *subtree) {
+  ApproxCluster cluster;
+  char **subdirs = NULL;
+  size_t subdirCount = 0;
+  DIR *pDir;
+  struct dirent *dir;
+  int status = 0;
+
+  pDir = opendir(path);
+  TAG_PROBE2(dir__open, path, pDir != NULL);
+  if (pDir == NULL) return -1;
+  state->directories++;
+  memset(&cluster, 0, sizeof(cluster));
+
+  for (;;) {
+    errno = 0;
+    if ((dir = readdir(pDir)) == NULL) {
+      if (errno) status = -1;
+      break;
+    }
+
+    char _p[PATH_MAX];
+
+    // Ignore current and parent dir entries
+    if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+      continue;
+
+    // Ignore dot paths if the show hidden flag is not set
+    if (*(dir->d_name) == '.' && !(state->outputFlags & OutputFlagsShowHidden))
+      continue;
+
+    if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 dir->d_name) >= (int)sizeof(_p))
+      continue;
+
+    approxEntry(&cluster, _p);
+
+    // Remember subdirectories until the sibling count is known
+    unsigned char type = dir->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+      if (lstat(_p, &st) == 0 && S_ISDIR(st.st_mode)) type = DT_DIR;
+    }
+    if (type == DT_DIR) {
+      subdirs = realloc(subdirs, sizeof(*subdirs) * (subdirCount + 1));
+      subdirs[subdirCount++] = strdup(_p);
+    }
+  }
+  int error = errno;
+  closedir(pDir);
+
+  // The directory's own totals are exact
+  approxAdd(&subtree->files, cluster.files);
+  approxAdd(&subtree->tagged, cluster.tagged);
+  for (int i = 0; i < APPROX_BUCKETS; ++i)
+    approxAdd(subtree->buckets + i, cluster.buckets[i]);
+  for (size_t i = 0; i < cluster.tags.capacity; ++i) {
+    TagCount *slot = cluster.tags.slots + i;
+    if (!slot->name) continue;
+    ApproxTag *tag = approxTag(subtree, slot->name);
+    approxAdd(&tag->files, slot->files);
+    tag->directories++;
+  }
+  countTableFree(&cluster.tags);
+
+  // Expect at least one subdirectory to be entered
+  double rate = state->options->rate;
+  if (subdirCount && rate * subdirCount < 1) rate = 1.0 / subdirCount;
+  if (rate > 1) rate = 1;
+
+  for (size_t i = 0; i < subdirCount; ++i) {
+    if (approxUniform(subdirs[i], state->options->seed) < rate) {
+      // Unreadable subdirectories count as empty
+      ApproxSubtree child = {0};
+      approxDirectory(state, subdirs[i], &child);
+      approxMerge(subtree, &child, rate);
+      approxSubtreeFree(&child);
+    } else {
+      state->skipped++;
+    }
+    free(subdirs[i]);
+  }
+  free(subdirs);
+
+  errno = error;
+  return status;
+}
+#pragma clang diagnostic pop
+
+// Half width of the 95% confidence interval
+static double approxMargin(const ApproxEstimate *estimate) {
+  return APPROX_Z95 * sqrt(estimate->variance);
+}
+
+/**
+ * @typedef Estimated number of distinct tag names in the whole tree
+ * @field lower Lower bound of the 95% log-normal interval, never below the
+ * observed count
+ */
+typedef struct ApproxDistinct {
+  double estimate;
+  double lower;
+  double upper;
+  size_t observed;
+} ApproxDistinct;
+
+// Estimate the distinct tag names of the whole tree from their incidence in
+// the sampled directories (Chao2). Names seen in only one or two sampled
+// directories tell how many names the unsampled directories still hide.
+static ApproxDistinct approxDistinct(const ApproxState *state) {
+  const ApproxSubtree *total = &state->total;
+  ApproxDistinct distinct = {0};
+  double q1 = 0, q2 = 0, m = (double)state->directories;
+  double unseen, variance;
+
+  for (size_t i = 0; i < total->capacity; ++i) {
+    if (!total->tags[i].name) continue;
+    if (total->tags[i].directories == 1) q1++;
+    if (total->tags[i].directories == 2) q2++;
+  }
+  distinct.observed = total->used;
+
+  // Nothing was skipped, the sample is the whole tree
+  if (!state->skipped) {
+    distinct.estimate = distinct.lower = distinct.upper = total->used;
+    return distinct;
+  }
+
+  // Bias corrected form when no name was seen in exactly two directories
+  double k = m > 1 ? (m - 1) / m : 0;
+  if (q2 > 0) {
+    double r = q1 / q2;
+    unseen = k * q1 * q1 / (2 * q2);
+    variance = q2 * (k * r * r / 2 + k * k * r * r * r +
+                     k * k * r * r * r * r / 4);
+  } else {
+    unseen = k * q1 * (q1 - 1) / 2;
+    variance = k * q1 * (q1 - 1) / 2 +
+               k * k * q1 * (2 * q1 - 1) * (2 * q1 - 1) / 4 -
+               k * k * q1 * q1 * q1 * q1 / (4 * (unseen + total->used));
+    if (variance < 0) variance = 0;
+  }
+
+  distinct.estimate = total->used + unseen;
+  distinct.lower = distinct.upper = distinct.estimate;
+  if (unseen > 0 && variance > 0) {
+    double c = exp(APPROX_Z95 * sqrt(log(1 + variance / (unseen * unseen))));
+    distinct.lower = total->used + unseen / c;
+    distinct.upper = total->used + unseen * c;
+  }
+  return distinct;
+}
+
+// Sort by descending estimate, then by name
+static int approxCompare(const void *a, const void *b) {
+  const ApproxTag *ta = a, *tb = b;
+  if (ta->files.estimate != tb->files.estimate)
+    return ta->files.estimate < tb->files.estimate ? 1 : -1;
+  return strcmp(ta->name, tb->name);
+}
+
+// Print an estimate as JSON members
+static void approxPrintJson(const char *key, const ApproxEstimate *estimate) {
+  printf("\"%s\":{\"estimate\":%.0f,\"margin\":%.0f,\"observed\":%llu}", key,
+         estimate->estimate, approxMargin(estimate), estimate->observed);
+}
+
+static void approxPrint(ApproxState *state) {
+  ApproxSubtree *total = &state->total;
+  ApproxTag *sorted = calloc(total->used ? total->used : 1, sizeof(*sorted));
+  ApproxDistinct distinct = approxDistinct(state);
+  size_t n = 0;
+
+  for (size_t i = 0; i < total->capacity; ++i)
+    if (total->tags[i].name) sorted[n++] = total->tags[i];
+  qsort(sorted, n, sizeof(*sorted), approxCompare);
+
+  if (state->options->countFlags & CountFlagsJson) {
+    printf("{\"rate\":%g,\"seed\":%llu,\"directories\":%llu,\"skipped\":%llu,",
+           state->options->rate, (unsigned long long)state->options->seed,
+           state->directories, state->skipped);
+    approxPrintJson("files", &total->files);
+    printf(",");
+    approxPrintJson("tagged", &total->tagged);
+    printf(",\"distinct\":{\"estimate\":%.0f,\"lower\":%.0f,\"upper\":%.0f,"
+           "\"observed\":%zu},",
+           distinct.estimate, distinct.lower, distinct.upper,
+           distinct.observed);
+    printf("\"tags\":[");
+    for (size_t i = 0; i < n; ++i) {
+      printf("%s{\"name\":", i ? "," : "");
+      printJsonString(stdout, sorted[i].name);
+      printf(",\"estimate\":%.0f,\"margin\":%.0f,\"observed\":%llu}",
+             sorted[i].files.estimate, approxMargin(&sorted[i].files),
+             sorted[i].files.observed);
+    }
+    printf("],\"tags_per_file\":[");
+    for (int i = 0; i < APPROX_BUCKETS; ++i) {
+      printf("%s{\"tags\":%d,\"estimate\":%.0f,\"margin\":%.0f}", i ? "," : "",
+             i, total->buckets[i].estimate, approxMargin(total->buckets + i));
+    }
+    printf("]}\n");
+  } else {
+    printf("# sampled %llu directories, skipped %llu (rate %g, seed %llu)\n",
+           state->directories, state->skipped, state->options->rate,
+           (unsigned long long)state->options->seed);
+    printf("# files  %14.0f +/- %.0f (95%%)\n", total->files.estimate,
+           approxMargin(&total->files));
+    printf("# tagged %14.0f +/- %.0f (95%%)\n", total->tagged.estimate,
+           approxMargin(&total->tagged));
+    printf("# distinct %12.0f (95%% %.0f to %.0f, %zu seen)\n",
+           distinct.estimate, distinct.lower, distinct.upper,
+           distinct.observed);
+    for (size_t i = 0; i < n; ++i) {
+      printf("%14.0f %12.0f %10llu %s\n", sorted[i].files.estimate,
+             approxMargin(&sorted[i].files), sorted[i].files.observed,
+             sorted[i].name);
+    }
+    printf("# tags per file\n");
+    for (int i = 0; i < APPROX_BUCKETS; ++i) {
+      if (!total->buckets[i].observed) continue;
+      printf("%14.0f %12.0f %9d%s\n", total->buckets[i].estimate,
+             approxMargin(total->buckets + i), i,
+             i == APPROX_BUCKETS - 1 ? "+" : "");
+    }
+  }
+
+  free(sorted);
+}
+
+int approxTags(char *const *paths, int pathCount, OutputFlags outputFlags,
+               ApproxOptions *options) {
+  static char *const cwd[] = {"."};
+  ApproxState *state = calloc(1, sizeof(*state));
+  int status = EXIT_SUCCESS;
+
+  state->options = options;
+  state->outputFlags = outputFlags;
+
+  if (options->rate <= 0 || options->rate > 1) options->rate = 1;
+
+  // Default to the current directory
+  if (pathCount < 1) {
+    paths = cwd;
+    pathCount = 1;
+  }
+
+  // Root directories are enumerated with certainty
+  for (int i = 0; i < pathCount; ++i) {
+    ApproxSubtree root = {0};
+    if (!strlen(paths[i])) continue;
+    if (approxDirectory(state, paths[i], &root) != 0) {
+      reportError("%s: %s\n", paths[i], strerror(errno));
+      status = EXIT_FAILURE;
+    }
+    approxMerge(&state->total, &root, 1.0);
+    approxSubtreeFree(&root);
+  }
+
+  approxPrint(state);
+
+  approxSubtreeFree(&state->total);
+  free(state);
+
+  return status;
+}
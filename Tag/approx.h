@@ -0,0 +1,47 @@
+//
+// approx.h
+// Tag
+//
+
+#ifndef TAG_APPROX_H
+#define TAG_APPROX_H
+
+#include "count.h"
+
+#include <stdint.h>
+
+// Tags per file distribution buckets, the last one collects the rest
+#define APPROX_BUCKETS    17
+
+/**
+ * @typedef Sampling options
+ * @field rate Probability of descending into a subdirectory, 0 < rate <= 1
+ * @field seed Seed of the deterministic sampling hash
+ * @field countFlags CountFlagsJson selects JSON output
+ */
+typedef struct ApproxOptions {
+  double rate;
+  uint64_t seed;
+  CountFlags countFlags;
+} ApproxOptions;
+
+/**
+ * @brief Estimate tag statistics by randomized directory sampling
+ * @param paths Root directories, always enumerated completely
+ * @param pathCount Number of root directories, the current directory if none
+ * @param outputFlags Enumeration flags (hidden files)
+ * @param options Sampling options
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a root could not be opened or read
+ * @note Every subdirectory is entered with probability max(rate, 1/siblings)
+ * so chains of single subdirectories are always followed. Files inside an
+ * entered directory are all decoded and weighted by the inverse of the
+ * directory's inclusion probability (Horvitz-Thompson). The 95% intervals
+ * use the multistage variance estimator of the nested design, built up from
+ * the subtree of every sampled directory. The number of distinct tag names
+ * is estimated from how many sampled directories carry each name (Chao2),
+ * with a log-normal interval that never falls below the names seen.
+ */
+int approxTags(char *const *paths, int pathCount, OutputFlags outputFlags,
+               ApproxOptions *options);
+
+#endif  // TAG_APPROX_H
@@ -19,7 +19,8 @@ CFStringRef TagCallBackCopyDescription(const void *value) {
   return (CFStringRef)value;
 }
 
-// Compare the strings without the last 2 characters (new line and color code)
+// Compare the strings without the new line and color code, so a name does
+// not equal its prefixes ("proj" and "proj/alpha" are different tags).
 // Attempts to use CFStringCompareWithOptions would not work for some reason.
 Boolean TagCallBacksEqual(const void *s1, const void *s2) {
   CFIndex l1 = CFStringGetLength(s1);
@@ -31,7 +32,11 @@ Boolean TagCallBacksEqual(const void *s1, const void *s2) {
   CFStringGetCString(s1, p1, l1 + 1, enc);
   CFStringGetCString(s2, p2, l2 + 1, enc);
 
-  long result = strncasecmp(p1, p2, l1 - 2);
+  char *e1 = strrchr(p1, '\n'), *e2 = strrchr(p2, '\n');
+  if (e1) *e1 = '\0';
+  if (e2) *e2 = '\0';
+
+  long result = strcasecmp(p1, p2);
 
   free(p1);
   free(p2);
@@ -0,0 +1,548 @@
+//
+// async.c
+// Tag
+//
+
+#include "async.h"
+
+#include "store.h"
+#include "walk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct TagCancel {
+  int requested;
+};
+
+/**
+ * @typedef Self pipe telling an event loop that work is waiting
+ * @field fds Read and write ends
+ * @field raised The pipe holds its single byte, guarded by the owner's lock
+ */
+typedef struct AsyncNotify {
+  int fds[2];
+  int raised;
+} AsyncNotify;
+
+/**
+ * @typedef Read or write submitted to an executor
+ * @field operationMode OperationModeList for a read, otherwise the change
+ * @field error errno of the operation once it is complete
+ */
+typedef struct AsyncOperation {
+  struct AsyncOperation *next;
+  OperationMode operationMode;
+  char *path;
+  UserTag *userTags;
+  int tagCount;
+  TagCancel *cancel;
+  TagReadCallback read;
+  TagWriteCallback write;
+  void *context;
+  int error;
+} AsyncOperation;
+
+/**
+ * @typedef Queue of operations in submission order
+ */
+typedef struct AsyncQueue {
+  AsyncOperation *head;
+  AsyncOperation **tail;
+} AsyncQueue;
+
+struct TagQuery {
+  TagWalker walker;
+  TagQueryOptions options;
+  char **paths;
+  int pathCount;
+  TagQueryResult *results;
+  int head;
+  int count;
+  int done;
+  int closed;
+  int started;
+  pthread_t driver;
+  pthread_mutex_t lock;
+  pthread_cond_t space;
+  pthread_cond_t ready;
+  AsyncNotify notify;
+};
+
+struct TagExecutor {
+  pthread_t threads[WALK_MAX_JOBS];
+  int jobs;
+  int maxInflight;
+  int inflight;
+  int stopping;
+  AsyncQueue submitted;
+  AsyncQueue completed;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  AsyncNotify notify;
+};
+
+TagCancel *tagCancelCreate(void) { return calloc(1, sizeof(TagCancel)); }
+
+void tagCancelRequest(TagCancel *cancel) {
+  __atomic_store_n(&cancel->requested, 1, __ATOMIC_RELEASE);
+}
+
+int tagCancelRequested(const TagCancel *cancel) {
+  return cancel && __atomic_load_n(&cancel->requested, __ATOMIC_ACQUIRE);
+}
+
+void tagCancelFree(TagCancel *cancel) { free(cancel); }
+
+static int notifyOpen(AsyncNotify *notify) {
+  if (pipe(notify->fds) != 0) return -1;
+  for (int i = 0; i < 2; ++i) {
+    fcntl(notify->fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(notify->fds[i], F_SETFL,
+          fcntl(notify->fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  notify->raised = 0;
+  return 0;
+}
+
+// Make the read end readable, the owner's lock must be held
+static void notifyRaise(AsyncNotify *notify) {
+  char byte = 0;
+  if (notify->raised) return;
+  notify->raised = write(notify->fds[1], &byte, 1) == 1;
+}
+
+// Drain the read end, the owner's lock must be held
+static void notifyClear(AsyncNotify *notify) {
+  char byte;
+  if (!notify->raised) return;
+  notify->raised = read(notify->fds[0], &byte, 1) != 1;
+}
+
+static void notifyClose(AsyncNotify *notify) {
+  close(notify->fds[0]);
+  close(notify->fds[1]);
+}
+
+static void queuePush(AsyncQueue *queue, AsyncOperation *operation) {
+  operation->next = NULL;
+  *queue->tail = operation;
+  queue->tail = &operation->next;
+}
+
+static AsyncOperation *queueTake(AsyncQueue *queue) {
+  AsyncOperation *head = queue->head;
+  queue->head = NULL;
+  queue->tail = &queue->head;
+  return head;
+}
+
+// Copy tags so the caller's may be released as soon as they are submitted
+static UserTag *copyUserTags(const UserTag *userTags, int tagCount) {
+  UserTag *copy = calloc(tagCount ? tagCount : 1, sizeof(*copy));
+  for (int i = 0; i < tagCount; ++i) {
+    copy[i].name = strdup(userTags[i].name);
+    copy[i].color = userTags[i].color;
+  }
+  return copy;
+}
+
+// Queries
+
+// The consumer went away or the token was cancelled, the lock must be held
+static int queryStopped(const TagQuery *query) {
+  return query->closed || tagCancelRequested(query->options.cancel);
+}
+
+// Read the tags of an entry and hand it to the consumer, waiting for room
+static TagWalkResult queryVisit(const TagWalkEntry *entry, void *context) {
+  TagQuery *query = context;
+  UserTag *tags;
+  int tagCount;
+
+  if (tagCancelRequested(query->options.cancel)) return TagWalkStop;
+
+  tags = tagWalkEntryTags(entry, &tagCount);
+  if (query->options.query &&
+      !tagsMatch(query->options.query, tags, tagCount)) {
+    freeUserTags(tags, tagCount);
+    return TagWalkContinue;
+  }
+
+  pthread_mutex_lock(&query->lock);
+  while (query->count == query->options.capacity && !queryStopped(query))
+    pthread_cond_wait(&query->space, &query->lock);
+  if (queryStopped(query)) {
+    pthread_mutex_unlock(&query->lock);
+    freeUserTags(tags, tagCount);
+    return TagWalkStop;
+  }
+
+  TagQueryResult *result =
+    query->results +
+    (query->head + query->count++) % query->options.capacity;
+  result->path = strdup(entry->path);
+  result->tags = tags;
+  result->tagCount = tagCount;
+  notifyRaise(&query->notify);
+  pthread_cond_signal(&query->ready);
+  pthread_mutex_unlock(&query->lock);
+
+  return TagWalkContinue;
+}
+
+// Walk the roots, then wake the consumer for the end of the results
+static void *queryDriver(void *arg) {
+  TagQuery *query = arg;
+
+  tagWalk(&query->walker, query->paths, query->pathCount);
+
+  pthread_mutex_lock(&query->lock);
+  query->done = 1;
+  notifyRaise(&query->notify);
+  pthread_cond_broadcast(&query->ready);
+  pthread_mutex_unlock(&query->lock);
+
+  return NULL;
+}
+
+TagQuery *tagQueryStart(char *const *paths, int pathCount,
+                        const TagQueryOptions *options) {
+  TagQuery *query = calloc(1, sizeof(*query));
+
+  query->options = *options;
+  if (query->options.capacity < 1)
+    query->options.capacity = TAG_QUERY_CAPACITY;
+  if (notifyOpen(&query->notify) != 0) {
+    free(query);
+    return NULL;
+  }
+
+  // Default to the current directory, the roots outlive the caller's array
+  query->pathCount = pathCount < 1 ? 1 : pathCount;
+  query->paths = calloc(query->pathCount, sizeof(*query->paths));
+  for (int i = 0; i < query->pathCount; ++i)
+    query->paths[i] = strdup(pathCount < 1 ? "." : paths[i]);
+
+  query->results = calloc(query->options.capacity, sizeof(*query->results));
+  query->walker.jobs =
+    options->jobs > 0 ? options->jobs : tagWalkDefaultJobs();
+  query->walker.outputFlags = options->outputFlags;
+  query->walker.visit = queryVisit;
+  query->walker.context = query;
+  query->walker.prefetch = 1;
+  pthread_mutex_init(&query->lock, NULL);
+  pthread_cond_init(&query->space, NULL);
+  pthread_cond_init(&query->ready, NULL);
+
+  if ((errno = pthread_create(&query->driver, NULL, queryDriver, query)) !=
+      0) {
+    int error = errno;
+    tagQueryFinish(query);
+    errno = error;
+    return NULL;
+  }
+  query->started = 1;
+
+  return query;
+}
+
+int tagQueryFd(const TagQuery *query) { return query->notify.fds[0]; }
+
+int tagQueryNext(TagQuery *query, TagQueryResult *result, int wait) {
+  int status;
+
+  pthread_mutex_lock(&query->lock);
+  for (;;) {
+    if (queryStopped(query)) {
+      // Walkers waiting for room stop instead
+      pthread_cond_broadcast(&query->space);
+      status = -1;
+      break;
+    }
+    if (query->count) {
+      *result = query->results[query->head];
+      query->head = (query->head + 1) % query->options.capacity;
+      if (!--query->count && !query->done) notifyClear(&query->notify);
+      pthread_cond_signal(&query->space);
+      status = 1;
+      break;
+    }
+    if (query->done) {
+      status = -1;
+      break;
+    }
+    if (!wait) {
+      status = 0;
+      break;
+    }
+    pthread_cond_wait(&query->ready, &query->lock);
+  }
+  pthread_mutex_unlock(&query->lock);
+
+  return status;
+}
+
+void tagQueryResultFree(TagQueryResult *result) {
+  free(result->path);
+  freeUserTags(result->tags, result->tagCount);
+  result->path = NULL;
+  result->tags = NULL;
+  result->tagCount = 0;
+}
+
+int tagQueryFinish(TagQuery *query) {
+  int status;
+
+  pthread_mutex_lock(&query->lock);
+  query->closed = 1;
+  pthread_cond_broadcast(&query->space);
+  pthread_mutex_unlock(&query->lock);
+  if (query->started) pthread_join(query->driver, NULL);
+
+  status = (query->walker.errors || query->walker.stopped) ? EXIT_FAILURE
+                                                           : EXIT_SUCCESS;
+
+  for (; query->count; --query->count) {
+    tagQueryResultFree(query->results + query->head);
+    query->head = (query->head + 1) % query->options.capacity;
+  }
+  for (int i = 0; i < query->pathCount; ++i) free(query->paths[i]);
+  free(query->paths);
+  free(query->results);
+  notifyClose(&query->notify);
+  pthread_cond_destroy(&query->ready);
+  pthread_cond_destroy(&query->space);
+  pthread_mutex_destroy(&query->lock);
+  free(query);
+
+  return status;
+}
+
+// Executors
+
+// Run a single operation on a pool thread
+static void executorRun(AsyncOperation *operation) {
+  if (tagCancelRequested(operation->cancel)) {
+    operation->error = ECANCELED;
+    return;
+  }
+
+  int status = 0;
+  switch (operation->operationMode) {
+    case OperationModeList: {
+      unsigned char buf[EXT_ATTR_SIZE];
+      ssize_t len = tagStoreGet(operation->path, buf, sizeof(buf));
+      if (len < 0 && errno != TAG_ENOATTR) {
+        status = -1;
+        break;
+      }
+      freeUserTags(operation->userTags, operation->tagCount);
+      operation->userTags =
+        createUserTagsFromData(buf, len, &operation->tagCount);
+      break;
+    }
+    case OperationModeAdd:
+      status = addTags(operation->path, operation->userTags,
+                       operation->tagCount);
+      break;
+    case OperationModeRemove:
+      status = removeTags(operation->path, operation->userTags,
+                          operation->tagCount);
+      break;
+    default: {
+      size_t binLength;
+      unsigned char *bin =
+        createTagBlob(&binLength, operation->userTags, operation->tagCount);
+      status = setTags(operation->path, bin, binLength, operation->userTags,
+                       operation->tagCount);
+      free(bin);
+      break;
+    }
+  }
+
+  // A write completes once it is durable, writes finishing together share
+  // the sync
+  if (!status && operation->operationMode != OperationModeList)
+    status = tagStoreSync();
+  operation->error = status ? errno : 0;
+}
+
+// Pool thread main loop, runs operations until the executor stops
+static void *executorWorker(void *arg) {
+  TagExecutor *executor = arg;
+
+  pthread_mutex_lock(&executor->lock);
+  for (;;) {
+    while (!executor->submitted.head && !executor->stopping)
+      pthread_cond_wait(&executor->work, &executor->lock);
+    if (executor->stopping) break;
+
+    AsyncOperation *operation = executor->submitted.head;
+    if (!(executor->submitted.head = operation->next))
+      executor->submitted.tail = &executor->submitted.head;
+    pthread_mutex_unlock(&executor->lock);
+
+    executorRun(operation);
+
+    pthread_mutex_lock(&executor->lock);
+    queuePush(&executor->completed, operation);
+    notifyRaise(&executor->notify);
+  }
+  pthread_mutex_unlock(&executor->lock);
+
+  return NULL;
+}
+
+TagExecutor *tagExecutorCreate(int jobs, int maxInflight) {
+  TagExecutor *executor = calloc(1, sizeof(*executor));
+
+  if (notifyOpen(&executor->notify) != 0) {
+    free(executor);
+    return NULL;
+  }
+  executor->maxInflight =
+    maxInflight > 0 ? maxInflight : TAG_EXECUTOR_INFLIGHT;
+  executor->submitted.tail = &executor->submitted.head;
+  executor->completed.tail = &executor->completed.head;
+  pthread_mutex_init(&executor->lock, NULL);
+  pthread_cond_init(&executor->work, NULL);
+
+  if (jobs < 1) jobs = tagWalkDefaultJobs();
+  if (jobs > WALK_MAX_JOBS) jobs = WALK_MAX_JOBS;
+  for (; executor->jobs < jobs; ++executor->jobs) {
+    if ((errno = pthread_create(&executor->threads[executor->jobs], NULL,
+                                executorWorker, executor)) != 0)
+      break;
+  }
+
+  // Fewer threads than asked for still make progress
+  if (!executor->jobs) {
+    int error = errno;
+    tagExecutorFree(executor);
+    errno = error;
+    return NULL;
+  }
+
+  return executor;
+}
+
+// Queue an operation unless the cap is reached, taking ownership of it
+static int executorSubmit(TagExecutor *executor, AsyncOperation *operation) {
+  pthread_mutex_lock(&executor->lock);
+  if (executor->inflight >= executor->maxInflight) {
+    pthread_mutex_unlock(&executor->lock);
+    free(operation->path);
+    freeUserTags(operation->userTags, operation->tagCount);
+    free(operation);
+    errno = EAGAIN;
+    return -1;
+  }
+  executor->inflight++;
+  queuePush(&executor->submitted, operation);
+  pthread_cond_signal(&executor->work);
+  pthread_mutex_unlock(&executor->lock);
+
+  return 0;
+}
+
+int tagExecutorRead(TagExecutor *executor, const char *path,
+                    TagCancel *cancel, TagReadCallback callback,
+                    void *context) {
+  AsyncOperation *operation = calloc(1, sizeof(*operation));
+
+  operation->operationMode = OperationModeList;
+  operation->path = strdup(path);
+  operation->cancel = cancel;
+  operation->read = callback;
+  operation->context = context;
+
+  return executorSubmit(executor, operation);
+}
+
+int tagExecutorWrite(TagExecutor *executor, const char *path,
+                     OperationMode operationMode, UserTag *userTags,
+                     int tagCount, TagCancel *cancel,
+                     TagWriteCallback callback, void *context) {
+  // A removal needs at least one tag, or "*"
+  if ((operationMode != OperationModeAdd &&
+       operationMode != OperationModeRemove &&
+       operationMode != OperationModeSet) ||
+      (operationMode == OperationModeRemove && tagCount < 1)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  AsyncOperation *operation = calloc(1, sizeof(*operation));
+  operation->operationMode = operationMode;
+  operation->path = strdup(path);
+  operation->userTags = copyUserTags(userTags, tagCount);
+  operation->tagCount = tagCount;
+  operation->cancel = cancel;
+  operation->write = callback;
+  operation->context = context;
+
+  return executorSubmit(executor, operation);
+}
+
+int tagExecutorFd(const TagExecutor *executor) {
+  return executor->notify.fds[0];
+}
+
+int tagExecutorPoll(TagExecutor *executor) {
+  AsyncOperation *operation, *next;
+  int count = 0;
+
+  pthread_mutex_lock(&executor->lock);
+  operation = queueTake(&executor->completed);
+  notifyClear(&executor->notify);
+  for (next = operation; next; next = next->next) count++;
+  // Callbacks may submit again right away
+  executor->inflight -= count;
+  pthread_mutex_unlock(&executor->lock);
+
+  for (; operation; operation = next) {
+    next = operation->next;
+    if (operation->operationMode == OperationModeList) {
+      if (operation->read)
+        operation->read(operation->context, operation->path,
+                        operation->userTags, operation->tagCount,
+                        operation->error);
+    } else if (operation->write) {
+      operation->write(operation->context, operation->path, operation->error);
+    }
+    free(operation->path);
+    freeUserTags(operation->userTags, operation->tagCount);
+    free(operation);
+  }
+
+  return count;
+}
+
+void tagExecutorFree(TagExecutor *executor) {
+  AsyncOperation *operation, *next;
+
+  pthread_mutex_lock(&executor->lock);
+  executor->stopping = 1;
+  pthread_cond_broadcast(&executor->work);
+  pthread_mutex_unlock(&executor->lock);
+  for (int i = 0; i < executor->jobs; ++i)
+    pthread_join(executor->threads[i], NULL);
+
+  // Operations no thread started are completed as cancelled
+  for (operation = queueTake(&executor->submitted); operation;
+       operation = next) {
+    next = operation->next;
+    operation->error = ECANCELED;
+    queuePush(&executor->completed, operation);
+  }
+  tagExecutorPoll(executor);
+
+  notifyClose(&executor->notify);
+  pthread_cond_destroy(&executor->work);
+  pthread_mutex_destroy(&executor->lock);
+  free(executor);
+}
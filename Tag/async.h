@@ -0,0 +1,228 @@
+//
+// async.h
+// Tag
+//
+
+#ifndef TAG_ASYNC_H
+#define TAG_ASYNC_H
+
+#include "usertag.h"
+
+// Results a query holds before its walkers wait for the consumer
+#define TAG_QUERY_CAPACITY  256
+
+// Operations an executor accepts at once unless told otherwise
+#define TAG_EXECUTOR_INFLIGHT 1024
+
+struct TagTrie;
+
+/**
+ * @typedef Cancellation token, shared by any number of queries and
+ * operations
+ */
+typedef struct TagCancel TagCancel;
+
+/**
+ * @typedef Scan running on its own threads, consumed one result at a time
+ */
+typedef struct TagQuery TagQuery;
+
+/**
+ * @typedef Pool of threads running tag reads and writes for an event loop
+ */
+typedef struct TagExecutor TagExecutor;
+
+/**
+ * @typedef Options of a query
+ * @field jobs Number of walker threads, 0 for the number of processors
+ * @field outputFlags Honors OutputFlagsShowHidden and
+ * OutputFlagsRecurseDirectory
+ * @field query Tags to match compiled by tagTrieCompile, NULL yields every
+ * entry as a list would
+ * @field capacity Results held before the walkers wait, 0 for
+ * TAG_QUERY_CAPACITY
+ * @field cancel Token stopping the query, may be NULL
+ */
+typedef struct TagQueryOptions {
+  int jobs;
+  OutputFlags outputFlags;
+  const struct TagTrie *query;
+  int capacity;
+  TagCancel *cancel;
+} TagQueryOptions;
+
+/**
+ * @typedef Entry yielded by a query
+ * @field path Path of the entry
+ * @field tags Tags of the entry
+ * @field tagCount Number of tags
+ */
+typedef struct TagQueryResult {
+  char *path;
+  UserTag *tags;
+  int tagCount;
+} TagQueryResult;
+
+/**
+ * @typedef Completion of a read
+ * @note tags is released once the callback returns, error is 0 on success,
+ * ECANCELED if the token was cancelled before the read started
+ */
+typedef void (*TagReadCallback)(void *context, const char *path,
+                                UserTag *tags, int tagCount, int error);
+
+/**
+ * @typedef Completion of a write
+ * @note error is 0 on success, ECANCELED if the token was cancelled before
+ * the write started
+ */
+typedef void (*TagWriteCallback)(void *context, const char *path, int error);
+
+/**
+ * @brief Create a cancellation token
+ * @return Token, release with tagCancelFree
+ */
+TagCancel *tagCancelCreate(void);
+
+/**
+ * @brief Cancel everything using a token, from any thread
+ * @param cancel Token
+ */
+void tagCancelRequest(TagCancel *cancel);
+
+/**
+ * @brief Test whether a token was cancelled
+ * @param cancel Token, NULL is never cancelled
+ * @return 1 once cancelled, 0 otherwise
+ */
+int tagCancelRequested(const TagCancel *cancel);
+
+/**
+ * @brief Release a token no longer used by any query or operation
+ * @param cancel Token
+ */
+void tagCancelFree(TagCancel *cancel);
+
+/**
+ * @brief Start walking paths, yielding their tags as they are read
+ * @param paths Roots of the walk, the current directory if none
+ * @param pathCount Number of roots
+ * @param options Query options
+ * @return Query, release with tagQueryFinish, or NULL with errno set
+ * @note The walk runs on threads of its own. Once capacity results wait to
+ * be consumed the walkers block, so a slow consumer bounds the memory and
+ * the reads in flight instead of the walk racing ahead. Results come in
+ * the order they are read, not in path order.
+ */
+TagQuery *tagQueryStart(char *const *paths, int pathCount,
+                        const TagQueryOptions *options);
+
+/**
+ * @brief Descriptor to watch for results with poll, select or kqueue
+ * @param query Query
+ * @return Descriptor, readable while a result is waiting or the query has
+ * ended
+ * @note Only read the descriptor through tagQueryNext.
+ */
+int tagQueryFd(const TagQuery *query);
+
+/**
+ * @brief Take the next result of a query
+ * @param query Query
+ * @param result Receives the result, release with tagQueryResultFree
+ * @param wait Block until a result is ready, otherwise return 0 at once
+ * @return 1 with a result, 0 if none is ready yet, -1 once the query has
+ * ended or was cancelled
+ */
+int tagQueryNext(TagQuery *query, TagQueryResult *result, int wait);
+
+/**
+ * @brief Release the members of a result
+ * @param result Result filled in by tagQueryNext
+ */
+void tagQueryResultFree(TagQueryResult *result);
+
+/**
+ * @brief Stop a query if it is still running and release it
+ * @param query Query
+ * @return EXIT_SUCCESS if the walk ran to its end and every directory was
+ * read, EXIT_FAILURE if it was cancelled, finished early or met errors
+ */
+int tagQueryFinish(TagQuery *query);
+
+/**
+ * @brief Start a pool of threads running tag reads and writes
+ * @param jobs Number of threads, 0 for the number of processors
+ * @param maxInflight Operations submitted and not yet completed at once, 0
+ * for TAG_EXECUTOR_INFLIGHT
+ * @return Executor, release with tagExecutorFree, or NULL with errno set if
+ * no thread could be started
+ * @note Operations run on the pool, their callbacks on the thread calling
+ * tagExecutorPoll, so an event loop never blocks on the file system and
+ * needs no locking of its own.
+ */
+TagExecutor *tagExecutorCreate(int jobs, int maxInflight);
+
+/**
+ * @brief Submit a read of the tags of a path
+ * @param executor Executor
+ * @param path Path, copied
+ * @param cancel Token skipping the read if cancelled first, may be NULL
+ * @param callback Completion, run by tagExecutorPoll, may be NULL
+ * @param context Opaque pointer passed to the callback
+ * @return 0 once submitted, -1 with errno set to EAGAIN while maxInflight
+ * operations are pending
+ */
+int tagExecutorRead(TagExecutor *executor, const char *path,
+                    TagCancel *cancel, TagReadCallback callback,
+                    void *context);
+
+/**
+ * @brief Submit an add, remove or set of tags on a path
+ * @param executor Executor
+ * @param path Path, copied
+ * @param operationMode OperationModeAdd, OperationModeRemove or
+ * OperationModeSet
+ * @param userTags Tags of the change, copied
+ * @param tagCount Number of tags
+ * @param cancel Token skipping the write if cancelled first, may be NULL
+ * @param callback Completion, run by tagExecutorPoll, may be NULL
+ * @param context Opaque pointer passed to the callback
+ * @return 0 once submitted, -1 with errno set to EAGAIN while maxInflight
+ * operations are pending, or EINVAL for another operation mode
+ * @note Writes go through addTags, removeTags and setTags to the backend set
+ * with tagStoreSetDefault, so they retry on conflicts, and complete once
+ * tagStoreSync made them durable. They are only journaled if the embedder
+ * opened a journal with journalOpen, whose buffered records journalFlush
+ * appends.
+ */
+int tagExecutorWrite(TagExecutor *executor, const char *path,
+                     OperationMode operationMode, UserTag *userTags,
+                     int tagCount, TagCancel *cancel,
+                     TagWriteCallback callback, void *context);
+
+/**
+ * @brief Descriptor to watch for completions with poll, select or kqueue
+ * @param executor Executor
+ * @return Descriptor, readable while completions are waiting
+ * @note Only read the descriptor through tagExecutorPoll.
+ */
+int tagExecutorFd(const TagExecutor *executor);
+
+/**
+ * @brief Run the callbacks of the completed operations
+ * @param executor Executor
+ * @return Number of callbacks run
+ */
+int tagExecutorPoll(TagExecutor *executor);
+
+/**
+ * @brief Stop the pool and release it
+ * @param executor Executor
+ * @note Running operations are waited for, operations not yet started
+ * complete with ECANCELED, and every pending callback is run before the
+ * executor is released.
+ */
+void tagExecutorFree(TagExecutor *executor);
+
+#endif  // TAG_ASYNC_H
@@ -0,0 +1,137 @@
+//
+// cache.c
+// Tag
+//
+
+#include "cache.h"
+
+#include "hash.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @typedef Decoded tags of an inode, direct mapped by its hash
+ * @field tagCount Number of tags, -1 for an empty slot
+ */
+typedef struct CacheEntry {
+  dev_t dev;
+  ino_t ino;
+  struct timespec ctime;
+  UserTag *tags;
+  int tagCount;
+} CacheEntry;
+
+// Cached entries, NULL while the cache is disabled
+static CacheEntry *entries = NULL;
+
+// Number of entries, a power of two
+static size_t capacity = 0;
+
+// Serializes the walker threads
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Effectiveness counters
+static unsigned long hits = 0, misses = 0;
+
+// Copy a tag set, each name separately so freeUserTags can release it
+static UserTag *copyTags(const UserTag *userTags, int tagCount) {
+  UserTag *copy;
+
+  if (!tagCount) return NULL;
+  copy = calloc(tagCount, sizeof(*copy));
+  for (int i = 0; i < tagCount; ++i) {
+    copy[i].name = strdup(userTags[i].name);
+    copy[i].color = userTags[i].color;
+  }
+  return copy;
+}
+
+static CacheEntry *entryFor(dev_t dev, ino_t ino) {
+  uint64_t key[2] = {(uint64_t)dev, (uint64_t)ino};
+  return entries + (tagHash64(key, sizeof(key), 0) & (capacity - 1));
+}
+
+void tagCacheEnable(size_t size) {
+  tagCacheDisable();
+
+  for (capacity = 1; capacity < size; capacity <<= 1) continue;
+  entries = calloc(capacity, sizeof(*entries));
+  for (size_t i = 0; i < capacity; ++i) entries[i].tagCount = -1;
+  hits = misses = 0;
+}
+
+void tagCacheDisable(void) {
+  if (!entries) return;
+
+  for (size_t i = 0; i < capacity; ++i)
+    if (entries[i].tagCount > 0)
+      freeUserTags(entries[i].tags, entries[i].tagCount);
+  free(entries);
+  entries = NULL;
+  capacity = 0;
+}
+
+int tagCacheActive(void) { return entries != NULL; }
+
+UserTag *tagCacheLookup(const char *path, TagCacheStamp *stamp,
+                        int *tagCount) {
+  UserTag *userTags = NULL;
+  struct stat st;
+
+  *tagCount = -1;
+
+  // The path is resolved like getxattr does, following symbolic links
+  memset(stamp, 0, sizeof(*stamp));
+  if (stat(path, &st) != 0) return NULL;
+  stamp->dev = st.st_dev;
+  stamp->ino = st.st_ino;
+  stamp->ctime = STAT_CTIME(&st);
+  stamp->valid = 1;
+
+  pthread_mutex_lock(&lock);
+  CacheEntry *entry = entryFor(st.st_dev, st.st_ino);
+  if (entry->tagCount >= 0 && entry->dev == st.st_dev &&
+      entry->ino == st.st_ino &&
+      entry->ctime.tv_sec == stamp->ctime.tv_sec &&
+      entry->ctime.tv_nsec == stamp->ctime.tv_nsec) {
+    userTags = copyTags(entry->tags, entry->tagCount);
+    *tagCount = entry->tagCount;
+    hits++;
+  } else {
+    misses++;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return userTags;
+}
+
+void tagCacheInsert(const TagCacheStamp *stamp, const UserTag *userTags,
+                    int tagCount) {
+  struct timespec now;
+  UserTag *copy;
+
+  if (!stamp->valid) return;
+
+  // A write within the granularity of the ctime would not change it
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (stamp->ctime.tv_sec >= now.tv_sec - CACHE_RACY_SECONDS) return;
+
+  copy = copyTags(userTags, tagCount);
+
+  pthread_mutex_lock(&lock);
+  CacheEntry *entry = entryFor(stamp->dev, stamp->ino);
+  if (entry->tagCount > 0) freeUserTags(entry->tags, entry->tagCount);
+  entry->dev = stamp->dev;
+  entry->ino = stamp->ino;
+  entry->ctime = stamp->ctime;
+  entry->tags = copy;
+  entry->tagCount = tagCount;
+  pthread_mutex_unlock(&lock);
+}
+
+void tagCacheStats(unsigned long *hitCount, unsigned long *missCount) {
+  *hitCount = hits;
+  *missCount = misses;
+}
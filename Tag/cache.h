@@ -0,0 +1,84 @@
+//
+// cache.h
+// Tag
+//
+
+#ifndef TAG_CACHE_H
+#define TAG_CACHE_H
+
+#include "usertag.h"
+#include <sys/stat.h>
+
+// Default number of decoded tag sets held by the cache
+#define CACHE_ENTRIES   (1 << 16)
+
+// Paths changed this recently are not cached, a coarse ctime could miss a
+// second write
+#define CACHE_RACY_SECONDS 2
+
+/**
+ * @typedef Identity and change time of a path, taken before its tags are read
+ * @field dev Device
+ * @field ino Inode
+ * @field ctime Status change time, bumped by every tag write
+ * @field valid The path could be stat'ed
+ */
+typedef struct TagCacheStamp {
+  dev_t dev;
+  ino_t ino;
+  struct timespec ctime;
+  int valid;
+} TagCacheStamp;
+
+/**
+ * @brief Start caching decoded tag sets, keyed by device and inode and
+ * validated by the status change time
+ * @param capacity Number of entries, rounded up to a power of two
+ * @note Only valid for backends keeping tags in an extended attribute, whose
+ * writes change the ctime. Other backends must not enable the cache.
+ */
+void tagCacheEnable(size_t capacity);
+
+/**
+ * @brief Stop caching and release every entry
+ */
+void tagCacheDisable(void);
+
+/**
+ * @brief Test whether decoded tag sets are cached
+ * @return Non zero when the cache is enabled
+ */
+int tagCacheActive(void);
+
+/**
+ * @brief Look up the tags of a path
+ * @param path Path to the filename or directory
+ * @param stamp Receives the identity of the path, passed to tagCacheInsert
+ * on a miss
+ * @param tagCount Receives the number of tags on a hit
+ * @return Copy of the cached tags released with freeUserTags, NULL on a miss
+ * or if the path has no tags, in which case tagCount tells them apart (-1 on
+ * a miss)
+ */
+UserTag *tagCacheLookup(const char *path, TagCacheStamp *stamp,
+                        int *tagCount);
+
+/**
+ * @brief Remember the decoded tags of a path
+ * @param stamp Identity returned by the preceding tagCacheLookup
+ * @param userTags Decoded tags, copied
+ * @param tagCount Number of tags
+ * @note Paths whose ctime is within CACHE_RACY_SECONDS of now are not
+ * remembered.
+ */
+void tagCacheInsert(const TagCacheStamp *stamp, const UserTag *userTags,
+                    int tagCount);
+
+/**
+ * @brief Report the cache effectiveness
+ * @param hits Receives the number of lookups answered from the cache
+ * @param misses Receives the number of lookups that decoded the tags
+ */
+void tagCacheStats(unsigned long *hits, unsigned long *misses);
+
+#endif  // TAG_CACHE_H
@@ -0,0 +1,326 @@
+//
+// checkpoint.c
+// Tag
+//
+
+#include "checkpoint.h"
+
+#include "hash.h"
+#include "memo.h"
+#include "walk.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @typedef Position of a resumable run
+ * @field operation Identifier of the operation, tags and enumeration flags
+ * @field complete Every path was changed
+ * @field processed Entries changed so far
+ * @field roots Paths given to the run
+ * @field root Root of the last changed entry, -1 before the first
+ * @field cursor Path of the last changed entry relative to its root
+ * @field data File contents the strings point into
+ */
+typedef struct Checkpoint {
+  uint64_t operation;
+  int complete;
+  unsigned long long processed;
+  char **roots;
+  int rootCount;
+  int root;
+  char *cursor;
+  char *data;
+} Checkpoint;
+
+/**
+ * @typedef Walk context of a resumable run
+ */
+typedef struct CheckpointContext {
+  OperationMode operationMode;
+  UserTag *userTags;
+  int tagCount;
+  unsigned char *bin;
+  size_t binLength;
+  const char *path;
+  char *const *roots;
+  int rootCount;
+  uint64_t operation;
+  unsigned long long processed;
+  int root;
+  char cursor[PATH_MAX];
+  time_t saved;
+  int failed;
+  unsigned long long errors;
+} CheckpointContext;
+
+// Set by SIGINT and SIGTERM while a checkpointed run is in progress
+static volatile sig_atomic_t interrupted = 0;
+
+static void interruptRun(int signal) {
+  (void)signal;
+  interrupted = 1;
+}
+
+// Identify the operation so a checkpoint is only resumed by the same one
+static uint64_t operationIdentifier(OperationMode operationMode,
+                                    UserTag *userTags, int tagCount,
+                                    OutputFlags outputFlags) {
+  int flags = outputFlags & (OutputFlagsShowHidden |
+                             OutputFlagsRecurseDirectory);
+  uint64_t operation = memoOperation(operationMode, userTags, tagCount);
+
+  return tagHash64(&flags, sizeof(flags), operation);
+}
+
+// Replace the checkpoint file, written aside and renamed over the old one
+static int checkpointSave(CheckpointContext *ctx, int complete) {
+  char temporary[PATH_MAX];
+  FILE *file;
+  int status = 0;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", ctx->path) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((file = fopen(temporary, "w")) == NULL) return -1;
+
+  // The magic line is followed by NUL terminated fields
+  fprintf(file, "%s\n%016llx%c%d%c%llu%c%d%c", CHECKPOINT_MAGIC,
+          (unsigned long long)ctx->operation, '\0', complete, '\0',
+          ctx->processed, '\0', ctx->rootCount, '\0');
+  for (int i = 0; i < ctx->rootCount; ++i)
+    fprintf(file, "%s%c", ctx->roots[i], '\0');
+  fprintf(file, "%d%c%s%c", ctx->root, '\0', ctx->cursor, '\0');
+
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) status = -1;
+  if (fclose(file) != 0) status = -1;
+  if (status == 0 && rename(temporary, ctx->path) != 0) status = -1;
+  if (status != 0) unlink(temporary);
+
+  ctx->saved = time(NULL);
+
+  return status;
+}
+
+// Next NUL terminated field of a checkpoint, NULL past the end
+static char *nextField(char **p, char *end) {
+  char *field = *p;
+  char *nul;
+
+  if (field >= end || (nul = memchr(field, '\0', end - field)) == NULL)
+    return NULL;
+  *p = nul + 1;
+  return field;
+}
+
+static int checkpointLoad(const char *path, Checkpoint *checkpoint) {
+  FILE *file;
+  long size;
+  char *p, *end, *field;
+
+  memset(checkpoint, 0, sizeof(*checkpoint));
+  if ((file = fopen(path, "r")) == NULL) {
+    reportError("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  rewind(file);
+  checkpoint->data = malloc(size > 0 ? size : 1);
+  if (size <= 0 || fread(checkpoint->data, 1, size, file) != (size_t)size) {
+    fclose(file);
+    reportError("%s: %s\n", path, "Not a tag checkpoint");
+    return -1;
+  }
+  fclose(file);
+
+  p = checkpoint->data;
+  end = p + size;
+  if ((size_t)size <= strlen(CHECKPOINT_MAGIC) ||
+      memcmp(p, CHECKPOINT_MAGIC "\n", strlen(CHECKPOINT_MAGIC) + 1) != 0) {
+    reportError("%s: %s\n", path, "Not a tag checkpoint");
+    return -1;
+  }
+  p += strlen(CHECKPOINT_MAGIC) + 1;
+
+  if ((field = nextField(&p, end)) == NULL) goto malformed;
+  checkpoint->operation = strtoull(field, NULL, 16);
+  if ((field = nextField(&p, end)) == NULL) goto malformed;
+  checkpoint->complete = atoi(field);
+  if ((field = nextField(&p, end)) == NULL) goto malformed;
+  checkpoint->processed = strtoull(field, NULL, 10);
+  if ((field = nextField(&p, end)) == NULL) goto malformed;
+  checkpoint->rootCount = atoi(field);
+  if (checkpoint->rootCount < 0 || checkpoint->rootCount > size)
+    goto malformed;
+  checkpoint->roots =
+    calloc(checkpoint->rootCount ? checkpoint->rootCount : 1,
+           sizeof(*checkpoint->roots));
+  for (int i = 0; i < checkpoint->rootCount; ++i)
+    if ((checkpoint->roots[i] = nextField(&p, end)) == NULL) goto malformed;
+  if ((field = nextField(&p, end)) == NULL) goto malformed;
+  checkpoint->root = atoi(field);
+  if ((checkpoint->cursor = nextField(&p, end)) == NULL) goto malformed;
+  if (checkpoint->root < -1 || checkpoint->root >= checkpoint->rootCount)
+    goto malformed;
+
+  return 0;
+
+malformed:
+  reportError("%s: %s\n", path, "Malformed tag checkpoint");
+  return -1;
+}
+
+static void checkpointFree(Checkpoint *checkpoint) {
+  free(checkpoint->roots);
+  free(checkpoint->data);
+}
+
+// Change a single entry and advance the position past it
+static TagWalkResult checkpointVisit(const TagWalkEntry *entry,
+                                     void *context) {
+  CheckpointContext *ctx = context;
+  char *path = (char *)entry->path;
+  int status = 0;
+
+  switch (ctx->operationMode) {
+    case OperationModeSet:
+      status = setTags(path, ctx->bin, ctx->binLength, ctx->userTags,
+                       ctx->tagCount);
+      break;
+    case OperationModeAdd:
+      status = addTags(path, ctx->userTags, ctx->tagCount);
+      break;
+    case OperationModeRemove:
+      status = removeTags(path, ctx->userTags, ctx->tagCount);
+      break;
+    default:
+      break;
+  }
+
+  // A failed path is reported and passed, a resumed run does not retry it
+  if (status != 0) {
+    reportError("%s: %s\n", path, strerror(errno));
+    ctx->errors++;
+  }
+
+  ctx->processed++;
+  ctx->root = entry->root;
+  snprintf(ctx->cursor, sizeof(ctx->cursor), "%s", entry->relative);
+
+  if (ctx->path &&
+      (interrupted || time(NULL) - ctx->saved >= CHECKPOINT_INTERVAL) &&
+      checkpointSave(ctx, 0) != 0 && !ctx->failed) {
+    // Keep going, the run itself is unaffected
+    reportError("%s: %s\n", ctx->path, strerror(errno));
+    ctx->failed = 1;
+  }
+
+  return interrupted ? TagWalkStop : TagWalkContinue;
+}
+
+int checkpointTags(char *const *paths, int pathCount,
+                   OperationMode operationMode, UserTag *userTags,
+                   int tagCount, OutputFlags outputFlags,
+                   const char *checkpointPath, const char *resumePath) {
+  CheckpointContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = 1,
+                      .outputFlags = outputFlags,
+                      .visit = checkpointVisit,
+                      .context = ctx,
+                      .sorted = 1};
+  Checkpoint checkpoint = {0};
+  struct sigaction action = {.sa_handler = interruptRun};
+  struct sigaction previousInt, previousTerm;
+  int status = EXIT_SUCCESS;
+
+  ctx->operationMode = operationMode;
+  ctx->userTags = userTags;
+  ctx->tagCount = tagCount;
+  ctx->operation =
+    operationIdentifier(operationMode, userTags, tagCount, outputFlags);
+  ctx->root = -1;
+
+  // A resumed run keeps saving to the checkpoint it continues from
+  ctx->path = checkpointPath ? checkpointPath : resumePath;
+
+  if (resumePath) {
+    if (checkpointLoad(resumePath, &checkpoint) != 0) {
+      checkpointFree(&checkpoint);
+      free(ctx);
+      return EXIT_FAILURE;
+    }
+
+    // The paths of the interrupted run are used unless given again
+    if (pathCount < 1) {
+      paths = checkpoint.roots;
+      pathCount = checkpoint.rootCount;
+    }
+    int same = checkpoint.operation == ctx->operation &&
+               checkpoint.rootCount == pathCount;
+    for (int i = 0; same && i < pathCount; ++i)
+      same = strcmp(checkpoint.roots[i], paths[i]) == 0;
+    if (!same) {
+      reportError("%s: %s\n", resumePath,
+                  "Checkpoint of a different operation or paths");
+      checkpointFree(&checkpoint);
+      free(ctx);
+      return EXIT_FAILURE;
+    }
+
+    ctx->processed = checkpoint.processed;
+    ctx->root = checkpoint.root;
+    snprintf(ctx->cursor, sizeof(ctx->cursor), "%s", checkpoint.cursor);
+    if (checkpoint.root >= 0) {
+      walker.resumeRoot = checkpoint.root;
+      walker.resumeAfter = ctx->cursor;
+    }
+  }
+  ctx->roots = paths;
+  ctx->rootCount = pathCount;
+
+  if (!checkpoint.complete) {
+    // Encode the tags argument in the format of the storage backend
+    if (operationMode == OperationModeSet)
+      ctx->bin = createTagBlob(&ctx->binLength, userTags, tagCount);
+
+    if (ctx->path) {
+      // Save the position before exiting on an interrupt
+      interrupted = 0;
+      sigaction(SIGINT, &action, &previousInt);
+      sigaction(SIGTERM, &action, &previousTerm);
+      ctx->saved = time(NULL);
+    }
+
+    tagWalk(&walker, paths, pathCount);
+
+    if (ctx->path) {
+      sigaction(SIGINT, &previousInt, NULL);
+      sigaction(SIGTERM, &previousTerm, NULL);
+      if (checkpointSave(ctx, !walker.stopped) != 0) {
+        reportError("%s: %s\n", ctx->path, strerror(errno));
+        status = EXIT_FAILURE;
+      }
+    }
+
+    if (walker.stopped) {
+      reportError("%s: %s\n", ctx->path, "Interrupted, continue with --resume");
+      status = EXIT_FAILURE;
+    }
+    if (walker.errors || ctx->errors) status = EXIT_FAILURE;
+  }
+
+  // Cleanup
+  free(ctx->bin);
+  checkpointFree(&checkpoint);
+  free(ctx);
+
+  return status;
+}
@@ -0,0 +1,43 @@
+//
+// checkpoint.h
+// Tag
+//
+
+#ifndef TAG_CHECKPOINT_H
+#define TAG_CHECKPOINT_H
+
+#include "usertag.h"
+
+// Checkpoint file magic, also the version of the layout
+#define CHECKPOINT_MAGIC    "TAGCKPT1"
+
+// Seconds between checkpoint writes
+#define CHECKPOINT_INTERVAL 1
+
+/**
+ * @brief Add, remove or set tags on the paths in a resumable order
+ * @param paths Paths to change, recursively with OutputFlagsRecurseDirectory
+ * @param pathCount Number of paths, 0 to take the paths of the checkpoint
+ * being resumed
+ * @param operationMode OperationModeSet, OperationModeAdd or
+ * OperationModeRemove
+ * @param userTags Argument tags
+ * @param tagCount Number of argument tags
+ * @param outputFlags Enumeration flags (hidden files, recursion)
+ * @param checkpointPath File the position is saved to, NULL for none
+ * @param resumePath Checkpoint to continue after, NULL to start over
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the checkpoint is unusable, a
+ * directory could not be read or the run was interrupted
+ * @note Directories are walked depth first in name order. The checkpoint
+ * holds the last changed entry, every entry before it in that order is
+ * finished, and is replaced atomically at most every CHECKPOINT_INTERVAL
+ * seconds, on SIGINT and SIGTERM, and at the end. Resuming skips the
+ * finished subtrees without reading their directories or tags, and is
+ * refused if the operation, tags or paths differ from the checkpoint's.
+ */
+int checkpointTags(char *const *paths, int pathCount,
+                   OperationMode operationMode, UserTag *userTags,
+                   int tagCount, OutputFlags outputFlags,
+                   const char *checkpointPath, const char *resumePath);
+
+#endif  // TAG_CHECKPOINT_H
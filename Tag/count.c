@@ -0,0 +1,223 @@
+//
+// count.c
+// Tag
+//
+
+#include "count.h"
+
+#include "hash.h"
+#include "walk.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Initial number of slots of a count table, must be a power of two
+#define COUNT_TABLE_SIZE  64
+
+/**
+ * @typedef Walk context shared by the count workers
+ */
+typedef struct CountContext {
+  TagCountTable tables[WALK_MAX_JOBS];
+  CountFlags countFlags;
+  int recurse;
+  int implicitRoot;
+} CountContext;
+
+// Hash of a (tag, color) pair
+static uint64_t countHash(const char *name, TagColor color) {
+  return tagHashString(name, (uint64_t)color);
+}
+
+// Double the table capacity, rehashing the used slots
+static void countTableGrow(TagCountTable *table) {
+  size_t capacity = table->capacity ? table->capacity * 2 : COUNT_TABLE_SIZE;
+  TagCount *slots = calloc(capacity, sizeof(*slots));
+
+  for (size_t i = 0; i < table->capacity; ++i) {
+    TagCount *slot = table->slots + i;
+    if (!slot->name) continue;
+    size_t j = slot->hash & (capacity - 1);
+    while (slots[j].name) j = (j + 1) & (capacity - 1);
+    slots[j] = *slot;
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+}
+
+void countTableAdd(TagCountTable *table, const char *name, TagColor color,
+                   unsigned long long files, unsigned long long bytes) {
+  uint64_t hash = countHash(name, color);
+  size_t i;
+
+  // Keep the load factor below 3/4
+  if ((table->used + 1) * 4 > table->capacity * 3) countTableGrow(table);
+
+  // Linear probe for the pair or an empty slot
+  for (i = hash & (table->capacity - 1); table->slots[i].name;
+       i = (i + 1) & (table->capacity - 1)) {
+    TagCount *slot = table->slots + i;
+    if (slot->hash == hash && slot->color == color &&
+        strcmp(slot->name, name) == 0)
+      break;
+  }
+
+  if (!table->slots[i].name) {
+    table->slots[i].hash = hash;
+    table->slots[i].name = strdup(name);
+    table->slots[i].color = color;
+    table->used++;
+  }
+  table->slots[i].files += files;
+  table->slots[i].bytes += bytes;
+}
+
+void countTableMerge(TagCountTable *table, const TagCountTable *other) {
+  for (size_t i = 0; i < other->capacity; ++i) {
+    TagCount *slot = other->slots + i;
+    if (slot->name)
+      countTableAdd(table, slot->name, slot->color, slot->files, slot->bytes);
+  }
+  table->files += other->files;
+  table->tagged += other->tagged;
+  table->bytes += other->bytes;
+}
+
+// Sort by descending file count, then by name and color
+static int countCompare(const void *a, const void *b) {
+  const TagCount *ca = a, *cb = b;
+  if (ca->files != cb->files) return ca->files < cb->files ? 1 : -1;
+  int result = strcmp(ca->name, cb->name);
+  return result ? result : (int)ca->color - (int)cb->color;
+}
+
+void countTablePrint(TagCountTable *table, CountFlags countFlags) {
+  TagCount *sorted = calloc(table->used ? table->used : 1, sizeof(*sorted));
+  size_t n = 0;
+
+  // Collect and sort the used slots
+  for (size_t i = 0; i < table->capacity; ++i)
+    if (table->slots[i].name) sorted[n++] = table->slots[i];
+  qsort(sorted, n, sizeof(*sorted), countCompare);
+
+  if (countFlags & CountFlagsJson) {
+    printf("{\"files\":%llu,\"tagged\":%llu,", table->files, table->tagged);
+    if (countFlags & CountFlagsBytes) printf("\"bytes\":%llu,", table->bytes);
+    printf("\"tags\":[");
+    for (size_t i = 0; i < n; ++i) {
+      printf("%s{\"name\":", i ? "," : "");
+      printJsonString(stdout, sorted[i].name);
+      printf(",\"color\":\"%s\",\"files\":%llu", getColorName(sorted[i].color),
+             sorted[i].files);
+      if (countFlags & CountFlagsBytes)
+        printf(",\"bytes\":%llu", sorted[i].bytes);
+      printf("}");
+    }
+    printf("]}\n");
+  } else {
+    // Totals first, the rows can then be merged by `tag --merge`
+    printf("# files=%llu tagged=%llu", table->files, table->tagged);
+    if (countFlags & CountFlagsBytes) printf(" bytes=%llu", table->bytes);
+    printf(" tags=%zu\n", n);
+    for (size_t i = 0; i < n; ++i) {
+      if (countFlags & CountFlagsBytes) {
+        printf("%10llu %14llu %-7s %s\n", sorted[i].files, sorted[i].bytes,
+               getColorName(sorted[i].color), sorted[i].name);
+      } else {
+        printf("%10llu %14s %-7s %s\n", sorted[i].files, "-",
+               getColorName(sorted[i].color), sorted[i].name);
+      }
+    }
+  }
+
+  free(sorted);
+}
+
+void countTableFree(TagCountTable *table) {
+  for (size_t i = 0; i < table->capacity; ++i)
+    if (table->slots[i].name) free(table->slots[i].name);
+  free(table->slots);
+  memset(table, 0, sizeof(*table));
+}
+
+// Aggregate the tags of a single entry into the worker's table
+static TagWalkResult countVisit(const TagWalkEntry *entry, void *context) {
+  CountContext *ctx = context;
+  TagCountTable *table = ctx->tables + entry->worker;
+  unsigned long long bytes = 0;
+  UserTag *existingTags;
+  int existingTagsCount;
+
+  // The implicit current directory root is enumerated but not counted
+  if (ctx->implicitRoot && entry->depth == 0) return TagWalkContinue;
+
+  existingTags = tagWalkEntryTags(entry, &existingTagsCount);
+
+  if (ctx->countFlags & CountFlagsBytes) {
+    struct stat st;
+    if (entry->type == DT_REG && lstat(entry->path, &st) == 0)
+      bytes = (unsigned long long)st.st_size;
+  }
+
+  table->files++;
+  table->bytes += bytes;
+  if (existingTagsCount) table->tagged++;
+
+  // Sort so duplicate tags within a blob are only counted once
+  if (existingTagsCount)
+    qsort(existingTags, existingTagsCount, sizeof(*existingTags), tagCompare);
+  for (int i = 0; i < existingTagsCount; ++i) {
+    UserTag *tag = existingTags + i;
+    if (i && tagCompare(tag - 1, tag) == 0 && (tag - 1)->color == tag->color)
+      continue;
+    countTableAdd(table, tag->name, tag->color, 1, bytes);
+  }
+
+  freeUserTags(existingTags, existingTagsCount);
+
+  // Without recursion only the first level of the implicit root is entered
+  if (!ctx->recurse && entry->depth > 0) return TagWalkSkip;
+
+  return TagWalkContinue;
+}
+
+int countTags(char *const *paths, int pathCount, OutputFlags outputFlags,
+              CountFlags countFlags, int jobs) {
+  static char *const cwd[] = {"."};
+  CountContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags,
+                      .visit = countVisit,
+                      .context = ctx,
+                      .prefetch = 1};
+
+  ctx->countFlags = countFlags;
+  ctx->recurse = (outputFlags & OutputFlagsRecurseDirectory) != 0;
+
+  // Default to the contents of the current directory
+  if (pathCount < 1) {
+    paths = cwd;
+    pathCount = 1;
+    ctx->implicitRoot = 1;
+    walker.outputFlags |= OutputFlagsRecurseDirectory;
+  }
+
+  tagWalk(&walker, paths, pathCount);
+
+  // Merge the per worker tables into the first
+  for (int i = 1; i < walker.jobs; ++i) {
+    countTableMerge(ctx->tables, ctx->tables + i);
+    countTableFree(ctx->tables + i);
+  }
+
+  countTablePrint(ctx->tables, countFlags);
+
+  countTableFree(ctx->tables);
+  free(ctx);
+
+  return walker.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+//
+// count.h
+// Tag
+//
+
+#ifndef TAG_COUNT_H
+#define TAG_COUNT_H
+
+#include "usertag.h"
+
+#include <stdint.h>
+
+/**
+ * @typedef Options controlling tag frequency aggregation
+ * @enum 0b00000001 Accumulate the byte size of the files carrying each tag
+ * @enum 0b00000010 Emit JSON instead of a table
+ */
+typedef enum CountFlags {
+  CountFlagsBytes = (1 << 0),
+  CountFlagsJson  = (1 << 1)
+} CountFlags;
+
+/**
+ * @typedef Aggregated frequency of a single (tag, color) pair
+ */
+typedef struct TagCount {
+  uint64_t hash;
+  char *name;
+  TagColor color;
+  unsigned long long files;
+  unsigned long long bytes;
+} TagCount;
+
+/**
+ * @typedef Open addressing hash table of TagCount slots plus scan totals
+ * @field files Number of entries aggregated
+ * @field tagged Number of entries carrying at least one tag
+ * @field bytes Total size of the aggregated entries
+ */
+typedef struct TagCountTable {
+  TagCount *slots;
+  size_t capacity;
+  size_t used;
+  unsigned long long files;
+  unsigned long long tagged;
+  unsigned long long bytes;
+} TagCountTable;
+
+/**
+ * @brief Add to the counters of a (tag, color) pair, inserting it if needed
+ * @param table Table to update
+ * @param name Tag name, copied on insertion
+ * @param color Tag color
+ * @param files Number of files to add
+ * @param bytes Number of bytes to add
+ */
+void countTableAdd(TagCountTable *table, const char *name, TagColor color,
+                   unsigned long long files, unsigned long long bytes);
+
+/**
+ * @brief Merge all counters and totals of one table into another
+ * @param table Destination table
+ * @param other Source table, left untouched
+ */
+void countTableMerge(TagCountTable *table, const TagCountTable *other);
+
+/**
+ * @brief Print the table sorted by descending file count, then by name
+ * @param table Table to print
+ * @param countFlags Output options
+ */
+void countTablePrint(TagCountTable *table, CountFlags countFlags);
+
+/**
+ * @brief Release the memory held by a table
+ * @param table Table to release
+ */
+void countTableFree(TagCountTable *table);
+
+/**
+ * @brief Count how many files carry each (tag, color) pair under the paths
+ * @param paths Paths to aggregate, the current directory contents if none
+ * @param pathCount Number of paths
+ * @param outputFlags Enumeration flags (hidden files, recursion)
+ * @param countFlags Aggregation and output options
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if directories could not be read
+ * @note Each worker aggregates into its own hash table, the tables are merged
+ * once the walk is done. No per file output is produced.
+ */
+int countTags(char *const *paths, int pathCount, OutputFlags outputFlags,
+              CountFlags countFlags, int jobs);
+
+#endif  // TAG_COUNT_H
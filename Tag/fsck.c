@@ -0,0 +1,285 @@
+//
+// fsck.c
+// Tag
+//
+
+#include "fsck.h"
+
+#include "journal.h"
+#include "store.h"
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Names of the classes as printed
+static const char *const fsckClassNames[] = {"valid", "non-canonical",
+                                             "duplicate", "oversized",
+                                             "corrupt"};
+
+/**
+ * @typedef Counters of a single worker
+ * @field files Entries checked
+ * @field tagged Entries carrying a blob
+ * @field classes Blobs of each class
+ * @field repaired Blobs rewritten in the canonical form
+ * @field skipped Blobs left as they were because other writers kept
+ * changing them
+ * @field errors Entries that could not be read or rewritten
+ */
+typedef struct FsckCounters {
+  unsigned long long files;
+  unsigned long long tagged;
+  unsigned long long classes[FsckClassCorrupt + 1];
+  unsigned long long repaired;
+  unsigned long long skipped;
+  unsigned long long errors;
+} FsckCounters;
+
+/**
+ * @typedef Walk context shared by the check workers
+ */
+typedef struct FsckContext {
+  int repair;
+  OutputFlags outputFlags;
+  FsckCounters counters[WALK_MAX_JOBS];
+} FsckContext;
+
+// Order by name, then colored tags before uncolored ones
+static int canonicalCompare(const void *a, const void *b) {
+  const UserTag *ta = a, *tb = b;
+  int result = tagCompare(ta, tb);
+  if (result) return result;
+  return (ta->color == TagColorNone) - (tb->color == TagColorNone);
+}
+
+// Reduce a decoded tag set to its canonical form in place, returning the
+// number of tags kept and setting whether duplicates were merged
+static int canonicalTags(UserTag *tags, int count, int *duplicates) {
+  int kept = 0;
+
+  *duplicates = 0;
+  for (int i = 0; i < count; ++i) {
+    if (*tags[i].name) {
+      tags[kept++] = tags[i];
+    } else {
+      free(tags[i].name);
+    }
+  }
+  if (kept) qsort(tags, kept, sizeof(*tags), canonicalCompare);
+
+  // Merge duplicates into the first kept, as createPlistBinary would: exact
+  // ones keep a color if any has one, case variants keep the first in order
+  int unique = 0;
+  for (int i = 0; i < kept; ++i) {
+    int j = 0;
+    while (j < unique && strcasecmp(tags[j].name, tags[i].name) != 0) ++j;
+    if (j < unique) {
+      *duplicates = 1;
+      free(tags[i].name);
+      continue;
+    }
+    tags[unique++] = tags[i];
+  }
+
+  return unique;
+}
+
+// Read a blob of any size up to FSCK_MAX_BLOB, NULL with errno set if the
+// path carries none or it cannot be read
+static unsigned char *fsckRead(const char *path, ssize_t *length) {
+  size_t size = EXT_ATTR_SIZE;
+  unsigned char *blob = NULL;
+
+  for (;;) {
+    blob = realloc(blob, size);
+    if ((*length = tagStoreGet(path, blob, size)) >= 0) return blob;
+    if (errno != ERANGE || size >= FSCK_MAX_BLOB) break;
+    size *= 4;
+  }
+  int error = errno;
+  free(blob);
+  errno = error;
+
+  return NULL;
+}
+
+// Print an entry with its class, or with the outcome of its repair
+static void fsckPrint(FsckContext *ctx, const char *path, FsckClass class,
+                      const char *repaired) {
+  char delimiter = (ctx->outputFlags & OutputFlagsNulTerminate) ? '\0' : '\n';
+
+  flockfile(stdout);
+  printf("%s%s\t%s", fsckClassNames[class], repaired ? repaired : "", path);
+  putchar(delimiter);
+  funlockfile(stdout);
+}
+
+// Single optimistic check of an entry, rewriting its blob when asked to
+// unless another writer changed it since it was read. tagStoreSwap results,
+// tagged is left 0 if the entry carries no blob.
+static int fsckOnce(FsckContext *ctx, const char *path, int *tagged,
+                    FsckClass *class, int *repaired) {
+  unsigned char *blob, *canonical = NULL;
+  size_t canonicalLength = 0;
+  ssize_t length;
+  UserTag *tags;
+  int tagCount, canonicalCount, duplicates;
+  int status = 0;
+
+  *tagged = *repaired = 0;
+  if ((blob = fsckRead(path, &length)) == NULL) {
+    if (errno == ERANGE) {
+      // Too large to even be read here
+      *tagged = 1;
+      *class = FsckClassOversized;
+      return 0;
+    }
+    return errno == TAG_ENOATTR ? 0 : -1;
+  }
+  *tagged = 1;
+
+  if (decodeUserTags(blob, length, &tags, &tagCount) != 0) {
+    *class = FsckClassCorrupt;
+    free(blob);
+    return 0;
+  }
+
+  canonicalCount = canonicalTags(tags, tagCount, &duplicates);
+  if (canonicalCount &&
+      !(canonical = createTagBlob(&canonicalLength, tags, canonicalCount))) {
+    // Failing to encode tags is not a reason to remove them
+    freeUserTags(tags, canonicalCount);
+    free(blob);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if (length > EXT_ATTR_SIZE) {
+    *class = FsckClassOversized;
+  } else if (duplicates) {
+    *class = FsckClassDuplicate;
+  } else if (!canonical || canonicalLength != (size_t)length ||
+             memcmp(canonical, blob, length) != 0) {
+    *class = FsckClassNonCanonical;
+  } else {
+    *class = FsckClassValid;
+  }
+
+  // Rewrite unless the canonical form is unchanged or still unusable, and
+  // only over the blob that was classified. Only an entry without any tags
+  // left has its blob removed.
+  if (*class != FsckClassValid && ctx->repair &&
+      canonicalLength <= EXT_ATTR_SIZE &&
+      (canonicalLength != (size_t)length ||
+       memcmp(canonical, blob, length) != 0)) {
+    status = canonical ? tagStoreSwap(path, blob, length, canonical,
+                                      (ssize_t)canonicalLength)
+                       : tagStoreSwap(path, blob, length, NULL, -1);
+    if (status >= 0 && status != 1) {
+      *repaired = 1;
+      if (journalActive()) {
+        int oldCount;
+        UserTag *oldTags = createUserTagsFromData(blob, length, &oldCount);
+        journalRecord(path, oldTags, oldCount, tags, canonicalCount);
+        freeUserTags(oldTags, oldCount);
+      }
+    }
+  }
+
+  free(canonical);
+  freeUserTags(tags, canonicalCount);
+  free(blob);
+
+  return status;
+}
+
+// Classify the blob of a single entry, rewriting it when asked to
+static TagWalkResult fsckVisit(const TagWalkEntry *entry, void *context) {
+  FsckContext *ctx = context;
+  FsckCounters *counters = ctx->counters + entry->worker;
+  int tagged, repaired, skipped = 0;
+  FsckClass class;
+  int status;
+
+  // Links below the roots would check the blobs of their targets
+  if (entry->type == DT_LNK && entry->depth) return TagWalkContinue;
+
+  counters->files++;
+
+  // Check the entry again from a fresh read whenever another writer got in
+  // between, and leave it as it is if that keeps happening
+  for (int attempt = 0;
+       (status = fsckOnce(ctx, entry->path, &tagged, &class, &repaired)) > 0;
+       ++attempt) {
+    if (tagStoreBackoff(attempt) != 0) {
+      skipped = 1;
+      break;
+    }
+  }
+  if (status < 0) {
+    reportError("%s: %s\n", entry->path, strerror(errno));
+    counters->errors++;
+    return TagWalkContinue;
+  }
+  if (!tagged) return TagWalkContinue;
+
+  counters->tagged++;
+  counters->classes[class]++;
+  if (skipped) {
+    counters->skipped++;
+  } else if (repaired) {
+    counters->repaired++;
+  }
+  if (class != FsckClassValid)
+    fsckPrint(ctx, entry->path, class,
+              skipped ? " skipped" : repaired ? " repaired" : NULL);
+
+  return TagWalkContinue;
+}
+
+int fsckTags(char *const *paths, int pathCount, int repair,
+             OutputFlags outputFlags, int jobs) {
+  static char *const cwd[] = {"."};
+  FsckContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags | OutputFlagsRecurseDirectory,
+                      .visit = fsckVisit,
+                      .context = ctx};
+  FsckCounters total = {0};
+  unsigned long long unrepaired;
+
+  ctx->repair = repair;
+  ctx->outputFlags = outputFlags;
+
+  // Default to the current directory
+  if (pathCount < 1) {
+    paths = cwd;
+    pathCount = 1;
+  }
+
+  tagWalk(&walker, paths, pathCount);
+
+  for (int i = 0; i < walker.jobs; ++i) {
+    total.files += ctx->counters[i].files;
+    total.tagged += ctx->counters[i].tagged;
+    for (int c = FsckClassValid; c <= FsckClassCorrupt; ++c)
+      total.classes[c] += ctx->counters[i].classes[c];
+    total.repaired += ctx->counters[i].repaired;
+    total.skipped += ctx->counters[i].skipped;
+    total.errors += ctx->counters[i].errors;
+  }
+  free(ctx);
+
+  printf("# files=%llu tagged=%llu", total.files, total.tagged);
+  for (int c = FsckClassValid; c <= FsckClassCorrupt; ++c)
+    printf(" %s=%llu", fsckClassNames[c], total.classes[c]);
+  printf(" repaired=%llu skipped=%llu\n", total.repaired, total.skipped);
+
+  unrepaired = total.tagged - total.classes[FsckClassValid] - total.repaired;
+  return (unrepaired || total.errors || walker.errors) ? EXIT_FAILURE
+                                                       : EXIT_SUCCESS;
+}
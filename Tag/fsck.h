@@ -0,0 +1,52 @@
+//
+// fsck.h
+// Tag
+//
+
+#ifndef TAG_FSCK_H
+#define TAG_FSCK_H
+
+#include "usertag.h"
+
+// Largest blob read by a check, larger blobs are reported as oversized
+// without being decoded
+#define FSCK_MAX_BLOB   (1 << 20)
+
+/**
+ * @typedef Classification of a tag blob, in increasing order of severity
+ * @enum 0 Canonical: sorted, without duplicates, minimal encoding
+ * @enum 1 Decodes, but is not in the canonical encoding or order
+ * @enum 2 Carries the same tag name more than once, or names differing only
+ * in case
+ * @enum 3 Larger than EXT_ATTR_SIZE, unreadable by the other operations
+ * @enum 4 Not a property list array of strings
+ */
+typedef enum FsckClass {
+  FsckClassValid,
+  FsckClassNonCanonical,
+  FsckClassDuplicate,
+  FsckClassOversized,
+  FsckClassCorrupt
+} FsckClass;
+
+/**
+ * @brief Classify the tag blob of every entry below the paths
+ * @param paths Roots of the check, walked recursively
+ * @param pathCount Number of roots
+ * @param repair Rewrite the blobs that decode in the canonical form
+ * @param outputFlags Enumeration flags (hidden files)
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS if every blob is valid or was repaired, EXIT_FAILURE
+ * otherwise
+ * @note Each blob that is not valid is printed with its class, followed by
+ * a summary line. The canonical form holds the tags sorted by name without
+ * empty names, with duplicates merged the way createPlistBinary does (names
+ * differing only in case are one tag, the first in order is kept, and a
+ * color is kept over none), encoded by createPlistBinary, so canonical blobs
+ * of equal tag sets are equal byte for byte. An empty canonical set removes
+ * the blob. Corrupt blobs are never rewritten.
+ */
+int fsckTags(char *const *paths, int pathCount, int repair,
+             OutputFlags outputFlags, int jobs);
+
+#endif  // TAG_FSCK_H
@@ -0,0 +1,212 @@
+//
+// governor.c
+// Tag
+//
+
+#include "governor.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Niceness of a background process
+#define GOVERNOR_NICE       10
+
+// Multiplicative decrease of the rate over the latency target
+#define GOVERNOR_BACKOFF    0.7
+
+#ifdef __linux__
+// ioprio_set(2) has no libc wrapper
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_SHIFT  13
+#endif
+
+/**
+ * @typedef Process wide governor
+ * @field active Limits are configured, read without the lock on the fast
+ * path so it is accessed atomically
+ * @field rate Current operations per second, 0 when unlimited
+ * @field next Earliest start of the next operation, in nanoseconds
+ * @field inflight Operations in progress
+ * @field samples Read latencies of the current window, in microseconds
+ * @field windowStart Start of the current window, in nanoseconds
+ * @field windowOps Operations finished in the current window
+ */
+static struct {
+  int active;
+  GovernorOptions options;
+  double rate;
+  int64_t next;
+  int inflight;
+  uint64_t samples[GOVERNOR_WINDOW];
+  int sampleCount;
+  int64_t windowStart;
+  unsigned long windowOps;
+  pthread_mutex_t lock;
+  pthread_cond_t slot;
+} governor = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .slot = PTHREAD_COND_INITIALIZER};
+
+static int64_t monotonicNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int sampleCompare(const void *a, const void *b) {
+  uint64_t sa = *(const uint64_t *)a, sb = *(const uint64_t *)b;
+  return (sa > sb) - (sa < sb);
+}
+
+// Let co-tenant workloads go first for CPU and disk
+static void lowerPriority(void) {
+  setpriority(PRIO_PROCESS, 0, GOVERNOR_NICE);
+#if defined(__APPLE__)
+  setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE);
+#elif defined(__linux__)
+  // Lowest best effort level rather than idle, which may never be served
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7);
+#endif
+}
+
+// Adapt the rate to the read latency percentile of a full window, the lock
+// must be held
+static void adapt(int64_t now) {
+  uint64_t sorted[GOVERNOR_WINDOW];
+  double elapsed = (double)(now - governor.windowStart) / 1e9;
+  double observed = elapsed > 0 ? governor.windowOps / elapsed : 0;
+  double ceiling = governor.options.maxRate;
+
+  memcpy(sorted, governor.samples, sizeof(sorted));
+  qsort(sorted, GOVERNOR_WINDOW, sizeof(*sorted), sampleCompare);
+  uint64_t latency =
+    sorted[(int)(governor.options.percentile / 100 * (GOVERNOR_WINDOW - 1))];
+
+  if (latency > governor.options.targetLatency) {
+    // Back off from the current limit, or from the observed rate
+    double base = governor.rate > 0 ? governor.rate : observed;
+    governor.rate = base * GOVERNOR_BACKOFF;
+    if (governor.rate < GOVERNOR_MIN_RATE) governor.rate = GOVERNOR_MIN_RATE;
+  } else if (governor.rate > 0) {
+    // Probe for spare capacity
+    double step = ceiling > 0 ? ceiling / 20 : governor.rate / 10;
+    governor.rate += step < 1 ? 1 : step;
+    if (ceiling > 0 && governor.rate > ceiling) governor.rate = ceiling;
+    if (ceiling <= 0 && governor.rate > observed * 1.5) governor.rate = 0;
+  }
+
+  governor.sampleCount = 0;
+  governor.windowOps = 0;
+  governor.windowStart = now;
+}
+
+void governorConfigure(const GovernorOptions *options) {
+  pthread_mutex_lock(&governor.lock);
+  if (!options) {
+    __atomic_store_n(&governor.active, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&governor.slot);
+    pthread_mutex_unlock(&governor.lock);
+    return;
+  }
+  governor.options = *options;
+  if (governor.options.percentile <= 0 || governor.options.percentile > 100)
+    governor.options.percentile = 95;
+  governor.rate = options->maxRate > 0 ? options->maxRate : 0;
+  governor.next = 0;
+  governor.sampleCount = 0;
+  governor.windowOps = 0;
+  governor.windowStart = monotonicNow();
+  __atomic_store_n(&governor.active,
+                   options->maxRate > 0 || options->maxInflight > 0 ||
+                     options->targetLatency > 0,
+                   __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&governor.lock);
+
+  if (options->background) lowerPriority();
+}
+
+int governorParseTarget(const char *arg, GovernorOptions *options) {
+  char *end;
+  double milliseconds = strtod(arg, &end);
+
+  options->percentile = 95;
+  if (end == arg || milliseconds <= 0) return -1;
+  if (*end == ':') {
+    arg = end + 1;
+    if (*arg == 'p') arg++;
+    options->percentile = strtod(arg, &end);
+    if (end == arg || options->percentile <= 0 || options->percentile > 100)
+      return -1;
+  }
+  if (*end) return -1;
+  options->targetLatency = (uint64_t)(milliseconds * 1000);
+
+  return 0;
+}
+
+uint64_t governorAcquire(void) {
+  int64_t wait = 0;
+
+  if (!governorActive()) return 0;
+
+  pthread_mutex_lock(&governor.lock);
+  if (governor.rate > 0) {
+    // Reserve the next slot, allowing a short burst after an idle period
+    int64_t now = monotonicNow();
+    int64_t interval = (int64_t)(1e9 / governor.rate);
+    if (governor.next < now - GOVERNOR_BURST * interval)
+      governor.next = now - GOVERNOR_BURST * interval;
+    wait = governor.next - now;
+    governor.next += interval;
+  }
+  pthread_mutex_unlock(&governor.lock);
+
+  if (wait > 0) {
+    struct timespec delay = {.tv_sec = wait / 1000000000,
+                             .tv_nsec = wait % 1000000000};
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) continue;
+  }
+
+  pthread_mutex_lock(&governor.lock);
+  while (governorActive() && governor.options.maxInflight > 0 &&
+         governor.inflight >= governor.options.maxInflight)
+    pthread_cond_wait(&governor.slot, &governor.lock);
+  governor.inflight++;
+  pthread_mutex_unlock(&governor.lock);
+
+  return (uint64_t)monotonicNow();
+}
+
+void governorRelease(uint64_t start, int read) {
+  int64_t now;
+  int error = errno;
+
+  if (!start) return;
+  now = monotonicNow();
+
+  pthread_mutex_lock(&governor.lock);
+  governor.inflight--;
+  pthread_cond_signal(&governor.slot);
+  governor.windowOps++;
+  if (read && governor.options.targetLatency > 0) {
+    governor.samples[governor.sampleCount++] =
+      (uint64_t)(now - (int64_t)start) / 1000;
+    if (governor.sampleCount == GOVERNOR_WINDOW) adapt(now);
+  }
+  pthread_mutex_unlock(&governor.lock);
+
+  errno = error;
+}
+
+int governorActive(void) {
+  return __atomic_load_n(&governor.active, __ATOMIC_ACQUIRE);
+}
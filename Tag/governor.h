@@ -0,0 +1,73 @@
+//
+// governor.h
+// Tag
+//
+
+#ifndef TAG_GOVERNOR_H
+#define TAG_GOVERNOR_H
+
+#include <stdint.h>
+
+// Read latency samples per adaptation step
+#define GOVERNOR_WINDOW     256
+
+// Operations that may be issued back to back after an idle period
+#define GOVERNOR_BURST      16
+
+// Lowest rate the adaptation backs off to, in operations per second
+#define GOVERNOR_MIN_RATE   10
+
+/**
+ * @typedef Limits on the tag reads and writes of the whole process
+ * @field maxRate Operations per second, 0 for no limit
+ * @field maxInflight Operations in progress at once, 0 for no limit
+ * @field targetLatency Read latency in microseconds the rate adapts to, 0 to
+ * keep the rate fixed
+ * @field percentile Percentile of the read latencies compared to the target
+ * @field background Lower the CPU and I/O priority of the process
+ */
+typedef struct GovernorOptions {
+  double maxRate;
+  int maxInflight;
+  uint64_t targetLatency;
+  double percentile;
+  int background;
+} GovernorOptions;
+
+/**
+ * @brief Start governing the tag reads and writes
+ * @param options Limits, NULL stops governing
+ * @note Over the target latency the rate is cut multiplicatively, below it
+ * the rate grows additively back up to maxRate, or until it no longer limits
+ * the process when there is no maxRate.
+ */
+void governorConfigure(const GovernorOptions *options);
+
+/**
+ * @brief Parse a latency target
+ * @param arg Milliseconds, optionally followed by ":" and a percentile
+ * @param options Receives the target and the percentile, 95 if not given
+ * @return 0 on success, -1 if the target is malformed
+ */
+int governorParseTarget(const char *arg, GovernorOptions *options);
+
+/**
+ * @brief Wait until an operation may start
+ * @return Start time of the operation, passed to governorRelease
+ */
+uint64_t governorAcquire(void);
+
+/**
+ * @brief Account for a finished operation
+ * @param start Value returned by governorAcquire
+ * @param read The operation read tags, its latency drives the adaptation
+ */
+void governorRelease(uint64_t start, int read);
+
+/**
+ * @brief Test whether operations are governed
+ * @return Non zero while limits are configured
+ */
+int governorActive(void);
+
+#endif  // TAG_GOVERNOR_H
@@ -0,0 +1,51 @@
+//
+// hash.c
+// Tag
+//
+
+#include "hash.h"
+
+#include <string.h>
+
+uint64_t tagHash64(const void *data, size_t length, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const unsigned char *p = data;
+  const unsigned char *end = p + (length & ~(size_t)7);
+  uint64_t h = seed ^ (length * m);
+
+  // Mix in eight bytes at a time, memcpy avoids unaligned reads
+  for (; p != end; p += 8) {
+    uint64_t k;
+    memcpy(&k, p, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  // Mix in the remaining tail bytes
+  switch (length & 7) {
+    case 7: h ^= (uint64_t)p[6] << 48;  // fall through
+    case 6: h ^= (uint64_t)p[5] << 40;  // fall through
+    case 5: h ^= (uint64_t)p[4] << 32;  // fall through
+    case 4: h ^= (uint64_t)p[3] << 24;  // fall through
+    case 3: h ^= (uint64_t)p[2] << 16;  // fall through
+    case 2: h ^= (uint64_t)p[1] << 8;   // fall through
+    case 1:
+      h ^= (uint64_t)p[0];
+      h *= m;
+  }
+
+  // Final avalanche
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+
+  return h;
+}
+
+uint64_t tagHashString(const char *string, uint64_t seed) {
+  return tagHash64(string, strlen(string), seed);
+}
@@ -0,0 +1,29 @@
+//
+// hash.h
+// Tag
+//
+
+#ifndef TAG_HASH_H
+#define TAG_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief 64-bit non-cryptographic hash (MurmurHash64A) of a byte range
+ * @param data Bytes to hash
+ * @param length Number of bytes
+ * @param seed Seed value, use different seeds for independent hash functions
+ * @return 64-bit hash value
+ */
+uint64_t tagHash64(const void *data, size_t length, uint64_t seed);
+
+/**
+ * @brief Hash a NUL terminated string
+ * @param string String to hash
+ * @param seed Seed value
+ * @return 64-bit hash value
+ */
+uint64_t tagHashString(const char *string, uint64_t seed);
+
+#endif  // TAG_HASH_H
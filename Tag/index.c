@@ -0,0 +1,423 @@
+//
+// index.c
+// Tag
+//
+
+#include "index.h"
+
+#include "trie.h"
+#include "walk.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @typedef Tagged path found by a build
+ */
+typedef struct IndexEntry {
+  char *path;
+  UserTag *tags;
+  int tagCount;
+} IndexEntry;
+
+/**
+ * @typedef Tagged paths found by a single build worker
+ */
+typedef struct IndexEntries {
+  IndexEntry *entries;
+  size_t count;
+  size_t capacity;
+} IndexEntries;
+
+/**
+ * @typedef Walk context shared by the build workers
+ */
+typedef struct IndexBuildContext {
+  IndexEntries workers[WALK_MAX_JOBS];
+} IndexBuildContext;
+
+/**
+ * @typedef Index loaded for a query
+ * @field names Tag names in strcmp order, a name's index is its rank
+ * @field trie Trie over the names
+ * @field paths Tagged paths in strcmp order
+ * @field tags Tags of every path, those of path i start at tagOffsets[i]
+ * @field postings Paths carrying every name, those of rank r start at
+ * postingOffsets[r] and are in path order
+ */
+typedef struct TagIndex {
+  char **names;
+  uint32_t nameCount;
+  TagTrie *trie;
+  char **paths;
+  uint32_t pathCount;
+  IndexPosting *tags;
+  size_t *tagOffsets;
+  uint32_t *postings;
+  size_t *postingOffsets;
+} TagIndex;
+
+static int nameCompare(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int entryCompare(const void *a, const void *b) {
+  return strcmp(((const IndexEntry *)a)->path, ((const IndexEntry *)b)->path);
+}
+
+static int postingCompare(const void *a, const void *b) {
+  const IndexPosting *pa = a, *pb = b;
+  return (pa->rank > pb->rank) - (pa->rank < pb->rank);
+}
+
+// Keep the entry when it carries tags
+static TagWalkResult indexVisit(const TagWalkEntry *entry, void *context) {
+  IndexBuildContext *ctx = context;
+  IndexEntries *worker = ctx->workers + entry->worker;
+  UserTag *existingTags;
+  int existingTagsCount;
+
+  existingTags = tagWalkEntryTags(entry, &existingTagsCount);
+  if (existingTagsCount < 1) {
+    freeUserTags(existingTags, existingTagsCount);
+    return TagWalkContinue;
+  }
+
+  if (worker->count == worker->capacity) {
+    worker->capacity = worker->capacity ? worker->capacity * 2 : 1024;
+    worker->entries =
+      realloc(worker->entries, sizeof(*worker->entries) * worker->capacity);
+  }
+  worker->entries[worker->count].path = strdup(entry->path);
+  worker->entries[worker->count].tags = existingTags;
+  worker->entries[worker->count++].tagCount = existingTagsCount;
+
+  return TagWalkContinue;
+}
+
+// Write the index aside and rename it over the old one
+static int indexSave(const char *indexPath, IndexEntry *entries, size_t count,
+                     char **names, size_t nameCount) {
+  char temporary[PATH_MAX];
+  IndexHeader header = {.nameCount = nameCount, .pathCount = count};
+  IndexPosting *postings = NULL;
+  size_t postingCapacity = 0;
+  FILE *file;
+  int status = 0;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", indexPath) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((file = fopen(temporary, "w")) == NULL) return -1;
+
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  if (fwrite(&header, sizeof(header), 1, file) != 1) status = -1;
+
+  for (size_t i = 0; i < nameCount && status == 0; ++i) {
+    uint16_t length = (uint16_t)strlen(names[i]);
+    if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+        fwrite(names[i], 1, length, file) != length)
+      status = -1;
+  }
+
+  for (size_t i = 0; i < count && status == 0; ++i) {
+    IndexEntry *entry = entries + i;
+    uint32_t length = (uint32_t)strlen(entry->path), tagCount = 0;
+
+    // Ranks of the tags, repeated names are kept once
+    if ((size_t)entry->tagCount > postingCapacity) {
+      postingCapacity = entry->tagCount;
+      postings = realloc(postings, sizeof(*postings) * postingCapacity);
+    }
+    for (int j = 0; j < entry->tagCount; ++j) {
+      char **found = bsearch(&entry->tags[j].name, names, nameCount,
+                             sizeof(*names), nameCompare);
+      postings[j].rank = (uint32_t)(found - names);
+      postings[j].color = entry->tags[j].color;
+    }
+    qsort(postings, entry->tagCount, sizeof(*postings), postingCompare);
+    for (int j = 0; j < entry->tagCount; ++j)
+      if (!tagCount || postings[tagCount - 1].rank != postings[j].rank)
+        postings[tagCount++] = postings[j];
+
+    if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+        fwrite(entry->path, 1, length, file) != length ||
+        fwrite(&tagCount, sizeof(tagCount), 1, file) != 1 ||
+        fwrite(postings, sizeof(*postings), tagCount, file) != tagCount)
+      status = -1;
+  }
+  free(postings);
+
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) status = -1;
+  if (fclose(file) != 0) status = -1;
+  if (status == 0 && rename(temporary, indexPath) != 0) status = -1;
+  if (status != 0) unlink(temporary);
+
+  return status;
+}
+
+int indexBuild(const char *indexPath, char *const *paths, int pathCount,
+               OutputFlags outputFlags, int jobs) {
+  static char *const cwd[] = {"."};
+  IndexBuildContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags | OutputFlagsRecurseDirectory,
+                      .visit = indexVisit,
+                      .context = ctx,
+                      .prefetch = 1};
+  IndexEntry *entries;
+  size_t count = 0, nameCount = 0, unique = 0;
+  char **names;
+  int status = EXIT_SUCCESS;
+
+  // Default to the current directory
+  if (pathCount < 1) {
+    paths = cwd;
+    pathCount = 1;
+  }
+
+  tagWalk(&walker, paths, pathCount);
+
+  // Gather the entries of every worker in path order
+  for (int i = 0; i < WALK_MAX_JOBS; ++i) count += ctx->workers[i].count;
+  entries = calloc(count ? count : 1, sizeof(*entries));
+  count = 0;
+  for (int i = 0; i < WALK_MAX_JOBS; ++i) {
+    for (size_t j = 0; j < ctx->workers[i].count; ++j)
+      entries[count++] = ctx->workers[i].entries[j];
+    free(ctx->workers[i].entries);
+  }
+  qsort(entries, count, sizeof(*entries), entryCompare);
+
+  // Distinct names in strcmp order, the ranks the postings refer to
+  for (size_t i = 0; i < count; ++i) nameCount += entries[i].tagCount;
+  names = calloc(nameCount ? nameCount : 1, sizeof(*names));
+  nameCount = 0;
+  for (size_t i = 0; i < count; ++i)
+    for (int j = 0; j < entries[i].tagCount; ++j)
+      names[nameCount++] = entries[i].tags[j].name;
+  qsort(names, nameCount, sizeof(*names), nameCompare);
+  for (size_t i = 0; i < nameCount; ++i)
+    if (!unique || strcmp(names[unique - 1], names[i]) != 0)
+      names[unique++] = names[i];
+
+  if (indexSave(indexPath, entries, count, names, unique) != 0) {
+    reportError("%s: %s\n", indexPath, strerror(errno));
+    status = EXIT_FAILURE;
+  } else {
+    printf("# paths=%zu names=%zu\n", count, unique);
+  }
+  if (walker.errors) status = EXIT_FAILURE;
+
+  // Cleanup
+  free(names);
+  for (size_t i = 0; i < count; ++i) {
+    free(entries[i].path);
+    freeUserTags(entries[i].tags, entries[i].tagCount);
+  }
+  free(entries);
+  free(ctx);
+
+  return status;
+}
+
+static void indexFree(TagIndex *index) {
+  for (uint32_t i = 0; i < index->nameCount; ++i) free(index->names[i]);
+  for (uint32_t i = 0; i < index->pathCount; ++i) free(index->paths[i]);
+  free(index->names);
+  free(index->paths);
+  free(index->tags);
+  free(index->tagOffsets);
+  free(index->postings);
+  free(index->postingOffsets);
+  tagTrieFree(index->trie);
+}
+
+// Read a length prefixed string, NULL if the file is truncated
+static char *indexReadString(FILE *file, size_t length) {
+  char *string = malloc(length + 1);
+
+  if (fread(string, 1, length, file) != length) {
+    free(string);
+    return NULL;
+  }
+  string[length] = '\0';
+  return string;
+}
+
+static int indexLoad(const char *indexPath, TagIndex *index) {
+  IndexHeader header;
+  size_t tagCount = 0, tagCapacity = 0;
+  FILE *file;
+
+  if ((file = fopen(indexPath, "r")) == NULL) {
+    reportError("%s: %s\n", indexPath, strerror(errno));
+    return -1;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+      header.nameCount > UINT32_MAX || header.pathCount > UINT32_MAX) {
+    reportError("%s: %s\n", indexPath, "Not a tag index");
+    fclose(file);
+    return -1;
+  }
+
+  index->names = calloc(header.nameCount + 1, sizeof(*index->names));
+  for (; index->nameCount < header.nameCount; ++index->nameCount) {
+    uint16_t length;
+    char *name;
+    if (fread(&length, sizeof(length), 1, file) != 1 ||
+        (name = indexReadString(file, length)) == NULL)
+      goto corrupt;
+    index->names[index->nameCount] = name;
+    // The trie needs the names sorted and unique
+    if (index->nameCount &&
+        strcmp(index->names[index->nameCount - 1], name) >= 0) {
+      free(name);
+      goto corrupt;
+    }
+  }
+
+  index->paths = calloc(header.pathCount + 1, sizeof(*index->paths));
+  index->tagOffsets = calloc(header.pathCount + 1,
+                             sizeof(*index->tagOffsets));
+  while (index->pathCount < header.pathCount) {
+    uint32_t length, count;
+    char *path;
+    if (fread(&length, sizeof(length), 1, file) != 1 ||
+        (path = indexReadString(file, length)) == NULL)
+      goto corrupt;
+    index->paths[index->pathCount++] = path;
+    if (fread(&count, sizeof(count), 1, file) != 1) goto corrupt;
+    if (tagCount + count > tagCapacity) {
+      tagCapacity = (tagCount + count) * 2;
+      index->tags = realloc(index->tags, sizeof(*index->tags) * tagCapacity);
+    }
+    if (fread(index->tags + tagCount, sizeof(*index->tags), count, file) !=
+        count)
+      goto corrupt;
+    for (uint32_t j = 0; j < count; ++j)
+      if (index->tags[tagCount + j].rank >= index->nameCount) goto corrupt;
+    tagCount += count;
+    index->tagOffsets[index->pathCount] = tagCount;
+  }
+  fclose(file);
+
+  // Invert the tags of the paths into the paths of every name, visiting the
+  // paths in order keeps every posting list in path order
+  index->postingOffsets = calloc(index->nameCount + 1,
+                                 sizeof(*index->postingOffsets));
+  index->postings = calloc(tagCount ? tagCount : 1, sizeof(*index->postings));
+  for (size_t i = 0; i < tagCount; ++i)
+    index->postingOffsets[index->tags[i].rank + 1]++;
+  for (uint32_t r = 0; r < index->nameCount; ++r)
+    index->postingOffsets[r + 1] += index->postingOffsets[r];
+  size_t *fill = calloc(index->nameCount + 1, sizeof(*fill));
+  for (uint32_t i = 0; i < index->pathCount; ++i) {
+    for (size_t j = index->tagOffsets[i]; j < index->tagOffsets[i + 1]; ++j) {
+      uint32_t rank = index->tags[j].rank;
+      index->postings[index->postingOffsets[rank] + fill[rank]++] = i;
+    }
+  }
+  free(fill);
+
+  index->trie = tagTrieBuild(index->names, index->nameCount);
+
+  return 0;
+
+corrupt:
+  reportError("%s: %s\n", indexPath, "Truncated or corrupt tag index");
+  fclose(file);
+  return -1;
+}
+
+// The path is one of the filters or lies below one of them
+static int indexSelected(const char *path, char *const *paths, int pathCount) {
+  if (pathCount < 1) return 1;
+  for (int i = 0; i < pathCount; ++i) {
+    size_t length = strlen(paths[i]);
+    // A trailing separator is not part of the directory
+    while (length > 1 && paths[i][length - 1] == *PATH_SEPARATOR) length--;
+    if (strncmp(path, paths[i], length) == 0 &&
+        (path[length] == '\0' || path[length] == *PATH_SEPARATOR))
+      return 1;
+  }
+  return 0;
+}
+
+int indexMatch(const char *indexPath, char *const *paths, int pathCount,
+               UserTag *userTags, int tagCount, OutputFlags outputFlags) {
+  TagIndex index = {0};
+  TagTrie *query = tagTrieCompile(userTags, tagCount);
+  uint32_t *hits = NULL, *stamps = NULL, requirement = 0;
+  UserTag *tags = NULL;
+  size_t tagCapacity = 0;
+  int status = EXIT_SUCCESS;
+
+  if (query->none) {
+    reportError("%s\n", "Untagged paths are not indexed");
+    tagTrieFree(query);
+    return EXIT_FAILURE;
+  }
+  if (indexLoad(indexPath, &index) != 0) {
+    indexFree(&index);
+    tagTrieFree(query);
+    return EXIT_FAILURE;
+  }
+
+  hits = calloc(index.pathCount + 1, sizeof(*hits));
+  stamps = calloc(index.pathCount + 1, sizeof(*stamps));
+
+  // Every (key, kind) pair of the query expands to a range of names, a path
+  // is counted once per pair however many of those names it carries
+  for (uint32_t k = 0; k < query->keyCount && !query->any; ++k) {
+    for (int kind = TagTrieExact; kind <= TagTriePrefix; kind <<= 1) {
+      uint32_t low, high;
+      if (!(query->kinds[k] & kind)) continue;
+      requirement++;
+      tagTrieExpand(index.trie, query->keys[k], kind, &low, &high);
+      for (size_t j = index.postingOffsets[low];
+           j < index.postingOffsets[high]; ++j) {
+        uint32_t path = index.postings[j];
+        if (stamps[path] != requirement) {
+          stamps[path] = requirement;
+          hits[path]++;
+        }
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < index.pathCount; ++i) {
+    size_t count = index.tagOffsets[i + 1] - index.tagOffsets[i];
+
+    if ((!query->any && hits[i] != query->requirements) ||
+        !indexSelected(index.paths[i], paths, pathCount))
+      continue;
+
+    // The tags are already in name order
+    if (count > tagCapacity) {
+      tagCapacity = count;
+      tags = realloc(tags, sizeof(*tags) * tagCapacity);
+    }
+    for (size_t j = 0; j < count; ++j) {
+      IndexPosting *posting = index.tags + index.tagOffsets[i] + j;
+      tags[j].name = index.names[posting->rank];
+      tags[j].color = posting->color;
+    }
+    printPath(index.paths[i], tags, (long)count, outputFlags);
+  }
+
+  free(tags);
+  free(hits);
+  free(stamps);
+  indexFree(&index);
+  tagTrieFree(query);
+
+  return status;
+}
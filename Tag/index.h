@@ -0,0 +1,73 @@
+//
+// index.h
+// Tag
+//
+
+#ifndef TAG_INDEX_H
+#define TAG_INDEX_H
+
+#include "usertag.h"
+
+#include <stdint.h>
+
+// Index file magic, also the version of the record layout
+#define INDEX_MAGIC     "TAGIDX01"
+
+/**
+ * @typedef Head of an index file
+ * @field nameCount Number of distinct tag names
+ * @field pathCount Number of tagged paths
+ * @note The head is followed by the names in strcmp order, each a uint16_t
+ * length and its bytes, then by the paths in strcmp order, each a uint32_t
+ * length, its bytes, a uint32_t tag count and an IndexPosting per tag.
+ */
+typedef struct IndexHeader {
+  char magic[8];
+  uint64_t nameCount;
+  uint64_t pathCount;
+} IndexHeader;
+
+/**
+ * @typedef Tag of an indexed path
+ * @field rank Index of the tag name in the sorted names
+ * @field color TagColor of the tag
+ */
+typedef struct IndexPosting {
+  uint32_t rank;
+  int32_t color;
+} IndexPosting;
+
+/**
+ * @brief Record the tags of every entry below the paths in an index file
+ * @param indexPath Index file, replaced once the walk is complete
+ * @param paths Roots of the walk, walked recursively, the current directory
+ * if none
+ * @param pathCount Number of roots
+ * @param outputFlags Enumeration flags (hidden files)
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the tree could not be read or the
+ * index could not be written
+ */
+int indexBuild(const char *indexPath, char *const *paths, int pathCount,
+               OutputFlags outputFlags, int jobs);
+
+/**
+ * @brief Print the indexed paths matching tags without reading the tree
+ * @param indexPath Index file written by indexBuild
+ * @param paths Only print the indexed paths equal to or below these, every
+ * indexed path if none
+ * @param pathCount Number of paths
+ * @param userTags Tags to match, as for matchTags
+ * @param tagCount Number of tags
+ * @param outputFlags Output flags
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the index could not be read
+ * @note Loading rebuilds a trie over the indexed names and a posting list of
+ * the paths carrying each name. A pattern expands through the trie to a
+ * contiguous range of names, so a prefix query only visits the postings of
+ * the names below it. Paths are printed in path order. The index only holds
+ * tagged paths, so matching untagged paths is refused.
+ */
+int indexMatch(const char *indexPath, char *const *paths, int pathCount,
+               UserTag *userTags, int tagCount, OutputFlags outputFlags);
+
+#endif  // TAG_INDEX_H
@@ -0,0 +1,462 @@
+//
+// journal.c
+// Tag
+//
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Size of the file header, the magic followed by reserved bytes
+#define JOURNAL_HEADER  16
+
+// Size of the record trailer, the repeated length and padding
+#define JOURNAL_TRAILER 8
+
+// Round a length up to the record alignment
+#define JOURNAL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/**
+ * @typedef Process wide journal writer
+ */
+static struct {
+  int fd;
+  char cwd[PATH_MAX];
+  unsigned char *buffer;
+  size_t length;
+  size_t capacity;
+  int records;
+  pthread_mutex_t lock;
+} journal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Sequence number of the last record of the journal, 0 if it is empty.
+// Returns -1 if the tail is not a complete record, numbering after it would
+// repeat sequence numbers.
+static int lastSeq(int fd, off_t size, uint64_t *seq) {
+  JournalRecord record;
+  uint32_t length;
+
+  *seq = 0;
+  if (size == JOURNAL_HEADER) return 0;
+  if (size < JOURNAL_HEADER || (size - JOURNAL_HEADER) % 8 ||
+      pread(fd, &length, sizeof(length), size - JOURNAL_TRAILER) !=
+        sizeof(length) ||
+      length < sizeof(record) + JOURNAL_TRAILER || length % 8 ||
+      length > size - JOURNAL_HEADER ||
+      pread(fd, &record, sizeof(record), size - length) != sizeof(record) ||
+      record.length != length || !record.seq)
+    return -1;
+
+  *seq = record.seq;
+  return 0;
+}
+
+// End of the last complete record, found by walking forwards from the
+// header. A crash during an append can leave a torn record behind.
+static off_t completeEnd(int fd, off_t size) {
+  off_t position = JOURNAL_HEADER;
+  uint64_t seq = 0;
+
+  while (size - position >= (off_t)(sizeof(JournalRecord) + JOURNAL_TRAILER)) {
+    JournalRecord record;
+    uint32_t length;
+    if (pread(fd, &record, sizeof(record), position) != sizeof(record) ||
+        record.length < sizeof(record) + JOURNAL_TRAILER ||
+        record.length % 8 || record.length > size - position ||
+        pread(fd, &length, sizeof(length),
+              position + record.length - JOURNAL_TRAILER) != sizeof(length) ||
+        length != record.length || record.seq <= seq)
+      break;
+    seq = record.seq;
+    position += record.length;
+  }
+
+  return position;
+}
+
+// Sequence number of the last record, cutting off a torn tail first so
+// appending can continue after it. The caller holds the file lock.
+static int repairTail(int fd, const char *name, off_t *size, uint64_t *seq) {
+  if (lastSeq(fd, *size, seq) == 0) return 0;
+
+  off_t end = completeEnd(fd, *size);
+  reportError("%s: Discarding %lld bytes of torn journal tail\n", name,
+              (long long)(*size - end));
+  if (ftruncate(fd, end) != 0) {
+    reportError("%s: %s\n", name, strerror(errno));
+    return -1;
+  }
+  *size = end;
+  return lastSeq(fd, end, seq);
+}
+
+int journalOpen(const char *path) {
+  struct stat st;
+  char magic[JOURNAL_HEADER] = JOURNAL_MAGIC;
+  uint64_t seq;
+  int status = 0;
+
+  if ((journal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+    reportError("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  // Write the header of a new journal, or validate an existing one and
+  // truncate it to its last complete record
+  flock(journal.fd, LOCK_EX);
+  if (fstat(journal.fd, &st) == 0 && st.st_size == 0) {
+    if (write(journal.fd, magic, sizeof(magic)) != sizeof(magic)) status = -1;
+  } else if (pread(journal.fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+             memcmp(magic, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+    reportError("%s: %s\n", path, "Not a tag journal");
+    status = -1;
+  } else if (repairTail(journal.fd, path, &st.st_size, &seq) != 0) {
+    status = -1;
+  }
+  flock(journal.fd, LOCK_UN);
+
+  if (status) {
+    close(journal.fd);
+    journal.fd = -1;
+    return -1;
+  }
+
+  if (!getcwd(journal.cwd, sizeof(journal.cwd))) *journal.cwd = '\0';
+
+  return 0;
+}
+
+void journalChdir(void) {
+  pthread_mutex_lock(&journal.lock);
+  if (!getcwd(journal.cwd, sizeof(journal.cwd))) *journal.cwd = '\0';
+  pthread_mutex_unlock(&journal.lock);
+}
+
+int journalActive(void) { return journal.fd >= 0; }
+
+// Sorted shallow copy of a tag set without empty names and duplicates
+static int canonicalTags(UserTag *tags, int count, UserTag **canonical) {
+  int n = 0;
+
+  *canonical = calloc(count ? count : 1, sizeof(**canonical));
+  for (int i = 0; i < count; ++i)
+    if ((tags + i)->name && *(tags + i)->name) (*canonical)[n++] = tags[i];
+  if (n) qsort(*canonical, n, sizeof(**canonical), tagCompare);
+
+  // Drop repeated (name, color) pairs
+  int unique = 0;
+  for (int i = 0; i < n; ++i) {
+    if (unique && tagCompare(*canonical + unique - 1, *canonical + i) == 0 &&
+        (*canonical)[unique - 1].color == (*canonical)[i].color)
+      continue;
+    (*canonical)[unique++] = (*canonical)[i];
+  }
+
+  return unique;
+}
+
+// Encoded size of a tag set
+static size_t tagsLength(UserTag *tags, int count) {
+  size_t length = 0;
+  for (int i = 0; i < count; ++i) {
+    size_t nameLength = strlen((tags + i)->name);
+    length += 3 + (nameLength > UINT16_MAX ? UINT16_MAX : nameLength);
+  }
+  return length;
+}
+
+// Encode a tag set, returning the position after it
+static unsigned char *encodeTags(unsigned char *p, UserTag *tags, int count) {
+  for (int i = 0; i < count; ++i) {
+    size_t nameLength = strlen((tags + i)->name);
+    uint16_t length = nameLength > UINT16_MAX ? UINT16_MAX : nameLength;
+    memcpy(p, &length, sizeof(length));
+    p[2] = (unsigned char)(tags + i)->color;
+    memcpy(p + 3, (tags + i)->name, length);
+    p += 3 + length;
+  }
+  return p;
+}
+
+void journalRecord(const char *path, UserTag *oldTags, int oldCount,
+                   UserTag *newTags, int newCount) {
+  UserTag *oldSet, *newSet;
+  char absolute[PATH_MAX];
+  struct stat st;
+  struct timespec now;
+
+  if (journal.fd < 0) return;
+
+  // Record absolute paths so consumers do not depend on our directory, a
+  // truncated path would name another file
+  int fits = (*path == *PATH_SEPARATOR || !*journal.cwd)
+               ? snprintf(absolute, sizeof(absolute), "%s", path)
+               : snprintf(absolute, sizeof(absolute), "%s%s%s", journal.cwd,
+                          PATH_SEPARATOR, path);
+  if (fits < 0 || (size_t)fits >= sizeof(absolute)) {
+    reportError("%s: %s\n", path, "Path too long to be journaled");
+    return;
+  }
+
+  oldCount = canonicalTags(oldTags, oldCount, &oldSet);
+  newCount = canonicalTags(newTags, newCount, &newSet);
+
+  // Only record actual changes
+  int changed = oldCount != newCount;
+  for (int i = 0; i < oldCount && !changed; ++i)
+    changed = tagCompare(oldSet + i, newSet + i) != 0 ||
+              oldSet[i].color != newSet[i].color;
+
+  if (changed) {
+    JournalRecord record = {0};
+    size_t pathLength = strlen(absolute);
+    size_t length =
+      JOURNAL_ALIGN(sizeof(record) + pathLength + tagsLength(oldSet, oldCount) +
+                    tagsLength(newSet, newCount)) +
+      JOURNAL_TRAILER;
+
+    if (stat(path, &st) != 0) memset(&st, 0, sizeof(st));
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    record.length = (uint32_t)length;
+    record.pathLength = (uint16_t)pathLength;
+    record.oldCount = (uint16_t)oldCount;
+    record.newCount = (uint16_t)newCount;
+    record.time = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record.dev = (uint64_t)st.st_dev;
+    record.ino = (uint64_t)st.st_ino;
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.length + length > journal.capacity) {
+      journal.capacity = (journal.length + length) * 2;
+      journal.buffer = realloc(journal.buffer, journal.capacity);
+    }
+
+    // Sequence numbers are assigned when the group is appended
+    unsigned char *p = journal.buffer + journal.length;
+    memset(p, 0, length);
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), absolute, pathLength);
+    p = encodeTags(p + sizeof(record) + pathLength, oldSet, oldCount);
+    encodeTags(p, newSet, newCount);
+    memcpy(journal.buffer + journal.length + length - JOURNAL_TRAILER,
+           &record.length, sizeof(record.length));
+    journal.length += length;
+    int full = ++journal.records >= JOURNAL_BATCH ||
+               journal.length >= JOURNAL_BUFFER;
+    pthread_mutex_unlock(&journal.lock);
+
+    if (full) journalFlush();
+  }
+
+  free(oldSet);
+  free(newSet);
+}
+
+int journalFlush(void) {
+  struct stat st;
+  int status = 0;
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.fd < 0 || !journal.length) {
+    pthread_mutex_unlock(&journal.lock);
+    return 0;
+  }
+
+  // Other processes may append to the same journal
+  flock(journal.fd, LOCK_EX);
+  uint64_t seq;
+  if (fstat(journal.fd, &st) != 0 ||
+      repairTail(journal.fd, "journal", &st.st_size, &seq) != 0) {
+    reportError("%s: %s\n", "journal", "Corrupt journal tail, not appending");
+    flock(journal.fd, LOCK_UN);
+    journal.length = 0;
+    journal.records = 0;
+    pthread_mutex_unlock(&journal.lock);
+    return -1;
+  }
+
+  // Number the group
+  for (size_t offset = 0; offset < journal.length;) {
+    JournalRecord *record = (JournalRecord *)(journal.buffer + offset);
+    record->seq = ++seq;
+    offset += record->length;
+  }
+
+  // Append the group and sync it once
+  for (size_t written = 0; written < journal.length;) {
+    ssize_t n =
+      write(journal.fd, journal.buffer + written, journal.length - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      reportError("%s: %s\n", "journal", strerror(errno));
+      status = -1;
+      break;
+    }
+    written += n;
+  }
+
+  // A partial group would leave a tail that cannot be numbered after
+  if (status && ftruncate(journal.fd, st.st_size) != 0)
+    reportError("%s: %s\n", "journal", strerror(errno));
+  if (fsync(journal.fd) != 0) status = -1;
+  flock(journal.fd, LOCK_UN);
+
+  journal.length = 0;
+  journal.records = 0;
+  pthread_mutex_unlock(&journal.lock);
+
+  return status;
+}
+
+int journalClose(void) {
+  int status;
+
+  if (journal.fd < 0) return 0;
+
+  status = journalFlush();
+  close(journal.fd);
+  journal.fd = -1;
+  free(journal.buffer);
+  journal.buffer = NULL;
+  journal.capacity = 0;
+
+  return status;
+}
+
+// Print an encoded tag set, returning the position after it
+static const unsigned char *printTags(const unsigned char *p, int count,
+                                      int json) {
+  for (int i = 0; i < count; ++i) {
+    uint16_t length;
+    char name[UINT16_MAX + 1];
+
+    memcpy(&length, p, sizeof(length));
+    memcpy(name, p + 3, length);
+    name[length] = '\0';
+
+    if (json) {
+      printf("%s{\"name\":", i ? "," : "");
+      printJsonString(stdout, name);
+      printf(",\"color\":\"%s\"}", getColorName(p[2]));
+    } else if (p[2]) {
+      printf("%s%s:%s", i ? "," : "", name, getColorName(p[2]));
+    } else {
+      printf("%s%s", i ? "," : "", name);
+    }
+    p += 3 + length;
+  }
+  return p;
+}
+
+// Print a single record
+static void printRecord(const JournalRecord *record, OutputFlags outputFlags,
+                        int json) {
+  const unsigned char *p = (const unsigned char *)(record + 1);
+  char path[PATH_MAX];
+  size_t pathLength = record->pathLength < PATH_MAX ? record->pathLength
+                                                    : PATH_MAX - 1;
+
+  memcpy(path, p, pathLength);
+  path[pathLength] = '\0';
+  p += record->pathLength;
+
+  if (json) {
+    printf("{\"seq\":%llu,\"time\":%lld,\"dev\":%llu,\"ino\":%llu,\"path\":",
+           (unsigned long long)record->seq, (long long)record->time,
+           (unsigned long long)record->dev, (unsigned long long)record->ino);
+    printJsonString(stdout, path);
+    printf(",\"old\":[");
+    p = printTags(p, record->oldCount, 1);
+    printf("],\"new\":[");
+    printTags(p, record->newCount, 1);
+    printf("]}");
+  } else {
+    printf("%llu\t%lld.%09lld\t%llu:%llu\t%s\t",
+           (unsigned long long)record->seq,
+           (long long)(record->time / 1000000000),
+           (long long)(record->time % 1000000000),
+           (unsigned long long)record->dev, (unsigned long long)record->ino,
+           path);
+    p = printTags(p, record->oldCount, 0);
+    putc('\t', stdout);
+    printTags(p, record->newCount, 0);
+  }
+  putc((outputFlags & OutputFlagsNulTerminate) ? '\0' : '\n', stdout);
+}
+
+int journalRead(const char *path, uint64_t since, OutputFlags outputFlags,
+                int json) {
+  struct stat st;
+  unsigned char *map;
+  size_t position, end;
+  uint64_t seq;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    reportError("%s: %s\n", path, strerror(errno));
+    if (fd >= 0) close(fd);
+    return EXIT_FAILURE;
+  }
+
+  if (st.st_size < JOURNAL_HEADER) {
+    reportError("%s: %s\n", path, "Not a tag journal");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  // Stop at the last complete record if an append was torn
+  end = (size_t)(lastSeq(fd, st.st_size, &seq) == 0
+                   ? st.st_size
+                   : completeEnd(fd, st.st_size));
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    reportError("%s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (memcmp(map, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0) {
+    reportError("%s: %s\n", path, "Not a tag journal");
+    munmap(map, st.st_size);
+    return EXIT_FAILURE;
+  }
+
+  // Walk backwards over the trailers to the first record newer than since
+  position = end;
+  while (position > JOURNAL_HEADER) {
+    uint32_t length;
+    memcpy(&length, map + position - JOURNAL_TRAILER, sizeof(length));
+    if (length < sizeof(JournalRecord) + JOURNAL_TRAILER || length % 8 ||
+        length > position - JOURNAL_HEADER) {
+      reportError("%s: %s\n", path, "Corrupt journal record");
+      munmap(map, st.st_size);
+      return EXIT_FAILURE;
+    }
+    if (((JournalRecord *)(map + position - length))->seq <= since) break;
+    position -= length;
+  }
+
+  // Print forwards from there
+  while (position < end) {
+    const JournalRecord *record = (const JournalRecord *)(map + position);
+    printRecord(record, outputFlags, json);
+    position += record->length;
+  }
+
+  munmap(map, st.st_size);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+//
+// journal.h
+// Tag
+//
+
+#ifndef TAG_JOURNAL_H
+#define TAG_JOURNAL_H
+
+#include "usertag.h"
+
+#include <stdint.h>
+
+// Journal file magic, also the version of the record layout
+#define JOURNAL_MAGIC   "TAGJRNL1"
+
+// Records buffered before they are appended and synced as one group
+#define JOURNAL_BATCH   256
+
+// Buffered bytes that force an early group append
+#define JOURNAL_BUFFER  (1 << 20)
+
+/**
+ * @typedef Fixed size head of every journal record, 8 byte aligned
+ * @field length Total record length including the trailer
+ * @field pathLength Length of the path following the head
+ * @field oldCount Number of tags in the old set
+ * @field newCount Number of tags in the new set
+ * @field seq Sequence number, strictly increasing within a journal
+ * @field time Wall clock time of the change in nanoseconds since the epoch
+ * @field dev Device of the changed path
+ * @field ino Inode of the changed path
+ * @note The head is followed by the path, the old and the new tags (each a
+ * uint16_t name length, a uint8_t color, and the name), padding to 8 bytes,
+ * and a trailer repeating the uint32_t length so the journal can be walked
+ * backwards from its end.
+ */
+typedef struct JournalRecord {
+  uint32_t length;
+  uint16_t pathLength;
+  uint16_t oldCount;
+  uint16_t newCount;
+  uint16_t reserved[3];
+  uint64_t seq;
+  int64_t time;
+  uint64_t dev;
+  uint64_t ino;
+} JournalRecord;
+
+/**
+ * @brief Start recording tag changes to an append-only journal
+ * @param path Journal file, created if it does not exist
+ * @return 0 on success, -1 if the journal could not be opened
+ * @note A torn record left at the end by an interrupted append is reported
+ * and cut off, so the journal ends with its last complete record.
+ */
+int journalOpen(const char *path);
+
+/**
+ * @brief Record a change of the tags on a path
+ * @param path Changed path
+ * @param oldTags Tags before the change
+ * @param oldCount Number of tags before the change
+ * @param newTags Tags after the change
+ * @param newCount Number of tags after the change
+ * @note Does nothing without an open journal or if the sets are equal.
+ * Records are appended in groups followed by a single fsync. A path too long
+ * to be made absolute is reported and not recorded.
+ */
+void journalRecord(const char *path, UserTag *oldTags, int oldCount,
+                   UserTag *newTags, int newCount);
+
+/**
+ * @brief Test whether changes are being recorded
+ * @return Non zero when a journal is open
+ */
+int journalActive(void);
+
+/**
+ * @brief Resolve the relative paths of later records against the current
+ * working directory
+ * @note Needed after changing the working directory with the journal open.
+ */
+void journalChdir(void);
+
+/**
+ * @brief Append and sync any buffered records
+ * @return 0 on success, -1 on a write error
+ * @note A group that cannot be written whole is cut off again, and a torn
+ * tail left by another process is cut off before appending, so sequence
+ * numbers never repeat.
+ */
+int journalFlush(void);
+
+/**
+ * @brief Flush and close the journal
+ * @return 0 on success, -1 on a write error
+ */
+int journalClose(void);
+
+/**
+ * @brief Print the records of a journal newer than a sequence number
+ * @param path Journal file
+ * @param since Print only records with a greater sequence number
+ * @param outputFlags OutputFlagsNulTerminate terminates records with NUL
+ * @param json Print one JSON object per record
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the journal is unreadable
+ * @note The journal is mapped and walked backwards from its end, so reading
+ * is proportional to the number of new records. A torn tail is skipped, the
+ * last record printed is the last complete one.
+ */
+int journalRead(const char *path, uint64_t since, OutputFlags outputFlags,
+                int json);
+
+#endif  // TAG_JOURNAL_H
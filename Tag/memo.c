@@ -0,0 +1,290 @@
+//
+// memo.c
+// Tag
+//
+
+#include "memo.h"
+
+#include "hash.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @typedef Memoized value of a key made of an operation and raw bytes
+ * @field operation Serialized operation, NULL for keys of no operation
+ * @field prev Previous entry in recency order, index + 1, 0 for none
+ * @field next Next entry in recency order, index + 1, 0 for none
+ * @field chain Next entry of the same bucket, index + 1, 0 for none
+ */
+typedef struct MemoEntry {
+  uint64_t hash;
+  unsigned char *operation;
+  size_t operationLength;
+  unsigned char *key;
+  size_t keyLength;
+  unsigned char *value;
+  size_t valueLength;
+  int prev;
+  int next;
+  int chain;
+} MemoEntry;
+
+/**
+ * @typedef Bounded LRU table
+ * @field buckets First entry of each bucket, index + 1, 0 for none
+ * @field head Most recently used entry, index + 1
+ * @field tail Least recently used entry, index + 1
+ */
+typedef struct MemoTable {
+  MemoEntry entries[MEMO_ENTRIES];
+  int buckets[MEMO_ENTRIES];
+  int used;
+  int head;
+  int tail;
+  pthread_mutex_t lock;
+} MemoTable;
+
+// Decoded tag sets keyed by blob
+static MemoTable tagsMemo = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Output blobs keyed by operation and input blob
+static MemoTable blobMemo = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void memoUnlink(MemoTable *table, int slot) {
+  MemoEntry *entry = table->entries + slot - 1;
+
+  if (entry->prev) {
+    table->entries[entry->prev - 1].next = entry->next;
+  } else {
+    table->head = entry->next;
+  }
+  if (entry->next) {
+    table->entries[entry->next - 1].prev = entry->prev;
+  } else {
+    table->tail = entry->prev;
+  }
+  entry->prev = entry->next = 0;
+}
+
+static void memoPushFront(MemoTable *table, int slot) {
+  MemoEntry *entry = table->entries + slot - 1;
+
+  entry->prev = 0;
+  entry->next = table->head;
+  if (table->head) table->entries[table->head - 1].prev = slot;
+  table->head = slot;
+  if (!table->tail) table->tail = slot;
+}
+
+// Hash of a key, seeded by the hash of its operation
+static uint64_t memoHash(const MemoOperation *operation,
+                         const unsigned char *key, size_t keyLength) {
+  return tagHash64(key, keyLength, operation ? operation->hash : 0);
+}
+
+// Slot of a key, 0 if it is not memoized, the lock must be held
+static int memoFind(MemoTable *table, uint64_t hash,
+                    const MemoOperation *operation, const unsigned char *key,
+                    size_t keyLength) {
+  int slot = table->buckets[hash % MEMO_ENTRIES];
+  size_t operationLength = operation ? operation->length : 0;
+
+  while (slot) {
+    MemoEntry *entry = table->entries + slot - 1;
+    if (entry->hash == hash && entry->operationLength == operationLength &&
+        entry->keyLength == keyLength &&
+        (!operationLength ||
+         memcmp(entry->operation, operation->data, operationLength) == 0) &&
+        memcmp(entry->key, key, keyLength) == 0)
+      return slot;
+    slot = entry->chain;
+  }
+  return 0;
+}
+
+// Copy the value of a key, NULL on a miss
+static unsigned char *memoGet(MemoTable *table,
+                              const MemoOperation *operation,
+                              const unsigned char *key, size_t keyLength,
+                              size_t *valueLength) {
+  uint64_t hash = memoHash(operation, key, keyLength);
+  unsigned char *value = NULL;
+
+  pthread_mutex_lock(&table->lock);
+  int slot = memoFind(table, hash, operation, key, keyLength);
+  if (slot) {
+    MemoEntry *entry = table->entries + slot - 1;
+    value = malloc(entry->valueLength ? entry->valueLength : 1);
+    memcpy(value, entry->value, entry->valueLength);
+    *valueLength = entry->valueLength;
+    memoUnlink(table, slot);
+    memoPushFront(table, slot);
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  return value;
+}
+
+// Remember the value of a key, evicting the least recently used entry
+static void memoPut(MemoTable *table, const MemoOperation *operation,
+                    const unsigned char *key, size_t keyLength,
+                    const unsigned char *value, size_t valueLength) {
+  uint64_t hash = memoHash(operation, key, keyLength);
+  size_t operationLength = operation ? operation->length : 0;
+  MemoEntry *entry;
+  int slot;
+
+  pthread_mutex_lock(&table->lock);
+  if ((slot = memoFind(table, hash, operation, key, keyLength)) != 0) {
+    // Another thread memoized the same key first
+    memoUnlink(table, slot);
+    memoPushFront(table, slot);
+    pthread_mutex_unlock(&table->lock);
+    return;
+  }
+
+  if (table->used < MEMO_ENTRIES) {
+    slot = ++table->used;
+  } else {
+    // Reuse the least recently used entry, removing it from its bucket
+    slot = table->tail;
+    entry = table->entries + slot - 1;
+    int *link = table->buckets + entry->hash % MEMO_ENTRIES;
+    while (*link != slot) link = &table->entries[*link - 1].chain;
+    *link = entry->chain;
+    memoUnlink(table, slot);
+    free(entry->operation);
+    free(entry->key);
+    free(entry->value);
+  }
+
+  entry = table->entries + slot - 1;
+  entry->hash = hash;
+  entry->operation = NULL;
+  if (operationLength) {
+    entry->operation = malloc(operationLength);
+    memcpy(entry->operation, operation->data, operationLength);
+  }
+  entry->operationLength = operationLength;
+  entry->key = malloc(keyLength ? keyLength : 1);
+  memcpy(entry->key, key, keyLength);
+  entry->keyLength = keyLength;
+  entry->value = malloc(valueLength ? valueLength : 1);
+  memcpy(entry->value, value, valueLength);
+  entry->valueLength = valueLength;
+  entry->chain = table->buckets[hash % MEMO_ENTRIES];
+  table->buckets[hash % MEMO_ENTRIES] = slot;
+  memoPushFront(table, slot);
+  pthread_mutex_unlock(&table->lock);
+}
+
+UserTag *memoLookupTags(const unsigned char *buf, size_t len, int *tagCount) {
+  UserTag *userTags = NULL;
+  size_t valueLength;
+  unsigned char *value = memoGet(&tagsMemo, NULL, buf, len, &valueLength);
+
+  *tagCount = -1;
+  if (!value) return NULL;
+
+  // Each tag is stored as its color byte followed by its NUL terminated name
+  *tagCount = 0;
+  for (size_t i = 0; i < valueLength; i += strlen((char *)value + i + 1) + 2)
+    (*tagCount)++;
+  if (*tagCount) userTags = calloc(*tagCount, sizeof(*userTags));
+  *tagCount = 0;
+  for (size_t i = 0; i < valueLength; i += strlen((char *)value + i + 1) + 2) {
+    userTags[*tagCount].color = value[i];
+    userTags[(*tagCount)++].name = strdup((char *)value + i + 1);
+  }
+  free(value);
+
+  return userTags;
+}
+
+void memoInsertTags(const unsigned char *buf, size_t len,
+                    const UserTag *userTags, int tagCount) {
+  size_t valueLength = 0;
+  unsigned char *value, *p;
+
+  for (int i = 0; i < tagCount; ++i)
+    valueLength += strlen(userTags[i].name) + 2;
+  p = value = malloc(valueLength ? valueLength : 1);
+  for (int i = 0; i < tagCount; ++i) {
+    size_t nameLength = strlen(userTags[i].name) + 1;
+    *p++ = (unsigned char)userTags[i].color;
+    memcpy(p, userTags[i].name, nameLength);
+    p += nameLength;
+  }
+
+  memoPut(&tagsMemo, NULL, buf, len, value, valueLength);
+  free(value);
+}
+
+uint64_t memoOperation(int kind, const UserTag *userTags, int tagCount) {
+  uint64_t operation = tagHash64(&kind, sizeof(kind), 0);
+
+  for (int i = 0; i < tagCount; ++i) {
+    int color = userTags[i].color;
+    operation = tagHashString(userTags[i].name, operation);
+    operation = tagHash64(&color, sizeof(color), operation);
+  }
+  return operation;
+}
+
+void memoOperationInit(MemoOperation *operation, int kind,
+                       const UserTag *userTags, int tagCount) {
+  operation->data = NULL;
+  operation->length = 0;
+  memoOperationAppend(operation, &kind, sizeof(kind));
+
+  // Each tag is stored as its color followed by its NUL terminated name, so
+  // operations only share outputs if they are the same
+  for (int i = 0; i < tagCount; ++i) {
+    int color = userTags[i].color;
+    memoOperationAppend(operation, &color, sizeof(color));
+    memoOperationAppend(operation, userTags[i].name,
+                        strlen(userTags[i].name) + 1);
+  }
+}
+
+void memoOperationAppend(MemoOperation *operation, const void *data,
+                         size_t length) {
+  operation->data = realloc(operation->data, operation->length + length);
+  memcpy(operation->data + operation->length, data, length);
+  operation->length += length;
+  operation->hash = tagHash64(operation->data, operation->length, 0);
+}
+
+void memoOperationFree(MemoOperation *operation) {
+  free(operation->data);
+  operation->data = NULL;
+  operation->length = 0;
+}
+
+unsigned char *memoLookupBlob(const MemoOperation *operation,
+                              const unsigned char *buf, size_t len,
+                              MemoResult *result, size_t *outLength) {
+  size_t valueLength;
+  unsigned char *value = memoGet(&blobMemo, operation, buf, len, &valueLength);
+
+  if (!value) return NULL;
+
+  // The outcome is stored in front of the output blob
+  *result = value[0];
+  *outLength = valueLength - 1;
+  memmove(value, value + 1, valueLength - 1);
+
+  return value;
+}
+
+void memoInsertBlob(const MemoOperation *operation, const unsigned char *buf,
+                    size_t len, MemoResult result, const unsigned char *out,
+                    size_t outLength) {
+  unsigned char *value = malloc(outLength + 1);
+
+  value[0] = (unsigned char)result;
+  if (outLength) memcpy(value + 1, out, outLength);
+  memoPut(&blobMemo, operation, buf, len, value, outLength + 1);
+  free(value);
+}
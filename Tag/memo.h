@@ -0,0 +1,122 @@
+//
+// memo.h
+// Tag
+//
+
+#ifndef TAG_MEMO_H
+#define TAG_MEMO_H
+
+#include "usertag.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Entries of each memo table, the least recently used entry is evicted
+#define MEMO_ENTRIES    4096
+
+/**
+ * @typedef Outcome of a tag operation on a blob
+ * @enum 0 The blob is left as it is
+ * @enum 1 The output blob replaces the blob
+ * @enum 2 The blob is removed
+ */
+typedef enum MemoResult {
+  MemoResultKeep,
+  MemoResultWrite,
+  MemoResultRemove
+} MemoResult;
+
+/**
+ * @typedef Operation applied to many blobs, part of the key of its outputs
+ * @field data Serialized operation, its kind followed by the color and name
+ * of each argument tag
+ * @field length Length of the serialized operation
+ * @field hash Hash of the serialized operation
+ */
+typedef struct MemoOperation {
+  unsigned char *data;
+  size_t length;
+  uint64_t hash;
+} MemoOperation;
+
+/**
+ * @brief Look up the decoded tags of a blob
+ * @param buf Tag blob
+ * @param len Length of the blob
+ * @param tagCount Receives the number of tags, -1 on a miss
+ * @return Copy of the tags released with freeUserTags, NULL on a miss or for
+ * an empty set
+ */
+UserTag *memoLookupTags(const unsigned char *buf, size_t len, int *tagCount);
+
+/**
+ * @brief Remember the decoded tags of a blob
+ * @param buf Tag blob
+ * @param len Length of the blob
+ * @param userTags Decoded tags, copied
+ * @param tagCount Number of tags
+ */
+void memoInsertTags(const unsigned char *buf, size_t len,
+                    const UserTag *userTags, int tagCount);
+
+/**
+ * @brief Identify an operation applied to many blobs
+ * @param kind Operation mode, or any other constant naming the operation
+ * @param userTags Argument tags
+ * @param tagCount Number of argument tags
+ * @return Hash identifying the operation in checkpoint and state files
+ */
+uint64_t memoOperation(int kind, const UserTag *userTags, int tagCount);
+
+/**
+ * @brief Serialize an operation applied to many blobs
+ * @param operation Operation to fill in, release with memoOperationFree
+ * @param kind Operation mode, or any other constant naming the operation
+ * @param userTags Argument tags
+ * @param tagCount Number of argument tags
+ */
+void memoOperationInit(MemoOperation *operation, int kind,
+                       const UserTag *userTags, int tagCount);
+
+/**
+ * @brief Add further arguments to a serialized operation
+ * @param operation Operation from memoOperationInit
+ * @param data Argument bytes
+ * @param length Number of bytes
+ */
+void memoOperationAppend(MemoOperation *operation, const void *data,
+                         size_t length);
+
+/**
+ * @brief Release a serialized operation
+ * @param operation Operation from memoOperationInit
+ */
+void memoOperationFree(MemoOperation *operation);
+
+/**
+ * @brief Look up the result of an operation on a blob
+ * @param operation Operation from memoOperationInit
+ * @param buf Input blob, empty if the path carries no tags
+ * @param len Length of the input blob
+ * @param result Receives the outcome on a hit
+ * @param outLength Receives the length of the output blob
+ * @return Copy of the output blob released with free, NULL on a miss
+ * @note A hit always returns a buffer, even when no output blob is written.
+ */
+unsigned char *memoLookupBlob(const MemoOperation *operation,
+                              const unsigned char *buf, size_t len,
+                              MemoResult *result, size_t *outLength);
+
+/**
+ * @brief Remember the result of an operation on a blob
+ * @param operation Operation from memoOperationInit
+ * @param buf Input blob
+ * @param len Length of the input blob
+ * @param result Outcome
+ * @param out Output blob written for MemoResultWrite
+ * @param outLength Length of the output blob
+ */
+void memoInsertBlob(const MemoOperation *operation, const unsigned char *buf,
+                    size_t len, MemoResult result, const unsigned char *out,
+                    size_t outLength);
+
+#endif  // TAG_MEMO_H
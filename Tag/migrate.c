@@ -0,0 +1,240 @@
+//
+// migrate.c
+// Tag
+//
+
+#include "migrate.h"
+
+#include "journal.h"
+#include "walk.h"
+#include "xdg.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @typedef Counters of a single worker
+ * @field files Entries visited
+ * @field migrated Entries whose tags were moved
+ * @field merged Moved entries whose target already carried tags
+ * @field kept Moved entries whose source was kept for the colors the target
+ * cannot hold
+ * @field errors Entries that could not be read, decoded or written
+ */
+typedef struct MigrateCounters {
+  unsigned long long files;
+  unsigned long long migrated;
+  unsigned long long merged;
+  unsigned long long kept;
+  unsigned long long errors;
+} MigrateCounters;
+
+/**
+ * @typedef Walk context shared by the migration workers
+ */
+typedef struct MigrateContext {
+  TagStore *source;
+  TagStore *target;
+  MigrateCounters counters[WALK_MAX_JOBS];
+} MigrateContext;
+
+/**
+ * @typedef Outcome of the migration of an entry
+ * @enum 0 The source carries no tags
+ * @enum 1 The tags were moved and the source removed
+ * @enum 2 The tags were copied and the source kept for its colors
+ * @enum 3 The tags cannot be stored in the target, reported
+ */
+typedef enum MigrateOutcome {
+  MigrateOutcomeNone,
+  MigrateOutcomeMoved,
+  MigrateOutcomeKept,
+  MigrateOutcomeRefused
+} MigrateOutcome;
+
+// Read and decode the tags of a backend, -1 with errno set if they cannot
+// be read, EINVAL if they do not decode, the length is -1 if there are none
+static int migrateRead(TagStore *store, const char *path,
+                       unsigned char *blob, ssize_t *length, UserTag **tags,
+                       int *tagCount) {
+  *tags = NULL;
+  *tagCount = 0;
+  if ((*length = tagStoreGetIn(store, path, blob, EXT_ATTR_SIZE)) < 0)
+    return errno == TAG_ENOATTR ? 0 : -1;
+  if (decodeUserTags(blob, *length, tags, tagCount) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+// Append copies of the tags not already carried, names differing only in
+// case being one tag, returning the new count
+static int migrateUnion(UserTag *merged, int count, const UserTag *tags,
+                        int tagCount) {
+  for (int i = 0; i < tagCount; ++i) {
+    int j = 0;
+    while (j < count && strcasecmp(merged[j].name, tags[i].name) != 0) ++j;
+    if (j < count || !*tags[i].name) continue;
+    merged[count].name = strdup(tags[i].name);
+    merged[count++].color = tags[i].color;
+  }
+  return count;
+}
+
+// Single optimistic attempt to move the tags of an entry, writing each
+// attribute only if it still holds the blob the union was computed from.
+// tagStoreSwap results.
+static int migrateOnce(MigrateContext *ctx, const char *path,
+                       MigrateOutcome *outcome, int *merged) {
+  unsigned char sourceBlob[EXT_ATTR_SIZE], targetBlob[EXT_ATTR_SIZE];
+  ssize_t sourceLength, targetLength;
+  UserTag *sourceTags, *targetTags = NULL, *tags = NULL;
+  int sourceCount, targetCount = 0, count = 0;
+  unsigned char *bin = NULL;
+  size_t binLength = 0;
+  int status = -1, keep = 0, error;
+
+  *outcome = MigrateOutcomeNone;
+  *merged = 0;
+  if (migrateRead(ctx->source, path, sourceBlob, &sourceLength, &sourceTags,
+                  &sourceCount) != 0)
+    return -1;
+  if (sourceLength < 0) return 0;
+  if (migrateRead(ctx->target, path, targetBlob, &targetLength, &targetTags,
+                  &targetCount) != 0)
+    goto done;
+
+  // The target's tags come first
+  tags = calloc(targetCount + sourceCount + 1, sizeof(*tags));
+  count = migrateUnion(tags, 0, targetTags, targetCount);
+  count = migrateUnion(tags, count, sourceTags, sourceCount);
+
+  if (ctx->target->format == TagFormatXdg) {
+    // A name the xdg list cannot hold would be lost with the source
+    for (int i = 0; i < count; ++i) {
+      if (strchr(tags[i].name, XDG_SEPARATOR)) {
+        reportError("%s: %s: %s\n", path, tags[i].name,
+                    "Tag name cannot be stored as xdg");
+        *outcome = MigrateOutcomeRefused;
+        status = 0;
+        goto done;
+      }
+    }
+
+    // So would colors, the source keeps them
+    for (int i = 0; i < sourceCount; ++i)
+      if (sourceTags[i].color != TagColorNone) keep = 1;
+  }
+
+  bin = ctx->target->format == TagFormatXdg
+          ? xdgEncodeTags(&binLength, tags, count)
+          : createPlistBinary(&binLength, tags, count);
+
+  // An empty union only drops the source, an unchanged target is not
+  // rewritten
+  status = 0;
+  if (count && !tagBlobMatches(targetBlob, targetLength, bin,
+                               (ssize_t)binLength)) {
+    status = tagStoreSwapIn(ctx->target, path, targetBlob, targetLength, bin,
+                            (ssize_t)binLength);
+    if (status >= 0 && status != 1 && journalActive()) {
+      // As the target holds them, without colors in xdg
+      int writtenCount;
+      UserTag *written = createUserTagsFromData(bin, binLength, &writtenCount);
+      journalRecord(path, targetTags, targetCount, written, writtenCount);
+      freeUserTags(written, writtenCount);
+    }
+  }
+  if (status == 0 && !keep)
+    status =
+      tagStoreSwapIn(ctx->source, path, sourceBlob, sourceLength, NULL, -1);
+
+  *outcome = keep ? MigrateOutcomeKept : MigrateOutcomeMoved;
+  *merged = targetCount > 0;
+
+done:
+  error = errno;
+  free(bin);
+  freeUserTags(tags, count);
+  freeUserTags(targetTags, targetCount);
+  freeUserTags(sourceTags, sourceCount);
+  errno = error;
+  return status;
+}
+
+// Move the tags of a single entry from the source to the target attribute
+static TagWalkResult migrateVisit(const TagWalkEntry *entry, void *context) {
+  MigrateContext *ctx = context;
+  MigrateCounters *counters = ctx->counters + entry->worker;
+  MigrateOutcome outcome;
+  int merged, status;
+
+  // Links below the roots would migrate the tags of their targets
+  if (entry->type == DT_LNK && entry->depth) return TagWalkContinue;
+
+  counters->files++;
+
+  // Start over from a fresh read whenever another writer got in between
+  for (int attempt = 0;
+       (status = migrateOnce(ctx, entry->path, &outcome, &merged)) > 0;
+       ++attempt) {
+    if (tagStoreBackoff(attempt) != 0) {
+      status = -1;
+      break;
+    }
+  }
+
+  if (status < 0) {
+    reportError("%s: %s\n", entry->path, strerror(errno));
+    counters->errors++;
+  } else if (outcome == MigrateOutcomeRefused) {
+    counters->errors++;
+  } else if (outcome != MigrateOutcomeNone) {
+    counters->migrated++;
+    if (merged) counters->merged++;
+    if (outcome == MigrateOutcomeKept) counters->kept++;
+  }
+
+  return TagWalkContinue;
+}
+
+int migrateTags(char *const *paths, int pathCount, TagFormat format,
+                OutputFlags outputFlags, int jobs) {
+  static char *const cwd[] = {"."};
+  MigrateContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags | OutputFlagsRecurseDirectory,
+                      .visit = migrateVisit,
+                      .context = ctx};
+  MigrateCounters total = {0};
+
+  ctx->target = tagStoreAttribute(format);
+  ctx->source = tagStoreAttribute(format == TagFormatXdg ? TagFormatPlist
+                                                         : TagFormatXdg);
+
+  // Default to the current directory
+  if (pathCount < 1) {
+    paths = cwd;
+    pathCount = 1;
+  }
+
+  tagWalk(&walker, paths, pathCount);
+
+  for (int i = 0; i < walker.jobs; ++i) {
+    total.files += ctx->counters[i].files;
+    total.migrated += ctx->counters[i].migrated;
+    total.merged += ctx->counters[i].merged;
+    total.kept += ctx->counters[i].kept;
+    total.errors += ctx->counters[i].errors;
+  }
+  free(ctx);
+
+  printf("# files=%llu migrated=%llu merged=%llu kept=%llu errors=%llu\n",
+         total.files, total.migrated, total.merged, total.kept, total.errors);
+
+  return (total.errors || walker.errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
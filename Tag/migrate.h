@@ -0,0 +1,35 @@
+//
+// migrate.h
+// Tag
+//
+
+#ifndef TAG_MIGRATE_H
+#define TAG_MIGRATE_H
+
+#include "store.h"
+#include "usertag.h"
+
+/**
+ * @brief Move the tags of every entry below the paths into the extended
+ * attribute of a format
+ * @param paths Roots of the migration, walked recursively, the current
+ * directory if none
+ * @param pathCount Number of roots
+ * @param format Format to migrate to, the tags of the other format's
+ * attribute are moved
+ * @param outputFlags Enumeration flags (hidden files)
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS if every entry was migrated, EXIT_FAILURE otherwise
+ * @note Tags already in the target attribute are kept first, followed by
+ * the moved tags it does not carry, names differing only in case being one
+ * tag. Each attribute is written with tagStoreSwapIn against the blob that
+ * was read. The source attribute is removed once the target is written, so
+ * an interrupted migration can be run again. xdg has no colors, so an entry
+ * with a colored tag keeps its source when migrating to xdg, and entries
+ * carrying a name with a comma are left alone with an error. A summary line
+ * closes the output.
+ */
+int migrateTags(char *const *paths, int pathCount, TagFormat format,
+                OutputFlags outputFlags, int jobs);
+
+#endif  // TAG_MIGRATE_H
@@ -0,0 +1,178 @@
+//
+// mutate.c
+// Tag
+//
+
+#include "mutate.h"
+
+#include "store.h"
+#include "walk.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @typedef Shared state of the mutation workers
+ * @field paths Paths ordered by parent directory
+ * @field count Number of paths
+ * @field next First path not yet handed to a worker
+ * @field bin Blob of the tags, for set
+ * @field errors Paths that could not be changed, per worker
+ */
+typedef struct MutateContext {
+  OperationMode operationMode;
+  UserTag *userTags;
+  int tagCount;
+  unsigned char *bin;
+  size_t binLength;
+  char **paths;
+  size_t count;
+  size_t next;
+  int nextWorker;
+  pthread_mutex_t lock;
+  unsigned long long errors[WALK_MAX_JOBS];
+} MutateContext;
+
+// Length of the parent directory portion of a path
+static size_t parentLength(const char *path) {
+  const char *separator = strrchr(path, *PATH_SEPARATOR);
+  return separator ? (size_t)(separator - path) : 0;
+}
+
+// Order paths by parent directory, then by name, so repeats are adjacent
+static int parentCompare(const void *a, const void *b) {
+  const char *pa = *(char *const *)a, *pb = *(char *const *)b;
+  size_t la = parentLength(pa), lb = parentLength(pb);
+  int result = memcmp(pa, pb, la < lb ? la : lb);
+
+  if (result) return result;
+  if (la != lb) return la < lb ? -1 : 1;
+  return strcmp(pa + la, pb + lb);
+}
+
+// Claim the next batch of paths sharing a parent, 0 once none are left
+static size_t mutateClaim(MutateContext *ctx, size_t *start) {
+  size_t end;
+
+  pthread_mutex_lock(&ctx->lock);
+  *start = end = ctx->next;
+  if (end < ctx->count) {
+    size_t length = parentLength(ctx->paths[end]);
+    for (++end; end < ctx->count; ++end) {
+      const char *previous = ctx->paths[end - 1], *path = ctx->paths[end];
+      // Repeats of a path are never split between workers
+      if (strcmp(previous, path) == 0) continue;
+      if (end - *start >= MUTATE_BATCH || parentLength(path) != length ||
+          memcmp(path, ctx->paths[*start], length) != 0)
+        break;
+    }
+  }
+  ctx->next = end;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return end - *start;
+}
+
+// Change a single path
+static int mutatePath(MutateContext *ctx, char *path) {
+  switch (ctx->operationMode) {
+    case OperationModeSet:
+      return setTags(path, ctx->bin, ctx->binLength, ctx->userTags,
+                     ctx->tagCount);
+    case OperationModeAdd:
+      return addTags(path, ctx->userTags, ctx->tagCount);
+    case OperationModeRemove:
+      return removeTags(path, ctx->userTags, ctx->tagCount);
+    default:
+      return 0;
+  }
+}
+
+// Worker thread main loop, changes batches until every path is claimed
+static void *mutateWorker(void *arg) {
+  MutateContext *ctx = arg;
+  size_t start, count;
+  int worker;
+
+  pthread_mutex_lock(&ctx->lock);
+  worker = ctx->nextWorker++;
+  pthread_mutex_unlock(&ctx->lock);
+
+  // A write lost to another writer shows up when the swap reads the blob
+  // back, and is retried from a fresh read
+  while ((count = mutateClaim(ctx, &start)) > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      if (mutatePath(ctx, ctx->paths[start + i]) != 0) {
+        reportError("%s: %s\n", ctx->paths[start + i], strerror(errno));
+        ctx->errors[worker]++;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int mutateTags(char *const *paths, int pathCount, OperationMode operationMode,
+               UserTag *userTags, int tagCount, int jobs, int report) {
+  MutateContext *ctx = calloc(1, sizeof(*ctx));
+  pthread_t threads[WALK_MAX_JOBS];
+  unsigned long long errors = 0;
+  struct timespec started, finished;
+  TagSwapStats before, after;
+
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  tagStoreSwapStats(&before);
+
+  ctx->operationMode = operationMode;
+  ctx->userTags = userTags;
+  ctx->tagCount = tagCount;
+  pthread_mutex_init(&ctx->lock, NULL);
+
+  // Encode the tags argument in the format of the storage backend
+  if (operationMode == OperationModeSet)
+    ctx->bin = createTagBlob(&ctx->binLength, userTags, tagCount);
+
+  // Skip empty path requests
+  ctx->paths = calloc(pathCount ? pathCount : 1, sizeof(*ctx->paths));
+  for (int i = 0; i < pathCount; ++i)
+    if (*paths[i]) ctx->paths[ctx->count++] = paths[i];
+  qsort(ctx->paths, ctx->count, sizeof(*ctx->paths), parentCompare);
+
+  // No more workers than paths, a single one runs on the calling thread
+  if (jobs > WALK_MAX_JOBS) jobs = WALK_MAX_JOBS;
+  if ((size_t)jobs > ctx->count) jobs = (int)ctx->count;
+  if (jobs > 1) {
+    for (int i = 0; i < jobs; ++i)
+      pthread_create(&threads[i], NULL, mutateWorker, ctx);
+    for (int i = 0; i < jobs; ++i) pthread_join(threads[i], NULL);
+  } else {
+    mutateWorker(ctx);
+  }
+
+  for (int i = 0; i < WALK_MAX_JOBS; ++i) errors += ctx->errors[i];
+
+  if (report) {
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    tagStoreSwapStats(&after);
+    double seconds = (double)(finished.tv_sec - started.tv_sec) +
+                     (double)(finished.tv_nsec - started.tv_nsec) / 1e9;
+    fprintf(stderr,
+            "# paths=%zu errors=%llu conflicts=%llu contended=%llu "
+            "exhausted=%llu seconds=%.3f rate=%.0f/s\n",
+            ctx->count, errors, after.conflicts - before.conflicts,
+            after.contended - before.contended,
+            after.exhausted - before.exhausted, seconds,
+            seconds > 0 ? (double)ctx->count / seconds : 0.0);
+  }
+
+  // Cleanup
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx->paths);
+  free(ctx->bin);
+  free(ctx);
+
+  return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,38 @@
+//
+// mutate.h
+// Tag
+//
+
+#ifndef TAG_MUTATE_H
+#define TAG_MUTATE_H
+
+#include "usertag.h"
+
+// Most paths of a single directory handed to a worker at once
+#define MUTATE_BATCH    256
+
+/**
+ * @brief Add, remove or set tags on a list of paths with several workers
+ * @param paths Paths to change, empty ones are skipped
+ * @param pathCount Number of paths
+ * @param operationMode OperationModeAdd, OperationModeRemove or
+ * OperationModeSet
+ * @param userTags Tags of the operation
+ * @param tagCount Number of tags
+ * @param jobs Number of worker threads
+ * @param report Print the number of paths, errors, write conflicts and the
+ * throughput to stderr at the end
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a path could not be changed
+ * @note The paths are grouped by parent directory and the groups are handed
+ * out in batches of up to MUTATE_BATCH paths, so each worker stays within one
+ * directory at a time. Every path is read, changed and written by a single
+ * worker, and repeats of a path fall in the same batch, so the change of a
+ * path is never interleaved with another change of the same path by this
+ * process. A change that another process overwrote is caught when the
+ * write is read back, and computed again from the current tags. Each path
+ * that could not be changed is reported as it fails.
+ */
+int mutateTags(char *const *paths, int pathCount, OperationMode operationMode,
+               UserTag *userTags, int tagCount, int jobs, int report);
+
+#endif  // TAG_MUTATE_H
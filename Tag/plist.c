@@ -0,0 +1,336 @@
+//
+// plist.c
+// Tag
+//
+
+#include "plist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Object types, the high nibble of an object's marker byte
+#define PLIST_INT       0x1
+#define PLIST_ASCII     0x5
+#define PLIST_UTF16     0x6
+#define PLIST_ARRAY     0xA
+
+/**
+ * @typedef Growing output of the encoder
+ */
+typedef struct PlistBuffer {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+} PlistBuffer;
+
+static void plistAppend(PlistBuffer *buffer, const void *bytes,
+                        size_t length) {
+  if (buffer->length + length > buffer->capacity) {
+    buffer->capacity = (buffer->length + length) * 2;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+  }
+  memcpy(buffer->data + buffer->length, bytes, length);
+  buffer->length += length;
+}
+
+static void plistAppendByte(PlistBuffer *buffer, unsigned char byte) {
+  plistAppend(buffer, &byte, 1);
+}
+
+// Big endian unsigned integer of the given size
+static void plistAppendUInt(PlistBuffer *buffer, uint64_t value, int size) {
+  for (int i = size - 1; i >= 0; --i)
+    plistAppendByte(buffer, (unsigned char)(value >> (i * 8)));
+}
+
+// Smallest of 1, 2, 4 or 8 bytes holding a value
+static int plistByteCount(uint64_t value) {
+  if (value < (1ULL << 8)) return 1;
+  if (value < (1ULL << 16)) return 2;
+  if (value < (1ULL << 32)) return 4;
+  return 8;
+}
+
+// Marker of an object, counts of 15 and more follow as an integer object
+static void plistAppendMarker(PlistBuffer *buffer, int type, uint64_t count) {
+  if (count < 15) {
+    plistAppendByte(buffer, (unsigned char)(type << 4 | count));
+    return;
+  }
+  int size = plistByteCount(count);
+  plistAppendByte(buffer, (unsigned char)(type << 4 | 0xF));
+  plistAppendByte(buffer, (unsigned char)(PLIST_INT << 4 |
+                                          (size == 1   ? 0
+                                           : size == 2 ? 1
+                                           : size == 4 ? 2
+                                                       : 3)));
+  plistAppendUInt(buffer, count, size);
+}
+
+// Next code point of a UTF-8 string, U+FFFD for a malformed sequence
+static uint32_t utf8Next(const unsigned char **p, const unsigned char *end) {
+  const unsigned char *s = *p;
+  uint32_t code;
+  int extra;
+
+  if (*s < 0x80) {
+    *p = s + 1;
+    return *s;
+  } else if ((*s & 0xE0) == 0xC0) {
+    code = *s & 0x1F;
+    extra = 1;
+  } else if ((*s & 0xF0) == 0xE0) {
+    code = *s & 0x0F;
+    extra = 2;
+  } else if ((*s & 0xF8) == 0xF0) {
+    code = *s & 0x07;
+    extra = 3;
+  } else {
+    *p = s + 1;
+    return 0xFFFD;
+  }
+
+  if (end - s <= extra) {
+    *p = end;
+    return 0xFFFD;
+  }
+  for (int i = 1; i <= extra; ++i) {
+    if ((s[i] & 0xC0) != 0x80) {
+      *p = s + i;
+      return 0xFFFD;
+    }
+    code = code << 6 | (s[i] & 0x3F);
+  }
+  *p = s + extra + 1;
+
+  return code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF) ? 0xFFFD : code;
+}
+
+// Append a string object, ASCII as bytes and anything else as UTF-16
+static void plistAppendString(PlistBuffer *buffer, const char *string) {
+  const unsigned char *p = (const unsigned char *)string;
+  size_t length = strlen(string);
+  const unsigned char *end = p + length;
+  int ascii = 1;
+
+  for (size_t i = 0; i < length && ascii; ++i) ascii = p[i] < 0x80;
+  if (ascii) {
+    plistAppendMarker(buffer, PLIST_ASCII, length);
+    plistAppend(buffer, string, length);
+    return;
+  }
+
+  // At most one UTF-16 unit per byte
+  uint16_t *units = malloc(sizeof(*units) * length);
+  size_t count = 0;
+  while (p < end) {
+    uint32_t code = utf8Next(&p, end);
+    if (code >= 0x10000) {
+      code -= 0x10000;
+      units[count++] = (uint16_t)(0xD800 | code >> 10);
+      units[count++] = (uint16_t)(0xDC00 | (code & 0x3FF));
+    } else {
+      units[count++] = (uint16_t)code;
+    }
+  }
+  plistAppendMarker(buffer, PLIST_UTF16, count);
+  for (size_t i = 0; i < count; ++i) plistAppendUInt(buffer, units[i], 2);
+  free(units);
+}
+
+unsigned char *plistEncodeTags(size_t *length, const UserTag *userTags,
+                               int tagCount) {
+  PlistBuffer buffer = {0};
+  uint64_t objectCount = (uint64_t)tagCount + 1;
+  int refSize = plistByteCount(objectCount);
+  uint64_t *offsets = calloc(objectCount, sizeof(*offsets));
+  char color[16];
+
+  plistAppend(&buffer, PLIST_MAGIC, strlen(PLIST_MAGIC));
+
+  // The array is object 0, its strings follow in order
+  offsets[0] = buffer.length;
+  plistAppendMarker(&buffer, PLIST_ARRAY, tagCount);
+  for (int i = 0; i < tagCount; ++i) plistAppendUInt(&buffer, i + 1, refSize);
+
+  for (int i = 0; i < tagCount; ++i) {
+    size_t nameLength = strlen(userTags[i].name);
+    snprintf(color, sizeof(color), "\n%d", userTags[i].color);
+    char *string = malloc(nameLength + strlen(color) + 1);
+    memcpy(string, userTags[i].name, nameLength);
+    strcpy(string + nameLength, color);
+    offsets[i + 1] = buffer.length;
+    plistAppendString(&buffer, string);
+    free(string);
+  }
+
+  // Offset table and trailer
+  uint64_t tableOffset = buffer.length;
+  int offsetSize = plistByteCount(tableOffset);
+  for (uint64_t i = 0; i < objectCount; ++i)
+    plistAppendUInt(&buffer, offsets[i], offsetSize);
+  plistAppendUInt(&buffer, 0, 6);
+  plistAppendByte(&buffer, (unsigned char)offsetSize);
+  plistAppendByte(&buffer, (unsigned char)refSize);
+  plistAppendUInt(&buffer, objectCount, 8);
+  plistAppendUInt(&buffer, 0, 8);
+  plistAppendUInt(&buffer, tableOffset, 8);
+
+  free(offsets);
+  *length = buffer.length;
+  return buffer.data;
+}
+
+static uint64_t plistReadUInt(const unsigned char *p, int size) {
+  uint64_t value = 0;
+  for (int i = 0; i < size; ++i) value = value << 8 | p[i];
+  return value;
+}
+
+// Read the marker of the object at an offset below the limit, returning the
+// offset of its contents, 0 if it is malformed
+static size_t plistReadMarker(const unsigned char *buf, size_t offset,
+                              size_t limit, int *type, uint64_t *count) {
+  // Objects lie between the header and the offset table
+  if (offset < strlen(PLIST_MAGIC) || offset >= limit) return 0;
+  *type = buf[offset] >> 4;
+  *count = buf[offset] & 0xF;
+  if (*count < 15) return offset + 1;
+
+  // Longer counts follow as an integer object
+  if (offset + 2 > limit || buf[offset + 1] >> 4 != PLIST_INT ||
+      (buf[offset + 1] & 0xF) > 3)
+    return 0;
+  int size = 1 << (buf[offset + 1] & 0xF);
+  if (offset + 2 + size > limit) return 0;
+  *count = plistReadUInt(buf + offset + 2, size);
+  return offset + 2 + size;
+}
+
+// Append a code point to a UTF-8 string
+static char *utf8Append(char *p, uint32_t code) {
+  if (code < 0x80) {
+    *p++ = (char)code;
+  } else if (code < 0x800) {
+    *p++ = (char)(0xC0 | code >> 6);
+    *p++ = (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    *p++ = (char)(0xE0 | code >> 12);
+    *p++ = (char)(0x80 | (code >> 6 & 0x3F));
+    *p++ = (char)(0x80 | (code & 0x3F));
+  } else {
+    *p++ = (char)(0xF0 | code >> 18);
+    *p++ = (char)(0x80 | (code >> 12 & 0x3F));
+    *p++ = (char)(0x80 | (code >> 6 & 0x3F));
+    *p++ = (char)(0x80 | (code & 0x3F));
+  }
+  return p;
+}
+
+// Decode a string object as a NUL terminated UTF-8 string
+static char *plistReadString(const unsigned char *buf, size_t offset,
+                             size_t limit) {
+  int type;
+  uint64_t count;
+  char *string, *p;
+
+  if ((offset = plistReadMarker(buf, offset, limit, &type, &count)) == 0)
+    return NULL;
+
+  if (type == PLIST_ASCII) {
+    if (count > limit - offset) return NULL;
+    string = malloc(count + 1);
+    memcpy(string, buf + offset, count);
+    string[count] = '\0';
+    return string;
+  }
+  if (type != PLIST_UTF16 || count > (limit - offset) / 2) return NULL;
+
+  // At most three bytes per unit, a surrogate pair takes four for two
+  p = string = malloc(count * 3 + 1);
+  for (uint64_t i = 0; i < count; ++i) {
+    uint32_t code = (uint32_t)plistReadUInt(buf + offset + i * 2, 2);
+    if (code >= 0xD800 && code <= 0xDBFF && i + 1 < count) {
+      uint32_t low = (uint32_t)plistReadUInt(buf + offset + i * 2 + 2, 2);
+      if (low >= 0xDC00 && low <= 0xDFFF) {
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+        i++;
+      } else {
+        code = 0xFFFD;
+      }
+    } else if (code >= 0xD800 && code <= 0xDFFF) {
+      code = 0xFFFD;
+    }
+    p = utf8Append(p, code);
+  }
+  *p = '\0';
+
+  return string;
+}
+
+int plistDecodeTags(const unsigned char *buf, size_t len, UserTag **userTags,
+                    int *tagCount) {
+  const unsigned char *trailer;
+  size_t offset;
+  int type;
+  uint64_t count;
+
+  // Default to no tags
+  *userTags = NULL;
+  *tagCount = 0;
+
+  if (len < strlen(PLIST_MAGIC) + PLIST_TRAILER ||
+      memcmp(buf, PLIST_MAGIC, strlen(PLIST_MAGIC) - 1) != 0)
+    return -1;
+
+  // Every offset read is checked against the table and the trailer
+  trailer = buf + len - PLIST_TRAILER;
+  int offsetSize = trailer[6], refSize = trailer[7];
+  uint64_t objectCount = plistReadUInt(trailer + 8, 8);
+  uint64_t top = plistReadUInt(trailer + 16, 8);
+  uint64_t tableOffset = plistReadUInt(trailer + 24, 8);
+  size_t limit = len - PLIST_TRAILER;
+  if (offsetSize < 1 || offsetSize > 8 || refSize < 1 || refSize > 8 ||
+      top >= objectCount || tableOffset < strlen(PLIST_MAGIC) ||
+      tableOffset > limit ||
+      objectCount > (limit - tableOffset) / (uint64_t)offsetSize)
+    return -1;
+  // The top object is an array of strings
+  offset = plistReadMarker(
+    buf, plistReadUInt(buf + tableOffset + top * offsetSize, offsetSize),
+    tableOffset, &type, &count);
+  if (!offset || type != PLIST_ARRAY ||
+      count > (tableOffset - offset) / (uint64_t)refSize || count > INT32_MAX)
+    return -1;
+
+  *userTags = calloc(count ? count : 1, sizeof(**userTags));
+  for (uint64_t i = 0; i < count; ++i) {
+    uint64_t ref = plistReadUInt(buf + offset + i * refSize, refSize);
+    char *string, *newline;
+
+    if (ref >= objectCount ||
+        (string = plistReadString(
+           buf, plistReadUInt(buf + tableOffset + ref * offsetSize,
+                              offsetSize),
+           tableOffset)) == NULL) {
+      freeUserTags(*userTags, (int)i);
+      *userTags = NULL;
+      return -1;
+    }
+
+    // Tag name, a new line and the color code, the color only counts when
+    // there is a single new line
+    (*userTags)[i].name = string;
+    (*userTags)[i].color = TagColorNone;
+    if ((newline = strchr(string, '\n')) != NULL) {
+      *newline = '\0';
+      if (!strchr(newline + 1, '\n'))
+        (*userTags)[i].color = (TagColor)atoi(newline + 1);
+    }
+  }
+  *tagCount = (int)count;
+
+  return 0;
+}
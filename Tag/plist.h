@@ -0,0 +1,46 @@
+//
+// plist.h
+// Tag
+//
+
+#ifndef TAG_PLIST_H
+#define TAG_PLIST_H
+
+#include "usertag.h"
+
+#include <stddef.h>
+
+// Binary property list header, also the version of the format
+#define PLIST_MAGIC     "bplist00"
+
+// Length of the trailer closing a binary property list
+#define PLIST_TRAILER   32
+
+/**
+ * @brief Encode tags as a binary property list array of strings, each the
+ * tag name, a new line and the color code
+ * @param length Receives the length of the blob
+ * @param userTags Tags to encode, in order, none of them empty or repeated
+ * @param tagCount Number of tags
+ * @return Blob, release with free
+ * @note The layout is the one CoreFoundation writes for the same array:
+ * the array first, then the strings, ASCII strings as single bytes and the
+ * others as UTF-16, with the smallest offset and reference sizes. Equal tag
+ * lists are therefore encoded to equal blobs on every platform.
+ */
+unsigned char *plistEncodeTags(size_t *length, const UserTag *userTags,
+                               int tagCount);
+
+/**
+ * @brief Decode a binary property list array of strings as tags
+ * @param buf Blob
+ * @param len Length of the blob
+ * @param userTags Receives the tags, NULL on failure
+ * @param tagCount Receives the count of the tags
+ * @return 0 on success, -1 if the blob is not a property list array of
+ * strings
+ */
+int plistDecodeTags(const unsigned char *buf, size_t len, UserTag **userTags,
+                    int *tagCount);
+
+#endif  // TAG_PLIST_H
@@ -0,0 +1,34 @@
+//
+// probes.h
+// Tag
+//
+
+#ifndef TAG_PROBES_H
+#define TAG_PROBES_H
+
+// Statically defined tracepoints of the "tag" provider. Built with TAG_USDT
+// each probe is a single nop plus a note describing its arguments, which
+// perf, bpftrace and DTrace patch in when the probe is attached. Without it
+// the probes compile to nothing.
+//
+//   dir__open      (const char *path, int ok)
+//   entry__visit   (const char *path, int depth, int type)
+//   get__start     (const char *path)
+//   get__done      (const char *path, long length, int error)
+//   decode         (long length, int tagCount)
+//   match          (const char *path, int matched, int tagCount)
+//   set__start     (const char *path, long length)
+//   set__done      (const char *path, int status, int error)
+//   output__flush  (int fd, long length), length -1 for a stdio flush
+#ifdef TAG_USDT
+#include <sys/sdt.h>
+#define TAG_PROBE1(name, a)                 DTRACE_PROBE1(tag, name, a)
+#define TAG_PROBE2(name, a, b)              DTRACE_PROBE2(tag, name, a, b)
+#define TAG_PROBE3(name, a, b, c)           DTRACE_PROBE3(tag, name, a, b, c)
+#else
+#define TAG_PROBE1(name, a)                 do {} while (0)
+#define TAG_PROBE2(name, a, b)              do {} while (0)
+#define TAG_PROBE3(name, a, b, c)           do {} while (0)
+#endif
+
+#endif  // TAG_PROBES_H
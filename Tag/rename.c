@@ -0,0 +1,231 @@
+//
+// rename.c
+// Tag
+//
+
+#include "rename.h"
+
+#include "journal.h"
+#include "memo.h"
+#include "store.h"
+#include "walk.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @typedef Tag being rewritten
+ * @field tag Name and color, the name is borrowed from the decoded tags or
+ * from a rule
+ * @field renamed The tag was produced by a rule
+ * @field setColor A rule forced the color
+ */
+typedef struct RenameSlot {
+  UserTag tag;
+  int renamed;
+  int setColor;
+} RenameSlot;
+
+/**
+ * @typedef Walk context shared by the rename workers
+ */
+typedef struct RenameContext {
+  TagRename *renames;
+  int renameCount;
+  MemoOperation operation;
+  unsigned long errors[WALK_MAX_JOBS];
+} RenameContext;
+
+int parseRenameArgument(char *arg, TagRename *rename) {
+  char *to = strchr(arg, '=');
+  char *color;
+
+  if (!to || to == arg || !*(to + 1)) return -1;
+  *to++ = '\0';
+
+  rename->from = arg;
+  rename->to = to;
+  rename->color = TagColorNone;
+  rename->setColor = 0;
+
+  // Optional color of the renamed tag
+  if ((color = strchr(to, ':')) != NULL) {
+    *color++ = '\0';
+    rename->color = getColorCode(color);
+    rename->setColor = 1;
+  }
+
+  return 0;
+}
+
+int parseRecolorArgument(char *arg, TagRename *rename) {
+  char *color = strchr(arg, ':');
+
+  if (!color || color == arg) return -1;
+  *color++ = '\0';
+
+  rename->from = arg;
+  rename->to = arg;
+  rename->color = getColorCode(color);
+  rename->setColor = 1;
+
+  return 0;
+}
+
+// Order by name, tags already on the path before renamed ones
+static int slotCompare(const void *a, const void *b) {
+  const RenameSlot *sa = a, *sb = b;
+  int result = tagCompare(&sa->tag, &sb->tag);
+  return result ? result : sa->renamed - sb->renamed;
+}
+
+// Rewritten blob of a decoded tag set, NULL if no rule changes it
+static unsigned char *renameBlob(RenameContext *ctx, UserTag *existingTags,
+                                 int existingTagsCount, size_t *siz) {
+  unsigned char *bin = NULL;
+  int changed = 0;
+
+  // Apply the rules in order, so renames may be chained
+  RenameSlot *slots = calloc(existingTagsCount, sizeof(*slots));
+  for (int i = 0; i < existingTagsCount; ++i) {
+    slots[i].tag = existingTags[i];
+    for (int r = 0; r < ctx->renameCount; ++r) {
+      TagRename *rename = ctx->renames + r;
+      if (strcmp(slots[i].tag.name, rename->from) != 0) continue;
+
+      TagColor color = rename->setColor ? rename->color : slots[i].tag.color;
+      if (strcmp(rename->to, slots[i].tag.name) != 0 ||
+          color != slots[i].tag.color)
+        changed = 1;
+
+      slots[i].tag.name = rename->to;
+      slots[i].tag.color = color;
+      slots[i].renamed = 1;
+      slots[i].setColor |= rename->setColor;
+    }
+  }
+
+  if (changed) {
+    UserTag *mergedTags = calloc(existingTagsCount, sizeof(*mergedTags));
+    int mergedTagsCount = 0;
+
+    // Merge on the sorted set, a renamed tag folds into an existing one
+    qsort(slots, existingTagsCount, sizeof(*slots), slotCompare);
+    for (int i = 0; i < existingTagsCount; ++i) {
+      if (mergedTagsCount &&
+          tagCompare(mergedTags + mergedTagsCount - 1, &slots[i].tag) == 0) {
+        if (slots[i].setColor)
+          mergedTags[mergedTagsCount - 1].color = slots[i].tag.color;
+        continue;
+      }
+      mergedTags[mergedTagsCount++] = slots[i].tag;
+    }
+
+    bin = createTagBlob(siz, mergedTags, mergedTagsCount);
+    free(mergedTags);
+  }
+
+  free(slots);
+
+  return bin;
+}
+
+// Single optimistic rewrite of a path's tags, tagStoreSwap results
+static int renamePath(RenameContext *ctx, const char *path) {
+  unsigned char buf[EXT_ATTR_SIZE];
+  ssize_t len;
+  UserTag *existingTags = NULL;
+  int existingTagsCount = 0;
+  MemoResult result;
+  unsigned char *bin;
+  size_t siz = 0;
+  int status = 0, error = 0;
+
+  // Untagged paths and empty blobs have nothing to rename
+  if ((len = tagStoreGet(path, buf, EXT_ATTR_SIZE)) < 0)
+    return errno == TAG_ENOATTR ? 0 : -1;
+  if (len == 0) return 0;
+
+  // Paths carrying identical blobs are rewritten to identical blobs
+  bin = memoLookupBlob(&ctx->operation, buf, len, &result, &siz);
+  if (!bin || (result == MemoResultWrite && journalActive()))
+    existingTags = createUserTagsFromData(buf, len, &existingTagsCount);
+  if (!bin) {
+    bin = renameBlob(ctx, existingTags, existingTagsCount, &siz);
+    result = bin ? MemoResultWrite : MemoResultKeep;
+    memoInsertBlob(&ctx->operation, buf, len, result, bin, siz);
+  }
+
+  if (result == MemoResultWrite) {
+    // Written only if no other writer changed the path since it was read
+    if ((status = tagStoreSwap(path, buf, len, bin, (ssize_t)siz)) < 0) {
+      error = errno;
+    } else if (status != 1 && journalActive()) {
+      int mergedTagsCount;
+      UserTag *mergedTags = createUserTagsFromData(bin, siz,
+                                                   &mergedTagsCount);
+      journalRecord(path, existingTags, existingTagsCount, mergedTags,
+                    mergedTagsCount);
+      freeUserTags(mergedTags, mergedTagsCount);
+    }
+  }
+
+  if (bin) free(bin);
+  freeUserTags(existingTags, existingTagsCount);
+  if (status < 0) errno = error;
+
+  return status;
+}
+
+// Rewrite the tags of a single entry, starting over on a conflict
+static TagWalkResult renameVisit(const TagWalkEntry *entry, void *context) {
+  RenameContext *ctx = context;
+  int status;
+
+  for (int attempt = 0; (status = renamePath(ctx, entry->path)) > 0;
+       ++attempt) {
+    if (tagStoreBackoff(attempt) != 0) {
+      status = -1;
+      break;
+    }
+  }
+  if (status < 0) {
+    reportError("%s: %s\n", entry->path, strerror(errno));
+    ctx->errors[entry->worker]++;
+  }
+
+  return TagWalkContinue;
+}
+
+int renameTags(char *const *paths, int pathCount, TagRename *renames,
+               int renameCount, OutputFlags outputFlags, int jobs) {
+  RenameContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags,
+                      .visit = renameVisit,
+                      .context = ctx};
+  unsigned long errors = 0;
+
+  ctx->renames = renames;
+  ctx->renameCount = renameCount;
+
+  // Identify the rule set for the output memo
+  memoOperationInit(&ctx->operation, OperationModeRename, NULL, 0);
+  for (int r = 0; r < renameCount; ++r) {
+    int color = renames[r].setColor ? (int)renames[r].color : -1;
+    memoOperationAppend(&ctx->operation, renames[r].from,
+                        strlen(renames[r].from) + 1);
+    memoOperationAppend(&ctx->operation, renames[r].to,
+                        strlen(renames[r].to) + 1);
+    memoOperationAppend(&ctx->operation, &color, sizeof(color));
+  }
+
+  tagWalk(&walker, paths, pathCount);
+
+  for (int i = 0; i < walker.jobs; ++i) errors += ctx->errors[i];
+  memoOperationFree(&ctx->operation);
+  free(ctx);
+
+  return (errors || walker.errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+//
+// rename.h
+// Tag
+//
+
+#ifndef TAG_RENAME_H
+#define TAG_RENAME_H
+
+#include "usertag.h"
+
+/**
+ * @typedef Rewrite applied to every tag with a given name
+ * @field from Tag name to rewrite
+ * @field to Replacement name, equal to from for a recolor
+ * @field color Replacement color
+ * @field setColor Apply color, otherwise the tag keeps its own color
+ */
+typedef struct TagRename {
+  char *from;
+  char *to;
+  TagColor color;
+  int setColor;
+} TagRename;
+
+/**
+ * @brief Parse a rename argument of the form old=new[:color]
+ * @param arg Argument, modified in place
+ * @param rename Rule to fill in, pointing into arg
+ * @return 0 on success, -1 if the argument is malformed
+ */
+int parseRenameArgument(char *arg, TagRename *rename);
+
+/**
+ * @brief Parse a recolor argument of the form tag:color
+ * @param arg Argument, modified in place
+ * @param rename Rule to fill in, pointing into arg
+ * @return 0 on success, -1 if the argument is malformed
+ */
+int parseRecolorArgument(char *arg, TagRename *rename);
+
+/**
+ * @brief Apply rename and recolor rules to the paths in a single pass
+ * @param paths Paths to rewrite, recursively with OutputFlagsRecurseDirectory
+ * @param pathCount Number of paths
+ * @param renames Rules, applied in order to each tag
+ * @param renameCount Number of rules
+ * @param outputFlags Enumeration flags (hidden files, recursion)
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a path could not be rewritten
+ * @note Each path's tags are decoded once. Only paths carrying a source tag
+ * are rewritten. When a renamed tag collides with a tag already on the path
+ * the two are merged, keeping the existing tag's color unless the rule sets
+ * one.
+ */
+int renameTags(char *const *paths, int pathCount, TagRename *renames,
+               int renameCount, OutputFlags outputFlags, int jobs);
+
+#endif  // TAG_RENAME_H
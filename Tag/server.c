@@ -0,0 +1,548 @@
+//
+// server.c
+// Tag
+//
+
+#include "server.h"
+
+#include "cache.h"
+#include "journal.h"
+#include "probes.h"
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * @typedef Growable byte buffer
+ */
+typedef struct Buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+/**
+ * @typedef Connection of a client
+ * @field fd Socket, -1 for a free slot
+ * @field in Received bytes not yet forming a complete request
+ * @field out Replies of the requests received in one read
+ */
+typedef struct Client {
+  int fd;
+  Buffer in;
+  Buffer out;
+} Client;
+
+/**
+ * @typedef Files capturing the output of a request
+ */
+typedef struct Capture {
+  int out;
+  int err;
+  int savedOut;
+  int savedErr;
+  int cwd;
+} Capture;
+
+// Set while a forwarded invocation is running
+static int serving = 0;
+
+// Set by SIGINT and SIGTERM
+static volatile sig_atomic_t stopping = 0;
+
+static void stopServing(int signal) {
+  (void)signal;
+  stopping = 1;
+}
+
+static void bufferReserve(Buffer *buffer, size_t length) {
+  if (buffer->length + length <= buffer->capacity) return;
+  while (buffer->length + length > buffer->capacity)
+    buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+  buffer->data = realloc(buffer->data, buffer->capacity);
+}
+
+static void bufferAppend(Buffer *buffer, const void *data, size_t length) {
+  bufferReserve(buffer, length);
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+static void bufferAppend32(Buffer *buffer, uint32_t value) {
+  unsigned char bytes[4] = {value >> 24, value >> 16, value >> 8, value};
+  bufferAppend(buffer, bytes, sizeof(bytes));
+}
+
+static uint32_t decode32(const void *data) {
+  const unsigned char *bytes = data;
+  return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+         ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static int writeAll(int fd, const void *data, size_t length) {
+  const char *p = data;
+
+  while (length) {
+    ssize_t written = write(fd, p, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += written;
+    length -= written;
+  }
+  return 0;
+}
+
+static int readAll(int fd, void *data, size_t length) {
+  char *p = data;
+
+  while (length) {
+    ssize_t got = read(fd, p, length);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) {
+      if (got == 0) errno = ECONNRESET;
+      return -1;
+    }
+    p += got;
+    length -= got;
+  }
+  return 0;
+}
+
+// Append the captured bytes of a file to a reply and empty the file
+static size_t drainCapture(int fd, Buffer *reply) {
+  off_t length = lseek(fd, 0, SEEK_END);
+  size_t got = 0;
+
+  if (length > 0) {
+    bufferReserve(reply, length);
+    while (got < (size_t)length) {
+      ssize_t n = pread(fd, reply->data + reply->length + got, length - got,
+                        got);
+      if (n <= 0) break;
+      got += n;
+    }
+    reply->length += got;
+  }
+  ftruncate(fd, 0);
+  lseek(fd, 0, SEEK_SET);
+
+  return got;
+}
+
+// Empty a capture file without reading it
+static off_t discardCapture(int fd) {
+  off_t length = lseek(fd, 0, SEEK_END);
+  ftruncate(fd, 0);
+  lseek(fd, 0, SEEK_SET);
+  return length;
+}
+
+// Run one request and append its reply frame. Requests run one at a time on
+// the serving thread, they share its standard streams, working directory
+// and option parser.
+static void runRequest(Capture *capture, char *payload, size_t length,
+                       Buffer *reply) {
+  char **argv = NULL;
+  int argc = 1;
+  int status = EXIT_FAILURE;
+  size_t frame = reply->length;
+  size_t outLength;
+
+  // Reserve the frame length, exit status and output length
+  bufferAppend32(reply, 0);
+  bufferAppend32(reply, 0);
+  bufferAppend32(reply, 0);
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(capture->out, STDOUT_FILENO);
+  dup2(capture->err, STDERR_FILENO);
+
+  // The working directory and the arguments, each NUL terminated
+  if (!length || payload[length - 1] != '\0') {
+    reportError("%s\n", "Malformed request");
+  } else if (chdir(payload) != 0) {
+    reportError("%s: %s\n", payload, strerror(errno));
+  } else {
+    journalChdir();
+    char *first = payload + strlen(payload) + 1, *end = payload + length;
+    for (char *arg = first; arg < end; arg += strlen(arg) + 1) argc++;
+    argv = calloc(argc + 1, sizeof(*argv));
+    argv[0] = PROGRAM_NAME;
+    argc = 1;
+    for (char *arg = first; arg < end; arg += strlen(arg) + 1)
+      argv[argc++] = arg;
+
+    // Restart option parsing for the new argument vector
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optreset = 1;
+    optind = 1;
+#endif
+    serving = 1;
+    status = parseCommandLine(argc, argv);
+    serving = 0;
+    free(argv);
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(capture->savedOut, STDOUT_FILENO);
+  dup2(capture->savedErr, STDERR_FILENO);
+  fchdir(capture->cwd);
+
+  // Standard output then standard error, followed by the reserved fields.
+  // Output that would not fit a frame is replaced by an error.
+  off_t outSize = lseek(capture->out, 0, SEEK_END);
+  off_t errSize = lseek(capture->err, 0, SEEK_END);
+  if (outSize < 0 || errSize < 0 ||
+      (uint64_t)outSize + (uint64_t)errSize > SERVER_MAX_FRAME - 8) {
+    char message[160];
+    long long total = (long long)(discardCapture(capture->out) +
+                                  discardCapture(capture->err));
+    int n = snprintf(message, sizeof(message),
+                     "Reply of %lld bytes exceeds the %d byte limit of the "
+                     "server, run the command without --client\n",
+                     total, SERVER_MAX_FRAME - 8);
+    bufferAppend(reply, message, (size_t)n);
+    status = EXIT_FAILURE;
+    outLength = 0;
+  } else {
+    outLength = drainCapture(capture->out, reply);
+    drainCapture(capture->err, reply);
+  }
+
+  unsigned char *head = (unsigned char *)reply->data + frame;
+  uint32_t fields[3] = {reply->length - frame - 4, status, outLength};
+  for (int i = 0; i < 3; ++i) {
+    head[i * 4] = fields[i] >> 24;
+    head[i * 4 + 1] = fields[i] >> 16;
+    head[i * 4 + 2] = fields[i] >> 8;
+    head[i * 4 + 3] = fields[i];
+  }
+}
+
+static void closeClient(Client *client) {
+  close(client->fd);
+  free(client->in.data);
+  free(client->out.data);
+  memset(client, 0, sizeof(*client));
+  client->fd = -1;
+}
+
+// Read what a client sent, answering every complete request in one write
+static void serveClient(Capture *capture, Client *client) {
+  size_t offset = 0;
+
+  bufferReserve(&client->in, 65536);
+  ssize_t got = read(client->fd, client->in.data + client->in.length,
+                     client->in.capacity - client->in.length);
+  if (got < 0 && errno == EINTR) return;
+  if (got <= 0) {
+    closeClient(client);
+    return;
+  }
+  client->in.length += got;
+
+  // Pipelined requests are answered in order
+  while (client->in.length - offset >= 4) {
+    uint32_t length = decode32(client->in.data + offset);
+    if (length > SERVER_MAX_FRAME) {
+      closeClient(client);
+      return;
+    }
+    if (client->in.length - offset - 4 < length) {
+      // Make room for the rest of a large request
+      bufferReserve(&client->in, length + 4);
+      break;
+    }
+    runRequest(capture, client->in.data + offset + 4, length, &client->out);
+    offset += 4 + length;
+  }
+
+  memmove(client->in.data, client->in.data + offset,
+          client->in.length - offset);
+  client->in.length -= offset;
+
+  if (client->out.length) {
+    TAG_PROBE2(output__flush, client->fd, (long)client->out.length);
+    if (writeAll(client->fd, client->out.data, client->out.length) != 0) {
+      closeClient(client);
+      return;
+    }
+    client->out.length = 0;
+  }
+}
+
+// Create the listening socket, replacing one left by a server that is gone
+static int listenSocket(const char *socketPath) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct stat st;
+  int fd;
+
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  if ((fd = tagClientConnect(socketPath)) >= 0) {
+    close(fd);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socketPath);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+
+  // Only the current user may connect
+  mode_t mask = umask(0077);
+  int status = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (status != 0 || listen(fd, SOMAXCONN) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+int serveTags(const char *socketPath, const char *journalPath) {
+  Client clients[SERVER_MAX_CLIENTS];
+  struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+  struct sigaction action = {.sa_handler = stopServing};
+  Capture capture;
+  FILE *out, *err;
+  int listener;
+
+  if ((listener = listenSocket(socketPath)) < 0) {
+    reportError("%s: %s\n", socketPath, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  // Changes made by every request are recorded in the same journal
+  if (journalPath && journalOpen(journalPath) != 0) {
+    close(listener);
+    unlink(socketPath);
+    return EXIT_FAILURE;
+  }
+
+  out = tmpfile();
+  err = tmpfile();
+  capture.out = fileno(out);
+  capture.err = fileno(err);
+  capture.savedOut = dup(STDOUT_FILENO);
+  capture.savedErr = dup(STDERR_FILENO);
+  capture.cwd = open(".", O_RDONLY);
+
+  // Interrupt poll rather than restarting it
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Only attribute writes change the ctime validating cached tags
+  if (tagStoreDefault()->attribute) tagCacheEnable(CACHE_ENTRIES);
+
+  for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+    memset(clients + i, 0, sizeof(*clients));
+    clients[i].fd = -1;
+  }
+
+  while (!stopping) {
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+      fds[i + 1].revents = 0;
+    }
+
+    if (poll(fds, SERVER_MAX_CLIENTS + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      reportError("%s: %s\n", socketPath, strerror(errno));
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      int slot = 0;
+      while (slot < SERVER_MAX_CLIENTS && clients[slot].fd >= 0) slot++;
+      if (fd >= 0 && slot == SERVER_MAX_CLIENTS) {
+        close(fd);
+      } else if (fd >= 0) {
+        clients[slot].fd = fd;
+      }
+    }
+
+    for (int i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+      if (clients[i].fd >= 0 && fds[i + 1].fd == clients[i].fd &&
+          (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        serveClient(&capture, clients + i);
+    }
+  }
+
+  // Cleanup
+  for (int i = 0; i < SERVER_MAX_CLIENTS; ++i)
+    if (clients[i].fd >= 0) closeClient(clients + i);
+  close(listener);
+  unlink(socketPath);
+  tagCacheDisable();
+  fclose(out);
+  fclose(err);
+  close(capture.savedOut);
+  close(capture.savedErr);
+  close(capture.cwd);
+
+  return journalClose() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int tagServerActive(void) { return serving; }
+
+int tagClientConnect(const char *socketPath) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int fd;
+
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+int tagClientSend(int fd, const char *cwd, int argc, char *const argv[]) {
+  Buffer frame = {0};
+  int status;
+
+  bufferAppend32(&frame, 0);
+  bufferAppend(&frame, cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; ++i)
+    bufferAppend(&frame, argv[i], strlen(argv[i]) + 1);
+
+  if (frame.length - 4 > SERVER_MAX_FRAME) {
+    free(frame.data);
+    errno = E2BIG;
+    return -1;
+  }
+
+  uint32_t length = frame.length - 4;
+  unsigned char *head = (unsigned char *)frame.data;
+  head[0] = length >> 24;
+  head[1] = length >> 16;
+  head[2] = length >> 8;
+  head[3] = length;
+
+  status = writeAll(fd, frame.data, frame.length);
+  free(frame.data);
+
+  return status;
+}
+
+int tagClientReceive(int fd, TagReply *reply) {
+  unsigned char head[4];
+  uint32_t length;
+
+  memset(reply, 0, sizeof(*reply));
+
+  if (readAll(fd, head, sizeof(head)) != 0) return -1;
+  length = decode32(head);
+  if (length < 8 || length > SERVER_MAX_FRAME) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  reply->frame = malloc(length);
+  if (readAll(fd, reply->frame, length) != 0) {
+    free(reply->frame);
+    reply->frame = NULL;
+    return -1;
+  }
+
+  reply->status = (int)decode32(reply->frame);
+  reply->outLength = decode32(reply->frame + 4);
+  if (reply->outLength > length - 8) {
+    free(reply->frame);
+    reply->frame = NULL;
+    errno = EPROTO;
+    return -1;
+  }
+  reply->out = reply->frame + 8;
+  reply->err = reply->out + reply->outLength;
+  reply->errLength = length - 8 - reply->outLength;
+
+  return 0;
+}
+
+int clientTags(int argc, char *const argv[], int *status) {
+  const char *socketPath = NULL;
+  char **forward = calloc(argc, sizeof(*forward));
+  int forwardCount = 0;
+  char cwd[PATH_MAX];
+  TagReply reply;
+  int fd;
+
+  // Everything but the program name and the --client option is forwarded
+  for (int i = 1; i < argc; ++i) {
+    if (!socketPath && strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (!socketPath && strncmp(argv[i], "--client=", 9) == 0) {
+      socketPath = argv[i] + 9;
+    } else {
+      if (strcmp(argv[i], "--") == 0 && !socketPath) break;
+      forward[forwardCount++] = argv[i];
+    }
+  }
+
+  if (!socketPath) {
+    free(forward);
+    return 0;
+  }
+
+  *status = EXIT_FAILURE;
+  if (!getcwd(cwd, sizeof(cwd))) {
+    reportError("%s: %s\n", ".", strerror(errno));
+  } else if ((fd = tagClientConnect(socketPath)) < 0) {
+    reportError("%s: %s\n", socketPath, strerror(errno));
+  } else {
+    if (tagClientSend(fd, cwd, forwardCount, forward) != 0 ||
+        tagClientReceive(fd, &reply) != 0) {
+      reportError("%s: %s\n", socketPath, strerror(errno));
+    } else {
+      fwrite(reply.out, 1, reply.outLength, stdout);
+      fwrite(reply.err, 1, reply.errLength, stderr);
+      *status = reply.status;
+      free(reply.frame);
+    }
+    close(fd);
+  }
+
+  free(forward);
+  return 1;
+}
@@ -0,0 +1,100 @@
+//
+// server.h
+// Tag
+//
+
+#ifndef TAG_SERVER_H
+#define TAG_SERVER_H
+
+#include "usertag.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Largest request or reply frame accepted
+#define SERVER_MAX_FRAME    (16 << 20)
+
+// Connections served at once
+#define SERVER_MAX_CLIENTS  64
+
+/**
+ * @typedef Reply to a forwarded invocation
+ * @field status Exit status of the invocation
+ * @field out Standard output of the invocation
+ * @field outLength Length of the standard output
+ * @field err Standard error of the invocation
+ * @field errLength Length of the standard error
+ * @field frame Frame holding out and err, released with free
+ * @note Frames are a 32 bit big endian payload length followed by the
+ * payload. A request payload is the working directory followed by the
+ * arguments, each terminated by NUL. A reply payload is the 32 bit big endian
+ * exit status and standard output length, the standard output, then the
+ * standard error. Requests may be pipelined, replies come back in order.
+ */
+typedef struct TagReply {
+  int status;
+  const char *out;
+  size_t outLength;
+  const char *err;
+  size_t errLength;
+  char *frame;
+} TagReply;
+
+/**
+ * @brief Serve list, match, add, remove and set invocations on a Unix socket
+ * @param socketPath Socket to create, only accessible by the current user
+ * @param journalPath Journal recording the changes made through the server,
+ * may be NULL
+ * @return EXIT_SUCCESS once interrupted, or EXIT_FAILURE if the socket
+ * could not be created
+ * @note Requests are served one at a time, in the order they arrive on each
+ * connection. Decoded tags are cached across requests and revalidated by
+ * the inode status change time, for backends keeping tags in an extended
+ * attribute only. The storage backend current when serving starts is used
+ * by every request. Output that does not fit SERVER_MAX_FRAME is discarded
+ * and the request fails with an error saying so.
+ */
+int serveTags(const char *socketPath, const char *journalPath);
+
+/**
+ * @brief Test whether the current invocation is a request of a server
+ * @return Non zero while a forwarded invocation is running
+ */
+int tagServerActive(void);
+
+/**
+ * @brief Forward the invocation to a server if it names one with --client
+ * @param argc Number of arguments, including the program name
+ * @param argv Arguments, everything but the program name and the --client
+ * option is forwarded
+ * @param status Receives the exit status of the forwarded invocation, or
+ * EXIT_FAILURE if the server is unreachable
+ * @return Non zero if the invocation was forwarded
+ */
+int clientTags(int argc, char *const argv[], int *status);
+
+/**
+ * @brief Connect to a server
+ * @param socketPath Server socket
+ * @return Connected socket, or -1 with errno set
+ */
+int tagClientConnect(const char *socketPath);
+
+/**
+ * @brief Send an invocation without waiting for its reply
+ * @param fd Connected socket
+ * @param cwd Working directory of the relative paths
+ * @param argc Number of arguments
+ * @param argv Arguments, without the program name
+ * @return 0 on success, or -1 with errno set
+ */
+int tagClientSend(int fd, const char *cwd, int argc, char *const argv[]);
+
+/**
+ * @brief Wait for the reply to the oldest unanswered invocation
+ * @param fd Connected socket
+ * @param reply Receives the reply, release reply->frame with free
+ * @return 0 on success, or -1 with errno set
+ */
+int tagClientReceive(int fd, TagReply *reply);
+
+#endif  // TAG_SERVER_H
@@ -0,0 +1,548 @@
+//
+// shard.c
+// Tag
+//
+
+#include "shard.h"
+
+#include "probes.h"
+#include "trie.h"
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Header line starting a count table
+#define COUNT_HEADER    "# files="
+
+// Prefix of the lines continuing a garrulous record
+#define CONTINUATION    "    "
+
+// Bytes of records a worker holds before sorting them into a spilled run
+#define SHARD_RUN_BYTES (8 << 20)
+
+// Runs merged at once, each holds a file open
+#define SHARD_FANIN     64
+
+/**
+ * @typedef Output records of a single worker
+ * @field stream Memory stream the records are printed to
+ * @field data Buffer of the stream once it is closed
+ * @field size Size of the buffer
+ * @field offsets Start of every record in the buffer
+ */
+typedef struct ShardOutput {
+  FILE *stream;
+  char *data;
+  size_t size;
+  size_t *offsets;
+  size_t count;
+  size_t capacity;
+} ShardOutput;
+
+/**
+ * @typedef Sorted run of records in the spill file
+ */
+typedef struct ShardRun {
+  off_t offset;
+  off_t length;
+} ShardRun;
+
+/**
+ * @typedef Walk context shared by the slice workers
+ * @field spill Temporary file the runs are appended to, created by the
+ * first spill
+ * @field spillPath Path of the spill file, reopened by every merged run
+ * @field failed Set when a run could not be written
+ * @note The spill members are under lock.
+ */
+typedef struct ShardContext {
+  OperationMode operationMode;
+  TagTrie *query;
+  OutputFlags outputFlags;
+  ShardOutput outputs[WALK_MAX_JOBS];
+  pthread_mutex_t lock;
+  FILE *spill;
+  char spillPath[PATH_MAX];
+  ShardRun *runs;
+  size_t runCount;
+  size_t runCapacity;
+  int failed;
+} ShardContext;
+
+/**
+ * @typedef Record of an output
+ */
+typedef struct ShardRecord {
+  const char *data;
+  size_t length;
+} ShardRecord;
+
+/**
+ * @typedef Input of a merge, holding its current record and the line read
+ * ahead to find the end of that record
+ * @field remaining Bytes left of a run, -1 for an input read to its end
+ */
+typedef struct MergeInput {
+  FILE *file;
+  const char *path;
+  off_t remaining;
+  char *record;
+  size_t recordLength;
+  size_t recordCapacity;
+  char *line;
+  size_t lineCapacity;
+  ssize_t lineLength;
+} MergeInput;
+
+static int recordCompare(const char *a, size_t aLength, const char *b,
+                         size_t bLength) {
+  int result = memcmp(a, b, aLength < bLength ? aLength : bLength);
+  if (result) return result;
+  return (aLength > bLength) - (aLength < bLength);
+}
+
+static int shardRecordCompare(const void *a, const void *b) {
+  const ShardRecord *ra = a, *rb = b;
+  return recordCompare(ra->data, ra->length, rb->data, rb->length);
+}
+
+// Sort the records of a buffer, which must be closed
+static ShardRecord *sortRecords(ShardOutput *output) {
+  ShardRecord *records =
+    calloc(output->count ? output->count : 1, sizeof(*records));
+
+  for (size_t j = 0; j < output->count; ++j) {
+    size_t end = j + 1 < output->count ? output->offsets[j + 1] : output->size;
+    records[j].data = output->data + output->offsets[j];
+    records[j].length = end - output->offsets[j];
+  }
+  qsort(records, output->count, sizeof(*records), shardRecordCompare);
+
+  return records;
+}
+
+// Create the spill file, under lock
+static int openSpill(ShardContext *ctx) {
+  const char *directory = getenv("TMPDIR");
+  int fd;
+
+  if (!directory || !*directory) directory = "/tmp";
+  snprintf(ctx->spillPath, sizeof(ctx->spillPath), "%s/%s.XXXXXX", directory,
+           PROGRAM_NAME);
+  if ((fd = mkstemp(ctx->spillPath)) < 0) return -1;
+  if (!(ctx->spill = fdopen(fd, "w+"))) {
+    close(fd);
+    unlink(ctx->spillPath);
+    return -1;
+  }
+  return 0;
+}
+
+// Sort the records a worker holds and append them to the spill file as a
+// run, emptying the worker's buffer
+static void spillRun(ShardContext *ctx, ShardOutput *output) {
+  fclose(output->stream);
+  ShardRecord *records = sortRecords(output);
+
+  pthread_mutex_lock(&ctx->lock);
+  if (!ctx->failed && (ctx->spill || openSpill(ctx) == 0) &&
+      fseeko(ctx->spill, 0, SEEK_END) == 0) {
+    off_t offset = ftello(ctx->spill);
+    for (size_t i = 0; i < output->count; ++i)
+      fwrite(records[i].data, 1, records[i].length, ctx->spill);
+    if (fflush(ctx->spill) == 0) {
+      if (ctx->runCount == ctx->runCapacity) {
+        ctx->runCapacity = ctx->runCapacity ? ctx->runCapacity * 2 : 64;
+        ctx->runs = realloc(ctx->runs, sizeof(*ctx->runs) * ctx->runCapacity);
+      }
+      ctx->runs[ctx->runCount].offset = offset;
+      ctx->runs[ctx->runCount++].length = ftello(ctx->spill) - offset;
+    } else {
+      ctx->failed = errno;
+    }
+  } else if (!ctx->failed) {
+    ctx->failed = errno ? errno : EIO;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  free(records);
+  free(output->data);
+  output->data = NULL;
+  output->count = 0;
+  output->stream = open_memstream(&output->data, &output->size);
+}
+
+// Print the entry to its worker's stream when it is listed or matched
+static TagWalkResult shardVisit(const TagWalkEntry *entry, void *context) {
+  ShardContext *ctx = context;
+  ShardOutput *output = ctx->outputs + entry->worker;
+  UserTag *existingTags;
+  int existingTagsCount;
+
+  existingTags = tagWalkEntryTags(entry, &existingTagsCount);
+
+  int matched = ctx->operationMode == OperationModeList ||
+                tagsMatch(ctx->query, existingTags, existingTagsCount);
+  if (ctx->operationMode == OperationModeMatch)
+    TAG_PROBE3(match, entry->path, matched, existingTagsCount);
+
+  if (matched) {
+    if (output->count == output->capacity) {
+      output->capacity = output->capacity ? output->capacity * 2 : 1024;
+      output->offsets =
+        realloc(output->offsets, sizeof(*output->offsets) * output->capacity);
+    }
+    output->offsets[output->count++] = (size_t)ftell(output->stream);
+    fprintPath(output->stream, (char *)entry->path, existingTags,
+               existingTagsCount, ctx->outputFlags);
+    if (ftell(output->stream) >= SHARD_RUN_BYTES) spillRun(ctx, output);
+  }
+
+  freeUserTags(existingTags, existingTagsCount);
+
+  return TagWalkContinue;
+}
+
+// Read the line after the current record, 0 at the end of the input
+static int mergeReadLine(MergeInput *input, int delimiter) {
+  if (!input->remaining) {
+    input->lineLength = 0;
+    return 0;
+  }
+  input->lineLength =
+    getdelim(&input->line, &input->lineCapacity, delimiter, input->file);
+  if (input->lineLength > 0 && input->remaining > 0)
+    input->remaining -= input->lineLength;
+  return input->lineLength > 0;
+}
+
+// Advance to the next record, 0 at the end of the input
+static int mergeNext(MergeInput *input, int delimiter) {
+  if (input->lineLength <= 0) return 0;
+
+  input->recordLength = 0;
+  do {
+    size_t length = (size_t)input->lineLength;
+    if (input->recordLength + length > input->recordCapacity) {
+      input->recordCapacity = (input->recordLength + length) * 2;
+      input->record = realloc(input->record, input->recordCapacity);
+    }
+    memcpy(input->record + input->recordLength, input->line, length);
+    input->recordLength += length;
+  } while (mergeReadLine(input, delimiter) &&
+           strncmp(input->line, CONTINUATION, strlen(CONTINUATION)) == 0);
+
+  return 1;
+}
+
+static int mergeLess(MergeInput *a, MergeInput *b) {
+  return recordCompare(a->record, a->recordLength, b->record,
+                       b->recordLength) < 0;
+}
+
+// Restore the heap order below a slot
+static void heapDown(MergeInput **heap, int count, int slot) {
+  for (;;) {
+    int least = slot, left = slot * 2 + 1, right = left + 1;
+    if (left < count && mergeLess(heap[left], heap[least])) least = left;
+    if (right < count && mergeLess(heap[right], heap[least])) least = right;
+    if (least == slot) return;
+    MergeInput *swap = heap[slot];
+    heap[slot] = heap[least];
+    heap[least] = swap;
+    slot = least;
+  }
+}
+
+// K-way merge of sorted record streams whose first line is read, returning
+// the number of bytes written
+static size_t mergeInputs(MergeInput *inputs, int inputCount, int delimiter,
+                          FILE *out) {
+  MergeInput **heap = calloc(inputCount ? inputCount : 1, sizeof(*heap));
+  int heapCount = 0;
+  size_t written = 0;
+
+  for (int i = 0; i < inputCount; ++i)
+    if (inputs[i].file && mergeNext(inputs + i, delimiter))
+      heap[heapCount++] = inputs + i;
+  for (int i = heapCount / 2 - 1; i >= 0; --i) heapDown(heap, heapCount, i);
+
+  while (heapCount) {
+    MergeInput *input = heap[0];
+    written += fwrite(input->record, 1, input->recordLength, out);
+    if (!mergeNext(input, delimiter)) heap[0] = heap[--heapCount];
+    heapDown(heap, heapCount, 0);
+  }
+
+  free(heap);
+  return written;
+}
+
+// Merge a group of spilled runs into a stream
+static int mergeRunGroup(ShardContext *ctx, const ShardRun *runs, size_t count,
+                         int delimiter, FILE *out, size_t *written) {
+  MergeInput *inputs = calloc(count, sizeof(*inputs));
+  int status = 0;
+
+  for (size_t i = 0; i < count && !status; ++i) {
+    inputs[i].path = ctx->spillPath;
+    inputs[i].remaining = runs[i].length;
+    if (!(inputs[i].file = fopen(ctx->spillPath, "r")) ||
+        fseeko(inputs[i].file, runs[i].offset, SEEK_SET) != 0) {
+      status = -1;
+      break;
+    }
+    mergeReadLine(inputs + i, delimiter);
+  }
+  if (!status) *written += mergeInputs(inputs, (int)count, delimiter, out);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (inputs[i].file) fclose(inputs[i].file);
+    free(inputs[i].record);
+    free(inputs[i].line);
+  }
+  free(inputs);
+
+  return status;
+}
+
+// Merge the spilled runs to standard output, first merging groups of
+// SHARD_FANIN runs into longer runs while there are more
+static int mergeRuns(ShardContext *ctx, int delimiter, size_t *written) {
+  while (ctx->runCount > SHARD_FANIN) {
+    size_t merged = 0, scratch = 0;
+
+    for (size_t start = 0; start < ctx->runCount; start += SHARD_FANIN) {
+      size_t count = ctx->runCount - start < SHARD_FANIN
+                       ? ctx->runCount - start
+                       : SHARD_FANIN;
+      if (fseeko(ctx->spill, 0, SEEK_END) != 0) return -1;
+      off_t offset = ftello(ctx->spill);
+      if (mergeRunGroup(ctx, ctx->runs + start, count, delimiter, ctx->spill,
+                        &scratch) != 0 ||
+          fflush(ctx->spill) != 0)
+        return -1;
+      ctx->runs[merged].offset = offset;
+      ctx->runs[merged++].length = ftello(ctx->spill) - offset;
+    }
+    ctx->runCount = merged;
+  }
+
+  return mergeRunGroup(ctx, ctx->runs, ctx->runCount, delimiter, stdout,
+                       written);
+}
+
+int shardTags(char *const *paths, int pathCount, OperationMode operationMode,
+              UserTag *userTags, int tagCount, OutputFlags outputFlags,
+              int jobs) {
+  ShardContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags,
+                      .visit = shardVisit,
+                      .context = ctx,
+                      .prefetch = 1};
+  char **roots = NULL;
+  int rootCount = 0;
+  int delimiter = (outputFlags & OutputFlagsNulTerminate) ? '\0' : '\n';
+  ShardRecord *records;
+  size_t recordCount = 0;
+
+  ctx->operationMode = operationMode;
+  ctx->query = tagTrieCompile(userTags, tagCount);
+  ctx->outputFlags = outputFlags;
+
+  // Without paths the current directory contents are the roots, as printed
+  // by an unsharded list or match
+  if (pathCount < 1) {
+    struct dirent *dir;
+    DIR *_d;
+
+    if ((_d = opendir(".")) != NULL) {
+      while ((dir = readdir(_d)) != NULL) {
+        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+          continue;
+        if (*(dir->d_name) == '.' && !(outputFlags & OutputFlagsShowHidden))
+          continue;
+        roots = realloc(roots, sizeof(*roots) * (rootCount + 1));
+        roots[rootCount++] = strdup(dir->d_name);
+      }
+      closedir(_d);
+    }
+    paths = roots;
+    pathCount = rootCount;
+  }
+
+  for (int i = 0; i < WALK_MAX_JOBS; ++i)
+    ctx->outputs[i].stream =
+      open_memstream(&ctx->outputs[i].data, &ctx->outputs[i].size);
+  pthread_mutex_init(&ctx->lock, NULL);
+
+  tagWalk(&walker, paths, pathCount);
+
+  // Once a worker spilled a run, the records of every worker are spilled
+  // and the runs merged
+  if (ctx->runCount)
+    for (int i = 0; i < WALK_MAX_JOBS; ++i)
+      if (ctx->outputs[i].count) spillRun(ctx, ctx->outputs + i);
+
+  for (int i = 0; i < WALK_MAX_JOBS; ++i) {
+    fclose(ctx->outputs[i].stream);
+    recordCount += ctx->outputs[i].count;
+  }
+
+  size_t written = 0;
+  if (ctx->runCount) {
+    if (!ctx->failed && mergeRuns(ctx, delimiter, &written) != 0)
+      ctx->failed = errno ? errno : EIO;
+  } else {
+    // Gather the records of every worker and sort them
+    records = calloc(recordCount ? recordCount : 1, sizeof(*records));
+    recordCount = 0;
+    for (int i = 0; i < WALK_MAX_JOBS; ++i) {
+      ShardOutput *output = ctx->outputs + i;
+      for (size_t j = 0; j < output->count; ++j) {
+        size_t end = j + 1 < output->count ? output->offsets[j + 1]
+                                           : output->size;
+        records[recordCount].data = output->data + output->offsets[j];
+        records[recordCount++].length = end - output->offsets[j];
+      }
+    }
+    qsort(records, recordCount, sizeof(*records), shardRecordCompare);
+
+    for (size_t i = 0; i < recordCount; ++i)
+      written += fwrite(records[i].data, 1, records[i].length, stdout);
+    free(records);
+  }
+  fflush(stdout);
+  TAG_PROBE2(output__flush, STDOUT_FILENO, (long)written);
+
+  if (ctx->failed)
+    reportError("%s: %s\n", ctx->spillPath, strerror(ctx->failed));
+  int status = (walker.errors || ctx->failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+  // Cleanup
+  if (ctx->spill) {
+    fclose(ctx->spill);
+    unlink(ctx->spillPath);
+  }
+  free(ctx->runs);
+  pthread_mutex_destroy(&ctx->lock);
+  for (int i = 0; i < WALK_MAX_JOBS; ++i) {
+    free(ctx->outputs[i].data);
+    free(ctx->outputs[i].offsets);
+  }
+  tagTrieFree(ctx->query);
+  free(ctx);
+  for (int i = 0; i < rootCount; ++i) free(roots[i]);
+  free(roots);
+
+  return status;
+}
+
+
+// Sum the count tables of every input, the header line is already read
+static int mergeCountTables(MergeInput *inputs, int inputCount,
+                            CountFlags countFlags) {
+  TagCountTable table = {0};
+  int allBytes = 1;
+  int status = EXIT_SUCCESS;
+
+  for (int i = 0; i < inputCount && status == EXIT_SUCCESS; ++i) {
+    MergeInput *input = inputs + i;
+    unsigned long long files = 0, tagged = 0, bytes = 0;
+    char *field;
+
+    if (input->lineLength <= 0 ||
+        strncmp(input->line, COUNT_HEADER, strlen(COUNT_HEADER)) != 0 ||
+        sscanf(input->line, "# files=%llu tagged=%llu", &files, &tagged) != 2) {
+      reportError("%s: %s\n", input->path, "Not a count table");
+      status = EXIT_FAILURE;
+      break;
+    }
+    if ((field = strstr(input->line, " bytes=")) != NULL) {
+      bytes = strtoull(field + 7, NULL, 10);
+    } else {
+      allBytes = 0;
+    }
+    table.files += files;
+    table.tagged += tagged;
+    table.bytes += bytes;
+
+    // Rows are the file count, byte count or "-", padded color and name
+    while (mergeReadLine(input, '\n')) {
+      char bytesField[32], colorField[16];
+      int consumed = 0;
+
+      input->line[strcspn(input->line, "\n")] = '\0';
+      if (sscanf(input->line, "%llu %31s %15s%n", &files, bytesField,
+                 colorField, &consumed) != 3) {
+        reportError("%s: %s\n", input->path, "Malformed count table row");
+        status = EXIT_FAILURE;
+        break;
+      }
+      size_t colorLength = strlen(colorField);
+      char *name = input->line + consumed + 1;
+      if (colorLength < 7) name += 7 - colorLength;
+      if (name > input->line + input->lineLength) name = "";
+
+      countTableAdd(&table, name, getColorCode(colorField), files,
+                    strcmp(bytesField, "-") ? strtoull(bytesField, NULL, 10)
+                                            : 0);
+    }
+  }
+
+  if (status == EXIT_SUCCESS) {
+    // Byte totals are only meaningful if every slice counted them
+    if (allBytes) countFlags |= CountFlagsBytes;
+    countTablePrint(&table, countFlags);
+  }
+  countTableFree(&table);
+
+  return status;
+}
+
+int mergeResults(char *const *paths, int pathCount, OutputFlags outputFlags,
+                 CountFlags countFlags) {
+  int delimiter = (outputFlags & OutputFlagsNulTerminate) ? '\0' : '\n';
+  MergeInput *inputs = calloc(pathCount ? pathCount : 1, sizeof(*inputs));
+  int status = EXIT_SUCCESS;
+  int tables = 0;
+
+  for (int i = 0; i < pathCount; ++i) {
+    inputs[i].path = paths[i];
+    inputs[i].remaining = -1;
+    inputs[i].file = strcmp(paths[i], "-") == 0 ? stdin : fopen(paths[i], "r");
+    if (!inputs[i].file) {
+      reportError("%s: %s\n", paths[i], strerror(errno));
+      status = EXIT_FAILURE;
+      continue;
+    }
+    if (mergeReadLine(&inputs[i], delimiter) &&
+        strncmp(inputs[i].line, COUNT_HEADER, strlen(COUNT_HEADER)) == 0)
+      tables++;
+  }
+
+  if (status != EXIT_SUCCESS) {
+    // Nothing is printed unless every slice is available
+  } else if (tables) {
+    status = mergeCountTables(inputs, pathCount, countFlags);
+  } else {
+    mergeInputs(inputs, pathCount, delimiter, stdout);
+  }
+
+  // Cleanup
+  for (int i = 0; i < pathCount; ++i) {
+    if (inputs[i].file && inputs[i].file != stdin) fclose(inputs[i].file);
+    free(inputs[i].record);
+    free(inputs[i].line);
+  }
+  free(inputs);
+
+  return status;
+}
@@ -0,0 +1,46 @@
+//
+// shard.h
+// Tag
+//
+
+#ifndef TAG_SHARD_H
+#define TAG_SHARD_H
+
+#include "count.h"
+#include "usertag.h"
+
+/**
+ * @brief List or match the paths of the slice selected with tagWalkSetShard
+ * @param paths Paths to process, the current directory contents if none
+ * @param pathCount Number of paths
+ * @param operationMode OperationModeList or OperationModeMatch
+ * @param userTags Tags to match
+ * @param tagCount Number of tags to match
+ * @param outputFlags Output and enumeration options
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if directories could not be read
+ * @note The output records are sorted by their bytes so the outputs of all
+ * slices can be combined with mergeResults. Each worker sorts the records
+ * it holds into a run in a temporary file once they reach 8 MiB, and the
+ * runs are merged, so memory does not grow with the output.
+ */
+int shardTags(char *const *paths, int pathCount, OperationMode operationMode,
+              UserTag *userTags, int tagCount, OutputFlags outputFlags,
+              int jobs);
+
+/**
+ * @brief Combine the outputs of sharded scans
+ * @param paths Output files of the slices, "-" reads standard input
+ * @param pathCount Number of files
+ * @param outputFlags OutputFlagsNulTerminate when records end with NUL
+ * @param countFlags Output options of merged count tables
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if an input is unreadable or
+ * malformed
+ * @note Count tables are summed. Sorted list or match outputs are merged
+ * into one sorted stream, a line starting with four spaces belongs to the
+ * record before it. Index files built by --build-index are not merged.
+ */
+int mergeResults(char *const *paths, int pathCount, OutputFlags outputFlags,
+                 CountFlags countFlags);
+
+#endif  // TAG_SHARD_H
@@ -0,0 +1,542 @@
+//
+// since.c
+// Tag
+//
+
+#include "since.h"
+
+#include "hash.h"
+#include "memo.h"
+#include "probes.h"
+#include "store.h"
+#include "trie.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @typedef Records of a scan with their names, and the entries of each
+ * directory of a loaded scan
+ * @field names NUL terminated names, indexed by nameOffsets
+ * @field children Indexes of the records of every directory's entries, those
+ * of record i start at childOffsets[i] and are in name order
+ */
+typedef struct SinceScan {
+  SinceHeader header;
+  SinceRecord *records;
+  size_t count;
+  size_t capacity;
+  char *names;
+  size_t *nameOffsets;
+  size_t namesLength;
+  size_t namesCapacity;
+  int32_t *children;
+  size_t *childOffsets;
+  uint32_t *childCounts;
+} SinceScan;
+
+/**
+ * @typedef State of an incremental scan
+ * @field query Tags of a match compiled once for every entry
+ * @field previous Scan loaded from the state file
+ * @field current Scan being recorded
+ * @field trustCtime Tag changes show in the status change time
+ */
+typedef struct SinceContext {
+  OperationMode operationMode;
+  TagTrie *query;
+  OutputFlags outputFlags;
+  SinceScan previous;
+  SinceScan current;
+  int trustCtime;
+  unsigned long errors;
+} SinceContext;
+
+/**
+ * @typedef Entry of a directory being compared to its previous entries
+ */
+typedef struct SinceName {
+  const char *name;
+  int32_t previous;
+} SinceName;
+
+static int64_t timespecNanoseconds(struct timespec ts) {
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *recordName(const SinceScan *scan, size_t index) {
+  return scan->names + scan->nameOffsets[index];
+}
+
+// Identify the scan so a state file is only continued by the same one
+static uint64_t scanIdentifier(OperationMode operationMode, UserTag *userTags,
+                               int tagCount, OutputFlags outputFlags) {
+  int flags = outputFlags & (OutputFlagsShowHidden |
+                             OutputFlagsRecurseDirectory);
+  uint64_t scan = memoOperation(operationMode, userTags, tagCount);
+
+  return tagHash64(&flags, sizeof(flags), scan);
+}
+
+// Hash of a tag set independent of the order of its tags
+static uint64_t tagSetHash(UserTag *tags, int count) {
+  uint64_t hash = 0;
+
+  if (count) qsort(tags, count, sizeof(*tags), tagCompare);
+  for (int i = 0; i < count; ++i) {
+    int color = tags[i].color;
+    hash = tagHashString(tags[i].name, hash);
+    hash = tagHash64(&color, sizeof(color), hash);
+  }
+  return hash;
+}
+
+// Append a record to a scan, returning its index
+static int32_t scanAppend(SinceScan *scan, const SinceRecord *record,
+                          const char *name) {
+  size_t nameLength = strlen(name);
+
+  if (scan->count == scan->capacity) {
+    scan->capacity = scan->capacity ? scan->capacity * 2 : 1024;
+    scan->records =
+      realloc(scan->records, sizeof(*scan->records) * scan->capacity);
+    scan->nameOffsets =
+      realloc(scan->nameOffsets, sizeof(*scan->nameOffsets) * scan->capacity);
+  }
+  if (scan->namesLength + nameLength + 1 > scan->namesCapacity) {
+    scan->namesCapacity = (scan->namesLength + nameLength + 1) * 2;
+    scan->names = realloc(scan->names, scan->namesCapacity);
+  }
+
+  scan->records[scan->count] = *record;
+  scan->records[scan->count].nameLength =
+    nameLength > UINT16_MAX ? UINT16_MAX : (uint16_t)nameLength;
+  scan->nameOffsets[scan->count] = scan->namesLength;
+  memcpy(scan->names + scan->namesLength, name, nameLength + 1);
+  scan->namesLength += nameLength + 1;
+
+  return (int32_t)scan->count++;
+}
+
+static void scanFree(SinceScan *scan) {
+  free(scan->records);
+  free(scan->names);
+  free(scan->nameOffsets);
+  free(scan->children);
+  free(scan->childOffsets);
+  free(scan->childCounts);
+}
+
+// Load the previous scan, an empty scan if the state file does not exist
+static int scanLoad(const char *path, uint64_t identifier, SinceScan *scan) {
+  FILE *file;
+  SinceRecord record;
+  char name[UINT16_MAX + 1];
+
+  if ((file = fopen(path, "r")) == NULL) {
+    if (errno == ENOENT) return 0;
+    reportError("%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (fread(&scan->header, sizeof(scan->header), 1, file) != 1 ||
+      memcmp(scan->header.magic, SINCE_MAGIC, sizeof(scan->header.magic)) !=
+        0) {
+    reportError("%s: %s\n", path, "Not a tag scan state");
+    fclose(file);
+    return -1;
+  }
+  if (scan->header.scan != identifier) {
+    reportError("%s: %s\n", path, "State of a different scan");
+    fclose(file);
+    return -1;
+  }
+
+  for (uint64_t i = 0; i < scan->header.count; ++i) {
+    if (fread(&record, sizeof(record), 1, file) != 1 ||
+        fread(name, 1, record.nameLength, file) != record.nameLength ||
+        record.parent >= (int32_t)i) {
+      reportError("%s: %s\n", path, "Truncated tag scan state");
+      fclose(file);
+      return -1;
+    }
+    name[record.nameLength] = '\0';
+    scanAppend(scan, &record, name);
+  }
+  fclose(file);
+
+  // Index the entries of every directory, records of the same parent are
+  // already in name order
+  scan->childOffsets = calloc(scan->count + 1, sizeof(*scan->childOffsets));
+  scan->childCounts = calloc(scan->count + 1, sizeof(*scan->childCounts));
+  scan->children = calloc(scan->count + 1, sizeof(*scan->children));
+  for (size_t i = 0; i < scan->count; ++i)
+    if (scan->records[i].parent >= 0)
+      scan->childCounts[scan->records[i].parent]++;
+  for (size_t i = 1; i <= scan->count; ++i)
+    scan->childOffsets[i] = scan->childOffsets[i - 1] + scan->childCounts[i - 1];
+  memset(scan->childCounts, 0, sizeof(*scan->childCounts) * (scan->count + 1));
+  for (size_t i = 0; i < scan->count; ++i) {
+    int32_t parent = scan->records[i].parent;
+    if (parent >= 0)
+      scan->children[scan->childOffsets[parent] +
+                     scan->childCounts[parent]++] = (int32_t)i;
+  }
+
+  return 0;
+}
+
+// Replace the state file, written aside and renamed over the old one
+static int scanSave(const char *path, SinceScan *scan) {
+  char temporary[PATH_MAX];
+  FILE *file;
+  int status = 0;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((file = fopen(temporary, "w")) == NULL) return -1;
+
+  scan->header.count = scan->count;
+  if (fwrite(&scan->header, sizeof(scan->header), 1, file) != 1) status = -1;
+  for (size_t i = 0; i < scan->count && status == 0; ++i) {
+    if (fwrite(scan->records + i, sizeof(*scan->records), 1, file) != 1 ||
+        fwrite(recordName(scan, i), 1, scan->records[i].nameLength, file) !=
+          scan->records[i].nameLength)
+      status = -1;
+  }
+
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) status = -1;
+  if (fclose(file) != 0) status = -1;
+  if (status == 0 && rename(temporary, path) != 0) status = -1;
+  if (status != 0) unlink(temporary);
+
+  return status;
+}
+
+static void printChange(char change, const char *path, UserTag *tags,
+                        int count, OutputFlags outputFlags) {
+  fputc(change, stdout);
+  fputc(' ', stdout);
+  fprintPath(stdout, (char *)path, tags, count, outputFlags);
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Print a previous entry and everything beneath it as removed
+static void printRemoved(SinceContext *ctx, const char *path, int32_t index) {
+  SinceScan *previous = &ctx->previous;
+
+  if (previous->records[index].member)
+    printChange('-', path, NULL, 0, ctx->outputFlags);
+
+  for (uint32_t i = 0; i < previous->childCounts[index]; ++i) {
+    int32_t child = previous->children[previous->childOffsets[index] + i];
+    char _p[PATH_MAX];
+
+    if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 recordName(previous, child)) < (int)sizeof(_p))
+      printRemoved(ctx, _p, child);
+  }
+}
+
+static void scanDirectory(SinceContext *ctx, const char *path, int32_t index,
+                          int32_t previousIndex);
+
+// Compare an entry to its previous record, print its change and record it
+static void scanEntry(SinceContext *ctx, const char *path, const char *name,
+                      int32_t parent, int32_t previousIndex,
+                      const struct stat *st) {
+  SinceRecord *previous =
+    previousIndex >= 0 ? ctx->previous.records + previousIndex : NULL;
+  SinceRecord record = {.parent = parent,
+                        .ctime = timespecNanoseconds(STAT_CTIME(st)),
+                        .mtime = timespecNanoseconds(STAT_MTIME(st))};
+
+  if (S_ISDIR(st->st_mode)) {
+    record.type = DT_DIR;
+  } else if (S_ISLNK(st->st_mode)) {
+    record.type = DT_LNK;
+  } else {
+    record.type = DT_REG;
+  }
+
+  if (previous && ctx->trustCtime && previous->ctime == record.ctime &&
+      record.ctime < ctx->previous.header.watermark) {
+    // Unchanged since the previous scan, its tags are not read
+    record.member = previous->member;
+    record.tags = previous->tags;
+  } else {
+    UserTag *existingTags;
+    int existingTagsCount;
+
+    existingTags = createUserTagsFromPath((char *)path, &existingTagsCount);
+    record.member = ctx->operationMode == OperationModeList ||
+                    tagsMatch(ctx->query, existingTags, existingTagsCount);
+    if (ctx->operationMode == OperationModeMatch)
+      TAG_PROBE3(match, path, record.member, existingTagsCount);
+    record.tags = tagSetHash(existingTags, existingTagsCount);
+
+    if (record.member && (!previous || !previous->member)) {
+      printChange('+', path, existingTags, existingTagsCount,
+                  ctx->outputFlags);
+    } else if (record.member && record.tags != previous->tags) {
+      printChange('~', path, existingTags, existingTagsCount,
+                  ctx->outputFlags);
+    } else if (!record.member && previous && previous->member) {
+      printChange('-', path, existingTags, existingTagsCount,
+                  ctx->outputFlags);
+    }
+
+    freeUserTags(existingTags, existingTagsCount);
+  }
+
+  int32_t index = scanAppend(&ctx->current, &record, name);
+
+  if (record.type == DT_DIR &&
+      (ctx->outputFlags & OutputFlagsRecurseDirectory)) {
+    // The entries of a directory that was not a directory before are new
+    scanDirectory(ctx, path, index,
+                  previous && previous->type == DT_DIR ? previousIndex : -1);
+  } else if (previous && previous->type == DT_DIR) {
+    // A directory replaced by another kind of entry
+    for (uint32_t i = 0; i < ctx->previous.childCounts[previousIndex]; ++i) {
+      int32_t child =
+        ctx->previous.children[ctx->previous.childOffsets[previousIndex] + i];
+      char _p[PATH_MAX];
+      if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                   recordName(&ctx->previous, child)) < (int)sizeof(_p))
+        printRemoved(ctx, _p, child);
+    }
+  }
+}
+
+static int nameCompare(const void *a, const void *b) {
+  return strcmp(((const SinceName *)a)->name, ((const SinceName *)b)->name);
+}
+
+// Compare the entries of a directory to its previous entries
+static void scanDirectory(SinceContext *ctx, const char *path, int32_t index,
+                          int32_t previousIndex) {
+  SinceScan *previous = &ctx->previous;
+  SinceRecord *record = ctx->current.records + index;
+  SinceName *names = NULL;
+  size_t count = 0;
+  int32_t *previousChildren = NULL;
+  uint32_t previousCount = 0;
+  DIR *pDir = NULL;
+
+  if (previousIndex >= 0) {
+    previousChildren = previous->children + previous->childOffsets[previousIndex];
+    previousCount = previous->childCounts[previousIndex];
+  }
+
+  if (previousIndex >= 0 &&
+      previous->records[previousIndex].mtime == record->mtime &&
+      record->mtime < previous->header.watermark) {
+    // No entry was added or removed, the directory is not read again
+    names = calloc(previousCount ? previousCount : 1, sizeof(*names));
+    for (uint32_t i = 0; i < previousCount; ++i)
+      names[count++] = (SinceName){.name = recordName(previous,
+                                                      previousChildren[i]),
+                                   .previous = previousChildren[i]};
+  } else {
+    struct dirent *dir;
+    size_t capacity = 0;
+
+    pDir = opendir(path);
+    TAG_PROBE2(dir__open, path, pDir != NULL);
+    if (pDir == NULL) {
+      reportError("%s: %s\n", path, strerror(errno));
+      ctx->errors++;
+      return;
+    }
+
+    while ((dir = readdir(pDir)) != NULL) {
+      // Ignore current and parent dir entries
+      if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+        continue;
+
+      // Ignore dot paths if the show hidden flag is not set
+      if (*(dir->d_name) == '.' &&
+          !(ctx->outputFlags & OutputFlagsShowHidden))
+        continue;
+
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        names = realloc(names, sizeof(*names) * capacity);
+      }
+      names[count++] = (SinceName){.name = strdup(dir->d_name),
+                                   .previous = -1};
+    }
+    qsort(names, count, sizeof(*names), nameCompare);
+
+    // Pair the entries with the previous ones, both in name order
+    uint32_t j = 0;
+    for (size_t i = 0; i < count; ++i) {
+      int result = -1;
+      while (j < previousCount &&
+             (result = strcmp(recordName(previous, previousChildren[j]),
+                              names[i].name)) < 0)
+        j++;
+      if (j < previousCount && result == 0)
+        names[i].previous = previousChildren[j++];
+    }
+  }
+
+  // Walk the union of both in name order, previous entries left unpaired
+  // were removed
+  uint32_t j = 0;
+  for (size_t i = 0; i <= count; ++i) {
+    const char *limit = i < count ? names[i].name : NULL;
+    char _p[PATH_MAX];
+    struct stat st;
+
+    while (j < previousCount &&
+           (!limit || strcmp(recordName(previous, previousChildren[j]),
+                             limit) < 0)) {
+      if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                   recordName(previous, previousChildren[j])) <
+          (int)sizeof(_p))
+        printRemoved(ctx, _p, previousChildren[j]);
+      j++;
+    }
+    if (i == count) break;
+    if (j < previousCount && names[i].previous == previousChildren[j]) j++;
+
+    // Combine the parent path and entry name, skipping truncated paths
+    if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 names[i].name) >= (int)sizeof(_p))
+      continue;
+
+    if (lstat(_p, &st) != 0) {
+      // Removed while the directory was being read
+      if (names[i].previous >= 0) printRemoved(ctx, _p, names[i].previous);
+      continue;
+    }
+    scanEntry(ctx, _p, names[i].name, index, names[i].previous, &st);
+  }
+
+  if (pDir) {
+    // The names were copied from the directory stream
+    for (size_t i = 0; i < count; ++i) free((char *)names[i].name);
+    closedir(pDir);
+  }
+  free(names);
+}
+#pragma clang diagnostic pop
+
+int sinceTags(char *const *paths, int pathCount, OperationMode operationMode,
+              UserTag *userTags, int tagCount, OutputFlags outputFlags,
+              const char *statePath) {
+  SinceContext *ctx = calloc(1, sizeof(*ctx));
+  char **roots = NULL;
+  int rootCount = 0;
+  struct timespec start;
+  int status = EXIT_SUCCESS;
+
+  ctx->operationMode = operationMode;
+  ctx->query = tagTrieCompile(userTags, tagCount);
+  ctx->outputFlags = outputFlags;
+  ctx->trustCtime = tagStoreDefault()->attribute != NULL;
+
+  // Changes from here on are picked up by the next scan
+  clock_gettime(CLOCK_REALTIME, &start);
+  memcpy(ctx->current.header.magic, SINCE_MAGIC,
+         sizeof(ctx->current.header.magic));
+  ctx->current.header.scan =
+    scanIdentifier(operationMode, userTags, tagCount, outputFlags);
+  ctx->current.header.watermark = timespecNanoseconds(start) - SINCE_MARGIN;
+
+  if (scanLoad(statePath, ctx->current.header.scan, &ctx->previous) != 0) {
+    scanFree(&ctx->previous);
+    tagTrieFree(ctx->query);
+    free(ctx);
+    return EXIT_FAILURE;
+  }
+
+  // Without paths the current directory contents are the roots, as printed
+  // by an unsharded list or match
+  if (pathCount < 1) {
+    struct dirent *dir;
+    DIR *_d;
+
+    if ((_d = opendir(".")) != NULL) {
+      while ((dir = readdir(_d)) != NULL) {
+        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+          continue;
+        if (*(dir->d_name) == '.' && !(outputFlags & OutputFlagsShowHidden))
+          continue;
+        roots = realloc(roots, sizeof(*roots) * (rootCount + 1));
+        roots[rootCount++] = strdup(dir->d_name);
+      }
+      closedir(_d);
+    }
+    paths = roots;
+    pathCount = rootCount;
+  }
+
+  // Roots are paired with the previous roots by their path as given
+  int32_t *previousRoots = calloc(ctx->previous.count + 1, sizeof(int32_t));
+  size_t previousRootCount = 0;
+  for (size_t i = 0; i < ctx->previous.count; ++i)
+    if (ctx->previous.records[i].parent < 0)
+      previousRoots[previousRootCount++] = (int32_t)i;
+
+  for (int i = 0; i < pathCount; ++i) {
+    int32_t previousIndex = -1;
+    struct stat st;
+
+    // Skip empty path requests
+    if (!strlen(paths[i])) continue;
+
+    for (size_t j = 0; j < previousRootCount; ++j) {
+      if (previousRoots[j] >= 0 &&
+          strcmp(recordName(&ctx->previous, previousRoots[j]), paths[i]) ==
+            0) {
+        previousIndex = previousRoots[j];
+        previousRoots[j] = -1;
+        break;
+      }
+    }
+
+    if (stat(paths[i], &st) != 0) {
+      reportError("%s: %s\n", paths[i], strerror(errno));
+      ctx->errors++;
+      if (previousIndex >= 0) printRemoved(ctx, paths[i], previousIndex);
+      continue;
+    }
+    scanEntry(ctx, paths[i], paths[i], -1, previousIndex, &st);
+  }
+
+  // Roots of the previous scan that were not given again
+  for (size_t j = 0; j < previousRootCount; ++j)
+    if (previousRoots[j] >= 0)
+      printRemoved(ctx, recordName(&ctx->previous, previousRoots[j]),
+                   previousRoots[j]);
+
+  if (scanSave(statePath, &ctx->current) != 0) {
+    reportError("%s: %s\n", statePath, strerror(errno));
+    status = EXIT_FAILURE;
+  }
+  if (ctx->errors) status = EXIT_FAILURE;
+
+  // Cleanup
+  free(previousRoots);
+  scanFree(&ctx->previous);
+  scanFree(&ctx->current);
+  tagTrieFree(ctx->query);
+  free(ctx);
+  for (int i = 0; i < rootCount; ++i) free(roots[i]);
+  free(roots);
+
+  return status;
+}
@@ -0,0 +1,80 @@
+//
+// since.h
+// Tag
+//
+
+#ifndef TAG_SINCE_H
+#define TAG_SINCE_H
+
+#include "usertag.h"
+
+#include <stdint.h>
+
+// State file magic, also the version of the record layout
+#define SINCE_MAGIC     "TAGSINC1"
+
+// Nanoseconds before the start of a scan still treated as changed after it,
+// covering file systems that stamp times from a coarse clock
+#define SINCE_MARGIN    1000000000LL
+
+/**
+ * @typedef Head of a state file
+ * @field scan Identifier of the operation, argument tags and enumeration flags
+ * @field watermark Start of the scan in nanoseconds since the epoch, less
+ * SINCE_MARGIN
+ * @field count Number of records
+ */
+typedef struct SinceHeader {
+  char magic[8];
+  uint64_t scan;
+  int64_t watermark;
+  uint64_t count;
+} SinceHeader;
+
+/**
+ * @typedef Entry of a scan, followed in the state file by its name
+ * @field parent Index of the parent directory's record, -1 for a root
+ * @field type Directory entry type
+ * @field member The entry was listed or matched
+ * @field nameLength Length of the name, the path as given for a root
+ * @field ctime Status change time in nanoseconds
+ * @field mtime Modification time in nanoseconds
+ * @field tags Hash of the sorted tag set
+ * @note Records are stored depth first, each directory's entries in name
+ * order.
+ */
+typedef struct SinceRecord {
+  int32_t parent;
+  uint8_t type;
+  uint8_t member;
+  uint16_t nameLength;
+  int64_t ctime;
+  int64_t mtime;
+  uint64_t tags;
+} SinceRecord;
+
+/**
+ * @brief Print the entries listed or matched differently than in the scan
+ * recorded in a state file, and record this scan in its place
+ * @param paths Paths to scan, the contents of the current directory if none
+ * @param pathCount Number of paths
+ * @param operationMode OperationModeList or OperationModeMatch
+ * @param userTags Tags to match
+ * @param tagCount Number of tags to match
+ * @param outputFlags Output and enumeration flags
+ * @param statePath State file, a missing file prints every entry as added
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the state file is unusable or a
+ * path could not be read
+ * @note Each entry is printed after "+ " when it is new to the output, "~ "
+ * when its tags changed, and "- " when it left the output. The tags of an
+ * entry are only read if its status change time is not older than the
+ * previous scan or differs from the recorded one, and a directory is only
+ * read if its modification time changed. With a storage backend outside
+ * the extended attributes the change times say nothing about the tags,
+ * which are then always read.
+ */
+int sinceTags(char *const *paths, int pathCount, OperationMode operationMode,
+              UserTag *userTags, int tagCount, OutputFlags outputFlags,
+              const char *statePath);
+
+#endif  // TAG_SINCE_H
@@ -0,0 +1,452 @@
+//
+// store.c
+// Tag
+//
+
+#include "store.h"
+
+#include "governor.h"
+#include "hash.h"
+#include "probes.h"
+#include "usertag.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/xattr.h>
+#include <time.h>
+
+
+// Extended attribute backend
+
+// macOS takes a position and options and Linux does not, both follow
+// symbolic links
+#ifdef __APPLE__
+#define XATTR_GET(path, name, buf, size)  getxattr(path, name, buf, size, 0, 0)
+#define XATTR_SET(path, name, buf, length, flags) \
+  setxattr(path, name, buf, length, 0, flags)
+#define XATTR_REMOVE(path, name)          removexattr(path, name, 0)
+#else
+#define XATTR_GET(path, name, buf, size)  getxattr(path, name, buf, size)
+#define XATTR_SET(path, name, buf, length, flags) \
+  setxattr(path, name, buf, length, flags)
+#define XATTR_REMOVE(path, name)          removexattr(path, name)
+#endif
+
+static ssize_t xattrGet(TagStore *store, const char *path, void *buf,
+                        size_t size) {
+  return XATTR_GET(path, store->attribute, buf, size);
+}
+
+static int xattrSet(TagStore *store, const char *path, const void *buf,
+                    size_t length) {
+  return XATTR_SET(path, store->attribute, buf, length, 0);
+}
+
+static int xattrRemove(TagStore *store, const char *path) {
+  return XATTR_REMOVE(path, store->attribute);
+}
+
+static int xattrSwap(TagStore *store, const char *path, const void *expected,
+                     ssize_t expectedLength, const void *buf,
+                     ssize_t length) {
+  unsigned char current[EXT_ATTR_SIZE];
+  ssize_t currentLength;
+
+  // A blob too large to read is not the one the update was computed from
+  if ((currentLength = XATTR_GET(path, store->attribute, current,
+                                 sizeof(current))) < 0) {
+    if (errno == ERANGE) return 1;
+    if (errno != TAG_ENOATTR) return -1;
+  }
+  if (!tagBlobMatches(current, currentLength, expected, expectedLength))
+    return 1;
+
+  if (length < 0) {
+    // Removed by someone else as well
+    if (XATTR_REMOVE(path, store->attribute) != 0 && errno != TAG_ENOATTR)
+      return -1;
+  } else if (XATTR_SET(path, store->attribute, buf, length,
+                       expectedLength < 0 ? XATTR_CREATE : XATTR_REPLACE) !=
+             0) {
+    // The flags catch a blob created or removed since it was compared
+    return (errno == EEXIST || errno == TAG_ENOATTR) ? 1 : -1;
+  }
+
+  // A writer that compared before this write may have overwritten it, the
+  // caller then checks whether its change survived
+  currentLength = XATTR_GET(path, store->attribute, current, sizeof(current));
+  if (currentLength < 0 && errno != TAG_ENOATTR && errno != ERANGE) return 0;
+  return tagBlobMatches(current, currentLength, buf, length) ? 0 : 2;
+}
+
+static int xattrClose(TagStore *store) {
+  (void)store;
+  return 0;
+}
+
+static TagStore xattrStore = {.name = "xattr",
+                              .format = TagFormatPlist,
+                              .attribute = TAG_NAME,
+                              .get = xattrGet,
+                              .set = xattrSet,
+                              .remove = xattrRemove,
+                              .swap = xattrSwap,
+                              .close = xattrClose};
+
+static TagStore xdgStore = {.name = "xdg",
+                            .format = TagFormatXdg,
+                            .attribute = TAG_XDG_NAME,
+                            .get = xattrGet,
+                            .set = xattrSet,
+                            .remove = xattrRemove,
+                            .swap = xattrSwap,
+                            .close = xattrClose};
+
+// In-memory backend, a locked open addressing table of path to blob
+
+/**
+ * @typedef Blob of a path held in memory
+ */
+typedef struct MemoryEntry {
+  uint64_t hash;
+  char *path;
+  unsigned char *data;
+  size_t length;
+} MemoryEntry;
+
+/**
+ * @typedef In-memory backend state
+ */
+typedef struct MemoryState {
+  pthread_mutex_t lock;
+  MemoryEntry *entries;
+  size_t capacity;
+  size_t used;
+} MemoryState;
+
+// Find the slot of a path, or the empty slot it would be inserted at
+static MemoryEntry *memoryFind(MemoryState *state, const char *path) {
+  uint64_t hash = tagHashString(path, 0);
+  size_t i;
+
+  if (!state->capacity) return NULL;
+  for (i = hash & (state->capacity - 1); state->entries[i].path;
+       i = (i + 1) & (state->capacity - 1)) {
+    if (state->entries[i].hash == hash &&
+        strcmp(state->entries[i].path, path) == 0)
+      break;
+  }
+  return state->entries + i;
+}
+
+static ssize_t memoryGet(TagStore *store, const char *path, void *buf,
+                         size_t size) {
+  MemoryState *state = store->state;
+  ssize_t length = -1;
+
+  pthread_mutex_lock(&state->lock);
+  MemoryEntry *entry = memoryFind(state, path);
+  if (!entry || !entry->path || !entry->data) {
+    errno = TAG_ENOATTR;
+  } else if (entry->length > size) {
+    errno = ERANGE;
+  } else {
+    memcpy(buf, entry->data, entry->length);
+    length = (ssize_t)entry->length;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  return length;
+}
+
+// Store the blob of a path, the lock must be held
+static void memoryPut(MemoryState *state, const char *path, const void *buf,
+                      size_t length) {
+  // Keep the load factor below 3/4, removed entries keep their slot
+  if ((state->used + 1) * 4 > state->capacity * 3) {
+    size_t capacity = state->capacity ? state->capacity * 2 : 1024;
+    MemoryEntry *entries = calloc(capacity, sizeof(*entries));
+    for (size_t i = 0; i < state->capacity; ++i) {
+      if (!state->entries[i].path) continue;
+      size_t j = state->entries[i].hash & (capacity - 1);
+      while (entries[j].path) j = (j + 1) & (capacity - 1);
+      entries[j] = state->entries[i];
+    }
+    free(state->entries);
+    state->entries = entries;
+    state->capacity = capacity;
+  }
+
+  MemoryEntry *entry = memoryFind(state, path);
+  if (!entry->path) {
+    entry->hash = tagHashString(path, 0);
+    entry->path = strdup(path);
+    state->used++;
+  }
+  free(entry->data);
+  entry->data = malloc(length ? length : 1);
+  memcpy(entry->data, buf, length);
+  entry->length = length;
+}
+
+static int memorySet(TagStore *store, const char *path, const void *buf,
+                     size_t length) {
+  MemoryState *state = store->state;
+
+  pthread_mutex_lock(&state->lock);
+  memoryPut(state, path, buf, length);
+  pthread_mutex_unlock(&state->lock);
+
+  return 0;
+}
+
+static int memoryRemove(TagStore *store, const char *path) {
+  MemoryState *state = store->state;
+  int status = 0;
+
+  pthread_mutex_lock(&state->lock);
+  MemoryEntry *entry = memoryFind(state, path);
+  if (!entry || !entry->path || !entry->data) {
+    errno = TAG_ENOATTR;
+    status = -1;
+  } else {
+    free(entry->data);
+    entry->data = NULL;
+    entry->length = 0;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  return status;
+}
+
+static int memorySwap(TagStore *store, const char *path, const void *expected,
+                      ssize_t expectedLength, const void *buf,
+                      ssize_t length) {
+  MemoryState *state = store->state;
+  int status = 1;
+
+  pthread_mutex_lock(&state->lock);
+  MemoryEntry *entry = memoryFind(state, path);
+  int present = entry && entry->path && entry->data;
+  if (tagBlobMatches(present ? entry->data : NULL,
+                  present ? (ssize_t)entry->length : -1, expected,
+                  expectedLength)) {
+    if (length >= 0) {
+      memoryPut(state, path, buf, length);
+    } else if (present) {
+      free(entry->data);
+      entry->data = NULL;
+      entry->length = 0;
+    }
+    status = 0;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  return status;
+}
+
+static int memoryClose(TagStore *store) {
+  MemoryState *state = store->state;
+
+  for (size_t i = 0; i < state->capacity; ++i) {
+    free(state->entries[i].path);
+    free(state->entries[i].data);
+  }
+  free(state->entries);
+  pthread_mutex_destroy(&state->lock);
+  free(state);
+  free(store);
+
+  return 0;
+}
+
+static TagStore *memoryOpen(void) {
+  TagStore *store = calloc(1, sizeof(*store));
+  MemoryState *state = calloc(1, sizeof(*state));
+
+  pthread_mutex_init(&state->lock, NULL);
+  store->name = "memory";
+  store->get = memoryGet;
+  store->set = memorySet;
+  store->remove = memoryRemove;
+  store->swap = memorySwap;
+  store->close = memoryClose;
+  store->state = state;
+
+  return store;
+}
+
+// Backend selection
+
+static TagStore *defaultStore = &xattrStore;
+
+TagStore *tagStoreOpen(const char *spec) {
+  if (strcmp(spec, "xattr") == 0) return &xattrStore;
+  if (strcmp(spec, "xdg") == 0) return &xdgStore;
+  if (strcmp(spec, "memory") == 0) return memoryOpen();
+  if (strncmp(spec, "db:", 3) == 0) return tagStoreOpenDatabase(spec + 3, 0);
+  if (strncmp(spec, "db-inode:", 9) == 0)
+    return tagStoreOpenDatabase(spec + 9, 1);
+
+  reportError("%s: %s\n", spec, "Unknown tag store");
+  return NULL;
+}
+
+TagStore *tagStoreDefault(void) { return defaultStore; }
+
+int tagFormatParse(const char *name, TagFormat *format) {
+  if (strcmp(name, "plist") == 0) {
+    *format = TagFormatPlist;
+  } else if (strcmp(name, "xdg") == 0) {
+    *format = TagFormatXdg;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+TagStore *tagStoreAttribute(TagFormat format) {
+  return format == TagFormatXdg ? &xdgStore : &xattrStore;
+}
+
+void tagStoreSetDefault(TagStore *store) {
+  defaultStore = store ? store : &xattrStore;
+}
+
+int tagStoreClose(TagStore *store) {
+  // The attribute backends are never released
+  if (!store || store->attribute) return 0;
+  if (defaultStore == store) defaultStore = &xattrStore;
+  return store->close(store);
+}
+
+int tagStoreSync(void) {
+  return defaultStore->sync ? defaultStore->sync(defaultStore) : 0;
+}
+
+ssize_t tagStoreGet(const char *path, void *buf, size_t size) {
+  return tagStoreGetIn(defaultStore, path, buf, size);
+}
+
+ssize_t tagStoreGetIn(TagStore *store, const char *path, void *buf,
+                      size_t size) {
+  uint64_t start = governorAcquire();
+  TAG_PROBE1(get__start, path);
+  ssize_t length = store->get(store, path, buf, size);
+  TAG_PROBE3(get__done, path, (long)length, length < 0 ? errno : 0);
+  governorRelease(start, 1);
+  return length;
+}
+
+int tagStoreSet(const char *path, const void *buf, size_t length) {
+  uint64_t start = governorAcquire();
+  TAG_PROBE2(set__start, path, (long)length);
+  int status = defaultStore->set(defaultStore, path, buf, length);
+  TAG_PROBE3(set__done, path, status, status ? errno : 0);
+  governorRelease(start, 0);
+  return status;
+}
+
+int tagStoreRemove(const char *path) {
+  uint64_t start = governorAcquire();
+  TAG_PROBE2(set__start, path, -1L);
+  int status = defaultStore->remove(defaultStore, path);
+  TAG_PROBE3(set__done, path, status, status ? errno : 0);
+  governorRelease(start, 0);
+  return status;
+}
+
+int tagBlobMatches(const void *blob, ssize_t length, const void *expected,
+                   ssize_t expectedLength) {
+  if (length != expectedLength) return 0;
+  return length <= 0 || memcmp(blob, expected, length) == 0;
+}
+
+int tagStoreSwap(const char *path, const void *expected,
+                 ssize_t expectedLength, const void *buf, ssize_t length) {
+  return tagStoreSwapIn(defaultStore, path, expected, expectedLength, buf,
+                        length);
+}
+
+int tagStoreSwapIn(TagStore *store, const char *path, const void *expected,
+                   ssize_t expectedLength, const void *buf, ssize_t length) {
+  uint64_t start = governorAcquire();
+  TAG_PROBE2(set__start, path, (long)length);
+  int status =
+    store->swap(store, path, expected, expectedLength, buf, length);
+  TAG_PROBE3(set__done, path, status, status < 0 ? errno : 0);
+  governorRelease(start, 0);
+  return status;
+}
+
+/**
+ * @typedef Process wide swap contention counters
+ */
+static struct {
+  TagSwapStats stats;
+  pthread_mutex_t lock;
+} swapStats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int tagStoreBackoff(int attempt) {
+  int exhausted = attempt + 1 >= TAG_SWAP_ATTEMPTS;
+
+  pthread_mutex_lock(&swapStats.lock);
+  swapStats.stats.conflicts++;
+  if (!attempt) swapStats.stats.contended++;
+  if (exhausted) swapStats.stats.exhausted++;
+  pthread_mutex_unlock(&swapStats.lock);
+
+  if (exhausted) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // Random delay below a bound doubling up to the longest backoff
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t bound = (uint64_t)TAG_SWAP_BACKOFF >> (TAG_SWAP_ATTEMPTS - 2 -
+                                                  attempt);
+  uint64_t micros = 1 + tagHash64(&now, sizeof(now), attempt) % (bound + 1);
+  struct timespec delay = {.tv_sec = micros / 1000000,
+                           .tv_nsec = (long)(micros % 1000000) * 1000};
+  nanosleep(&delay, NULL);
+
+  return 0;
+}
+
+void tagStoreSwapStats(TagSwapStats *stats) {
+  pthread_mutex_lock(&swapStats.lock);
+  *stats = swapStats.stats;
+  pthread_mutex_unlock(&swapStats.lock);
+}
+
+int tagStoreGetBatch(const char *const *paths, int count, TagBlob *results) {
+  unsigned char buf[EXT_ATTR_SIZE];
+  int found = 0;
+
+  if (defaultStore->getBatch) {
+    // A batch is a single operation for the governor
+    uint64_t start = governorAcquire();
+    found = defaultStore->getBatch(defaultStore, paths, count, results);
+    governorRelease(start, 1);
+    return found;
+  }
+
+  // Backends without batching are asked one path at a time
+  for (int i = 0; i < count; ++i) {
+    ssize_t len = tagStoreGet(paths[i], buf, sizeof(buf));
+    results[i].data = NULL;
+    results[i].length = 0;
+    results[i].error = 0;
+    if (len < 0) {
+      results[i].error = errno;
+      continue;
+    }
+    results[i].data = malloc(len ? len : 1);
+    memcpy(results[i].data, buf, len);
+    results[i].length = (size_t)len;
+    found++;
+  }
+
+  return found;
+}
@@ -0,0 +1,262 @@
+//
+// store.h
+// Tag
+//
+
+#ifndef TAG_STORE_H
+#define TAG_STORE_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Error reported when a path carries no tags
+#ifdef ENOATTR
+#define TAG_ENOATTR     ENOATTR
+#else
+#define TAG_ENOATTR     ENODATA
+#endif
+
+// Attempts of an optimistic update before it gives up with EAGAIN
+#define TAG_SWAP_ATTEMPTS   8
+
+// Longest backoff between two attempts, in microseconds
+#define TAG_SWAP_BACKOFF    10000
+
+/**
+ * @typedef Encoding of the tag blobs written by a backend
+ * @enum 0 Binary property list array of "name\ncolor" strings, as written by
+ * the Finder
+ * @enum 1 Comma separated names without colors, the user.xdg.tags format of
+ * desktop tools on Linux
+ */
+typedef enum TagFormat {
+  TagFormatPlist,
+  TagFormatXdg
+} TagFormat;
+
+/**
+ * @typedef Result of a batched lookup
+ * @field data Tag blob, owned by the caller, NULL if the path has no tags
+ * @field length Length of the blob
+ * @field error errno of a failed lookup, TAG_ENOATTR if the path has no tags
+ */
+typedef struct TagBlob {
+  unsigned char *data;
+  size_t length;
+  int error;
+} TagBlob;
+
+/**
+ * @typedef Storage backend for the raw tag blobs of paths
+ * @field name Backend name
+ * @field format Encoding of the blobs written, blobs of either encoding are
+ * read
+ * @field attribute Extended attribute holding the blobs, NULL for backends
+ * keeping them outside the file system
+ * @field get Copy the blob of a path, getxattr semantics
+ * @field set Replace the blob of a path, setxattr semantics
+ * @field remove Remove the blob of a path, removexattr semantics
+ * @field swap Replace or remove the blob of a path only if it still holds
+ * the expected blob, tagStoreSwap semantics
+ * @field getBatch Look up several paths at once, may be NULL
+ * @field sync Make the writes so far durable, may be NULL for backends
+ * whose writes are durable once they return
+ * @field close Flush and release the backend
+ * @field state Backend private state
+ */
+typedef struct TagStore TagStore;
+struct TagStore {
+  const char *name;
+  TagFormat format;
+  const char *attribute;
+  ssize_t (*get)(TagStore *, const char *, void *, size_t);
+  int (*set)(TagStore *, const char *, const void *, size_t);
+  int (*remove)(TagStore *, const char *);
+  int (*swap)(TagStore *, const char *, const void *, ssize_t, const void *,
+              ssize_t);
+  int (*getBatch)(TagStore *, const char *const *, int, TagBlob *);
+  int (*sync)(TagStore *);
+  int (*close)(TagStore *);
+  void *state;
+};
+
+/**
+ * @typedef Contention seen by the optimistic updates of this process
+ * @field conflicts Updates that found the blob changed since it was read
+ * @field contended Updates of a path that saw at least one conflict
+ * @field exhausted Updates that gave up after TAG_SWAP_ATTEMPTS attempts
+ */
+typedef struct TagSwapStats {
+  unsigned long long conflicts;
+  unsigned long long contended;
+  unsigned long long exhausted;
+} TagSwapStats;
+
+/**
+ * @brief Open a backend from a specification
+ * @param spec "xattr", "xdg" for the user.xdg.tags attribute in its own
+ * format, "memory", "db:<file>" for an embedded store keyed by path, or
+ * "db-inode:<file>" for one keyed by device and inode
+ * @return Backend, or NULL with an error reported
+ */
+TagStore *tagStoreOpen(const char *spec);
+
+/**
+ * @brief Backend used by the tag operations, the xattr backend by default
+ * @return Current backend
+ */
+TagStore *tagStoreDefault(void);
+
+/**
+ * @brief Replace the backend used by the tag operations
+ * @param store New backend, NULL restores the xattr backend
+ */
+void tagStoreSetDefault(TagStore *store);
+
+/**
+ * @brief Close a backend opened with tagStoreOpen
+ * @param store Backend
+ * @return 0 on success, -1 if pending writes could not be flushed
+ */
+int tagStoreClose(TagStore *store);
+
+/**
+ * @brief Make the writes to the current backend durable
+ * @return 0 on success, -1 with errno set if they could not be synced
+ * @note Writes that return have been applied but may be lost in a crash
+ * until they are synced.
+ */
+int tagStoreSync(void);
+
+/**
+ * @brief Read the tag blob of a path from the current backend
+ * @param path Path to the filename or directory
+ * @param buf Buffer to receive the blob
+ * @param size Size of the buffer
+ * @return Length of the blob, or -1 with errno set
+ */
+ssize_t tagStoreGet(const char *path, void *buf, size_t size);
+
+/**
+ * @brief Write the tag blob of a path to the current backend
+ * @param path Path to the filename or directory
+ * @param buf Blob
+ * @param length Length of the blob
+ * @return 0 on success, or -1 with errno set
+ */
+int tagStoreSet(const char *path, const void *buf, size_t length);
+
+/**
+ * @brief Remove the tag blob of a path from the current backend
+ * @param path Path to the filename or directory
+ * @return 0 on success, or -1 with errno set
+ */
+int tagStoreRemove(const char *path);
+
+/**
+ * @brief Compare a blob with the one an update was computed from
+ * @param blob Blob, ignored if length is negative
+ * @param length Length of the blob, -1 for no blob
+ * @param expected Expected blob, ignored if expectedLength is negative
+ * @param expectedLength Length of the expected blob, -1 for no blob
+ * @return 1 if both are the same blob or both are absent, 0 otherwise
+ */
+int tagBlobMatches(const void *blob, ssize_t length, const void *expected,
+                   ssize_t expectedLength);
+
+/**
+ * @brief Replace the tag blob of a path in the current backend, provided it
+ * still holds the blob the replacement was computed from
+ * @param path Path to the filename or directory
+ * @param expected Blob read before, ignored if expectedLength is negative
+ * @param expectedLength Length of that blob, -1 if the path carried none
+ * @param buf Replacement blob, ignored if length is negative
+ * @param length Length of the replacement, -1 to remove the blob
+ * @return 0 if the blob was replaced, 1 if it changed in the meantime and
+ * was left alone, 2 if it was replaced but differs when read back, or -1
+ * with errno set
+ * @note The memory and database backends compare and write under their
+ * lock. The xattr backend reads the blob again and writes it with
+ * XATTR_CREATE or XATTR_REPLACE, so a blob created or removed in the
+ * meantime is always caught. A rewrite by another process between the
+ * comparison and the write cannot be prevented, so the blob is read back
+ * after writing: on 2 the caller recomputes its change from the current
+ * blob, which writes nothing if the change survived.
+ */
+int tagStoreSwap(const char *path, const void *expected,
+                 ssize_t expectedLength, const void *buf, ssize_t length);
+
+/**
+ * @brief Read the tag blob of a path from a given backend, as tagStoreGet
+ * @param store Backend
+ * @param path Path to the filename or directory
+ * @param buf Buffer to receive the blob
+ * @param size Size of the buffer
+ * @return Length of the blob, or -1 with errno set
+ */
+ssize_t tagStoreGetIn(TagStore *store, const char *path, void *buf,
+                      size_t size);
+
+/**
+ * @brief Replace the tag blob of a path in a given backend, as tagStoreSwap
+ * @param store Backend
+ * @param path Path to the filename or directory
+ * @param expected Blob read before, ignored if expectedLength is negative
+ * @param expectedLength Length of that blob, -1 if the path carried none
+ * @param buf Replacement blob, ignored if length is negative
+ * @param length Length of the replacement, -1 to remove the blob
+ * @return tagStoreSwap results
+ */
+int tagStoreSwapIn(TagStore *store, const char *path, const void *expected,
+                   ssize_t expectedLength, const void *buf, ssize_t length);
+
+/**
+ * @brief Account for a failed swap and wait before the next attempt
+ * @param attempt Number of the failed attempt, 0 for the first
+ * @return 0 once the caller may read the blob and try again, or -1 with errno
+ * set to EAGAIN after TAG_SWAP_ATTEMPTS attempts
+ * @note The wait is a random delay doubling with every attempt, up to
+ * TAG_SWAP_BACKOFF, so colliding writers spread out.
+ */
+int tagStoreBackoff(int attempt);
+
+/**
+ * @brief Contention seen by the swaps of this process so far
+ * @param stats Receives the counters
+ */
+void tagStoreSwapStats(TagSwapStats *stats);
+
+/**
+ * @brief Read the tag blobs of several paths from the current backend
+ * @param paths Paths to look up
+ * @param count Number of paths
+ * @param results Array of count results, release each data with free
+ * @return Number of paths carrying tags
+ */
+int tagStoreGetBatch(const char *const *paths, int count, TagBlob *results);
+
+/**
+ * @brief Parse the name of a blob format
+ * @param name "plist" or "xdg"
+ * @param format Receives the format
+ * @return 0 on success, -1 if the name is unknown
+ */
+int tagFormatParse(const char *name, TagFormat *format);
+
+/**
+ * @brief Extended attribute backend of a format
+ * @param format Format
+ * @return The "xattr" backend for TagFormatPlist, "xdg" for TagFormatXdg
+ */
+TagStore *tagStoreAttribute(TagFormat format);
+
+/**
+ * @brief Open the embedded single file B-tree backend
+ * @param path Store file, created if it does not exist
+ * @param byInode Key entries by device and inode instead of by path
+ * @return Backend, or NULL with an error reported
+ */
+TagStore *tagStoreOpenDatabase(const char *path, int byInode);
+
+#endif  // TAG_STORE_H
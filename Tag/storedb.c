@@ -0,0 +1,946 @@
+//
+// storedb.c
+// Tag
+//
+
+#include "store.h"
+
+#include "hash.h"
+#include "usertag.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Store file magic, also the version of the page layout
+#define DB_MAGIC        "TAGDB003"
+
+// Size of a B-tree page, page 0 holds the header
+#define DB_PAGE         4096
+
+// Page 0 holds two header slots, written in turn
+#define DB_HEADER_SLOT  (DB_PAGE / 2)
+
+// Size of the head of every page
+#define DB_PAGE_HEAD    16
+
+// Entries of a leaf page, key, blob offset and blob length
+#define DB_LEAF_MAX     ((DB_PAGE - DB_PAGE_HEAD) / 32)
+
+// Entries of an internal page, key and child page
+#define DB_INTERNAL_MAX ((DB_PAGE - DB_PAGE_HEAD) / 24)
+
+// Garbage that makes a commit compact the store, once it also exceeds the
+// space still referenced
+#define DB_COMPACT_MIN  (16 * DB_PAGE)
+
+// Seeds of the two halves of a path key
+#define DB_SEED_HIGH    0x243f6a8885a308d3ULL
+#define DB_SEED_LOW     0x13198a2e03707344ULL
+
+/**
+ * @typedef 128-bit key, device and inode or the halves of a path hash
+ */
+typedef struct DbKey {
+  uint64_t high;
+  uint64_t low;
+} DbKey;
+
+/**
+ * @typedef Header stored in one of the slots of page 0
+ * @field magic DB_MAGIC
+ * @field pageSize DB_PAGE
+ * @field byInode Keys are device and inode rather than path hashes
+ * @field root Offset of the root page
+ * @field end End of the used space, pages and blobs are appended here
+ * @field entries Number of keys with a blob
+ * @field garbage Bytes below end no longer referenced by the tree, superseded
+ * pages and blobs and the padding before pages
+ * @field sequence Number of the commit, odd ones go to the second slot
+ * @field checksum Hash of the fields above, a torn header does not match
+ * @note Pages reachable from a written header are never rewritten, so either
+ * slot describes a whole tree and the newest valid one is used.
+ */
+typedef struct DbHeader {
+  char magic[8];
+  uint32_t pageSize;
+  uint32_t byInode;
+  uint64_t root;
+  uint64_t end;
+  uint64_t entries;
+  uint64_t garbage;
+  uint64_t sequence;
+  uint64_t checksum;
+} DbHeader;
+
+/**
+ * @typedef Decoded page
+ * @field leaf Leaf page holding blob references, otherwise internal
+ * @field next Internal: child for keys below keys[0], unused by leaves
+ * @field values Leaf: blob offsets. Internal: child for keys from keys[i]
+ * @field lengths Leaf: blob lengths, 0 for removed entries
+ * @note Arrays hold one spare entry so a full node can overflow before it is
+ * split.
+ */
+typedef struct DbNode {
+  int leaf;
+  int count;
+  uint64_t next;
+  DbKey keys[DB_INTERNAL_MAX + 1];
+  uint64_t values[DB_INTERNAL_MAX + 1];
+  uint32_t lengths[DB_LEAF_MAX + 1];
+} DbNode;
+
+/**
+ * @typedef Backend state
+ * @field header Header of the tree including changes not yet committed
+ * @field committed Header last handed to a commit, its pages are all below
+ * frozen
+ * @field frozen Pages below were referenced by a committed header and are
+ * copied rather than rewritten, newer pages are updated in place
+ * @field failed Set once a write failed, later changes and commits are
+ * refused until the store is reopened
+ * @field changes Changes made to the tree
+ * @field synced Changes covered by the header on disk, under commit
+ * @field sequence Sequence of the header on disk, under commit
+ * @field path Absolute path of the store file, which a compaction replaces
+ * @note Members without a note are under lock.
+ */
+typedef struct DbState {
+  int fd;
+  DbHeader header;
+  DbHeader committed;
+  uint64_t frozen;
+  int failed;
+  uint64_t changes;
+  uint64_t synced;
+  uint64_t sequence;
+  pthread_mutex_t lock;
+  pthread_mutex_t commit;
+  char cwd[PATH_MAX];
+  char path[PATH_MAX];
+} DbState;
+
+/**
+ * @typedef Copy of a node written by an insert
+ * @field copy Page the updated node was written to
+ * @field split Set if the node was split in two
+ * @field key Separator of the right half
+ * @field page Page of the right half
+ */
+typedef struct DbSplit {
+  uint64_t copy;
+  int split;
+  DbKey key;
+  uint64_t page;
+} DbSplit;
+
+static int keyCompare(const DbKey *a, const DbKey *b) {
+  if (a->high != b->high) return a->high < b->high ? -1 : 1;
+  if (a->low != b->low) return a->low < b->low ? -1 : 1;
+  return 0;
+}
+
+// Lexically normalized absolute path, resolving ".", ".." and repeated "/"
+static void absolutePath(const char *cwd, const char *path, char *out,
+                         size_t size) {
+  char joined[PATH_MAX * 2];
+  size_t length = 0;
+
+  if (*path == '/') {
+    snprintf(joined, sizeof(joined), "%s", path);
+  } else {
+    snprintf(joined, sizeof(joined), "%s/%s", cwd, path);
+  }
+
+  for (char *part = joined, *end; *part; part = end) {
+    while (*part == '/') ++part;
+    for (end = part; *end && *end != '/'; ++end) continue;
+    size_t partLength = end - part;
+
+    if (!partLength || (partLength == 1 && *part == '.')) continue;
+    if (partLength == 2 && part[0] == '.' && part[1] == '.') {
+      while (length && out[length - 1] != '/') --length;
+      if (length) --length;
+      continue;
+    }
+    if (length + partLength + 2 > size) break;
+    out[length++] = '/';
+    memcpy(out + length, part, partLength);
+    length += partLength;
+  }
+
+  if (!length) out[length++] = '/';
+  out[length] = '\0';
+}
+
+// Key of a path, 0 on success or -1 if the path cannot be stat'ed
+static int pathKey(DbState *state, const char *path, DbKey *key) {
+  if (state->header.byInode) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    key->high = (uint64_t)st.st_dev;
+    key->low = (uint64_t)st.st_ino;
+  } else {
+    char absolute[PATH_MAX];
+    absolutePath(state->cwd, path, absolute, sizeof(absolute));
+    key->high = tagHashString(absolute, DB_SEED_HIGH);
+    key->low = tagHashString(absolute, DB_SEED_LOW);
+  }
+  return 0;
+}
+
+static int readNode(DbState *state, uint64_t page, DbNode *node) {
+  unsigned char buf[DB_PAGE];
+  uint16_t head[2];
+
+  if (page < DB_PAGE || page % DB_PAGE || page + DB_PAGE > state->header.end ||
+      pread(state->fd, buf, DB_PAGE, (off_t)page) != DB_PAGE)
+    return -1;
+
+  // A damaged page must not overflow the arrays of the node
+  memcpy(head, buf, sizeof(head));
+  node->leaf = head[0];
+  node->count = head[1];
+  if (node->leaf > 1 ||
+      node->count > (node->leaf ? DB_LEAF_MAX : DB_INTERNAL_MAX))
+    return -1;
+  memcpy(&node->next, buf + 8, sizeof(node->next));
+
+  unsigned char *p = buf + DB_PAGE_HEAD;
+  for (int i = 0; i < node->count; ++i) {
+    memcpy(node->keys + i, p, sizeof(DbKey));
+    memcpy(node->values + i, p + 16, sizeof(uint64_t));
+    if (node->leaf) {
+      memcpy(node->lengths + i, p + 24, sizeof(uint32_t));
+      p += 32;
+    } else {
+      p += 24;
+    }
+  }
+
+  return 0;
+}
+
+static int writeNode(DbState *state, uint64_t page, const DbNode *node) {
+  unsigned char buf[DB_PAGE] = {0};
+  uint16_t head[2] = {(uint16_t)node->leaf, (uint16_t)node->count};
+
+  memcpy(buf, head, sizeof(head));
+  memcpy(buf + 8, &node->next, sizeof(node->next));
+
+  unsigned char *p = buf + DB_PAGE_HEAD;
+  for (int i = 0; i < node->count; ++i) {
+    memcpy(p, node->keys + i, sizeof(DbKey));
+    memcpy(p + 16, node->values + i, sizeof(uint64_t));
+    if (node->leaf) {
+      memcpy(p + 24, node->lengths + i, sizeof(uint32_t));
+      p += 32;
+    } else {
+      p += 24;
+    }
+  }
+
+  return pwrite(state->fd, buf, DB_PAGE, (off_t)page) == DB_PAGE ? 0 : -1;
+}
+
+static uint64_t headerChecksum(const DbHeader *header) {
+  return tagHash64(header, offsetof(DbHeader, checksum), DB_SEED_LOW);
+}
+
+static int writeHeader(DbState *state, DbHeader *header) {
+  off_t slot = (off_t)(header->sequence & 1) * DB_HEADER_SLOT;
+  header->checksum = headerChecksum(header);
+  return pwrite(state->fd, header, sizeof(*header), slot) ==
+             (ssize_t)sizeof(*header)
+           ? 0
+           : -1;
+}
+
+// Newest valid header of the two slots, -1 if neither is valid
+static int readHeader(DbState *state) {
+  unsigned char buf[DB_PAGE];
+  int found = 0;
+
+  if (pread(state->fd, buf, DB_PAGE, 0) != DB_PAGE) return -1;
+  for (int i = 0; i < 2; ++i) {
+    DbHeader header;
+    memcpy(&header, buf + i * DB_HEADER_SLOT, sizeof(header));
+    if (memcmp(header.magic, DB_MAGIC, sizeof(header.magic)) != 0 ||
+        header.pageSize != DB_PAGE ||
+        header.checksum != headerChecksum(&header) ||
+        (header.sequence & 1) != (uint64_t)i)
+      continue;
+    if (!found || header.sequence > state->header.sequence)
+      state->header = header;
+    found = 1;
+  }
+  return found ? 0 : -1;
+}
+
+// Allocate a page aligned page at the end of the file
+static uint64_t allocatePage(DbState *state) {
+  uint64_t page = (state->header.end + DB_PAGE - 1) & ~(uint64_t)(DB_PAGE - 1);
+  state->header.garbage += page - state->header.end;
+  state->header.end = page + DB_PAGE;
+  return page;
+}
+
+// Page to write an updated node to, in place unless a header references it.
+// The copied page is garbage once the next header no longer references it.
+static uint64_t writablePage(DbState *state, uint64_t page) {
+  if (page >= state->frozen) return page;
+  state->header.garbage += DB_PAGE;
+  return allocatePage(state);
+}
+
+// First index whose key is not less than the key
+static int lowerBound(const DbNode *node, const DbKey *key) {
+  int low = 0, high = node->count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (keyCompare(node->keys + mid, key) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Child reference of an internal node covering the key
+static uint64_t *childFor(DbNode *node, const DbKey *key) {
+  int i = lowerBound(node, key);
+  if (i < node->count && keyCompare(node->keys + i, key) == 0)
+    return node->values + i;
+  return i ? node->values + i - 1 : &node->next;
+}
+
+// Descend to the leaf covering the key
+static int findLeaf(DbState *state, const DbKey *key, DbNode *node) {
+  if (readNode(state, state->header.root, node) != 0) return -1;
+  while (!node->leaf) {
+    if (readNode(state, *childFor(node, key), node) != 0) return -1;
+  }
+  return 0;
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Insert or update a key below a page. A committed node is copied to a new
+// page rather than rewritten, the copy and any split are reported to the
+// caller.
+static int insertKey(DbState *state, uint64_t page, const DbKey *key,
+                     uint64_t offset, uint32_t length, DbSplit *split) {
+  DbNode *node = malloc(sizeof(*node));
+  DbSplit child = {0};
+  int status = -1;
+  int i;
+
+  split->copy = page;
+  split->split = 0;
+  if (readNode(state, page, node) != 0) goto done;
+
+  i = lowerBound(node, key);
+
+  if (node->leaf) {
+    if (i < node->count && keyCompare(node->keys + i, key) == 0) {
+      if (!node->lengths[i] && length) state->header.entries++;
+      if (node->lengths[i] && !length) state->header.entries--;
+      state->header.garbage += node->lengths[i];
+      node->values[i] = offset;
+      node->lengths[i] = length;
+    } else if (!length) {
+      // Removing a key that is not stored
+      status = 1;
+      goto done;
+    } else {
+      memmove(node->keys + i + 1, node->keys + i,
+              sizeof(*node->keys) * (node->count - i));
+      memmove(node->values + i + 1, node->values + i,
+              sizeof(*node->values) * (node->count - i));
+      memmove(node->lengths + i + 1, node->lengths + i,
+              sizeof(*node->lengths) * (node->count - i));
+      node->keys[i] = *key;
+      node->values[i] = offset;
+      node->lengths[i] = length;
+      node->count++;
+      state->header.entries++;
+    }
+  } else {
+    uint64_t *childPage = childFor(node, key);
+    if ((status = insertKey(state, *childPage, key, offset, length, &child)) !=
+        0)
+      goto done;
+    *childPage = child.copy;
+
+    // Insert the separator of the split child
+    if (child.split) {
+      i = lowerBound(node, &child.key);
+      memmove(node->keys + i + 1, node->keys + i,
+              sizeof(*node->keys) * (node->count - i));
+      memmove(node->values + i + 1, node->values + i,
+              sizeof(*node->values) * (node->count - i));
+      node->keys[i] = child.key;
+      node->values[i] = child.page;
+      node->count++;
+    }
+  }
+
+  int max = node->leaf ? DB_LEAF_MAX : DB_INTERNAL_MAX;
+  if (node->count <= max) {
+    split->copy = writablePage(state, page);
+    status = writeNode(state, split->copy, node);
+    goto done;
+  }
+
+  // Split the overflowing node in half
+  DbNode *right = calloc(1, sizeof(*right));
+  int half = node->count / 2;
+
+  right->leaf = node->leaf;
+  if (node->leaf) {
+    right->count = node->count - half;
+    memcpy(right->keys, node->keys + half, sizeof(DbKey) * right->count);
+    memcpy(right->values, node->values + half,
+           sizeof(uint64_t) * right->count);
+    memcpy(right->lengths, node->lengths + half,
+           sizeof(uint32_t) * right->count);
+    split->key = right->keys[0];
+  } else {
+    // The middle key moves up, its child becomes the right node's first
+    right->count = node->count - half - 1;
+    right->next = node->values[half];
+    memcpy(right->keys, node->keys + half + 1, sizeof(DbKey) * right->count);
+    memcpy(right->values, node->values + half + 1,
+           sizeof(uint64_t) * right->count);
+    split->key = node->keys[half];
+  }
+  node->count = half;
+  split->split = 1;
+  split->copy = writablePage(state, page);
+  split->page = allocatePage(state);
+
+  status = (writeNode(state, split->copy, node) ||
+            writeNode(state, split->page, right))
+             ? -1
+             : 0;
+  free(right);
+
+done:
+  free(node);
+  return status;
+}
+#pragma clang diagnostic pop
+
+// Insert below the root, growing the tree when the root splits
+static int storeKey(DbState *state, const DbKey *key, uint64_t offset,
+                    uint32_t length) {
+  DbSplit split;
+  int status = insertKey(state, state->header.root, key, offset, length, &split);
+
+  if (status != 0) return status;
+  if (split.split) {
+    DbNode *root = calloc(1, sizeof(*root));
+    uint64_t page = allocatePage(state);
+    root->leaf = 0;
+    root->count = 1;
+    root->next = split.copy;
+    root->keys[0] = split.key;
+    root->values[0] = split.page;
+    status = writeNode(state, page, root);
+    split.copy = page;
+    free(root);
+  }
+  state->header.root = split.copy;
+  return status;
+}
+
+// Append a blob, or none to remove the key, and store its reference under
+// the lock, 1 if a removed key was not stored
+static int updateKey(DbState *state, const DbKey *key, const void *buf,
+                     size_t length) {
+  uint64_t offset = state->header.end;
+  int status = -1;
+
+  if (state->failed) return -1;
+  if (!length ||
+      pwrite(state->fd, buf, length, (off_t)offset) == (ssize_t)length) {
+    state->header.end += length;
+    status = storeKey(state, key, length ? offset : 0, (uint32_t)length);
+  }
+
+  if (status < 0) {
+    // Pages updated in place may be half written, fall back to the last
+    // committed tree whose pages are untouched
+    state->header = state->committed;
+    state->failed = 1;
+  } else if (!status) {
+    state->changes++;
+  }
+  return status;
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Copy the subtree below a page to a compacted store, leaving out removed
+// entries. Children and blobs are written before the page referencing them.
+static int copyNode(DbState *state, DbState *target, uint64_t page,
+                    uint64_t *copy) {
+  DbNode *node = malloc(sizeof(*node));
+  int status = -1;
+
+  if (readNode(state, page, node) != 0) goto done;
+
+  if (node->leaf) {
+    int count = 0;
+    for (int i = 0; i < node->count; ++i) {
+      uint32_t length = node->lengths[i];
+      if (!length) continue;
+
+      unsigned char *blob = malloc(length);
+      uint64_t offset = target->header.end;
+      int copied =
+        pread(state->fd, blob, length, (off_t)node->values[i]) ==
+          (ssize_t)length &&
+        pwrite(target->fd, blob, length, (off_t)offset) == (ssize_t)length;
+      free(blob);
+      if (!copied) goto done;
+
+      target->header.end += length;
+      target->header.entries++;
+      node->keys[count] = node->keys[i];
+      node->values[count] = offset;
+      node->lengths[count++] = length;
+    }
+    node->count = count;
+  } else {
+    if (copyNode(state, target, node->next, &node->next) != 0) goto done;
+    for (int i = 0; i < node->count; ++i)
+      if (copyNode(state, target, node->values[i], node->values + i) != 0)
+        goto done;
+  }
+
+  *copy = allocatePage(target);
+  status = writeNode(target, *copy, node);
+
+done:
+  free(node);
+  return status;
+}
+#pragma clang diagnostic pop
+
+// Rewrite the tree and its blobs to a new file replacing the store, under
+// commit and lock. Processes waiting for the lock of the old file notice
+// the replacement and open the new one.
+static int dbCompact(DbState *state) {
+  char temporary[PATH_MAX];
+  DbState target = {0};
+  struct stat st;
+  int error;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.compact", state->path) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((target.fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    return -1;
+  flock(target.fd, LOCK_EX);
+
+  target.header = state->header;
+  target.header.end = DB_PAGE;
+  target.header.entries = 0;
+  target.header.garbage = 0;
+  target.header.sequence = state->sequence + 1;
+
+  if (fstat(state->fd, &st) != 0 ||
+      fchmod(target.fd, st.st_mode & 07777) != 0 ||
+      copyNode(state, &target, state->header.root, &target.header.root) != 0 ||
+      fsync(target.fd) != 0 || writeHeader(&target, &target.header) != 0 ||
+      fsync(target.fd) != 0 || rename(temporary, state->path) != 0) {
+    error = errno;
+    close(target.fd);
+    unlink(temporary);
+    errno = error;
+    return -1;
+  }
+
+  // Make the rename durable, the old file is complete until it is
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s", state->path);
+  char *slash = strrchr(directory, '/');
+  if (slash) {
+    *(slash == directory ? slash + 1 : slash) = '\0';
+    int dirfd = open(directory, O_RDONLY);
+    if (dirfd >= 0) {
+      fsync(dirfd);
+      close(dirfd);
+    }
+  }
+
+  flock(state->fd, LOCK_UN);
+  close(state->fd);
+  state->fd = target.fd;
+  state->header = target.header;
+  state->committed = target.header;
+  state->frozen = target.header.end;
+  state->sequence = target.header.sequence;
+  return 0;
+}
+
+// Write a header for the changes so far. Changes made while another thread
+// syncs are covered together by the next header.
+static int dbSync(TagStore *store) {
+  DbState *state = store->state;
+  int status = 0;
+
+  pthread_mutex_lock(&state->commit);
+  pthread_mutex_lock(&state->lock);
+  DbHeader header = state->header;
+  uint64_t changes = state->changes;
+  int failed = state->failed;
+  if (state->synced < changes && !failed) {
+    // Later changes copy the pages of this tree rather than rewrite them
+    state->committed = header;
+    state->frozen = header.end;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if (failed) {
+    errno = EIO;
+    status = -1;
+  } else if (state->synced < changes) {
+    // The pages reach the disk before the header referencing them
+    header.sequence = state->sequence + 1;
+    if (fsync(state->fd) != 0 || writeHeader(state, &header) != 0 ||
+        fsync(state->fd) != 0) {
+      status = -1;
+    } else {
+      state->sequence = header.sequence;
+      state->synced = changes;
+    }
+  }
+
+  // Reclaim the space of superseded pages and blobs once it dominates, the
+  // compacted store includes changes made since the header above
+  pthread_mutex_lock(&state->lock);
+  if (!status && !state->failed &&
+      state->header.garbage >= DB_COMPACT_MIN &&
+      state->header.garbage * 2 > state->header.end) {
+    if (dbCompact(state) == 0) {
+      state->synced = state->changes;
+    } else {
+      reportError("%s: %s\n", state->path, strerror(errno));
+    }
+  }
+  pthread_mutex_unlock(&state->lock);
+  pthread_mutex_unlock(&state->commit);
+
+  return status;
+}
+
+// Blob reference of a key within a leaf, 0 length if absent
+static uint32_t leafLookup(const DbNode *leaf, const DbKey *key,
+                           uint64_t *offset) {
+  int i = lowerBound(leaf, key);
+  if (i < leaf->count && keyCompare(leaf->keys + i, key) == 0) {
+    *offset = leaf->values[i];
+    return leaf->lengths[i];
+  }
+  return 0;
+}
+
+static ssize_t dbGet(TagStore *store, const char *path, void *buf,
+                     size_t size) {
+  DbState *state = store->state;
+  DbNode *leaf = malloc(sizeof(*leaf));
+  ssize_t result = -1;
+  uint64_t offset = 0;
+  uint32_t length;
+  DbKey key;
+
+  if (pathKey(state, path, &key) != 0) {
+    free(leaf);
+    return -1;
+  }
+
+  pthread_mutex_lock(&state->lock);
+  if (findLeaf(state, &key, leaf) != 0) {
+    errno = EIO;
+  } else if (!(length = leafLookup(leaf, &key, &offset))) {
+    errno = TAG_ENOATTR;
+  } else if (length > size) {
+    errno = ERANGE;
+  } else if (pread(state->fd, buf, length, (off_t)offset) == (ssize_t)length) {
+    result = length;
+  } else {
+    errno = EIO;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  free(leaf);
+  return result;
+}
+
+static int dbSet(TagStore *store, const char *path, const void *buf,
+                 size_t length) {
+  DbState *state = store->state;
+  int status;
+  DbKey key;
+
+  if (pathKey(state, path, &key) != 0) return -1;
+  if (!length) return store->remove(store, path);
+
+  // Blobs are appended, a rewrite leaves the previous blob as garbage
+  pthread_mutex_lock(&state->lock);
+  status = updateKey(state, &key, buf, length);
+  pthread_mutex_unlock(&state->lock);
+
+  if (status) errno = EIO;
+  return status ? -1 : 0;
+}
+
+static int dbRemove(TagStore *store, const char *path) {
+  DbState *state = store->state;
+  int status;
+  DbKey key;
+
+  if (pathKey(state, path, &key) != 0) return -1;
+
+  pthread_mutex_lock(&state->lock);
+  status = updateKey(state, &key, NULL, 0);
+  pthread_mutex_unlock(&state->lock);
+
+  if (status) errno = status > 0 ? TAG_ENOATTR : EIO;
+  return status ? -1 : 0;
+}
+
+static int dbSwap(TagStore *store, const char *path, const void *expected,
+                  ssize_t expectedLength, const void *buf, ssize_t length) {
+  DbState *state = store->state;
+  DbNode *leaf = malloc(sizeof(*leaf));
+  unsigned char *current = NULL;
+  ssize_t currentLength = -1;
+  uint64_t offset = 0;
+  uint32_t stored = 0;
+  int status = -1;
+  DbKey key;
+
+  if (pathKey(state, path, &key) != 0) {
+    free(leaf);
+    return -1;
+  }
+
+  // Compared and written under the lock, nothing can come in between
+  pthread_mutex_lock(&state->lock);
+  int readable = findLeaf(state, &key, leaf) == 0;
+  if (readable && (stored = leafLookup(leaf, &key, &offset)) != 0) {
+    current = malloc(stored);
+    readable =
+      pread(state->fd, current, stored, (off_t)offset) == (ssize_t)stored;
+    currentLength = stored;
+  }
+  if (!readable) {
+    errno = EIO;
+  } else if (!tagBlobMatches(current, currentLength, expected,
+                             expectedLength)) {
+    status = 1;
+  } else if (length > 0 || stored) {
+    // Appended as by dbSet, an empty blob is stored as none
+    status = updateKey(state, &key, buf, length > 0 ? (size_t)length : 0);
+  } else {
+    status = 0;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  if (status < 0) errno = EIO;
+
+  free(current);
+  free(leaf);
+  return status;
+}
+
+/**
+ * @typedef Key of a batched lookup and its position in the request
+ */
+typedef struct DbBatchKey {
+  DbKey key;
+  int index;
+} DbBatchKey;
+
+static int batchCompare(const void *a, const void *b) {
+  return keyCompare(&((const DbBatchKey *)a)->key,
+                    &((const DbBatchKey *)b)->key);
+}
+
+// Look up the keys in order so consecutive keys reuse the same leaf
+static int dbGetBatch(TagStore *store, const char *const *paths, int count,
+                      TagBlob *results) {
+  DbState *state = store->state;
+  DbBatchKey *keys = calloc(count ? count : 1, sizeof(*keys));
+  DbNode *leaf = malloc(sizeof(*leaf));
+  int haveLeaf = 0;
+  int found = 0;
+  int n = 0;
+
+  for (int i = 0; i < count; ++i) {
+    results[i].data = NULL;
+    results[i].length = 0;
+    results[i].error = TAG_ENOATTR;
+    if (pathKey(state, paths[i], &keys[n].key) != 0) {
+      results[i].error = errno;
+      continue;
+    }
+    keys[n++].index = i;
+  }
+  qsort(keys, n, sizeof(*keys), batchCompare);
+
+  pthread_mutex_lock(&state->lock);
+  for (int i = 0; i < n; ++i) {
+    TagBlob *result = results + keys[i].index;
+    uint64_t offset = 0;
+    uint32_t length;
+
+    // Reuse the current leaf while the key falls within its range
+    if (!haveLeaf || !leaf->count ||
+        keyCompare(&keys[i].key, leaf->keys) < 0 ||
+        keyCompare(&keys[i].key, leaf->keys + leaf->count - 1) > 0) {
+      if (findLeaf(state, &keys[i].key, leaf) != 0) {
+        result->error = EIO;
+        haveLeaf = 0;
+        continue;
+      }
+      haveLeaf = 1;
+    }
+
+    if (!(length = leafLookup(leaf, &keys[i].key, &offset))) continue;
+    result->data = malloc(length);
+    if (pread(state->fd, result->data, length, (off_t)offset) !=
+        (ssize_t)length) {
+      free(result->data);
+      result->data = NULL;
+      result->error = EIO;
+      continue;
+    }
+    result->length = length;
+    result->error = 0;
+    found++;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  free(leaf);
+  free(keys);
+  return found;
+}
+
+static int dbClose(TagStore *store) {
+  DbState *state = store->state;
+  int status = dbSync(store);
+
+  flock(state->fd, LOCK_UN);
+  close(state->fd);
+  pthread_mutex_destroy(&state->lock);
+  pthread_mutex_destroy(&state->commit);
+  free(state);
+  free(store);
+
+  return status;
+}
+
+TagStore *tagStoreOpenDatabase(const char *path, int byInode) {
+  DbState *state = calloc(1, sizeof(*state));
+  struct stat st;
+
+  // A single process owns the store while it is open. The previous owner
+  // may have replaced the file by a compacted one while this process was
+  // waiting for the lock.
+  for (;;) {
+    struct stat current;
+    if ((state->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+      reportError("%s: %s\n", path, strerror(errno));
+      free(state);
+      return NULL;
+    }
+    flock(state->fd, LOCK_EX);
+    if (fstat(state->fd, &st) != 0) {
+      reportError("%s: %s\n", path, strerror(errno));
+      close(state->fd);
+      free(state);
+      return NULL;
+    }
+    if (stat(path, &current) != 0 ||
+        (current.st_dev == st.st_dev && current.st_ino == st.st_ino))
+      break;
+    close(state->fd);
+  }
+  if (!realpath(path, state->path))
+    snprintf(state->path, sizeof(state->path), "%s", path);
+
+  if (st.st_size == 0) {
+    // Initialize an empty tree, a single empty leaf
+    DbNode *root = calloc(1, sizeof(*root));
+    memcpy(state->header.magic, DB_MAGIC, sizeof(state->header.magic));
+    state->header.pageSize = DB_PAGE;
+    state->header.byInode = (uint32_t)byInode;
+    state->header.end = DB_PAGE;
+    state->header.root = allocatePage(state);
+    root->leaf = 1;
+    writeNode(state, state->header.root, root);
+    state->header.sequence = 1;
+    writeHeader(state, &state->header);
+    fsync(state->fd);
+    free(root);
+  } else if (readHeader(state) != 0) {
+    reportError("%s: %s\n", path, "Not a tag store");
+    close(state->fd);
+    free(state);
+    return NULL;
+  } else if ((int)state->header.byInode != byInode) {
+    reportError("%s: %s\n", path,
+                byInode ? "Store is keyed by path" : "Store is keyed by inode");
+    close(state->fd);
+    free(state);
+    return NULL;
+  } else if (state->header.end > (uint64_t)st.st_size) {
+    reportError("%s: %s\n", path, "Store is truncated");
+    close(state->fd);
+    free(state);
+    return NULL;
+  } else if (state->header.end < (uint64_t)st.st_size &&
+             ftruncate(state->fd, (off_t)state->header.end) != 0) {
+    // Pages and blobs past the end were never committed
+    reportError("%s: %s\n", path, strerror(errno));
+    close(state->fd);
+    free(state);
+    return NULL;
+  }
+
+  state->committed = state->header;
+  state->frozen = state->header.end;
+  state->sequence = state->header.sequence;
+  if (!getcwd(state->cwd, sizeof(state->cwd))) strcpy(state->cwd, "/");
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_mutex_init(&state->commit, NULL);
+
+  TagStore *store = calloc(1, sizeof(*store));
+  store->name = "db";
+  store->get = dbGet;
+  store->set = dbSet;
+  store->remove = dbRemove;
+  store->swap = dbSwap;
+  store->getBatch = dbGetBatch;
+  store->sync = dbSync;
+  store->close = dbClose;
+  store->state = state;
+
+  return store;
+}
@@ -0,0 +1,458 @@
+//
+// sync.c
+// Tag
+//
+
+#include "sync.h"
+
+#include "governor.h"
+#include "journal.h"
+#include "store.h"
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * @typedef Outcome counters of a single worker
+ * @field files Source entries compared
+ * @field unchanged Destinations already carrying the source's blob
+ * @field written Destinations given the source's blob
+ * @field removed Destinations stripped of their tags
+ * @field missing Destinations that do not exist
+ * @field errors Entries that could not be read or written
+ */
+typedef struct SyncCounters {
+  unsigned long long files;
+  unsigned long long unchanged;
+  unsigned long long written;
+  unsigned long long removed;
+  unsigned long long missing;
+  unsigned long long errors;
+} SyncCounters;
+
+/**
+ * @typedef Directory entry of a listing merge
+ */
+typedef struct SyncName {
+  char *name;
+  unsigned char type;
+} SyncName;
+
+/**
+ * @typedef Walk context shared by the sync workers
+ */
+typedef struct SyncContext {
+  const char *source;
+  const char *destination;
+  OutputFlags outputFlags;
+  const SyncOptions *options;
+  SyncCounters counters[WALK_MAX_JOBS];
+} SyncContext;
+
+int parseMapArgument(char *arg, SyncMapping *mapping) {
+  char *to = strchr(arg, '=');
+
+  if (!to || to == arg) return -1;
+  *to++ = '\0';
+
+  // Mappings apply to whole components, without surrounding separators
+  while (*arg == *PATH_SEPARATOR) arg++;
+  while (*to == *PATH_SEPARATOR) to++;
+  for (size_t n = strlen(arg); n && arg[n - 1] == *PATH_SEPARATOR; --n)
+    arg[n - 1] = '\0';
+  for (size_t n = strlen(to); n && to[n - 1] == *PATH_SEPARATOR; --n)
+    to[n - 1] = '\0';
+  if (!*arg) return -1;
+
+  mapping->from = arg;
+  mapping->to = to;
+
+  return 0;
+}
+
+// Destination of a relative source path, 0 if it does not fit
+static int destinationPath(SyncContext *ctx, const char *relative,
+                           char *path, size_t size) {
+  const char *rest = relative;
+  const char *to = "";
+
+  for (int i = 0; i < ctx->options->mappingCount; ++i) {
+    SyncMapping *mapping = ctx->options->mappings + i;
+    size_t length = strlen(mapping->from);
+    if (strncmp(relative, mapping->from, length) == 0 &&
+        (!relative[length] || relative[length] == *PATH_SEPARATOR)) {
+      to = mapping->to;
+      rest = relative + length;
+      while (*rest == *PATH_SEPARATOR) rest++;
+      break;
+    }
+  }
+
+  return snprintf(path, size, "%s%s%s%s%s", ctx->destination,
+                  *to ? PATH_SEPARATOR : "", to,
+                  *rest ? PATH_SEPARATOR : "", rest) < (int)size;
+}
+
+// Record a change of a destination's tags in the journal
+static void syncRecord(const char *path, const unsigned char *oldBlob,
+                       ssize_t oldLength, const unsigned char *newBlob,
+                       ssize_t newLength) {
+  int oldCount, newCount;
+  UserTag *oldTags = createUserTagsFromData(oldBlob, oldLength, &oldCount);
+  UserTag *newTags = createUserTagsFromData(newBlob, newLength, &newCount);
+
+  journalRecord(path, oldTags, oldCount, newTags, newCount);
+  freeUserTags(oldTags, oldCount);
+  freeUserTags(newTags, newCount);
+}
+
+/**
+ * @typedef Outcome of bringing a destination in line with its source
+ * @enum 0 The destination already matched, or keeps tags the source lacks
+ * @enum 1 The destination was given the source's blob
+ * @enum 2 The destination was stripped of its tags
+ * @enum 3 The destination does not exist
+ */
+typedef enum SyncOutcome {
+  SyncOutcomeUnchanged,
+  SyncOutcomeWritten,
+  SyncOutcomeRemoved,
+  SyncOutcomeMissing
+} SyncOutcome;
+
+// Single optimistic attempt to give a destination the source's blob,
+// tagStoreSwap results
+static int syncOnce(SyncContext *ctx, const char *path,
+                    const unsigned char *sourceBlob, ssize_t sourceLength,
+                    SyncOutcome *outcome) {
+  unsigned char destinationBlob[EXT_ATTR_SIZE];
+  ssize_t destinationLength;
+  int status;
+
+  *outcome = SyncOutcomeUnchanged;
+  if ((destinationLength = tagStoreGet(path, destinationBlob,
+                                       sizeof(destinationBlob))) < 0) {
+    if (errno == ENOENT || errno == ENOTDIR) {
+      *outcome = SyncOutcomeMissing;
+      return 0;
+    }
+    if (errno != TAG_ENOATTR) return -1;
+  }
+  ssize_t currentLength = destinationLength < 0 ? 0 : destinationLength;
+
+  // Identical blobs are the common case and need no decoding
+  if (sourceLength == currentLength &&
+      memcmp(sourceBlob, destinationBlob, sourceLength) == 0)
+    return 0;
+
+  // Written only if no other writer changed the destination since it was
+  // read
+  if (sourceLength) {
+    *outcome = SyncOutcomeWritten;
+    status = tagStoreSwap(path, destinationBlob, destinationLength,
+                          sourceBlob, sourceLength);
+  } else if (ctx->options->mirrorRemovals) {
+    *outcome = SyncOutcomeRemoved;
+    status = tagStoreSwap(path, destinationBlob, destinationLength, NULL, -1);
+  } else {
+    // The destination keeps the tags the source does not have
+    return 0;
+  }
+
+  if (status >= 0 && status != 1 && journalActive())
+    syncRecord(path, destinationBlob, currentLength, sourceBlob,
+               sourceLength);
+
+  return status;
+}
+
+// Strip the tags of a destination, retrying if another writer got in between
+static int syncStrip(SyncContext *ctx, const char *path, SyncOutcome *outcome) {
+  unsigned char none = 0;
+  int status;
+
+  for (int attempt = 0; (status = syncOnce(ctx, path, &none, 0, outcome)) > 0;
+       ++attempt) {
+    if (tagStoreBackoff(attempt) != 0) return -1;
+  }
+  return status;
+}
+
+static int nameCompare(const void *a, const void *b) {
+  return strcmp(((const SyncName *)a)->name, ((const SyncName *)b)->name);
+}
+
+// Sorted entries of a directory the walk would visit, NULL with errno set if
+// it cannot be read
+static SyncName *listNames(SyncContext *ctx, const char *path, size_t *count) {
+  uint64_t start = governorAcquire();
+  DIR *pDir = opendir(path);
+  struct dirent *dir;
+  SyncName *names = NULL;
+  size_t capacity = 0, listed = 0;
+
+  governorRelease(start, 0);
+  *count = 0;
+  if (pDir == NULL) return NULL;
+
+  // Governed in batches of entries, like the listings of the walk
+  start = governorAcquire();
+  while ((dir = readdir(pDir)) != NULL) {
+    if (++listed % WALK_BATCH == 0) {
+      governorRelease(start, 0);
+      start = governorAcquire();
+    }
+    if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+      continue;
+    if (*(dir->d_name) == '.' && !(ctx->outputFlags & OutputFlagsShowHidden))
+      continue;
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      names = realloc(names, sizeof(*names) * capacity);
+    }
+    names[*count].name = strdup(dir->d_name);
+    names[(*count)++].type = dir->d_type;
+  }
+  governorRelease(start, 0);
+  closedir(pDir);
+
+  // An empty directory still lists successfully
+  if (!names) names = malloc(sizeof(*names));
+  qsort(names, *count, sizeof(*names), nameCompare);
+  return names;
+}
+
+static void freeNames(SyncName *names, size_t count) {
+  for (size_t i = 0; i < count; ++i) free(names[i].name);
+  free(names);
+}
+
+// Test whether a relative path lies at or below another, "" being the root
+static int underPath(const char *relative, const char *ancestor) {
+  size_t length = strlen(ancestor);
+
+  if (!length) return 1;
+  return strncmp(relative, ancestor, length) == 0 &&
+         (!relative[length] || relative[length] == *PATH_SEPARATOR);
+}
+
+// Test whether a mapping brings a source entry to a destination path the
+// listing merge found no source for
+static int syncMapped(SyncContext *ctx, const char *relative,
+                      const char *path) {
+  for (int i = 0; i < ctx->options->mappingCount; ++i) {
+    SyncMapping *mapping = ctx->options->mappings + i;
+    char source[PATH_MAX], candidate[PATH_MAX], target[PATH_MAX];
+    struct stat st;
+
+    if (!underPath(relative, mapping->to)) continue;
+
+    const char *rest = relative + strlen(mapping->to);
+    while (*rest == *PATH_SEPARATOR) rest++;
+    if (snprintf(candidate, sizeof(candidate), "%s%s%s", mapping->from,
+                 *rest ? PATH_SEPARATOR : "", rest) >= (int)sizeof(candidate) ||
+        snprintf(source, sizeof(source), "%s%s%s", ctx->source, PATH_SEPARATOR,
+                 candidate) >= (int)sizeof(source))
+      continue;
+
+    // The candidate counts only if no earlier mapping takes it elsewhere
+    if (lstat(source, &st) == 0 &&
+        destinationPath(ctx, candidate, target, sizeof(target)) &&
+        strcmp(target, path) == 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Strip the tags of a destination without a source, and of everything below
+// it that no mapping brings a source entry to
+static void stripTree(SyncContext *ctx, SyncCounters *counters,
+                      const char *relative, const char *path,
+                      unsigned char type) {
+  SyncOutcome outcome;
+  SyncName *names;
+  size_t count;
+
+  if (ctx->options->mappingCount && syncMapped(ctx, relative, path)) return;
+
+  if (type == DT_UNKNOWN) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return;
+    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : 0;
+  }
+  // Links would strip the tags of their targets
+  if (type == DT_LNK) return;
+
+  if (syncStrip(ctx, path, &outcome) < 0) {
+    reportError("%s: %s\n", path, strerror(errno));
+    counters->errors++;
+  } else if (outcome == SyncOutcomeRemoved) {
+    counters->removed++;
+  }
+
+  if (type != DT_DIR) return;
+  if (!(names = listNames(ctx, path, &count))) {
+    reportError("%s: %s\n", path, strerror(errno));
+    counters->errors++;
+    return;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    char _r[PATH_MAX], _p[PATH_MAX];
+    if (snprintf(_r, sizeof(_r), "%s%s%s", relative, PATH_SEPARATOR,
+                 names[i].name) < (int)sizeof(_r) &&
+        snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 names[i].name) < (int)sizeof(_p))
+      stripTree(ctx, counters, _r, _p, names[i].type);
+  }
+  freeNames(names, count);
+}
+#pragma clang diagnostic pop
+
+// Merge the sorted listings of a source directory and its destination,
+// stripping the tags of the entries only the destination has
+static void mirrorDirectory(SyncContext *ctx, SyncCounters *counters,
+                            const TagWalkEntry *entry, const char *path) {
+  SyncName *sources, *destinations;
+  size_t sourceCount, destinationCount, i = 0;
+
+  // An unreadable source is reported by the walk, and must not read as empty
+  if (!(sources = listNames(ctx, entry->path, &sourceCount))) return;
+  if (!(destinations = listNames(ctx, path, &destinationCount))) {
+    if (errno != ENOENT && errno != ENOTDIR) {
+      reportError("%s: %s\n", path, strerror(errno));
+      counters->errors++;
+    }
+    freeNames(sources, sourceCount);
+    return;
+  }
+
+  for (size_t j = 0; j < destinationCount; ++j) {
+    char relative[PATH_MAX], _p[PATH_MAX];
+    int order = 1;
+
+    while (i < sourceCount &&
+           (order = strcmp(sources[i].name, destinations[j].name)) < 0)
+      i++;
+    if (i < sourceCount && order == 0) continue;
+
+    if (snprintf(relative, sizeof(relative), "%s%s%s", entry->relative,
+                 *entry->relative ? PATH_SEPARATOR : "",
+                 destinations[j].name) >= (int)sizeof(relative) ||
+        snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 destinations[j].name) >= (int)sizeof(_p))
+      continue;
+    stripTree(ctx, counters, relative, _p, destinations[j].type);
+  }
+
+  freeNames(sources, sourceCount);
+  freeNames(destinations, destinationCount);
+}
+
+// Bring the tags of an entry's destination in line with the entry's
+static TagWalkResult syncVisit(const TagWalkEntry *entry, void *context) {
+  SyncContext *ctx = context;
+  SyncCounters *counters = ctx->counters + entry->worker;
+  unsigned char sourceBlob[EXT_ATTR_SIZE];
+  ssize_t sourceLength;
+  SyncOutcome outcome;
+  char path[PATH_MAX];
+  int status;
+
+  // Links below the source would copy the tags of their targets
+  if (entry->type == DT_LNK && entry->depth) return TagWalkContinue;
+
+  counters->files++;
+  if (!destinationPath(ctx, entry->relative, path, sizeof(path))) {
+    reportError("%s: %s\n", entry->path, strerror(ENAMETOOLONG));
+    counters->errors++;
+    return TagWalkContinue;
+  }
+
+  if ((sourceLength = tagStoreGet(entry->path, sourceBlob,
+                                  sizeof(sourceBlob))) < 0) {
+    if (errno != TAG_ENOATTR) {
+      reportError("%s: %s\n", entry->path, strerror(errno));
+      counters->errors++;
+      return TagWalkContinue;
+    }
+    sourceLength = 0;
+  }
+
+  // Start over from a fresh read whenever another writer got in between
+  for (int attempt = 0;
+       (status = syncOnce(ctx, path, sourceBlob, sourceLength, &outcome)) > 0;
+       ++attempt) {
+    if (tagStoreBackoff(attempt) != 0) {
+      status = -1;
+      break;
+    }
+  }
+  if (status < 0) {
+    reportError("%s: %s\n", path, strerror(errno));
+    counters->errors++;
+    return TagWalkContinue;
+  }
+
+  switch (outcome) {
+    case SyncOutcomeWritten:
+      counters->written++;
+      break;
+    case SyncOutcomeRemoved:
+      counters->removed++;
+      break;
+    case SyncOutcomeMissing:
+      counters->missing++;
+      break;
+    default:
+      counters->unchanged++;
+      break;
+  }
+
+  if (entry->type == DT_DIR && ctx->options->mirrorRemovals &&
+      outcome != SyncOutcomeMissing)
+    mirrorDirectory(ctx, counters, entry, path);
+
+  return TagWalkContinue;
+}
+
+int syncTags(char *source, char *destination, const SyncOptions *options,
+             OutputFlags outputFlags, int jobs) {
+  SyncContext *ctx = calloc(1, sizeof(*ctx));
+  TagWalker walker = {.jobs = jobs,
+                      .outputFlags = outputFlags | OutputFlagsRecurseDirectory,
+                      .visit = syncVisit,
+                      .context = ctx};
+  SyncCounters total = {0};
+
+  ctx->source = source;
+  ctx->destination = destination;
+  ctx->outputFlags = outputFlags;
+  ctx->options = options;
+
+  tagWalk(&walker, &source, 1);
+
+  for (int i = 0; i < walker.jobs; ++i) {
+    total.files += ctx->counters[i].files;
+    total.unchanged += ctx->counters[i].unchanged;
+    total.written += ctx->counters[i].written;
+    total.removed += ctx->counters[i].removed;
+    total.missing += ctx->counters[i].missing;
+    total.errors += ctx->counters[i].errors;
+  }
+  free(ctx);
+
+  printf("# files=%llu unchanged=%llu written=%llu removed=%llu "
+         "missing=%llu\n",
+         total.files, total.unchanged, total.written, total.removed,
+         total.missing);
+
+  return (total.errors || walker.errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+//
+// sync.h
+// Tag
+//
+
+#ifndef TAG_SYNC_H
+#define TAG_SYNC_H
+
+#include "usertag.h"
+
+/**
+ * @typedef Rewrite of the paths below the source into paths below the
+ * destination
+ * @field from Relative source path, a whole number of components
+ * @field to Relative destination path replacing it, empty for the root
+ */
+typedef struct SyncMapping {
+  char *from;
+  char *to;
+} SyncMapping;
+
+/**
+ * @typedef Options of a tag sync
+ * @field mappings Path rewrites, the first one matching a path applies
+ * @field mappingCount Number of path rewrites
+ * @field mirrorRemovals Remove the tags of destinations whose source carries
+ * none, or that have no source entry
+ */
+typedef struct SyncOptions {
+  SyncMapping *mappings;
+  int mappingCount;
+  int mirrorRemovals;
+} SyncOptions;
+
+/**
+ * @brief Parse a path mapping argument of the form from=to
+ * @param arg Argument, modified in place
+ * @param mapping Mapping to fill in, pointing into arg
+ * @return 0 on success, -1 if the argument is malformed
+ */
+int parseMapArgument(char *arg, SyncMapping *mapping);
+
+/**
+ * @brief Copy the tags of every entry below a source to the same entry below
+ * a destination
+ * @param source Source tree
+ * @param destination Destination tree
+ * @param options Mappings and removal mirroring
+ * @param outputFlags Enumeration flags (hidden files)
+ * @param jobs Number of worker threads
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if an entry could not be read or
+ * written
+ * @note The raw tag blobs are compared and only destinations whose blob
+ * differs are written, so a repeated sync reads both trees and writes
+ * nothing. Destinations that do not exist are counted and skipped, and
+ * symbolic links below the source are not followed. When removals are
+ * mirrored, the sorted listings of each source directory and its
+ * destination are merged to find the entries only the destination has. A
+ * summary line is printed at the end.
+ */
+int syncTags(char *source, char *destination, const SyncOptions *options,
+             OutputFlags outputFlags, int jobs);
+
+#endif  // TAG_SYNC_H
@@ -0,0 +1,231 @@
+//
+// trie.c
+// Tag
+//
+
+#include "trie.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @typedef Key being inserted and the ways it matches
+ */
+typedef struct TrieKey {
+  char *key;
+  unsigned char kinds;
+} TrieKey;
+
+static int trieKeyCompare(const void *a, const void *b) {
+  return strcmp(((const TrieKey *)a)->key, ((const TrieKey *)b)->key);
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Fill in a node for the keys [low, high) sharing their first depth bytes,
+// appending its children after every node allocated so far
+static void trieFill(TagTrie *trie, uint32_t node, uint32_t low, uint32_t high,
+                     size_t depth) {
+  uint32_t first = low, count = 0;
+
+  trie->nodes[node].low = low;
+  trie->nodes[node].high = high;
+
+  // A key ending here sorts before every longer key below the node
+  if (first < high && !trie->keys[first][depth]) {
+    trie->nodes[node].kinds = trie->kinds[first];
+    first++;
+  }
+
+  for (uint32_t i = first; i < high; ++i)
+    if (i == first || trie->keys[i][depth] != trie->keys[i - 1][depth])
+      count++;
+
+  // The children are allocated together, so they are contiguous
+  uint32_t child = trie->nodeCount;
+  trie->nodes[node].child = child;
+  trie->nodes[node].childCount = (uint16_t)count;
+  trie->nodeCount += count;
+
+  for (uint32_t i = first; i < high; ++child) {
+    unsigned char label = (unsigned char)trie->keys[i][depth];
+    uint32_t end = i + 1;
+    while (end < high && (unsigned char)trie->keys[end][depth] == label) end++;
+    trie->nodes[child].label = label;
+    trieFill(trie, child, i, end, depth + 1);
+    i = end;
+  }
+}
+#pragma clang diagnostic pop
+
+// Build a trie over keys sorted and merged by the caller, taking ownership
+static TagTrie *trieCreate(TrieKey *keys, uint32_t count) {
+  TagTrie *trie = calloc(1, sizeof(*trie));
+  size_t bytes = 1;
+
+  trie->keys = calloc(count ? count : 1, sizeof(*trie->keys));
+  trie->kinds = calloc(count ? count : 1, sizeof(*trie->kinds));
+  trie->keyCount = count;
+  for (uint32_t i = 0; i < count; ++i) {
+    trie->keys[i] = keys[i].key;
+    trie->kinds[i] = keys[i].kinds;
+    bytes += strlen(keys[i].key);
+    trie->requirements += (keys[i].kinds & TagTrieExact ? 1 : 0) +
+                          (keys[i].kinds & TagTriePrefix ? 1 : 0);
+  }
+
+  // A node per distinct prefix, at most one per byte plus the root
+  trie->nodes = calloc(bytes, sizeof(*trie->nodes));
+  trie->nodeCount = 1;
+  trieFill(trie, 0, 0, count, 0);
+
+  return trie;
+}
+
+// Sort keys and merge the kinds of equal ones, returning the unique count
+static uint32_t trieMerge(TrieKey *keys, uint32_t count) {
+  uint32_t unique = 0;
+
+  qsort(keys, count, sizeof(*keys), trieKeyCompare);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (unique && strcmp(keys[unique - 1].key, keys[i].key) == 0) {
+      keys[unique - 1].kinds |= keys[i].kinds;
+      free(keys[i].key);
+      continue;
+    }
+    keys[unique++] = keys[i];
+  }
+  return unique;
+}
+
+TagTrie *tagTrieCompile(UserTag *userTags, int tagCount) {
+  TrieKey *keys = calloc(tagCount ? tagCount : 1, sizeof(*keys));
+  uint32_t count = 0;
+  TagTrie *trie;
+
+  for (int i = 0; i < tagCount; ++i) {
+    const char *name = userTags[i].name;
+    size_t length = strlen(name);
+
+    // A trailing '*' turns the rest of the name into a prefix
+    if (length && name[length - 1] == '*') {
+      keys[count].key = strndup(name, length - 1);
+      keys[count++].kinds = TagTriePrefix;
+    } else {
+      keys[count].key = strdup(name);
+      keys[count++].kinds = TagTrieExact;
+    }
+  }
+
+  trie = trieCreate(keys, trieMerge(keys, count));
+  trie->none = !tagCount || !userTags->name;
+  trie->any = !trie->none && *userTags->name == '*';
+
+  free(keys);
+  return trie;
+}
+
+TagTrie *tagTrieBuild(char *const *names, uint32_t count) {
+  TrieKey *keys = calloc(count ? count : 1, sizeof(*keys));
+  TagTrie *trie;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    keys[i].key = strdup(names[i]);
+    keys[i].kinds = TagTrieExact;
+  }
+  trie = trieCreate(keys, count);
+
+  free(keys);
+  return trie;
+}
+
+void tagTrieFree(TagTrie *trie) {
+  if (!trie) return;
+  for (uint32_t i = 0; i < trie->keyCount; ++i) free(trie->keys[i]);
+  free(trie->keys);
+  free(trie->kinds);
+  free(trie->nodes);
+  free(trie);
+}
+
+// Child of a node along a byte, 0 if there is none
+static uint32_t trieChild(const TagTrie *trie, const TagTrieNode *node,
+                          unsigned char label) {
+  uint32_t low = node->child, high = node->child + node->childCount;
+
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    unsigned char found = trie->nodes[middle].label;
+    if (found == label) return middle;
+    if (found < label) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return 0;
+}
+
+// Record a satisfied (key, kind) pair, returning 1 if it is new
+static int trieMark(uint64_t *satisfied, uint32_t rank, TagTrieKind kind) {
+  uint32_t bit = rank * 2 + (kind == TagTriePrefix);
+  uint64_t mask = (uint64_t)1 << (bit % 64);
+
+  if (satisfied[bit / 64] & mask) return 0;
+  satisfied[bit / 64] |= mask;
+  return 1;
+}
+
+int tagTrieMatch(const TagTrie *trie, const UserTag *userTags, int tagCount) {
+  if (trie->none) return tagCount == 0;
+  if (trie->any) return tagCount > 0;
+
+  // Two bits per key, on the stack for the usual handful of patterns
+  size_t words = (trie->keyCount * 2 + 63) / 64;
+  uint64_t local = 0;
+  uint64_t *satisfied = words > 1 ? calloc(words, sizeof(*satisfied)) : &local;
+  uint32_t remaining = trie->requirements;
+
+  for (int i = 0; i < tagCount && remaining; ++i) {
+    const unsigned char *p = (const unsigned char *)userTags[i].name;
+    uint32_t n = 0;
+
+    for (;;) {
+      const TagTrieNode *node = trie->nodes + n;
+      if ((node->kinds & TagTriePrefix) &&
+          trieMark(satisfied, node->low, TagTriePrefix))
+        remaining--;
+      if (!*p) {
+        if ((node->kinds & TagTrieExact) &&
+            trieMark(satisfied, node->low, TagTrieExact))
+          remaining--;
+        break;
+      }
+      if (!(n = trieChild(trie, node, *p++))) break;
+    }
+  }
+
+  if (satisfied != &local) free(satisfied);
+  return remaining == 0;
+}
+
+uint32_t tagTrieExpand(const TagTrie *trie, const char *key,
+                       TagTrieKind kind, uint32_t *low, uint32_t *high) {
+  const TagTrieNode *node = trie->nodes;
+
+  *low = *high = 0;
+  for (const unsigned char *p = (const unsigned char *)key; *p; ++p) {
+    uint32_t n = trieChild(trie, node, *p);
+    if (!n) return 0;
+    node = trie->nodes + n;
+  }
+
+  if (kind == TagTriePrefix) {
+    *low = node->low;
+    *high = node->high;
+  } else if (node->kinds & TagTrieExact) {
+    *low = node->low;
+    *high = node->low + 1;
+  }
+  return *high - *low;
+}
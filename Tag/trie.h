@@ -0,0 +1,112 @@
+//
+// trie.h
+// Tag
+//
+
+#ifndef TAG_TRIE_H
+#define TAG_TRIE_H
+
+#include "usertag.h"
+
+#include <stdint.h>
+
+/**
+ * @typedef How a key of a trie matches a tag name
+ * @enum 0b00000001 The name equals the key
+ * @enum 0b00000010 The name starts with the key, a pattern ending in '*'
+ */
+typedef enum TagTrieKind {
+  TagTrieExact  = (1 << 0),
+  TagTriePrefix = (1 << 1)
+} TagTrieKind;
+
+/**
+ * @typedef Node of a trie, the children of a node are contiguous and sorted
+ * by label
+ * @field child Index of the first child
+ * @field low Rank of the first key at or below the node
+ * @field high Rank past the last key at or below the node
+ * @field childCount Number of children
+ * @field label Byte leading from the parent to the node
+ * @field kinds TagTrieKind bits of the key ending at the node, 0 if none
+ */
+typedef struct TagTrieNode {
+  uint32_t child;
+  uint32_t low;
+  uint32_t high;
+  uint16_t childCount;
+  unsigned char label;
+  unsigned char kinds;
+} TagTrieNode;
+
+/**
+ * @typedef Trie of sorted unique keys, node 0 is the root
+ * @field nodes Nodes in depth first order
+ * @field nodeCount Number of nodes
+ * @field keys Keys in strcmp order, a key's index is its rank
+ * @field keyCount Number of keys
+ * @field kinds TagTrieKind bits of every key, by rank
+ * @field requirements Number of (key, kind) pairs a match must satisfy
+ * @field any A match is satisfied by any tag, the "*" pattern
+ * @field none A match is satisfied by no tags only, an empty pattern list
+ */
+typedef struct TagTrie {
+  TagTrieNode *nodes;
+  uint32_t nodeCount;
+  char **keys;
+  uint32_t keyCount;
+  unsigned char *kinds;
+  uint32_t requirements;
+  int any;
+  int none;
+} TagTrie;
+
+/**
+ * @brief Compile the tags of a match request into a trie
+ * @param userTags Tags to match, a trailing '*' matches any rest of a name,
+ * "*" alone matches any tag, no name matches none
+ * @param tagCount Count of the tags
+ * @return Trie, release with tagTrieFree
+ */
+TagTrie *tagTrieCompile(UserTag *userTags, int tagCount);
+
+/**
+ * @brief Build a trie of plain keys, each matching only itself
+ * @param names Sorted unique names, copied
+ * @param count Number of names
+ * @return Trie, release with tagTrieFree
+ */
+TagTrie *tagTrieBuild(char *const *names, uint32_t count);
+
+/**
+ * @brief Release a trie
+ * @param trie Trie, may be NULL
+ */
+void tagTrieFree(TagTrie *trie);
+
+/**
+ * @brief Test tags against a compiled match request
+ * @param trie Compiled request
+ * @param userTags Tags of a path
+ * @param tagCount Count of the tags of the path
+ * @return 1 if every pattern of the request matches one of the tags
+ * @note Every name is walked down the trie once, marking the patterns it
+ * satisfies on the way, so the cost depends on the length of the names and
+ * not on the number of patterns.
+ */
+int tagTrieMatch(const TagTrie *trie, const UserTag *userTags, int tagCount);
+
+/**
+ * @brief Ranks of the keys of a trie matching a key of a compiled request
+ * @param trie Trie built by tagTrieBuild
+ * @param key Key of the request
+ * @param kind TagTrieExact for the key itself, TagTriePrefix for every key
+ * starting with it
+ * @param low Receives the rank of the first matching key
+ * @param high Receives the rank past the last matching key
+ * @return Number of matching keys, which are contiguous in rank order
+ */
+uint32_t tagTrieExpand(const TagTrie *trie, const char *key,
+                       TagTrieKind kind, uint32_t *low, uint32_t *high);
+
+#endif  // TAG_TRIE_H
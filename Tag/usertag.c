@@ -30,15 +30,46 @@
 
 #include "usertag.h"
 
-#include "array.h"
-#include <CoreFoundation/CoreFoundation.h>
+#include "approx.h"
+#include "cache.h"
+#include "checkpoint.h"
+#include "count.h"
+#include "fsck.h"
+#include "governor.h"
+#include "index.h"
+#include "journal.h"
+#include "memo.h"
+#include "migrate.h"
+#include "mutate.h"
+#include "plist.h"
+#include "probes.h"
+#include "rename.h"
+#include "server.h"
+#include "shard.h"
+#include "since.h"
+#include "store.h"
+#include "sync.h"
+#include "trie.h"
+#include "walk.h"
+#include "xdg.h"
+#include <ctype.h>
 #include <dirent.h>
 #include <getopt.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
-#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+// The Finder's encoding of the tags is used where it is available
+#ifdef __APPLE__
+#include "array.h"
+#include <CoreFoundation/CoreFoundation.h>
+#endif
 
 int parseCommandLine(int argc, char *const argv[]) {
   // Command line arguments
@@ -63,6 +94,44 @@ int parseCommandLine(int argc, char *const argv[]) {
     // Directory enumeration options
     {"all", no_argument, 0, 'A'},
     {"recursive", no_argument, 0, 'R'},
+    {"jobs", required_argument, 0, 'j'},
+    {"shard", required_argument, 0, LongOptionShard},
+    // I/O governor
+    {"max-rate", required_argument, 0, LongOptionMaxRate},
+    {"max-inflight", required_argument, 0, LongOptionMaxInflight},
+    {"target-latency", required_argument, 0, LongOptionTargetLatency},
+    {"background", no_argument, 0, LongOptionBackground},
+    // Resumable bulk changes
+    {"checkpoint", required_argument, 0, LongOptionCheckpoint},
+    {"resume", required_argument, 0, LongOptionResume},
+    // Aggregation
+    {"count", no_argument, 0, OperationModeCount},
+    {"histogram", no_argument, 0, OperationModeCount},
+    {"bytes", no_argument, 0, LongOptionBytes},
+    {"json", no_argument, 0, LongOptionJson},
+    {"approx", required_argument, 0, OperationModeApprox},
+    {"seed", required_argument, 0, LongOptionSeed},
+    {"rename", required_argument, 0, OperationModeRename},
+    {"recolor", required_argument, 0, LongOptionRecolor},
+    {"merge", no_argument, 0, OperationModeMerge},
+    {"sync", required_argument, 0, OperationModeSync},
+    {"map", required_argument, 0, LongOptionMap},
+    {"mirror-removals", no_argument, 0, LongOptionMirrorRemovals},
+    {"fsck", no_argument, 0, OperationModeFsck},
+    {"repair", no_argument, 0, LongOptionRepair},
+    // Tag index
+    {"build-index", required_argument, 0, OperationModeIndex},
+    {"index", required_argument, 0, LongOptionIndex},
+    // Storage
+    {"store", required_argument, 0, LongOptionStore},
+    {"migrate-format", required_argument, 0, OperationModeMigrate},
+    // Change journal
+    {"journal", required_argument, 0, LongOptionJournal},
+    {"journal-read", no_argument, 0, OperationModeJournalRead},
+    {"since", required_argument, 0, LongOptionSince},
+    // Server
+    {"serve", required_argument, 0, OperationModeServe},
+    {"client", required_argument, 0, LongOptionClient},
     // Other
     {"help", no_argument, 0, 'h'},
     {"version", no_argument, 0, 'v'},
@@ -71,6 +140,9 @@ int parseCommandLine(int argc, char *const argv[]) {
   // Option character
   int opt;
 
+  // Exit status
+  int status = EXIT_SUCCESS;
+
   // Operation mode initialized to a known state
   OperationMode operationMode = OperationModeUnknown;
 
@@ -83,15 +155,72 @@ int parseCommandLine(int argc, char *const argv[]) {
   // Number of argument tags
   int tagCount = 0;
 
-  // Tag extended attribute property list binary data
-  UInt8 *plBin = NULL;
+  // Aggregation options
+  CountFlags countFlags = 0;
+
+  // Number of worker threads, 0 selects the number of processors
+  int jobs = 0;
+
+  // Report the throughput of add, remove and set, once -j is given
+  int mutateReport = 0;
+
+  // Slice of the tree walked by this process, and the number of slices
+  int shard = 0, shardCount = 0, shardDepth = 0;
+
+  // Limits on the tag reads and writes
+  GovernorOptions governorOptions = {0};
+
+  // Any limit was given
+  int governed = 0;
+
+  // Sampling options, the seed is reported so runs can be reproduced
+  ApproxOptions approxOptions = {
+    .rate = 1, .seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32)};
+
+  // Rename and recolor rules
+  TagRename *renames = NULL;
 
-  // Tag extended attribute property list binary data length
-  size_t plLen = 0;
+  // Sync source, path mappings and removal mirroring
+  char *syncSource = NULL;
+  SyncOptions syncOptions = {0};
+
+  // Rewrite the blobs found by a check in the canonical form
+  int repair = 0;
+
+  // Index file to build, or to answer a match from
+  char *indexPath = NULL;
+
+  // Tags of a match compiled once for every path
+  TagTrie *query = NULL;
+
+  // Number of rename and recolor rules
+  int renameCount = 0;
+
+  // Tag storage backend, extended attributes unless specified
+  TagStore *store = NULL;
+
+  // Format whose attribute a migration moves the tags into
+  TagFormat migrateFormat = TagFormatPlist;
+
+  // Change journal file
+  char *journalPath = NULL;
+
+  // Journal sequence number to read after, or the state file of a list or
+  // match reporting changes
+  char *since = NULL;
+
+  // Socket of the server to run or to forward to
+  char *socketPath = NULL;
+
+  // Position file of a resumable bulk change, and the one to continue from
+  char *checkpointPath = NULL, *resumePath = NULL;
+
+  // Forward the whole invocation to a server before parsing it
+  if (!tagServerActive() && clientTags(argc, argv, &status)) return status;
 
   // Parse options
   int ndx = 0;
-  while ((opt = getopt_long(argc, argv, "s:a:r:lnNtTgGcCp0ARhv", options,
+  while ((opt = getopt_long(argc, argv, "s:a:r:lnNtTgGcCp0ARj:hv", options,
                             &ndx)) != -1) {
     switch (opt) {
       case OperationModeSet:
@@ -102,11 +231,162 @@ int parseCommandLine(int argc, char *const argv[]) {
         if (operationMode) {
           reportError("%s\n", "Operation mode cannot be respecified");
           freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
           return EXIT_FAILURE;
         }
         operationMode = opt;
         tags = parseTagsArgument(optarg, &tagCount);
         break;
+      case OperationModeCount:
+      case OperationModeApprox:
+      case OperationModeJournalRead:
+      case OperationModeServe:
+      case OperationModeMerge:
+      case OperationModeSync:
+      case OperationModeFsck:
+      case OperationModeIndex:
+      case OperationModeMigrate:
+        if (operationMode) {
+          reportError("%s\n", "Operation mode cannot be respecified");
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        operationMode = opt;
+        if (opt == OperationModeApprox) approxOptions.rate = atof(optarg);
+        if (opt == OperationModeServe) socketPath = optarg;
+        if (opt == OperationModeSync) syncSource = optarg;
+        if (opt == OperationModeIndex) indexPath = optarg;
+        if (opt == OperationModeMigrate &&
+            tagFormatParse(optarg, &migrateFormat) != 0) {
+          reportError("%s: %s\n", "Unknown format", optarg);
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        break;
+      case LongOptionMap:
+        syncOptions.mappings =
+          realloc(syncOptions.mappings,
+                  sizeof(*syncOptions.mappings) *
+                    (syncOptions.mappingCount + 1));
+        if (parseMapArgument(optarg, syncOptions.mappings +
+                                       syncOptions.mappingCount) != 0) {
+          reportError("%s: %s\n", "Malformed mapping", optarg);
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        syncOptions.mappingCount++;
+        break;
+      case LongOptionMirrorRemovals:
+        syncOptions.mirrorRemovals = 1;
+        break;
+      case LongOptionRepair:
+        repair = 1;
+        break;
+      case LongOptionIndex:
+        indexPath = optarg;
+        break;
+      case OperationModeRename:
+      case LongOptionRecolor:
+        // Several rules may be given, they are applied in a single pass
+        if (operationMode && operationMode != OperationModeRename) {
+          reportError("%s\n", "Operation mode cannot be respecified");
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        operationMode = OperationModeRename;
+        renames = realloc(renames, sizeof(*renames) * (renameCount + 1));
+        if ((opt == OperationModeRename
+               ? parseRenameArgument(optarg, renames + renameCount)
+               : parseRecolorArgument(optarg, renames + renameCount)) != 0) {
+          reportError("%s: %s\n", "Malformed rule", optarg);
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        renameCount++;
+        break;
+      case LongOptionSeed:
+        approxOptions.seed = strtoull(optarg, NULL, 10);
+        break;
+      case LongOptionBytes:
+        countFlags |= CountFlagsBytes;
+        break;
+      case LongOptionJson:
+        countFlags |= CountFlagsJson;
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        mutateReport = 1;
+        break;
+      case LongOptionShard:
+        if (tagWalkParseShard(optarg, &shard, &shardCount, &shardDepth) !=
+            0) {
+          reportError("%s: %s\n", "Malformed shard", optarg);
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        tagWalkSetShard(shard, shardCount, shardDepth);
+        break;
+      case LongOptionMaxRate:
+        governorOptions.maxRate = atof(optarg);
+        governed = 1;
+        break;
+      case LongOptionMaxInflight:
+        governorOptions.maxInflight = atoi(optarg);
+        governed = 1;
+        break;
+      case LongOptionTargetLatency:
+        if (governorParseTarget(optarg, &governorOptions) != 0) {
+          reportError("%s: %s\n", "Malformed latency target", optarg);
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        governed = 1;
+        break;
+      case LongOptionBackground:
+        governorOptions.background = 1;
+        governed = 1;
+        break;
+      case LongOptionStore:
+        tagStoreClose(store);
+        if ((store = tagStoreOpen(optarg)) == NULL) {
+          freeUserTags(tags, tagCount);
+          free(renames);
+          free(syncOptions.mappings);
+          return EXIT_FAILURE;
+        }
+        tagStoreSetDefault(store);
+        break;
+      case LongOptionCheckpoint:
+        checkpointPath = optarg;
+        break;
+      case LongOptionResume:
+        resumePath = optarg;
+        break;
+      case LongOptionJournal:
+        journalPath = optarg;
+        break;
+      case LongOptionSince:
+        since = optarg;
+        break;
+      case LongOptionClient:
+        // Only reached by a request of a server
+        socketPath = optarg;
+        break;
       case 'n':
         outputFlags |= OutputFlagsName;
         break;
@@ -160,12 +440,121 @@ int parseCommandLine(int argc, char *const argv[]) {
   // Default the operation mode to list if it was not set
   if (operationMode == OperationModeUnknown) operationMode = OperationModeList;
 
-  // Process any remaining arguments as file paths
-  if (operationMode > OperationModeNone) {
-    if (operationMode == OperationModeSet) {
-      // Create a binary format property list from the tags argument
-      plBin = createPlistBinary(&plLen, tags, tagCount);
+  // A checkpoint is the position of a single ordered walk
+  int jobsGiven = jobs > 0;
+  if (jobs < 1) jobs = tagWalkDefaultJobs();
+
+  // Govern every tag read and write from here on
+  if (governed && !tagServerActive()) governorConfigure(&governorOptions);
+
+  if (tagServerActive() &&
+      (socketPath || store || journalPath || governed || checkpointPath ||
+       resumePath || since || indexPath ||
+       (operationMode != OperationModeNone &&
+        operationMode != OperationModeSet &&
+        operationMode != OperationModeAdd &&
+        operationMode != OperationModeRemove &&
+        operationMode != OperationModeMatch &&
+        operationMode != OperationModeList))) {
+    // The server owns the storage and the journal of its requests
+    reportError("%s\n", "Operation not available from a tag server");
+    status = EXIT_FAILURE;
+  } else if ((checkpointPath || resumePath) && jobsGiven) {
+    reportError("%s\n", "--jobs cannot be used with --checkpoint or --resume");
+    status = EXIT_FAILURE;
+  } else if (operationMode == OperationModeMerge) {
+    // Combine the outputs of the slices of a sharded scan
+    status = mergeResults(argv + optind, argc - optind, outputFlags,
+                          countFlags);
+  } else if (operationMode == OperationModeServe) {
+    // Answer forwarded invocations until interrupted
+    status = serveTags(socketPath, journalPath);
+  } else if (operationMode == OperationModeCount) {
+    // Aggregation walks the paths itself and prints only the final table
+    status = countTags(argv + optind, argc - optind, outputFlags, countFlags,
+                       jobs);
+  } else if (operationMode == OperationModeApprox) {
+    // Sampling likewise only prints the estimates
+    approxOptions.countFlags = countFlags;
+    status = approxTags(argv + optind, argc - optind, outputFlags,
+                        &approxOptions);
+  } else if (operationMode == OperationModeJournalRead) {
+    // Print the recorded changes
+    if (!journalPath) {
+      reportError("%s\n", "--journal-read requires --journal <file>");
+      status = EXIT_FAILURE;
+    } else {
+      status = journalRead(journalPath, since ? strtoull(since, NULL, 10) : 0,
+                           outputFlags, (countFlags & CountFlagsJson) != 0);
+    }
+  } else if (journalPath && (operationMode == OperationModeSet ||
+                             operationMode == OperationModeAdd ||
+                             operationMode == OperationModeRemove ||
+                             operationMode == OperationModeRename ||
+                             operationMode == OperationModeSync ||
+                             operationMode == OperationModeMigrate ||
+                             (operationMode == OperationModeFsck && repair)) &&
+             journalOpen(journalPath) != 0) {
+    // Changes made by the mutating operations cannot be recorded
+    status = EXIT_FAILURE;
+  } else if (operationMode == OperationModeRename) {
+    // Renames walk the paths once, decoding each path's tags once
+    status = renameTags(argv + optind, argc - optind, renames, renameCount,
+                        outputFlags, jobs);
+  } else if (operationMode == OperationModeFsck) {
+    // Classify every blob, rewriting the ones that decode when repairing
+    status = fsckTags(argv + optind, argc - optind, repair, outputFlags, jobs);
+  } else if (operationMode == OperationModeIndex) {
+    // Record the tags of the whole tree for matches answered without a walk
+    status = indexBuild(indexPath, argv + optind, argc - optind, outputFlags,
+                        jobs);
+  } else if (operationMode == OperationModeMigrate) {
+    // Move the tags of the other format's attribute into the chosen one
+    status = migrateTags(argv + optind, argc - optind, migrateFormat,
+                         outputFlags, jobs);
+  } else if (indexPath && operationMode == OperationModeMatch) {
+    // Expand the tags through the index instead of reading the tree
+    status = indexMatch(indexPath, argv + optind, argc - optind, tags,
+                        tagCount, outputFlags);
+  } else if (operationMode == OperationModeSync) {
+    // Copy the differing tags of the source tree to the destination tree
+    if (argc - optind != 1) {
+      reportError("%s\n", "--sync requires a source and a destination");
+      status = EXIT_FAILURE;
+    } else {
+      status = syncTags(syncSource, argv[optind], &syncOptions, outputFlags,
+                        jobs);
     }
+  } else if ((operationMode == OperationModeSet ||
+              operationMode == OperationModeAdd ||
+              operationMode == OperationModeRemove) &&
+             (checkpointPath || resumePath)) {
+    // Bulk changes walk the paths in an order that can be resumed, with -R
+    // every file below them
+    status = checkpointTags(argv + optind, argc - optind, operationMode, tags,
+                            tagCount, outputFlags, checkpointPath,
+                            resumePath);
+  } else if (since && (operationMode == OperationModeList ||
+                       operationMode == OperationModeMatch)) {
+    // Only the changes since the scan recorded in the state file
+    status = sinceTags(argv + optind, argc - optind, operationMode, tags,
+                       tagCount, outputFlags, since);
+  } else if (shardCount > 1 && (operationMode == OperationModeList ||
+                                 operationMode == OperationModeMatch)) {
+    // A slice is walked like count and printed sorted for merging
+    status = shardTags(argv + optind, argc - optind, operationMode, tags,
+                       tagCount, outputFlags, jobs);
+  } else if (operationMode == OperationModeSet ||
+             operationMode == OperationModeAdd ||
+             operationMode == OperationModeRemove) {
+    // Path lists are changed by a pool of workers, a directory at a time
+    status = mutateTags(argv + optind, argc - optind, operationMode, tags,
+                        tagCount, jobs, mutateReport);
+  } else if (operationMode > OperationModeNone) {
+    if (operationMode == OperationModeMatch)
+      query = tagTrieCompile(tags, tagCount);
+
+    // Process any remaining arguments as file paths
     // Default to CWD if no filenames entered
     if ((operationMode == OperationModeList ||
          operationMode == OperationModeMatch) &&
@@ -184,7 +573,7 @@ int parseCommandLine(int argc, char *const argv[]) {
           if (operationMode == OperationModeList)
             listTags(dir->d_name, outputFlags);
           if (operationMode == OperationModeMatch)
-            matchTags(dir->d_name, tags, tagCount, outputFlags);
+            matchTags(dir->d_name, query, outputFlags);
         }
         closedir(_d);
       }
@@ -198,18 +587,8 @@ int parseCommandLine(int argc, char *const argv[]) {
       if (!strlen(path)) continue;
 
       switch (operationMode) {
-        case OperationModeSet:
-          // Apply the attr data on each path
-          setxattr(path, TAG_NAME, plBin, plLen, 0, 0);
-          break;
-        case OperationModeAdd:
-          addTags(path, tags, tagCount);
-          break;
-        case OperationModeRemove:
-          removeTags(path, tags, tagCount);
-          break;
         case OperationModeMatch:
-          matchTags(path, tags, tagCount, outputFlags);
+          matchTags(path, query, outputFlags);
           break;
         case OperationModeList:
           listTags(path, outputFlags);
@@ -220,11 +599,31 @@ int parseCommandLine(int argc, char *const argv[]) {
     }
   }
 
+  // Hand the buffered output over before anything is torn down
+  fflush(stdout);
+  TAG_PROBE2(output__flush, STDOUT_FILENO, -1L);
+
   // Cleanup
-  if (plBin) free(plBin);
+  if (shardCount) tagWalkSetShard(0, 0, WALK_SHARD_DEPTH);
+  if (governed && !tagServerActive()) governorConfigure(NULL);
   freeUserTags(tags, tagCount);
+  tagTrieFree(query);
+  free(renames);
+  free(syncOptions.mappings);
+
+  // Append and sync the last group of journal records, a server keeps its
+  // journal open across requests
+  if ((tagServerActive() ? journalFlush() : journalClose()) != 0)
+    status = EXIT_FAILURE;
+
+  // Flush the storage backend, the one a server was started with is synced
+  // before the reply acknowledges the changes
+  if (tagStoreClose(store) != 0 || tagStoreSync() != 0) {
+    reportError("%s: %s\n", "Tag store", strerror(errno));
+    status = EXIT_FAILURE;
+  }
 
-  return EXIT_SUCCESS;
+  return status;
 }
 
 UserTag *parseTagsArgument(char *arg, int *tagCount) {
@@ -240,8 +639,8 @@ UserTag *parseTagsArgument(char *arg, int *tagCount) {
   // array of tags
   UserTag *userTags = calloc(ALLOC_AMOUNT, sizeof(*userTags));
 
-  // Process the comma delimited string of tags
-  while ((tok = strtok_r(arg, ",", &arg))) {
+  // Process the comma delimited string of tags, list passes no argument
+  while (arg && (tok = strtok_r(arg, ",", &arg))) {
     // If the tag name contains a color, split, and use the first part for the
     // name, second part for the color
     nam = strtok_r(tok, ":", &tok);
@@ -266,112 +665,272 @@ UserTag *parseTagsArgument(char *arg, int *tagCount) {
   return userTags;
 }
 
-void addTags(char *path, UserTag *userTags, int tagCount) {
-  // Paths' existing tags
-  UserTag *existingTags;
+// Single optimistic attempt of addTags, tagStoreSwap results
+static int addTagsOnce(char *path, UserTag *userTags, int tagCount) {
+  // Path's existing tag blob
+  unsigned char buf[EXT_ATTR_SIZE];
 
-  // Merged tags from the argument tags and existing path tags
-  UserTag *mergedTags;
+  // Path's existing tag blob length, -1 if it carries none
+  ssize_t len;
 
-  // Paths' existing tags count
-  int existingTagsCount;
+  // Paths' existing tags
+  UserTag *existingTags = NULL;
 
-  // Merged tags count
-  int mergedTagsCount;
+  // Paths' existing tags count
+  int existingTagsCount = 0;
 
   // Binary property list buffer
-  UInt8 *mergedBytes;
+  unsigned char *mergedBytes;
 
   // Binary property list size
   size_t mergedBytesLen = 0;
 
-  // Get the tags for the path if they exists
-  existingTags = createUserTagsFromPath(path, &existingTagsCount);
+  // Outcome of a memoized merge
+  MemoResult result;
+
+  // Outcome of the write, and its errno
+  int status, error = 0;
+
+  // Get the tag blob for the path if it exists, an unreadable blob is not
+  // replaced by the added tags alone
+  if ((len = tagStoreGet(path, buf, EXT_ATTR_SIZE)) < 0 &&
+      errno != TAG_ENOATTR)
+    return -1;
+  ssize_t expectedLen = len;
+  if (len < 0) len = 0;
+
+  // Paths carrying identical blobs get identical merged blobs
+  MemoOperation operation;
+  memoOperationInit(&operation, OperationModeAdd, userTags, tagCount);
+  mergedBytes =
+    memoLookupBlob(&operation, buf, len, &result, &mergedBytesLen);
+
+  // The existing tags are only needed to merge, or for the journal
+  if (!mergedBytes || journalActive())
+    existingTags = createUserTagsFromData(buf, len, &existingTagsCount);
+
+  if (!mergedBytes) {
+    // Merged tags count
+    int mergedTagsCount = tagCount + existingTagsCount;
+
+    // Merge the existing and argument tags
+    UserTag *mergedTags = calloc(mergedTagsCount, sizeof(*mergedTags));
+    if (existingTagsCount)
+      memcpy(mergedTags, existingTags,
+             sizeof(*mergedTags) * existingTagsCount);
+    memcpy((mergedTags + existingTagsCount), userTags,
+           sizeof(*mergedTags) * tagCount);
+
+    // Sort the tags
+    qsort(mergedTags, mergedTagsCount, sizeof(*mergedTags), tagCompare);
+
+    // Encode the merged tags
+    mergedBytes =
+      createTagBlob(&mergedBytesLen, mergedTags, mergedTagsCount);
+    memoInsertBlob(&operation, buf, len, MemoResultWrite, mergedBytes,
+                   mergedBytesLen);
+    free(mergedTags);
+  }
 
-  // Merged tags count
-  mergedTagsCount = tagCount + existingTagsCount;
+  // Apply the merged property list unless the path changed since it was
+  // read, a path already carrying the tags is left alone
+  if (tagBlobMatches(buf, expectedLen, mergedBytes, (ssize_t)mergedBytesLen)) {
+    status = 0;
+  } else if ((status = tagStoreSwap(path, buf, expectedLen, mergedBytes,
+                                    (ssize_t)mergedBytesLen)) < 0) {
+    error = errno;
+  } else if (status != 1 && journalActive()) {
+    int newTagsCount;
+    UserTag *newTags =
+      createUserTagsFromData(mergedBytes, mergedBytesLen, &newTagsCount);
+    journalRecord(path, existingTags, existingTagsCount, newTags,
+                  newTagsCount);
+    freeUserTags(newTags, newTagsCount);
+  }
 
-  // Merge the existing and argument tags
-  mergedTags = calloc(mergedTagsCount, sizeof(*mergedTags));
-  memcpy(mergedTags, existingTags, sizeof(*mergedTags) * existingTagsCount);
-  memcpy((mergedTags + existingTagsCount), userTags,
-         sizeof(*mergedTags) * tagCount);
+  // Cleanup
+  free(mergedBytes);
+  freeUserTags(existingTags, existingTagsCount);
+  memoOperationFree(&operation);
+  if (status < 0) errno = error;
 
-  // Sort the tags
-  qsort(mergedTags, mergedTagsCount, sizeof(*mergedTags), tagCompare);
+  return status;
+}
 
-  // Create the binary property list
-  mergedBytes = createPlistBinary(&mergedBytesLen, mergedTags, mergedTagsCount);
+int addTags(char *path, UserTag *userTags, int tagCount) {
+  int status;
 
-  // Apply the merged property list as an extended attribute to the path
-  setxattr(path, TAG_NAME, mergedBytes, mergedBytesLen, 0, 0);
+  // Start over from a fresh read whenever another writer got in between
+  for (int attempt = 0;
+       (status = addTagsOnce(path, userTags, tagCount)) > 0; ++attempt)
+    if (tagStoreBackoff(attempt) != 0) return -1;
 
-  // Cleanup
-  free(mergedBytes);
-  free(mergedTags);
-  freeUserTags(existingTags, existingTagsCount);
+  return status;
 }
 
-void removeTags(char *path, UserTag *userTags, int tagCount) {
+// Single optimistic attempt of removeTags, tagStoreSwap results
+static int removeTagsOnce(char *path, UserTag *userTags, int tagCount) {
+  // Path's existing tag blob
+  unsigned char buf[EXT_ATTR_SIZE];
+
+  // Path's existing tag blob length
+  ssize_t len;
+
   // Path's existing tags
-  UserTag *existingTags;
+  UserTag *existingTags = NULL;
 
   // Path's existing tags count
-  int existingCount;
+  int existingCount = 0;
+
+  // Replacement property list binary
+  unsigned char *bin;
+
+  // Property list size
+  size_t siz = 0;
+
+  // Outcome of the removal
+  MemoResult result;
+
+  // Outcome of the write, and its errno
+  int status = 0, error = 0;
 
   // Wildcard remove all tags
   if (*(userTags->name) == '*') {
-    removexattr(path, TAG_NAME, 0);
-    return;
+    // The prior tags are only needed for the journal
+    existingTags = journalActive()
+                     ? createUserTagsFromPath(path, &existingCount)
+                     : NULL;
+    if ((status = tagStoreRemove(path)) == 0) {
+      if (existingTags)
+        journalRecord(path, existingTags, existingCount, NULL, 0);
+    } else if (errno == TAG_ENOATTR) {
+      // Nothing to remove
+      status = 0;
+    } else {
+      error = errno;
+    }
+    if (existingTags) freeUserTags(existingTags, existingCount);
+    if (status) errno = error;
+    return status;
   }
 
-  // Get the tags for the path if they exist
-  existingTags = createUserTagsFromPath(path, &existingCount);
+  // Get the tag blob for the path if it exists
+  if ((len = tagStoreGet(path, buf, EXT_ATTR_SIZE)) < 0)
+    return errno == TAG_ENOATTR ? 0 : -1;
+  if (!len) return 0;
+
+  // Paths carrying identical blobs have the same tags removed
+  MemoOperation operation;
+  memoOperationInit(&operation, OperationModeRemove, userTags, tagCount);
+  bin = memoLookupBlob(&operation, buf, len, &result, &siz);
+
+  // The existing tags are only needed to remove from, or for the journal
+  if (!bin || journalActive())
+    existingTags = createUserTagsFromData(buf, len, &existingCount);
+
+  if (!bin) {
+    // Sort the argument tags before searching
+    UserTag *sortedTags = calloc(tagCount, sizeof(*sortedTags));
+    memcpy(sortedTags, userTags, sizeof(*sortedTags) * tagCount);
+    qsort(sortedTags, tagCount, sizeof(*sortedTags), tagCompare);
+
+    // Keep the existing tags that are not requested to be removed, the
+    // existing set stays intact for the journal
+    UserTag *remainingTags =
+      calloc(existingCount ? existingCount : 1, sizeof(*remainingTags));
+    int remainingCount = 0;
+    for (int j = 0; j < existingCount; ++j) {
+      if (!bsearch((existingTags + j), sortedTags, tagCount,
+                   sizeof(*sortedTags), tagCompare))
+        remainingTags[remainingCount++] = existingTags[j];
+    }
 
-  if (!existingTags || !existingCount) return;
+    if (remainingCount == existingCount) {
+      // Nothing to remove
+      result = MemoResultKeep;
+    } else if (remainingCount) {
+      // Encode the remaining existing tags
+      result = MemoResultWrite;
+      bin = createTagBlob(&siz, remainingTags, remainingCount);
+    } else {
+      // Remove the extended attribute altogether if there are no remaining
+      // tags
+      result = MemoResultRemove;
+    }
+    memoInsertBlob(&operation, buf, len, result, bin, siz);
 
-  // Sort the tags before searching
-  qsort(existingTags, existingCount, sizeof(*existingTags), tagCompare);
+    free(remainingTags);
+    free(sortedTags);
+  }
 
-  // Iterate over the tags requested to be removed
-  for (int j = 0; j < tagCount; ++j) {
-    UserTag *found = NULL;
-    found = bsearch((userTags + j), existingTags, existingCount,
-                    sizeof(*existingTags), tagCompare);
-    if (found) {
-      // Set the name of the found to an empty string
-      *(found->name) = '\0';
+  // Apply the remaining tags unless the path changed since it was read
+  if (result == MemoResultWrite) {
+    // Set the extended attribute tag using the binary property list
+    if ((status = tagStoreSwap(path, buf, len, bin, (ssize_t)siz)) < 0) {
+      error = errno;
+    } else if (status != 1 && journalActive()) {
+      int remainingCount;
+      UserTag *remainingTags =
+        createUserTagsFromData(bin, siz, &remainingCount);
+      journalRecord(path, existingTags, existingCount, remainingTags,
+                    remainingCount);
+      freeUserTags(remainingTags, remainingCount);
+    }
+  } else if (result == MemoResultRemove) {
+    if ((status = tagStoreSwap(path, buf, len, NULL, -1)) < 0) {
+      error = errno;
+    } else if (status != 1) {
+      journalRecord(path, existingTags, existingCount, NULL, 0);
     }
   }
 
-  // Replacement property list binary
-  UInt8 *bin;
+  // Cleanup
+  if (bin) free(bin);
+  freeUserTags(existingTags, existingCount);
+  memoOperationFree(&operation);
+  if (status < 0) errno = error;
 
-  // Property list size
-  size_t siz;
+  return status;
+}
 
-  // Apply the remaining tags
-  if (existingCount) {
-    // Create a binary property list of the remaining existing tags
-    bin = createPlistBinary(&siz, existingTags, existingCount);
+int removeTags(char *path, UserTag *userTags, int tagCount) {
+  int status;
 
-    // Set the extended attribute tag using the binary property list
-    setxattr(path, TAG_NAME, bin, siz, 0, 0);
+  // Start over from a fresh read whenever another writer got in between
+  for (int attempt = 0;
+       (status = removeTagsOnce(path, userTags, tagCount)) > 0; ++attempt)
+    if (tagStoreBackoff(attempt) != 0) return -1;
+
+  return status;
+}
 
-    // Release resources used by the binary
-    if (bin) free(bin);
+// Replace the tags of a single path
+int setTags(char *path, const unsigned char *bin, size_t len,
+            UserTag *userTags, int tagCount) {
+  // Outcome of the write, and its errno
+  int status, error = 0;
+
+  if (journalActive()) {
+    // The prior tags are only needed for the journal
+    int existingCount;
+    UserTag *existingTags = createUserTagsFromPath(path, &existingCount);
+    if ((status = tagStoreSet(path, bin, len)) == 0) {
+      journalRecord(path, existingTags, existingCount, userTags, tagCount);
+    } else {
+      error = errno;
+    }
+    freeUserTags(existingTags, existingCount);
+    if (status) errno = error;
   } else {
-    // Remove the extended attribute altogether if there are no remaining tags
-    removexattr(path, TAG_NAME, 0);
+    // Apply the attr data on each path
+    status = tagStoreSet(path, bin, len);
   }
 
-  // Cleanup
-  freeUserTags(existingTags, existingCount);
+  return status;
 }
 
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "misc-no-recursion"
-// Enumerate directory contents, recursively entering subdirectories
 void listTags(char *path, OutputFlags outputFlags) {
   DIR *pDir;
   struct dirent *dir;
@@ -392,7 +951,9 @@ void listTags(char *path, OutputFlags outputFlags) {
   freeUserTags(existingTags, existingTagsCount);
 
   // Is directory?
-  if ((pDir = opendir(path)) != NULL) {
+  pDir = opendir(path);
+  TAG_PROBE2(dir__open, path, pDir != NULL);
+  if (pDir != NULL) {
     // Recurse directory ?
     if (outputFlags & OutputFlagsRecurseDirectory) {
       while ((dir = readdir(pDir)) != NULL) {
@@ -418,8 +979,7 @@ void listTags(char *path, OutputFlags outputFlags) {
 
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "misc-no-recursion"
-bool matchTags(char *path, UserTag *userTags, int tagCount,
-               OutputFlags outputFlags) {
+bool matchTags(char *path, const TagTrie *query, OutputFlags outputFlags) {
   DIR *pDir;
   struct dirent *dir;
   bool matched = false;
@@ -433,25 +993,8 @@ bool matchTags(char *path, UserTag *userTags, int tagCount,
   // Get the tags for the path if they exists
   existingTags = createUserTagsFromPath(path, &existingTagsCount);
 
-  // Sort the tags before searching
-  qsort(existingTags, existingTagsCount, sizeof(*existingTags), tagCompare);
-
-  if (userTags->name) {
-    // Wildcard match any tags
-    matched = (*(userTags->name) == '*' && existingTagsCount > 0);
-  } else {
-    // Match none
-    matched = (existingTagsCount == 0);
-  }
-
-  // Iterate the tags to match against
-  int foundCount = 0;
-  for (int j = 0; j < tagCount && !matched; ++j) {
-    UserTag *found = NULL;
-    found = bsearch((userTags + j), existingTags, existingTagsCount,
-                    sizeof(*existingTags), tagCompare);
-    if (found) matched = (++foundCount == tagCount);
-  }
+  matched = tagsMatch(query, existingTags, existingTagsCount);
+  TAG_PROBE3(match, path, matched, existingTagsCount);
 
   if (matched) printPath(path, existingTags, existingTagsCount, outputFlags);
 
@@ -459,7 +1002,9 @@ bool matchTags(char *path, UserTag *userTags, int tagCount,
   freeUserTags(existingTags, existingTagsCount);
 
   // Is path a directory?
-  if ((pDir = opendir(path)) != NULL) {
+  pDir = opendir(path);
+  TAG_PROBE2(dir__open, path, pDir != NULL);
+  if (pDir != NULL) {
     // Recurse directory ?
     if (outputFlags & OutputFlagsRecurseDirectory) {
       while ((dir = readdir(pDir)) != NULL) {
@@ -475,7 +1020,7 @@ bool matchTags(char *path, UserTag *userTags, int tagCount,
 
         // Combine the parent path, entry name, and enumerate
         snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR, dir->d_name);
-        matchTags(_p, userTags, tagCount, outputFlags);
+        matchTags(_p, query, outputFlags);
       }
     }
     closedir(pDir);
@@ -485,9 +1030,34 @@ bool matchTags(char *path, UserTag *userTags, int tagCount,
 }
 #pragma clang diagnostic pop
 
-UInt8 *createPlistBinary(size_t *length, UserTag *userTags, int tagCount) {
+bool tagsMatch(const TagTrie *query, UserTag *existingTags,
+               int existingTagsCount) {
+  // Sorted for printing
+  qsort(existingTags, existingTagsCount, sizeof(*existingTags), tagCompare);
+
+  // Each tag is walked down the compiled patterns once
+  return tagTrieMatch(query, existingTags, existingTagsCount);
+}
+
+// Shallow copies of the tags to encode, without empty names and keeping the
+// first of the names differing only in case, as the Finder does
+static int uniqueTags(UserTag *userTags, int tagCount, UserTag *unique) {
+  int count = 0;
+
+  for (int i = 0; i < tagCount; ++i) {
+    int j = 0;
+    if (!*userTags[i].name) continue;
+    while (j < count && strcasecmp(unique[j].name, userTags[i].name) != 0) ++j;
+    if (j == count) unique[count++] = userTags[i];
+  }
+
+  return count;
+}
+
+#ifdef __APPLE__
+unsigned char *createPlistBinary(size_t *length, UserTag *userTags, int tagCount) {
   // Return byte array
-  UInt8 *bin;
+  unsigned char *bin;
 
   // Property list array
   CFMutableArrayRef arr;
@@ -543,75 +1113,190 @@ UInt8 *createPlistBinary(size_t *length, UserTag *userTags, int tagCount) {
   // Return the binary data address
   return bin;
 }
+#else
+unsigned char *createPlistBinary(size_t *length, UserTag *userTags,
+                                 int tagCount) {
+  UserTag *unique = calloc(tagCount ? tagCount : 1, sizeof(*unique));
+  unsigned char *bin =
+    plistEncodeTags(length, unique, uniqueTags(userTags, tagCount, unique));
+
+  free(unique);
+  return bin;
+}
+#endif
+
+unsigned char *createTagBlob(size_t *length, UserTag *userTags,
+                             int tagCount) {
+  if (tagStoreDefault()->format != TagFormatXdg)
+    return createPlistBinary(length, userTags, tagCount);
+
+  // Plain names, merged like the property list entries
+  UserTag *unique = calloc(tagCount ? tagCount : 1, sizeof(*unique));
+  unsigned char *bin =
+    xdgEncodeTags(length, unique, uniqueTags(userTags, tagCount, unique));
+
+  free(unique);
+  return bin;
+}
 
 UserTag *createUserTagsFromPath(char *path, int *tagCount) {
-  UserTag *userTags = NULL;
-  UInt8 buf[EXT_ATTR_SIZE];
+  unsigned char buf[EXT_ATTR_SIZE];
   ssize_t len;
+  UserTag *userTags;
+  TagCacheStamp stamp;
 
   // Default the tag count to zero
   *tagCount = 0;
 
-  // Get the binary property list user tag extended attribute if it exists
-  len = getxattr(path, TAG_NAME, buf, EXT_ATTR_SIZE, 0, 0);
+  // A long lived process reuses the tags decoded for an unchanged inode
+  if (tagCacheActive()) {
+    userTags = tagCacheLookup(path, &stamp, tagCount);
+    if (*tagCount >= 0) return userTags;
+    *tagCount = 0;
+  }
 
-  // Process only the buffer contains more than the binary plist header
-  if (len > 8) {
-    CFArrayRef cfArray;
-    CFMutableDataRef cfData = CFDataCreateMutable(NULL, 0);
-    CFStringEncoding enc = CFStringGetSystemEncoding();
+  // Get the binary property list user tag blob if it exists
+  len = tagStoreGet(path, buf, EXT_ATTR_SIZE);
+  int error = len < 0 ? errno : 0;
 
-    // Pack the binary property list into the core foundation data reference
-    CFDataAppendBytes(cfData, buf, len);
+  userTags = createUserTagsFromData(buf, len, tagCount);
 
-    // Create a core foundation array of strings from the cfData
-    cfArray = CFPropertyListCreateWithData(NULL, cfData, 0, NULL, NULL);
+  // Transient read errors are not remembered
+  if (tagCacheActive() && (!error || error == TAG_ENOATTR))
+    tagCacheInsert(&stamp, userTags, *tagCount);
 
-    // Release the core foundation data reference
-    if (cfData) CFRelease(cfData);
+  return userTags;
+}
 
-    // Return the default if creating the property list from the data failed
-    if (!cfArray) return userTags;
+UserTag *createUserTagsFromData(const unsigned char *buf, ssize_t len,
+                                int *tagCount) {
+  UserTag *userTags = NULL;
 
-    // Update the tag count
-    *tagCount = (int)CFArrayGetCount(cfArray);
+  // Default the tag count to zero
+  *tagCount = 0;
 
-    // Allocate and zero the memory for the user tags
-    userTags = calloc(*tagCount, sizeof(*userTags));
+  // An empty blob carries no tags
+  if (len > 0) {
+    // Identical blobs are decoded once
+    userTags = memoLookupTags(buf, len, tagCount);
+    if (*tagCount >= 0) {
+      TAG_PROBE2(decode, (long)len, *tagCount);
+      return userTags;
+    }
 
-    // Set the values for each UserTag struct
-    for (int i = 0; i < *tagCount; ++i) {
-      // Split the string on the new line. tag name + new line + color code
-      CFArrayRef parts = CFStringCreateArrayBySeparatingStrings(
-        NULL, CFArrayGetValueAtIndex(cfArray, i), CFSTR("\n"));
+    // A blob that cannot be decoded carries no tags
+    if (decodeUserTags(buf, len, &userTags, tagCount) == 0)
+      memoInsertTags(buf, len, userTags, *tagCount);
+  }
 
-      // Allocate memory for the tag name string
-      CFStringRef tagName = CFArrayGetValueAtIndex(parts, 0);
-      CFIndex nameLength =
-        CFStringGetMaximumSizeForEncoding(CFStringGetLength(tagName), enc);
-      (userTags + i)->name = malloc(nameLength + 1);
+  TAG_PROBE2(decode, (long)len, *tagCount);
 
-      // Set the name from the first part, and color value from the second
-      CFStringGetCString(tagName, (userTags + i)->name, nameLength + 1, enc);
+  return userTags;
+}
 
-      (userTags + i)->color = TagColorNone;
-      if (CFArrayGetCount(parts) == 2)
-        (userTags + i)->color =
-          CFStringGetIntValue(CFArrayGetValueAtIndex(parts, 1));
+#ifdef __APPLE__
+// Decode a binary property list through CoreFoundation
+static int decodePlist(const unsigned char *buf, ssize_t len,
+                       UserTag **userTags, int *tagCount) {
+  CFArrayRef cfArray;
+  CFMutableDataRef cfData;
+  CFStringEncoding enc = CFStringGetSystemEncoding();
 
-      // Cleanup, make way for the next iteration
-      CFRelease(parts);
-    }
+  // Default to no tags
+  *userTags = NULL;
+  *tagCount = 0;
+
+  // Anything up to the binary plist header cannot be a property list
+  if (len <= 8) return -1;
+
+  // Pack the binary property list into the core foundation data reference
+  cfData = CFDataCreateMutable(NULL, 0);
+  CFDataAppendBytes(cfData, buf, len);
+
+  // Create a core foundation array of strings from the cfData
+  cfArray = CFPropertyListCreateWithData(NULL, cfData, 0, NULL, NULL);
+
+  // Release the core foundation data reference
+  if (cfData) CFRelease(cfData);
 
-    // Property list array is no longer needed?
+  // Fail if creating the property list from the data failed, or if it is not
+  // an array of strings
+  if (!cfArray) return -1;
+  int valid = CFGetTypeID(cfArray) == CFArrayGetTypeID();
+  for (CFIndex i = 0; valid && i < CFArrayGetCount(cfArray); ++i)
+    valid = CFGetTypeID(CFArrayGetValueAtIndex(cfArray, i)) ==
+            CFStringGetTypeID();
+  if (!valid) {
     CFRelease(cfArray);
+    return -1;
   }
 
-  return userTags;
+  // Update the tag count
+  *tagCount = (int)CFArrayGetCount(cfArray);
+
+  // Allocate and zero the memory for the user tags
+  *userTags = calloc(*tagCount ? *tagCount : 1, sizeof(**userTags));
+
+  // Set the values for each UserTag struct
+  for (int i = 0; i < *tagCount; ++i) {
+    // Split the string on the new line. tag name + new line + color code
+    CFArrayRef parts = CFStringCreateArrayBySeparatingStrings(
+      NULL, CFArrayGetValueAtIndex(cfArray, i), CFSTR("\n"));
+
+    // Allocate memory for the tag name string
+    CFStringRef tagName = CFArrayGetValueAtIndex(parts, 0);
+    CFIndex nameLength =
+      CFStringGetMaximumSizeForEncoding(CFStringGetLength(tagName), enc);
+    (*userTags + i)->name = malloc(nameLength + 1);
+
+    // Set the name from the first part, and color value from the second
+    CFStringGetCString(tagName, (*userTags + i)->name, nameLength + 1, enc);
+
+    (*userTags + i)->color = TagColorNone;
+    if (CFArrayGetCount(parts) == 2)
+      (*userTags + i)->color =
+        CFStringGetIntValue(CFArrayGetValueAtIndex(parts, 1));
+
+    // Cleanup, make way for the next iteration
+    CFRelease(parts);
+  }
+
+  // Property list array is no longer needed?
+  CFRelease(cfArray);
+
+  return 0;
+}
+#else
+// Decode a binary property list without CoreFoundation
+static int decodePlist(const unsigned char *buf, ssize_t len,
+                       UserTag **userTags, int *tagCount) {
+  return plistDecodeTags(buf, (size_t)len, userTags, tagCount);
+}
+#endif
+
+int decodeUserTags(const unsigned char *buf, ssize_t len, UserTag **userTags,
+                   int *tagCount) {
+  // Default to no tags
+  *userTags = NULL;
+  *tagCount = 0;
+
+  // Property lists start with their magic
+  if (len >= 6 && memcmp(buf, PLIST_MAGIC, 6) == 0)
+    return decodePlist(buf, len, userTags, tagCount);
+
+  // Anything else is an xdg list of names, which holds no control characters
+  for (ssize_t i = 0; i < len; ++i)
+    if (buf[i] < 0x20) return -1;
+  return len < 0 ? -1 : xdgDecodeTags(buf, (size_t)len, userTags, tagCount);
 }
 
 void printPath(char *path, UserTag *userTags, long tagCount,
                OutputFlags outputFlags) {
+  fprintPath(stdout, path, userTags, tagCount, outputFlags);
+}
+
+void fprintPath(FILE *stream, char *path, UserTag *userTags, long tagCount,
+                OutputFlags outputFlags) {
   char *fileName = NULL;
   struct stat pathStat;
 
@@ -633,9 +1318,9 @@ void printPath(char *path, UserTag *userTags, long tagCount,
 
   if (fileName) {
     if (printTags && !tagsOnSeparateLines) {
-      printf("%-31s", fileName);
+      fprintf(stream, "%-31s", fileName);
     } else {
-      printf("%s", fileName);
+      fprintf(stream, "%s", fileName);
     }
   }
 
@@ -661,9 +1346,9 @@ void printPath(char *path, UserTag *userTags, long tagCount,
     char *sep = startingSeparator;
     buf = (char *)malloc(TAG_BUF_SIZE);
     for (int i = 0; i < tagCount; ++i) {
-      if (needLineTerm) putc(lineTerminator, stdout);
+      if (needLineTerm) putc(lineTerminator, stream);
       displayStringForTag(buf, (userTags + i), outputFlags);
-      printf("%s%s", sep, buf);
+      fprintf(stream, "%s%s", sep, buf);
 
       sep = tagSeparator;
       needLineTerm = tagsOnSeparateLines;
@@ -672,7 +1357,7 @@ void printPath(char *path, UserTag *userTags, long tagCount,
   }
 
   // Print out the ending line terminator
-  if (fileName || printTags) putc(lineTerminator, stdout);
+  if (fileName || printTags) putc(lineTerminator, stream);
 
   // Cleanup
   if (fileName) free(fileName);
@@ -756,6 +1441,41 @@ TagColor getColorCode(char *color) {
   return TagColorNone;
 }
 
+const char *getColorName(TagColor color) {
+  static const char *names[] = {"none",   "gray", "green", "purple",
+                                "blue",   "yellow", "red", "orange"};
+  if (color < TagColorNone || color > TagColorOrange) return names[0];
+  return names[color];
+}
+
+void printJsonString(FILE *stream, const char *string) {
+  putc('"', stream);
+  for (const unsigned char *p = (const unsigned char *)string; *p; ++p) {
+    switch (*p) {
+      case '"':
+        fputs("\\\"", stream);
+        break;
+      case '\\':
+        fputs("\\\\", stream);
+        break;
+      case '\n':
+        fputs("\\n", stream);
+        break;
+      case '\t':
+        fputs("\\t", stream);
+        break;
+      default:
+        if (*p < 0x20) {
+          fprintf(stream, "\\u%04x", *p);
+        } else {
+          putc(*p, stream);
+        }
+        break;
+    }
+  }
+  putc('"', stream);
+}
+
 int tagCompare(const void *a, const void *b) {
   return strcmp(((UserTag *)a)->name, ((UserTag *)b)->name);
 }
@@ -780,7 +1500,33 @@ void displayUsage(char *programName) {
     "    tag -s | --set <tags> <path>...     Set tags on file\n"
     "    tag -m | --match <tags> <path>...   Display files with matching tags\n"
     "    tag -l | --list <path>...           List the tags on file\n"
-    "  <tags> is a comma-separated list of tag names; use * to match any tag. "
+    "    tag --count [<path>...]             Count files carrying each tag\n"
+    "    tag --approx <rate> [<path>...]     Estimate tag statistics by "
+    "sampling\n"
+    "    tag --journal <file> --journal-read [--since <seq>]  Print recorded "
+    "changes\n"
+    "    tag -l | -m <tags> --since <file> [<path>...]  Print changes since "
+    "the last scan\n"
+    "    tag --rename <old=new[:color]> <path>...  Rename or merge a tag\n"
+    "    tag --recolor <tag:color> <path>...      Change the color of a tag\n"
+    "    tag --merge <file>...               Combine the outputs of sharded "
+    "scans\n"
+    "    tag --sync <src> <dst>              Copy differing tags from one tree "
+    "to another\n"
+    "    tag --fsck [--repair] [<path>...]   Check and repair the tags below "
+    "paths\n"
+    "    tag --build-index <file> [<path>...]  Record the tags below paths in "
+    "an index\n"
+    "    tag -m <tags> --index <file> [<path>...]  Match the tags recorded in "
+    "an index\n"
+    "    tag --migrate-format <plist|xdg> [<path>...]  Move tags into the "
+    "attribute of a format\n"
+    "    tag --serve <socket>                Answer forwarded invocations on a "
+    "Unix socket\n"
+    "    tag --client <socket> <options>...  Forward an invocation to a "
+    "server\n"
+    "  <tags> is a comma-separated list of tag names; use * to match any tag, "
+    "prefix* to match any tag starting with prefix. "
     "use tag_name:color to specify color when setting.\n"
     "  additional options:\n"
     "        -v | --version      Display version\n"
@@ -788,6 +1534,41 @@ void displayUsage(char *programName) {
     "        -A | --all          Display invisible files while enumerating\n"
     "        -e | --enter        Enter and enumerate directories provided\n"
     "        -R | --recursive    Recursively process directories\n"
+    "        -j | --jobs <n>     Number of worker threads (add, remove, set, "
+    "count, rename, sync, fsck, build-index, migrate-format)\n"
+    "             --shard <i/N[:depth]>  Only walk slice i of N of the tree "
+    "(list, match, count, rename)\n"
+    "             --max-rate <n> Cap tag and directory reads and writes per "
+    "second\n"
+    "             --max-inflight <n>  Cap concurrent tag and directory reads "
+    "and writes\n"
+    "             --target-latency <ms[:pct]>  Slow down while the pct (95) "
+    "percentile read latency is over ms\n"
+    "             --background   Lower the CPU and I/O priority\n"
+    "             --checkpoint <file>  Save the position of an add, remove or "
+    "set\n"
+    "             --resume <file>  Continue an add, remove or set from a "
+    "checkpoint\n"
+    "             --map <from=to>  Map a source path to a destination path "
+    "(sync)\n"
+    "             --mirror-removals  Remove tags the source does not carry "
+    "(sync)\n"
+    "             --repair       Rewrite damaged tags in canonical form "
+    "(fsck)\n"
+    "             --index <file> Match through an index instead of reading "
+    "the tree (match)\n"
+    "             --histogram    Same as --count\n"
+    "             --bytes        Total the size of files carrying each tag "
+    "(count)\n"
+    "             --json         Output JSON (count, approx)\n"
+    "             --seed <n>     Seed of the directory sampling (approx)\n"
+    "             --journal <file>  Record changes (add, remove, set, "
+    "rename, sync, fsck, migrate-format), or the journal to read\n"
+    "             --since <seq>  Read only changes after a sequence number\n"
+    "             --since <file>  Print only changes since the scan saved in "
+    "a state file (list, match)\n"
+    "             --store <spec> Tag storage: xattr (default), xdg, memory, "
+    "db:<file>, db-inode:<file>\n"
     "        -n | --name         Turn on filename display in output (default)\n"
     "        -N | --no-name      Turn off filename display in output (list, "
     "find, match)\n"
@@ -7,6 +7,9 @@
 #ifndef TAG_USERTAG_H
 #define TAG_USERTAG_H
 
+#include <stdio.h>
+#include <sys/types.h>
+
 // clang-format off
 #define PROGRAM_NAME    "tag"
 #define PROGRAM_VERSION "2022.4.04"
@@ -14,8 +17,16 @@
 // Extended attribute binary property list buffer size
 #define EXT_ATTR_SIZE   10000
 
-// Extended attribute key name
+// Extended attribute key name, other systems keep it in the user namespace
+// the way rsync and Samba carry macOS attributes over
+#ifdef __APPLE__
 #define TAG_NAME        "com.apple.metadata:_kMDItemUserTags"
+#else
+#define TAG_NAME        "user.com.apple.metadata:_kMDItemUserTags"
+#endif
+
+// Extended attribute key name of the tags of desktop tools on Linux
+#define TAG_XDG_NAME    "user.xdg.tags"
 
 // Tag string buffer size
 #define TAG_BUF_SIZE    512
@@ -36,6 +47,15 @@
 
 #define PATH_SEPARATOR  "/"
 
+// Status change and modification times of a struct stat as struct timespecs
+#ifdef __APPLE__
+#define STAT_CTIME(st)  ((st)->st_ctimespec)
+#define STAT_MTIME(st)  ((st)->st_mtimespec)
+#else
+#define STAT_CTIME(st)  ((st)->st_ctim)
+#define STAT_MTIME(st)  ((st)->st_mtim)
+#endif
+
 /**
  * @typedef Type of operation to perform
  * @enum    -1  None
@@ -43,6 +63,18 @@
  * @enum    's' Set tag extended attribute on a file or directory
  * @enum    'a' Append to the existing tags, or set if no prior tags exists
  * @enum    'r' Remove tags
+ * @enum    'm' Display paths with matching tags
+ * @enum    'l' List tags
+ * @enum  0x100 Aggregate tag frequencies
+ * @enum  0x101 Estimate tag statistics by sampling
+ * @enum  0x102 Print the records of a change journal
+ * @enum  0x103 Rename, merge or recolor tags
+ * @enum  0x104 Serve requests over a Unix socket
+ * @enum  0x105 Merge the outputs of sharded scans
+ * @enum  0x106 Copy the tags of one tree to another
+ * @enum  0x107 Classify and optionally repair tag blobs
+ * @enum  0x108 Record the tags of a tree in an index file
+ * @enum  0x109 Move tags between the plist and xdg attributes
  */
 typedef enum OperationMode {
   OperationModeNone     = -1,
@@ -51,9 +83,44 @@ typedef enum OperationMode {
   OperationModeAdd      = 'a',
   OperationModeRemove   = 'r',
   OperationModeMatch    = 'm',
-  OperationModeList     = 'l'
+  OperationModeList     = 'l',
+  OperationModeCount    = 0x100,
+  OperationModeApprox   = 0x101,
+  OperationModeJournalRead = 0x102,
+  OperationModeRename   = 0x103,
+  OperationModeServe    = 0x104,
+  OperationModeMerge    = 0x105,
+  OperationModeSync     = 0x106,
+  OperationModeFsck     = 0x107,
+  OperationModeIndex    = 0x108,
+  OperationModeMigrate  = 0x109
 } OperationMode;
 
+/**
+ * @typedef Codes of long options without a short equivalent
+ */
+typedef enum LongOption {
+  LongOptionBytes       = 0x200,
+  LongOptionJson,
+  LongOptionSeed,
+  LongOptionJournal,
+  LongOptionSince,
+  LongOptionRecolor,
+  LongOptionStore,
+  LongOptionClient,
+  LongOptionShard,
+  LongOptionMaxRate,
+  LongOptionMaxInflight,
+  LongOptionTargetLatency,
+  LongOptionBackground,
+  LongOptionCheckpoint,
+  LongOptionResume,
+  LongOptionMap,
+  LongOptionMirrorRemovals,
+  LongOptionRepair,
+  LongOptionIndex
+} LongOption;
+
 /**
  * @typedef Options to control how and what is printed via bit operations
  * @enum 0b00000001 Turn on filename display in output?
@@ -127,8 +194,10 @@ UserTag *parseTagsArgument(char *, int *);
  * @param path Path to the filename or directory
  * @param userTags Tags to be added
  * @param tagCount Count of tags to be added
+ * @return 0 on success, -1 with errno set if the tags could not be read or
+ * written
  */
-void addTags(char *, UserTag *, int);
+int addTags(char *, UserTag *, int);
 
 /**
  * @brief Remove individual tags from an existing set for a filename or
@@ -136,8 +205,22 @@ void addTags(char *, UserTag *, int);
  * @param path Path to the filename or directory
  * @param userTags Tags to be removed
  * @param tagCount Count of tags to be removed
+ * @return 0 on success, including a path carrying none of the tags, -1 with
+ * errno set if the tags could not be read or written
  */
-void removeTags(char *path, UserTag *userTags, int tagCount);
+int removeTags(char *path, UserTag *userTags, int tagCount);
+
+/**
+ * @brief Replace the tags of a filename or directory
+ * @param path Path to the filename or directory
+ * @param bin Binary property list of the tags
+ * @param len Length of the property list
+ * @param userTags Tags in the property list, recorded in the journal
+ * @param tagCount Count of tags in the property list
+ * @return 0 on success, -1 with errno set if the tags could not be written
+ */
+int setTags(char *path, const unsigned char *bin, size_t len,
+            UserTag *userTags, int tagCount);
 
 /**
  * @brief Print a list of tags for a specified filename or directory
@@ -147,15 +230,28 @@ void removeTags(char *path, UserTag *userTags, int tagCount);
  */
 void listTags(char *path, OutputFlags outputFlags);
 
+// Compiled match request, defined in trie.h
+struct TagTrie;
+
 /**
  * @brief Check file for matching tags
  * @param path
- * @param userTags
- * @param tagCount
+ * @param query Tags to match compiled by tagTrieCompile
  * @param outputFlags
  * @return
  */
-_Bool matchTags(char *, UserTag *, int, OutputFlags);
+_Bool matchTags(char *, const struct TagTrie *, OutputFlags);
+
+/**
+ * @brief Test a path's tags against the tags of a match request
+ * @param query Tags to match compiled by tagTrieCompile, "*" matches any
+ * tag, a trailing '*' any rest of a name, no name matches none
+ * @param existingTags Tags of the path, sorted in place
+ * @param existingTagsCount Count of the tags of the path
+ * @return true if every requested pattern matches a tag
+ */
+_Bool tagsMatch(const struct TagTrie *query, UserTag *existingTags,
+                int existingTagsCount);
 
 /**
  * @brief Print a specific path and it's tags in a formatted output
@@ -167,6 +263,17 @@ _Bool matchTags(char *, UserTag *, int, OutputFlags);
 void printPath(char *path, UserTag *userTags, long tagCount,
                OutputFlags outputFlags);
 
+/**
+ * @brief Print a specific path and it's tags in a formatted output to a stream
+ * @param stream Stream to print to
+ * @param path The path to process
+ * @param userTags Array of user tags applied to the path
+ * @param tagCount Count of the tags applied to the path
+ * @param outputFlags Output options
+ */
+void fprintPath(FILE *stream, char *path, UserTag *userTags, long tagCount,
+                OutputFlags outputFlags);
+
 /**
  * @brief Report formatted error message
  * @param fmt
@@ -199,6 +306,20 @@ char *displayStringForTag(char *, UserTag *, OutputFlags);
  */
 TagColor getColorCode(char *color);
 
+/**
+ * @brief Convert TagColor integer code to a lower case color name
+ * @param color Color code
+ * @return Color name, "none" for TagColorNone or out of range codes
+ */
+const char *getColorName(TagColor color);
+
+/**
+ * @brief Print a string as a quoted and escaped JSON string
+ * @param stream Output stream
+ * @param string String to print
+ */
+void printJsonString(FILE *stream, const char *string);
+
 /**
  * @brief Create a data pointer to a property list in binary format
  * @param length pointer to receive the length of the data
@@ -210,6 +331,18 @@ TagColor getColorCode(char *color);
 unsigned char *createPlistBinary(unsigned long *length, UserTag *userTags,
                                  int tagCount);
 
+/**
+ * @brief Encode tags in the format written by the current storage backend
+ * @param length Receives the length of the blob
+ * @param userTags Source user tags
+ * @param tagCount Number of sourced user tags
+ * @return Blob, a binary property list or an xdg list of names
+ * @note Empty names are skipped and of the names differing only in case the
+ * first is kept, in either format. Free the memory after use
+ */
+unsigned char *createTagBlob(unsigned long *length, UserTag *userTags,
+                             int tagCount);
+
 /**
  * @brief Get any user tags applied to a particular path as a UserTag array
  * @param path The path to the filename or directory
@@ -218,6 +351,33 @@ unsigned char *createPlistBinary(unsigned long *length, UserTag *userTags,
  */
 UserTag *createUserTagsFromPath(char *, int *);
 
+/**
+ * @brief Decode a tag blob as a UserTag array
+ * @param buf Blob as stored in the extended attribute, a binary property
+ * list or an xdg list of names
+ * @param len Length of the blob, values of 0 or less decode as no tags
+ * @param tagCount Reference to receive the count of the tags in the array
+ * @return pointer to a UserTag array, NULL if there are no tags or the blob
+ * cannot be decoded
+ */
+UserTag *createUserTagsFromData(const unsigned char *buf, ssize_t len,
+                                int *tagCount);
+
+/**
+ * @brief Decode a tag blob, telling a corrupt blob from an empty one
+ * @param buf Blob as stored in the extended attribute
+ * @param len Length of the blob
+ * @param userTags Receives the tags, NULL on failure
+ * @param tagCount Receives the count of the tags
+ * @return 0 on success, -1 if the blob is neither a property list array of
+ * strings nor a list of names free of control characters
+ * @note Blobs starting with the property list magic are decoded as property
+ * lists, any other blob as an xdg list of names
+ * @note Unlike createUserTagsFromData the result is not memoized
+ */
+int decodeUserTags(const unsigned char *buf, ssize_t len, UserTag **userTags,
+                   int *tagCount);
+
 /**
  * @brief Free the dynamically memory allocated to the name member of UserTag
  * structs
@@ -0,0 +1,534 @@
+//
+// walk.c
+// Tag
+//
+
+#include "walk.h"
+
+#include "governor.h"
+#include "hash.h"
+#include "probes.h"
+#include "store.h"
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @typedef Pending unit of work
+ * @field path Root path to visit, or directory to enumerate
+ * @field rootLength Length of the root prefix of path
+ * @field depth Depth of path below its root
+ * @field isRoot Visit the path itself rather than enumerating it
+ * @field root Index of the root path
+ */
+typedef struct WalkItem {
+  char *path;
+  size_t rootLength;
+  int depth;
+  int isRoot;
+  int root;
+} WalkItem;
+
+/**
+ * @typedef Shared state of a parallel walk
+ */
+typedef struct WalkPool {
+  TagWalker *walker;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  WalkItem *items;
+  size_t count;
+  size_t capacity;
+  int active;
+  int nextWorker;
+} WalkPool;
+
+/**
+ * @typedef Entry of a directory read ahead to be sorted
+ */
+typedef struct WalkName {
+  char *name;
+  unsigned char type;
+} WalkName;
+
+/**
+ * @typedef Entries of a directory read ahead, with their tag blobs when the
+ * walk prefetches them
+ * @field fetched Set when blobs holds the tag blob of every path
+ */
+typedef struct WalkBatch {
+  char *paths[WALK_BATCH];
+  unsigned char types[WALK_BATCH];
+  TagBlob blobs[WALK_BATCH];
+  size_t count;
+  int fetched;
+} WalkBatch;
+
+/**
+ * @typedef Slice of the tree walked by this process
+ */
+static struct {
+  int shard;
+  int count;
+  int depth;
+} walkShard = {0, 0, WALK_SHARD_DEPTH};
+
+// Entry type of a path, following symbolic links only when asked to
+static unsigned char pathType(const char *path, int follow) {
+  struct stat st;
+
+  if ((follow ? stat(path, &st) : lstat(path, &st)) != 0) return DT_UNKNOWN;
+  if (S_ISDIR(st.st_mode)) return DT_DIR;
+  if (S_ISREG(st.st_mode)) return DT_REG;
+  if (S_ISLNK(st.st_mode)) return DT_LNK;
+  return DT_UNKNOWN;
+}
+
+// Relative portion of a path given the length of its root prefix
+static const char *relativePath(const char *path, size_t rootLength) {
+  const char *rel = path + rootLength;
+  while (*rel == *PATH_SEPARATOR) ++rel;
+  return rel;
+}
+
+// Test whether an entry at or above the partition depth belongs to the slice
+// of this process, deeper entries share the slice of their ancestor
+static int shardOwns(const char *path, const char *relative, int depth) {
+  const char *key = depth ? relative : path;
+
+  return tagHash64(key, strlen(key), WALK_SHARD_SEED) % walkShard.count ==
+         (uint64_t)walkShard.shard;
+}
+
+// Whether a visitor stopped the walk, set by one worker and read by all
+static int walkStopped(const TagWalker *walker) {
+  return __atomic_load_n(&walker->stopped, __ATOMIC_ACQUIRE);
+}
+
+// Invoke the visitor, recording stop requests
+static TagWalkResult visitEntry(TagWalker *walker, const char *path,
+                                size_t rootLength, unsigned char type,
+                                int depth, int worker, int root,
+                                const TagBlob *blob) {
+  TagWalkEntry entry = {.path = path,
+                        .relative = relativePath(path, rootLength),
+                        .type = type,
+                        .depth = depth,
+                        .worker = worker,
+                        .root = root,
+                        .blob = blob};
+
+  // Entries of other slices are not visited, their directories are only
+  // entered above the partition depth
+  if (walkShard.count > 1 && depth <= walkShard.depth &&
+      !shardOwns(path, entry.relative, depth))
+    return depth < walkShard.depth ? TagWalkContinue : TagWalkSkip;
+
+  TAG_PROBE3(entry__visit, path, depth, type);
+  TagWalkResult result = walker->visit(&entry, walker->context);
+  if (result == TagWalkStop)
+    __atomic_store_n(&walker->stopped, 1, __ATOMIC_RELEASE);
+  return result;
+}
+
+// Open a directory as one governed operation, like a tag read
+static DIR *openDirectory(const char *path) {
+  uint64_t start = governorAcquire();
+  DIR *pDir = opendir(path);
+  governorRelease(start, 0);
+  TAG_PROBE2(dir__open, path, pDir != NULL);
+  return pDir;
+}
+
+// Read the next entries of a directory the walk does not ignore, and their
+// tag blobs in a single lookup when the walk prefetches them. Returns the
+// number of entries read, 0 at the end of the directory.
+static size_t readBatch(TagWalker *walker, DIR *pDir, const char *path,
+                        WalkBatch *batch) {
+  struct dirent *dir;
+  uint64_t start;
+
+  // A batch of entries is a single governed operation, released before the
+  // blobs are looked up as the lookup is governed itself
+  batch->count = 0;
+  start = governorAcquire();
+  while (batch->count < WALK_BATCH && (dir = readdir(pDir)) != NULL) {
+    char _p[PATH_MAX];
+
+    // Ignore current and parent dir entries
+    if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+      continue;
+
+    // Ignore dot paths if the show hidden flag is not set
+    if (*(dir->d_name) == '.' &&
+        !(walker->outputFlags & OutputFlagsShowHidden))
+      continue;
+
+    // Combine the parent path and entry name, skipping truncated paths
+    if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 dir->d_name) >= (int)sizeof(_p))
+      continue;
+
+    unsigned char type = dir->d_type;
+    if (type == DT_UNKNOWN) type = pathType(_p, 0);
+
+    batch->types[batch->count] = type;
+    batch->paths[batch->count++] = strdup(_p);
+  }
+  governorRelease(start, 0);
+
+  // Backends without batched lookups are read by the visitors themselves
+  batch->fetched = walker->prefetch && batch->count &&
+                   tagStoreDefault()->getBatch != NULL;
+  if (batch->fetched)
+    tagStoreGetBatch((const char *const *)batch->paths, (int)batch->count,
+                     batch->blobs);
+
+  return batch->count;
+}
+
+// Release the paths and blobs of a batch
+static void clearBatch(WalkBatch *batch) {
+  for (size_t i = 0; i < batch->count; ++i) {
+    free(batch->paths[i]);
+    if (batch->fetched) free(batch->blobs[i].data);
+  }
+  batch->count = 0;
+}
+
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "misc-no-recursion"
+// Depth first enumeration on the calling thread, in readdir order
+static void walkDirectory(TagWalker *walker, const char *path,
+                          size_t rootLength, int depth, int root) {
+  WalkBatch *batch;
+  DIR *pDir;
+
+  pDir = openDirectory(path);
+  if (pDir == NULL) {
+    walker->errors++;
+    return;
+  }
+
+  batch = malloc(sizeof(*batch));
+  while (!walkStopped(walker) && readBatch(walker, pDir, path, batch)) {
+    for (size_t i = 0; i < batch->count && !walkStopped(walker); ++i) {
+      if (visitEntry(walker, batch->paths[i], rootLength, batch->types[i],
+                     depth + 1, 0, root,
+                     batch->fetched ? batch->blobs + i : NULL) ==
+            TagWalkContinue &&
+          batch->types[i] == DT_DIR)
+        walkDirectory(walker, batch->paths[i], rootLength, depth + 1, root);
+    }
+    clearBatch(batch);
+  }
+  free(batch);
+  closedir(pDir);
+}
+
+static int nameCompare(const void *a, const void *b) {
+  return strcmp(((const WalkName *)a)->name, ((const WalkName *)b)->name);
+}
+
+// Compare a name to the first component of a cursor, pointing rest at the
+// remaining components, or at NULL if the cursor names the entry itself
+static int cursorCompare(const char *name, const char *cursor,
+                         const char **rest) {
+  size_t length = strcspn(cursor, PATH_SEPARATOR);
+  int result = strncmp(name, cursor, length);
+
+  if (!result && name[length]) result = 1;
+  *rest = cursor[length] ? cursor + length + 1 : NULL;
+  return result;
+}
+
+// Depth first enumeration on the calling thread, in name order, skipping the
+// entries up to and including the cursor
+static void walkSorted(TagWalker *walker, const char *path, size_t rootLength,
+                       int depth, int root, const char *cursor) {
+  DIR *pDir;
+  struct dirent *dir;
+  WalkName *names = NULL;
+  size_t count = 0, capacity = 0, listed = 0;
+  uint64_t start;
+
+  pDir = openDirectory(path);
+  if (pDir == NULL) {
+    walker->errors++;
+    return;
+  }
+
+  start = governorAcquire();
+  while ((dir = readdir(pDir)) != NULL) {
+    // Govern the listing in batches, as the pool and unsorted walks do
+    if (++listed % WALK_BATCH == 0) {
+      governorRelease(start, 0);
+      start = governorAcquire();
+    }
+    if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+      continue;
+    if (*(dir->d_name) == '.' &&
+        !(walker->outputFlags & OutputFlagsShowHidden))
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      names = realloc(names, sizeof(*names) * capacity);
+    }
+    names[count].name = strdup(dir->d_name);
+    names[count++].type = dir->d_type;
+  }
+  governorRelease(start, 0);
+  closedir(pDir);
+  qsort(names, count, sizeof(*names), nameCompare);
+
+  for (size_t i = 0; i < count && !walkStopped(walker); ++i) {
+    char _p[PATH_MAX];
+    const char *rest = NULL;
+    int position = cursor ? cursorCompare(names[i].name, cursor, &rest) : 1;
+
+    // Entries before the cursor are finished along with their subtrees
+    if (position < 0) continue;
+
+    if (snprintf(_p, sizeof(_p), "%s%s%s", path, PATH_SEPARATOR,
+                 names[i].name) >= (int)sizeof(_p))
+      continue;
+
+    unsigned char type = names[i].type;
+    if (type == DT_UNKNOWN) type = pathType(_p, 0);
+
+    if (position == 0) {
+      // The cursor's ancestors and the cursor itself were visited, only the
+      // rest of their subtree remains
+      cursor = NULL;
+      if (type == DT_DIR)
+        walkSorted(walker, _p, rootLength, depth + 1, root, rest);
+      continue;
+    }
+    cursor = NULL;
+
+    if (visitEntry(walker, _p, rootLength, type, depth + 1, 0, root, NULL) ==
+          TagWalkContinue &&
+        type == DT_DIR)
+      walkSorted(walker, _p, rootLength, depth + 1, root, NULL);
+  }
+
+  for (size_t i = 0; i < count; ++i) free(names[i].name);
+  free(names);
+}
+#pragma clang diagnostic pop
+
+// Push a unit of work, the pool lock must be held
+static void poolPush(WalkPool *pool, char *path, size_t rootLength, int depth,
+                     int isRoot, int root) {
+  if (pool->count == pool->capacity) {
+    pool->capacity = pool->capacity ? pool->capacity * 2 : 64;
+    pool->items = realloc(pool->items, sizeof(*pool->items) * pool->capacity);
+  }
+  pool->items[pool->count++] =
+    (WalkItem){.path = path, .rootLength = rootLength, .depth = depth,
+               .isRoot = isRoot, .root = root};
+  pthread_cond_signal(&pool->ready);
+}
+
+// Enumerate a single directory, queueing its subdirectories for any worker
+static void poolDirectory(WalkPool *pool, WalkItem *item, int worker) {
+  TagWalker *walker = pool->walker;
+  WalkBatch *batch;
+  DIR *pDir;
+
+  pDir = openDirectory(item->path);
+  if (pDir == NULL) {
+    pthread_mutex_lock(&pool->lock);
+    walker->errors++;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  batch = malloc(sizeof(*batch));
+  while (!walkStopped(walker) && readBatch(walker, pDir, item->path, batch)) {
+    for (size_t i = 0; i < batch->count && !walkStopped(walker); ++i) {
+      if (visitEntry(walker, batch->paths[i], item->rootLength,
+                     batch->types[i], item->depth + 1, worker, item->root,
+                     batch->fetched ? batch->blobs + i : NULL) ==
+            TagWalkContinue &&
+          batch->types[i] == DT_DIR) {
+        pthread_mutex_lock(&pool->lock);
+        poolPush(pool, batch->paths[i], item->rootLength, item->depth + 1, 0,
+                 item->root);
+        batch->paths[i] = NULL;
+        pthread_mutex_unlock(&pool->lock);
+      }
+    }
+    clearBatch(batch);
+  }
+  free(batch);
+  closedir(pDir);
+}
+
+// Worker thread main loop, exits once the queue drains and nobody is busy
+static void *poolWorker(void *arg) {
+  WalkPool *pool = arg;
+  TagWalker *walker = pool->walker;
+  int worker;
+
+  pthread_mutex_lock(&pool->lock);
+  worker = pool->nextWorker++;
+  for (;;) {
+    while (pool->count == 0 && pool->active > 0)
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    if (pool->count == 0) break;
+
+    WalkItem item = pool->items[--pool->count];
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!walkStopped(walker)) {
+      if (item.isRoot) {
+        unsigned char type = pathType(item.path, 1);
+        if (visitEntry(walker, item.path, item.rootLength, type, 0, worker,
+                       item.root, NULL) == TagWalkContinue &&
+            type == DT_DIR &&
+            (walker->outputFlags & OutputFlagsRecurseDirectory)) {
+          pthread_mutex_lock(&pool->lock);
+          poolPush(pool, item.path, item.rootLength, 0, 0, item.root);
+          item.path = NULL;
+          pthread_mutex_unlock(&pool->lock);
+        }
+      } else {
+        poolDirectory(pool, &item, worker);
+      }
+    }
+    free(item.path);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->active--;
+    if (pool->count == 0 && pool->active == 0)
+      pthread_cond_broadcast(&pool->ready);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+int tagWalk(TagWalker *walker, char *const *paths, int pathCount) {
+  __atomic_store_n(&walker->stopped, 0, __ATOMIC_RELEASE);
+  walker->errors = 0;
+  if (walker->jobs < 1) walker->jobs = 1;
+  if (walker->jobs > WALK_MAX_JOBS) walker->jobs = WALK_MAX_JOBS;
+
+  // A sorted walk is only ordered on a single thread
+  if (walker->sorted) walker->jobs = 1;
+
+  // A single job walks depth first on the calling thread
+  if (walker->jobs == 1) {
+    for (int i = 0; i < pathCount && !walkStopped(walker); ++i) {
+      char *path = paths[i];
+      size_t rootLength = strlen(path);
+      const char *cursor = NULL;
+      unsigned char type;
+
+      // Skip empty path requests
+      if (!rootLength) continue;
+
+      // Roots before the resumed one are finished
+      if (walker->sorted && walker->resumeAfter) {
+        if (i < walker->resumeRoot) continue;
+        if (i == walker->resumeRoot) cursor = walker->resumeAfter;
+      }
+
+      type = pathType(path, 1);
+      if (cursor) {
+        // The root was visited, continue below the cursor
+        if (type == DT_DIR &&
+            (walker->outputFlags & OutputFlagsRecurseDirectory))
+          walkSorted(walker, path, rootLength, 0, i, *cursor ? cursor : NULL);
+        continue;
+      }
+      if (visitEntry(walker, path, rootLength, type, 0, 0, i, NULL) ==
+            TagWalkContinue &&
+          type == DT_DIR &&
+          (walker->outputFlags & OutputFlagsRecurseDirectory)) {
+        if (walker->sorted) {
+          walkSorted(walker, path, rootLength, 0, i, NULL);
+        } else {
+          walkDirectory(walker, path, rootLength, 0, i);
+        }
+      }
+    }
+    return walkStopped(walker) ? -1 : 0;
+  }
+
+  WalkPool pool = {.walker = walker};
+  pthread_t threads[WALK_MAX_JOBS];
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.ready, NULL);
+
+  // Queue the roots in reverse so they are taken in argument order
+  for (int i = pathCount - 1; i >= 0; --i) {
+    if (!strlen(paths[i])) continue;
+    poolPush(&pool, strdup(paths[i]), strlen(paths[i]), 0, 1, i);
+  }
+
+  for (int i = 0; i < walker->jobs; ++i)
+    pthread_create(&threads[i], NULL, poolWorker, &pool);
+  for (int i = 0; i < walker->jobs; ++i) pthread_join(threads[i], NULL);
+
+  // Release anything left behind by a stopped walk
+  for (size_t i = 0; i < pool.count; ++i) free(pool.items[i].path);
+  free(pool.items);
+  pthread_cond_destroy(&pool.ready);
+  pthread_mutex_destroy(&pool.lock);
+
+  return walkStopped(walker) ? -1 : 0;
+}
+
+void tagWalkSetShard(int shard, int shardCount, int depth) {
+  walkShard.shard = shard;
+  walkShard.count = shardCount;
+  walkShard.depth = depth;
+}
+
+int tagWalkParseShard(const char *arg, int *shard, int *shardCount,
+                      int *depth) {
+  char *end;
+
+  *depth = WALK_SHARD_DEPTH;
+  *shard = (int)strtol(arg, &end, 10);
+  if (end == arg || *end != '/') return -1;
+  arg = end + 1;
+  *shardCount = (int)strtol(arg, &end, 10);
+  if (end == arg) return -1;
+  if (*end == ':') {
+    arg = end + 1;
+    *depth = (int)strtol(arg, &end, 10);
+    if (end == arg) return -1;
+  }
+  if (*end || *shardCount < 1 || *shard < 0 || *shard >= *shardCount ||
+      *depth < 1)
+    return -1;
+
+  return 0;
+}
+
+int tagWalkDefaultJobs(void) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) return 1;
+  if (jobs > WALK_MAX_JOBS) return WALK_MAX_JOBS;
+  return (int)jobs;
+}
+
+UserTag *tagWalkEntryTags(const TagWalkEntry *entry, int *tagCount) {
+  if (!entry->blob)
+    return createUserTagsFromPath((char *)entry->path, tagCount);
+
+  *tagCount = 0;
+  if (entry->blob->error) return NULL;
+  return createUserTagsFromData(entry->blob->data,
+                                (ssize_t)entry->blob->length, tagCount);
+}
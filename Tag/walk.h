@@ -0,0 +1,146 @@
+//
+// walk.h
+// Tag
+//
+
+#ifndef TAG_WALK_H
+#define TAG_WALK_H
+
+#include "store.h"
+#include "usertag.h"
+
+// Upper bound on the number of walker threads
+#define WALK_MAX_JOBS   64
+
+// Entries of a directory read, and their tags looked up, at a time
+#define WALK_BATCH      256
+
+// Depth of the directories partitioned between shards by default
+#define WALK_SHARD_DEPTH 2
+
+// Seed of the shard ownership hash, shared by every process of a scan
+#define WALK_SHARD_SEED 0x7368617264ULL
+
+/**
+ * @typedef Entry handed to a walk visitor
+ * @field path Full path of the entry, as it would be printed
+ * @field relative Path relative to the root it was found under ("" for roots)
+ * @field type Directory entry type (DT_DIR, DT_REG, ...), never DT_UNKNOWN
+ * @field depth Depth below the root, 0 for the root paths themselves
+ * @field worker Index of the worker visiting the entry, 0 to jobs - 1
+ * @field root Index of the root the entry was found under
+ * @field blob Tag blob read ahead by a prefetching walk, NULL if the visitor
+ * reads the tags itself
+ */
+typedef struct TagWalkEntry {
+  const char *path;
+  const char *relative;
+  unsigned char type;
+  int depth;
+  int worker;
+  int root;
+  const TagBlob *blob;
+} TagWalkEntry;
+
+/**
+ * @typedef Visitor result controlling the traversal
+ * @enum 0 Continue, descend into the entry if it is a directory
+ * @enum 1 Skip, do not descend into the entry
+ * @enum 2 Stop the whole walk as soon as possible
+ */
+typedef enum TagWalkResult {
+  TagWalkContinue,
+  TagWalkSkip,
+  TagWalkStop
+} TagWalkResult;
+
+/**
+ * @typedef Callback invoked for every visited entry
+ * @note Called concurrently from several threads when jobs > 1
+ */
+typedef TagWalkResult (*TagWalkVisitor)(const TagWalkEntry *, void *);
+
+/**
+ * @typedef Walk configuration
+ * @field jobs Number of worker threads, 1 walks depth first on the caller
+ * @field outputFlags Honors OutputFlagsShowHidden and
+ * OutputFlagsRecurseDirectory
+ * @field visit Visitor callback
+ * @field context Opaque pointer passed to the visitor
+ * @field sorted Enumerate every directory in name order, a single job only
+ * @field prefetch Look up the tag blobs of up to WALK_BATCH entries of a
+ * directory at once, for visitors that only read tags. Honored by unsorted
+ * walks over a backend with batched lookups.
+ * @field resumeRoot Root of the last entry of an earlier sorted walk
+ * @field resumeAfter Relative path of that entry, NULL to walk everything
+ * @field stopped Set when a visitor requested the walk to stop, accessed
+ * atomically while the walk runs
+ * @field errors Count of directories that could not be read
+ * @note A sorted walk visits entries in a fixed order, roots in argument order
+ * and each directory before its entries. Given resumeAfter it skips the
+ * entries up to and including that entry without reading the directories
+ * that lie entirely before it.
+ */
+typedef struct TagWalker {
+  int jobs;
+  OutputFlags outputFlags;
+  TagWalkVisitor visit;
+  void *context;
+  int sorted;
+  int prefetch;
+  int resumeRoot;
+  const char *resumeAfter;
+  int stopped;
+  unsigned long errors;
+} TagWalker;
+
+/**
+ * @brief Visit the given paths and, when recursing, everything beneath them
+ * @param walker Walk configuration
+ * @param paths Root paths
+ * @param pathCount Number of root paths
+ * @return 0 if the walk completed, -1 if it was stopped by a visitor
+ * @note Symbolic links are only followed for the root paths
+ */
+int tagWalk(TagWalker *walker, char *const *paths, int pathCount);
+
+/**
+ * @brief Decode the tags of a visited entry
+ * @param entry Entry handed to the visitor
+ * @param tagCount Receives the number of tags
+ * @return Tags as by createUserTagsFromPath, decoded from the blob read ahead
+ * if the walk prefetched it
+ */
+UserTag *tagWalkEntryTags(const TagWalkEntry *entry, int *tagCount);
+
+/**
+ * @brief Restrict every later walk to a deterministic slice of the tree
+ * @param shard Index of the slice, 0 to shardCount - 1
+ * @param shardCount Number of slices, 0 or 1 walks everything
+ * @param depth Depth of the directories assigned to slices
+ * @note An entry belongs to the slice chosen by hashing its path relative to
+ * its root, cut after depth components, and roots by their path as given.
+ * Directories above the depth are entered by every slice but visited by one,
+ * directories at the depth are only entered by their own slice. The slices
+ * of independent processes given the same roots are disjoint and complete.
+ */
+void tagWalkSetShard(int shard, int shardCount, int depth);
+
+/**
+ * @brief Parse a shard specification
+ * @param arg "i/N" or "i/N:depth"
+ * @param shard Receives the slice index
+ * @param shardCount Receives the number of slices
+ * @param depth Receives the partition depth, WALK_SHARD_DEPTH if not given
+ * @return 0 on success, -1 if the specification is malformed
+ */
+int tagWalkParseShard(const char *arg, int *shard, int *shardCount,
+                      int *depth);
+
+/**
+ * @brief Default number of walker threads, the number of online processors
+ * @return Job count in the range of 1 to WALK_MAX_JOBS
+ */
+int tagWalkDefaultJobs(void);
+
+#endif  // TAG_WALK_H
@@ -0,0 +1,68 @@
+//
+// xdg.c
+// Tag
+//
+
+#include "xdg.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const char *xdgNextTag(const char **cursor, const char *end, size_t *length) {
+  const char *p = *cursor;
+
+  // Skip empty names
+  while (p < end && *p == XDG_SEPARATOR) ++p;
+  if (p >= end) {
+    *cursor = end;
+    return NULL;
+  }
+
+  const char *separator = memchr(p, XDG_SEPARATOR, end - p);
+  const char *stop = separator ? separator : end;
+  *length = stop - p;
+  *cursor = separator ? separator + 1 : end;
+
+  return p;
+}
+
+unsigned char *xdgEncodeTags(size_t *length, const UserTag *userTags,
+                             int tagCount) {
+  size_t size = 1;
+  unsigned char *list, *p;
+
+  for (int i = 0; i < tagCount; ++i) size += strlen(userTags[i].name) + 1;
+  p = list = malloc(size);
+
+  for (int i = 0; i < tagCount; ++i) {
+    size_t nameLength = strlen(userTags[i].name);
+    if (!nameLength || memchr(userTags[i].name, XDG_SEPARATOR, nameLength))
+      continue;
+    if (p != list) *p++ = XDG_SEPARATOR;
+    memcpy(p, userTags[i].name, nameLength);
+    p += nameLength;
+  }
+  *length = p - list;
+
+  return list;
+}
+
+int xdgDecodeTags(const unsigned char *buf, size_t len, UserTag **userTags,
+                  int *tagCount) {
+  const char *cursor = (const char *)buf, *end = cursor + len, *name;
+  size_t length;
+  int count = 0;
+
+  // Every name is preceded by a separator or starts the list
+  for (size_t i = 0; i < len; ++i) count += buf[i] == XDG_SEPARATOR;
+  *userTags = calloc(count + 1, sizeof(**userTags));
+
+  count = 0;
+  while ((name = xdgNextTag(&cursor, end, &length)) != NULL) {
+    (*userTags)[count].name = strndup(name, length);
+    (*userTags)[count++].color = TagColorNone;
+  }
+  *tagCount = count;
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+//
+// xdg.h
+// Tag
+//
+
+#ifndef TAG_XDG_H
+#define TAG_XDG_H
+
+#include "usertag.h"
+
+#include <stddef.h>
+
+// Separator of the names of an xdg tag list
+#define XDG_SEPARATOR   ','
+
+/**
+ * @brief Next name of a comma separated tag list, without copying it
+ * @param cursor Position in the list, advanced past the name
+ * @param end End of the list
+ * @param length Receives the length of the name
+ * @return Start of the name within the list, NULL once there are no more
+ * @note Empty names, as left by leading, trailing or doubled separators, are
+ * skipped. The list needs no terminating NUL.
+ */
+const char *xdgNextTag(const char **cursor, const char *end, size_t *length);
+
+/**
+ * @brief Encode tags as a comma separated list of names
+ * @param length Receives the length of the list
+ * @param userTags Tags to encode, in order
+ * @param tagCount Number of tags
+ * @return List, not NUL terminated, release with free
+ * @note The format carries no colors. Names containing the separator cannot
+ * be represented and are left out.
+ */
+unsigned char *xdgEncodeTags(size_t *length, const UserTag *userTags,
+                             int tagCount);
+
+/**
+ * @brief Decode a comma separated list of names as tags without colors
+ * @param buf List
+ * @param len Length of the list
+ * @param userTags Receives the tags
+ * @param tagCount Receives the count of the tags
+ * @return 0, every list decodes
+ */
+int xdgDecodeTags(const unsigned char *buf, size_t len, UserTag **userTags,
+                  int *tagCount);
+
+#endif  // TAG_XDG_H